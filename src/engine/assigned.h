@@ -0,0 +1,69 @@
+#pragma once
+
+#include "visitor.h"
+#include <algorithm>
+#include <string_view>
+#include <vector>
+
+/// AssignedNames - Collects the names that an expression assigns to with
+/// '='. Names are compared as written, not resolved to a binding, so an
+/// assignment to one x counts against every x in the expression. That only
+/// ever makes a user of the result more careful than it needs to be.
+class AssignedNames : public ExprVisitor<AssignedNames> {
+public:
+  std::vector<std::string_view> names;
+
+  bool Contains(std::string_view name) const {
+    return std::find(names.begin(), names.end(), name) != names.end();
+  }
+
+  void VisitNumber(const NumberExprAST &) {}
+  void VisitVariable(const VariableExprAST &) {}
+
+  void VisitAssign(const AssignExprAST &expr) {
+    Visit(expr.GetValue());
+    if (!Contains(expr.GetName())) {
+      names.push_back(expr.GetName());
+    }
+  }
+
+  void VisitBinary(const BinaryExprAST &expr) {
+    Visit(expr.GetLHS());
+    Visit(expr.GetRHS());
+  }
+
+  void VisitCall(const CallExprAST &expr) {
+    for (const auto &arg : expr.GetArgs()) {
+      Visit(*arg);
+    }
+  }
+
+  void VisitVar(const VarExprAST &expr) {
+    for (const auto &binding : expr.GetVars()) {
+      Visit(*binding.second);
+    }
+    Visit(expr.GetBody());
+  }
+
+  void VisitIf(const IfExprAST &expr) {
+    Visit(expr.GetCond());
+    Visit(expr.GetThen());
+    Visit(expr.GetElse());
+  }
+
+  void VisitFor(const ForExprAST &expr) {
+    for (const auto &var : expr.GetVars()) {
+      Visit(*var.start);
+      Visit(*var.step);
+    }
+    Visit(expr.GetEnd());
+    Visit(expr.GetBody());
+  }
+};
+
+/// HasAssignment - Whether expr assigns to any name.
+inline bool HasAssignment(const ExprAST &expr) {
+  AssignedNames assigned;
+  assigned.Visit(expr);
+  return !assigned.names.empty();
+}
@@ -0,0 +1,883 @@
+#pragma once
+
+#include "engine.h"
+#include "inliner.h"
+#include "loop_optimizer.h"
+#include "runtime.h"
+#include "select.h"
+#include "visitor.h"
+#include <algorithm>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// A self-specializing AST interpreter. A function's body is lowered into a
+// tree of generic nodes the first time it is called, and each generic node
+// replaces itself with a specialized form the first time it runs, once it has
+// seen its operands:
+//
+//   - a variable reference caches its argument slot (ArgNode);
+//   - a binary operator picks a node for its operator and operand shapes, e.g.
+//     "argument + constant" (ArgConstNode<AddOp>), or folds to a constant;
+//   - a call caches the resolved callee (CachedCallNode / NativeCallNode).
+//
+// Every later execution runs the specialized node directly. There is no
+// separate compile step, so the first run of a top-level expression costs
+// about the same as a plain tree walk.
+//
+// A recursive function can run a generic node again before its first run is
+// done. Only the outermost run of a node replaces it: the others would return
+// into the node it destroyed.
+//
+// Bodies go through the Inliner and the LoopOptimizer before they are
+// lowered. Redefining a function throws away the node trees that copied its
+// body, to be lowered again on their next call.
+//
+// A call a function makes to itself in tail position is lowered to a
+// SelfTailCallNode, which overwrites the arguments and flags a tail call
+// instead of recursing; the TailLoopNode at the root of the body then runs
+// it again, so self recursion in tail position runs in constant stack.
+
+namespace interp {
+
+class Interpreter;
+class Node;
+using NodePtr = std::unique_ptr<Node>;
+
+/// Node - One executable node. Parents own their children through NodePtr
+/// slots and run them with Run(slot, args), which passes the slot along so
+/// the child can replace itself in it.
+class Node {
+public:
+  virtual ~Node() = default;
+
+  /// Execute - Evaluate this node with the given argument values. self is the
+  /// slot that owns this node; after replacing itself there a node must not
+  /// touch its members again.
+  virtual double Execute(NodePtr &self, double *args) = 0;
+
+  /// IsConstant/IsArg - Let a parent look at a specialized child's shape.
+  virtual bool IsConstant(double &) const { return false; }
+  virtual bool IsArg(size_t &) const { return false; }
+};
+
+inline double Run(NodePtr &node, double *args) {
+  return node->Execute(node, args);
+}
+
+/// Function - A named function: either a native builtin or a definition whose
+/// node tree is built on first call. Records are never freed or moved, so call
+/// nodes can cache a pointer to one; redefining a function updates its record
+/// in place.
+struct Function {
+  std::string_view name;
+  size_t arity = 0;
+  NativeFn native = nullptr;
+  std::unique_ptr<FunctionAST> ast;
+  NodePtr body;
+};
+
+/// Interpreter - The function table and evaluation state shared by all nodes.
+class Interpreter : public Engine {
+private:
+  std::unordered_map<std::string_view, std::unique_ptr<Function>> functions;
+  Inliner inliner;
+  LoopOptimizer loop_optimizer;
+  bool failed = false;
+  bool tail_call = false;
+  int depth = 0;
+
+  Function &GetOrCreate(std::string_view name) {
+    auto &slot = functions[name];
+    if (!slot) {
+      slot = std::make_unique<Function>();
+      slot->name = name;
+    }
+    return *slot;
+  }
+
+  /// Invalidate - Drop the node tree of every function that copied the body
+  /// of name.
+  void Invalidate(std::string_view name) {
+    std::vector<std::string_view> dependents;
+    inliner.GetDependents(name, dependents);
+    for (std::string_view dependent : dependents) {
+      if (Function *fn = FindFunction(dependent)) {
+        fn->body.reset();
+      }
+    }
+  }
+
+public:
+  InlineOptions &GetInlineOptions() { return inliner.GetOptions(); }
+  LoopOptions &GetLoopOptions() { return loop_optimizer.GetOptions(); }
+
+  /// Fail - Report a runtime error. Evaluation unwinds by returning 0 from
+  /// every node; no further calls are made once an error is recorded.
+  double Fail(SourceLoc loc, const char *message) {
+    if (!failed) {
+      ReportError(loc, message);
+    }
+    failed = true;
+    return 0.0;
+  }
+
+  bool HasFailed() const { return failed; }
+
+  /// SetTailCall/TakeTailCall - Flag a self tail call, whose arguments are
+  /// already in place, for the loop at the root of the body.
+  void SetTailCall() { tail_call = true; }
+  bool TakeTailCall() {
+    bool pending = tail_call;
+    tail_call = false;
+    return pending;
+  }
+
+  Function *FindFunction(std::string_view name) {
+    auto it = functions.find(name);
+    return it == functions.end() ? nullptr : it->second.get();
+  }
+
+  double Call(Function &fn, double *args, SourceLoc loc);
+
+  bool AddFunction(std::unique_ptr<FunctionAST> fn) override {
+    Function &record = GetOrCreate(fn->GetProto().GetName());
+    record.arity = fn->GetProto().GetArgs().size();
+    record.native = nullptr;
+    record.body.reset();
+    record.ast = std::move(fn);
+    inliner.Define(record.name, record.ast.get());
+    Invalidate(record.name);
+    return true;
+  }
+
+  bool AddExtern(std::unique_ptr<PrototypeAST> proto) override {
+    Function &record = GetOrCreate(proto->GetName());
+    if (const Builtin *builtin = FindBuiltin(proto->GetName())) {
+      if (builtin->arity != proto->GetArgs().size()) {
+        ReportError(proto->GetLoc(), "extern does not match builtin arity");
+        return false;
+      }
+      record.native = builtin->fn;
+      // Calls now reach the builtin, not any body copied from a 'def'.
+      inliner.Define(record.name, nullptr);
+      Invalidate(record.name);
+    }
+    // Otherwise this is a forward declaration for a later 'def'. A builtin
+    // takes the place of any 'def', arity included.
+    if (record.native || !record.ast) {
+      record.arity = proto->GetArgs().size();
+    }
+    return true;
+  }
+
+  void
+  GetInlinedCallees(std::string_view name,
+                    std::vector<std::string_view> &callees) const override {
+    inliner.GetInlinedCallees(name, callees);
+  }
+
+  bool Evaluate(std::unique_ptr<FunctionAST> fn, double &result) override;
+};
+
+/// ConstNode - A number literal, or a subtree folded to one.
+class ConstNode : public Node {
+private:
+  double val;
+
+public:
+  explicit ConstNode(double val) : val(val) {}
+  double Execute(NodePtr &, double *) override { return val; }
+  bool IsConstant(double &out) const override {
+    out = val;
+    return true;
+  }
+};
+
+/// ArgNode - A variable reference resolved to its argument slot.
+class ArgNode : public Node {
+private:
+  size_t slot;
+
+public:
+  explicit ArgNode(size_t slot) : slot(slot) {}
+  double Execute(NodePtr &, double *args) override { return args[slot]; }
+  bool IsArg(size_t &out) const override {
+    out = slot;
+    return true;
+  }
+};
+
+/// GenericVariableNode - A variable reference that has not run yet.
+class GenericVariableNode : public Node {
+private:
+  Interpreter &interp;
+  const PrototypeAST &proto;
+  std::string_view name;
+  SourceLoc loc;
+
+public:
+  GenericVariableNode(Interpreter &interp, const PrototypeAST &proto,
+                      std::string_view name, SourceLoc loc)
+      : interp(interp), proto(proto), name(name), loc(loc) {}
+
+  double Execute(NodePtr &self, double *args) override {
+    const auto &names = proto.GetArgs();
+    for (size_t i = 0; i < names.size(); ++i) {
+      if (names[i] == name) {
+        self = std::make_unique<ArgNode>(i);
+        return args[i];
+      }
+    }
+    return interp.Fail(loc, "Unknown variable name");
+  }
+};
+
+/// AssignNode - An assignment resolved to its frame slot.
+class AssignNode : public Node {
+private:
+  size_t slot;
+  NodePtr value;
+
+public:
+  AssignNode(size_t slot, NodePtr value)
+      : slot(slot), value(std::move(value)) {}
+  double Execute(NodePtr &, double *args) override {
+    return args[slot] = Run(value, args);
+  }
+};
+
+/// GenericAssignNode - An assignment to a name no var binds, which has not
+/// run yet.
+class GenericAssignNode : public Node {
+private:
+  Interpreter &interp;
+  const PrototypeAST &proto;
+  std::string_view name;
+  NodePtr value;
+  SourceLoc loc;
+
+public:
+  GenericAssignNode(Interpreter &interp, const PrototypeAST &proto,
+                    std::string_view name, NodePtr value, SourceLoc loc)
+      : interp(interp), proto(proto), name(name), value(std::move(value)),
+        loc(loc) {}
+
+  double Execute(NodePtr &self, double *args) override {
+    const auto &names = proto.GetArgs();
+    for (size_t i = 0; i < names.size(); ++i) {
+      if (names[i] == name) {
+        self = std::make_unique<AssignNode>(i, std::move(value));
+        return Run(self, args);
+      }
+    }
+    return interp.Fail(loc, "Unknown variable name");
+  }
+};
+
+/// BinaryNode<Op> - The fully general form: both operands are subtrees.
+template <typename Op> class BinaryNode : public Node {
+private:
+  NodePtr lhs;
+  NodePtr rhs;
+
+public:
+  BinaryNode(NodePtr lhs, NodePtr rhs)
+      : lhs(std::move(lhs)), rhs(std::move(rhs)) {}
+  double Execute(NodePtr &, double *args) override {
+    double l = Run(lhs, args);
+    return Op::Apply(l, Run(rhs, args));
+  }
+};
+
+/// BinaryConstNode<Op> - "subtree op constant".
+template <typename Op> class BinaryConstNode : public Node {
+private:
+  NodePtr lhs;
+  double k;
+
+public:
+  BinaryConstNode(NodePtr lhs, double k) : lhs(std::move(lhs)), k(k) {}
+  double Execute(NodePtr &, double *args) override {
+    return Op::Apply(Run(lhs, args), k);
+  }
+};
+
+/// ArgConstNode<Op> - "argument op constant", as in n-1 or x*2.
+template <typename Op> class ArgConstNode : public Node {
+private:
+  size_t slot;
+  double k;
+
+public:
+  ArgConstNode(size_t slot, double k) : slot(slot), k(k) {}
+  double Execute(NodePtr &, double *args) override {
+    return Op::Apply(args[slot], k);
+  }
+};
+
+/// ArgArgNode<Op> - "argument op argument", as in a*b.
+template <typename Op> class ArgArgNode : public Node {
+private:
+  size_t a;
+  size_t b;
+
+public:
+  ArgArgNode(size_t a, size_t b) : a(a), b(b) {}
+  double Execute(NodePtr &, double *args) override {
+    return Op::Apply(args[a], args[b]);
+  }
+};
+
+/// GenericBinaryNode - A binary operator that has not run yet. It runs its
+/// operands first, so they have specialized themselves by the time it picks
+/// its own form.
+class GenericBinaryNode : public Node {
+private:
+  Interpreter &interp;
+  NodePtr lhs;
+  NodePtr rhs;
+  SourceLoc loc;
+  char op;
+  unsigned active = 0; // Runs in progress, not counting this one.
+
+  template <typename Op>
+  double Specialize(NodePtr &self, double l, double r) {
+    if (active > 0) {
+      return Op::Apply(l, r);
+    }
+    double lk, rk;
+    size_t la, ra;
+    bool lhs_const = lhs->IsConstant(lk);
+    bool rhs_const = rhs->IsConstant(rk);
+    NodePtr replacement;
+    if (lhs_const && rhs_const) {
+      replacement = std::make_unique<ConstNode>(Op::Apply(lk, rk));
+    } else if (rhs_const && lhs->IsArg(la)) {
+      replacement = std::make_unique<ArgConstNode<Op>>(la, rk);
+    } else if (rhs_const) {
+      replacement = std::make_unique<BinaryConstNode<Op>>(std::move(lhs), rk);
+    } else if (lhs->IsArg(la) && rhs->IsArg(ra)) {
+      replacement = std::make_unique<ArgArgNode<Op>>(la, ra);
+    } else {
+      replacement =
+          std::make_unique<BinaryNode<Op>>(std::move(lhs), std::move(rhs));
+    }
+    self = std::move(replacement); // Destroys this node.
+    return Op::Apply(l, r);
+  }
+
+public:
+  GenericBinaryNode(Interpreter &interp, char op, NodePtr lhs, NodePtr rhs,
+                    SourceLoc loc)
+      : interp(interp), lhs(std::move(lhs)), rhs(std::move(rhs)), loc(loc),
+        op(op) {}
+
+  double Execute(NodePtr &self, double *args) override {
+    ++active;
+    double l = Run(lhs, args);
+    double r = Run(rhs, args);
+    --active;
+    if (interp.HasFailed()) {
+      return 0.0;
+    }
+    switch (op) {
+    case '+':
+      return Specialize<AddOp>(self, l, r);
+    case '-':
+      return Specialize<SubOp>(self, l, r);
+    case '*':
+      return Specialize<MulOp>(self, l, r);
+    case '<':
+      return Specialize<LessOp>(self, l, r);
+    default:
+      return interp.Fail(loc, "invalid binary operator");
+    }
+  }
+};
+
+/// LetNode - Binds one var name: stores the initializer in its frame slot,
+/// then runs the rest of the expression.
+class LetNode : public Node {
+private:
+  size_t slot;
+  NodePtr init;
+  NodePtr body;
+
+public:
+  LetNode(size_t slot, NodePtr init, NodePtr body)
+      : slot(slot), init(std::move(init)), body(std::move(body)) {}
+  double Execute(NodePtr &, double *args) override {
+    args[slot] = Run(init, args);
+    return Run(body, args);
+  }
+};
+
+/// FrameNode - The root of a body that binds names with var: copies the
+/// arguments into a frame with room for those names as well.
+class FrameNode : public Node {
+private:
+  size_t num_slots;
+  size_t arity;
+  NodePtr body;
+
+public:
+  FrameNode(size_t num_slots, size_t arity, NodePtr body)
+      : num_slots(num_slots), arity(arity), body(std::move(body)) {}
+  double Execute(NodePtr &, double *args) override {
+    double inline_slots[16];
+    std::vector<double> heap_slots;
+    double *slots = inline_slots;
+    if (num_slots > 16) {
+      heap_slots.resize(num_slots);
+      slots = heap_slots.data();
+    }
+    std::copy(args, args + arity, slots);
+    return Run(body, slots);
+  }
+};
+
+/// IfNode - if/then/else: runs the condition, then only the arm it picks.
+class IfNode : public Node {
+private:
+  NodePtr cond;
+  NodePtr then;
+  NodePtr otherwise;
+
+public:
+  IfNode(NodePtr cond, NodePtr then, NodePtr otherwise)
+      : cond(std::move(cond)), then(std::move(then)),
+        otherwise(std::move(otherwise)) {}
+  double Execute(NodePtr &, double *args) override {
+    return IsTrue(Run(cond, args)) ? Run(then, args) : Run(otherwise, args);
+  }
+};
+
+/// SelectNode - An if whose arms are cheap and make no calls: runs both and
+/// picks a value without branching on the condition.
+class SelectNode : public Node {
+private:
+  NodePtr cond;
+  NodePtr then;
+  NodePtr otherwise;
+
+public:
+  SelectNode(NodePtr cond, NodePtr then, NodePtr otherwise)
+      : cond(std::move(cond)), then(std::move(then)),
+        otherwise(std::move(otherwise)) {}
+  double Execute(NodePtr &, double *args) override {
+    double c = Run(cond, args);
+    double t = Run(then, args);
+    return Select(c, t, Run(otherwise, args));
+  }
+};
+
+/// ForNode - A for loop. Its variables live in consecutive frame slots from
+/// slot, and the body runs unroll times for every evaluation of end.
+class ForNode : public Node {
+private:
+  Interpreter &interp;
+  size_t slot;
+  std::vector<NodePtr> starts;
+  std::vector<NodePtr> steps;
+  NodePtr end;
+  NodePtr body;
+  uint32_t unroll;
+
+  void Step(double *args) {
+    for (size_t i = 0; i < steps.size(); ++i) {
+      double delta = Run(steps[i], args);
+      args[slot + i] = args[slot + i] + delta;
+    }
+  }
+
+public:
+  ForNode(Interpreter &interp, size_t slot, std::vector<NodePtr> starts,
+          std::vector<NodePtr> steps, NodePtr end, NodePtr body,
+          uint32_t unroll)
+      : interp(interp), slot(slot), starts(std::move(starts)),
+        steps(std::move(steps)), end(std::move(end)), body(std::move(body)),
+        unroll(unroll) {}
+  double Execute(NodePtr &, double *args) override {
+    // The starts cannot read the loop's slots, so each is stored at once.
+    for (size_t i = 0; i < starts.size(); ++i) {
+      args[slot + i] = Run(starts[i], args);
+    }
+    bool more;
+    do {
+      for (uint32_t copy = 1; copy < unroll; ++copy) {
+        Run(body, args);
+        Step(args);
+      }
+      Run(body, args);
+      more = IsTrue(Run(end, args));
+      Step(args);
+    } while (more && !interp.HasFailed());
+    return 0.0;
+  }
+};
+
+/// ArgValues - Evaluates call arguments into a small on-stack buffer, falling
+/// back to the heap for unusually wide calls.
+class ArgValues {
+private:
+  double inline_values[8];
+  std::vector<double> heap_values;
+  double *values;
+
+public:
+  ArgValues(std::vector<NodePtr> &nodes, double *args) {
+    values = inline_values;
+    if (nodes.size() > 8) {
+      heap_values.resize(nodes.size());
+      values = heap_values.data();
+    }
+    for (size_t i = 0; i < nodes.size(); ++i) {
+      values[i] = Run(nodes[i], args);
+    }
+  }
+  double *data() { return values; }
+};
+
+/// CachedCallNode - A call to a Kaleidoscope function, resolved once.
+class CachedCallNode : public Node {
+private:
+  Interpreter &interp;
+  Function &callee;
+  std::vector<NodePtr> arg_nodes;
+  SourceLoc loc;
+
+public:
+  CachedCallNode(Interpreter &interp, Function &callee,
+                 std::vector<NodePtr> arg_nodes, SourceLoc loc)
+      : interp(interp), callee(callee), arg_nodes(std::move(arg_nodes)),
+        loc(loc) {}
+
+  double Execute(NodePtr &, double *args) override {
+    ArgValues values(arg_nodes, args);
+    // The callee may have been redefined with a different arity since this
+    // node was specialized.
+    if (callee.arity != arg_nodes.size()) {
+      return interp.Fail(loc, "Incorrect # arguments passed");
+    }
+    return interp.Call(callee, values.data(), loc);
+  }
+};
+
+/// SelfTailCallNode - A call to the function itself whose value is the
+/// function's result.
+class SelfTailCallNode : public Node {
+private:
+  Interpreter &interp;
+  std::vector<NodePtr> arg_nodes;
+
+public:
+  SelfTailCallNode(Interpreter &interp, std::vector<NodePtr> arg_nodes)
+      : interp(interp), arg_nodes(std::move(arg_nodes)) {}
+
+  double Execute(NodePtr &, double *args) override {
+    ArgValues values(arg_nodes, args);
+    if (!interp.HasFailed()) {
+      std::copy(values.data(), values.data() + arg_nodes.size(), args);
+      interp.SetTailCall();
+    }
+    return 0.0;
+  }
+};
+
+/// TailLoopNode - The root of a body with self tail calls: runs the body
+/// again for as long as it ends in one.
+class TailLoopNode : public Node {
+private:
+  Interpreter &interp;
+  NodePtr body;
+
+public:
+  TailLoopNode(Interpreter &interp, NodePtr body)
+      : interp(interp), body(std::move(body)) {}
+
+  double Execute(NodePtr &, double *args) override {
+    while (true) {
+      double result = Run(body, args);
+      if (!interp.TakeTailCall()) {
+        return result;
+      }
+    }
+  }
+};
+
+/// NativeCallNode - A call to a builtin, resolved once. A later 'def' can
+/// take the builtin's name, so the node checks that the builtin is still
+/// bound and otherwise becomes a CachedCallNode.
+class NativeCallNode : public Node {
+private:
+  Interpreter &interp;
+  Function &callee;
+  NativeFn fn;
+  std::vector<NodePtr> arg_nodes;
+  SourceLoc loc;
+
+public:
+  NativeCallNode(Interpreter &interp, Function &callee,
+                 std::vector<NodePtr> arg_nodes, SourceLoc loc)
+      : interp(interp), callee(callee), fn(callee.native),
+        arg_nodes(std::move(arg_nodes)), loc(loc) {}
+
+  double Execute(NodePtr &self, double *args) override {
+    if (callee.native != fn) {
+      self = std::make_unique<CachedCallNode>(interp, callee,
+                                              std::move(arg_nodes), loc);
+      return Run(self, args);
+    }
+    ArgValues values(arg_nodes, args);
+    return fn(values.data());
+  }
+};
+
+/// GenericCallNode - A call whose callee has not been looked up yet. If the
+/// lookup fails it stays generic, so defining the callee later still works.
+class GenericCallNode : public Node {
+private:
+  Interpreter &interp;
+  std::string_view callee;
+  std::vector<NodePtr> arg_nodes;
+  SourceLoc loc;
+  unsigned active = 0; // Runs in progress, not counting this one.
+
+public:
+  GenericCallNode(Interpreter &interp, std::string_view callee,
+                  std::vector<NodePtr> arg_nodes, SourceLoc loc)
+      : interp(interp), callee(callee), arg_nodes(std::move(arg_nodes)),
+        loc(loc) {}
+
+  double Execute(NodePtr &self, double *args) override {
+    Function *fn = interp.FindFunction(callee);
+    if (!fn) {
+      return interp.Fail(loc, "Unknown function referenced");
+    }
+    if (fn->arity != arg_nodes.size()) {
+      return interp.Fail(loc, "Incorrect # arguments passed");
+    }
+    ++active;
+    ArgValues values(arg_nodes, args);
+    --active;
+    if (interp.HasFailed()) {
+      return 0.0;
+    }
+    if (active > 0) {
+      return fn->native ? fn->native(values.data())
+                        : interp.Call(*fn, values.data(), loc);
+    }
+    if (fn->native) {
+      self = std::make_unique<NativeCallNode>(interp, *fn, std::move(arg_nodes),
+                                              loc);
+      return fn->native(values.data());
+    }
+    // Replacing self destroys this node, so keep what the call still needs.
+    Interpreter &owner = interp;
+    SourceLoc call_loc = loc;
+    self = std::make_unique<CachedCallNode>(interp, *fn, std::move(arg_nodes),
+                                            loc);
+    return owner.Call(*fn, values.data(), call_loc);
+  }
+};
+
+/// Lowering - Builds the generic node tree for a function body.
+class Lowering : public ExprVisitor<Lowering, NodePtr> {
+private:
+  Interpreter &interp;
+  const PrototypeAST &proto;
+  // Names bound by enclosing var expressions, innermost last, and the frame
+  // slot of each. Their references need no lookup at run time, so they are
+  // lowered to ArgNodes directly.
+  std::vector<std::pair<std::string_view, size_t>> scope;
+  size_t num_slots;
+  // Whether the expression being visited is in tail position. Each handler
+  // reads it and clears it for its operands.
+  bool in_tail = false;
+  bool has_self_tail_call = false;
+
+public:
+  Lowering(Interpreter &interp, const PrototypeAST &proto)
+      : interp(interp), proto(proto), num_slots(proto.GetArgs().size()) {}
+
+  /// LowerBody - The root node for body, in a frame of its own if it binds
+  /// any names.
+  NodePtr LowerBody(const ExprAST &body) {
+    in_tail = true;
+    NodePtr root = Visit(body);
+    if (has_self_tail_call) {
+      root = std::make_unique<TailLoopNode>(interp, std::move(root));
+    }
+    size_t arity = proto.GetArgs().size();
+    if (num_slots == arity) {
+      return root;
+    }
+    return std::make_unique<FrameNode>(num_slots, arity, std::move(root));
+  }
+
+  NodePtr VisitNumber(const NumberExprAST &expr) {
+    in_tail = false;
+    return std::make_unique<ConstNode>(expr.GetVal());
+  }
+
+  NodePtr VisitVariable(const VariableExprAST &expr) {
+    in_tail = false;
+    for (auto it = scope.rbegin(); it != scope.rend(); ++it) {
+      if (it->first == expr.GetName()) {
+        return std::make_unique<ArgNode>(it->second);
+      }
+    }
+    return std::make_unique<GenericVariableNode>(interp, proto, expr.GetName(),
+                                                 expr.GetLoc());
+  }
+
+  NodePtr VisitAssign(const AssignExprAST &expr) {
+    in_tail = false;
+    NodePtr value = Visit(expr.GetValue());
+    for (auto it = scope.rbegin(); it != scope.rend(); ++it) {
+      if (it->first == expr.GetName()) {
+        return std::make_unique<AssignNode>(it->second, std::move(value));
+      }
+    }
+    return std::make_unique<GenericAssignNode>(interp, proto, expr.GetName(),
+                                               std::move(value),
+                                               expr.GetLoc());
+  }
+
+  NodePtr VisitBinary(const BinaryExprAST &expr) {
+    in_tail = false;
+    NodePtr lhs = Visit(expr.GetLHS());
+    return std::make_unique<GenericBinaryNode>(interp, expr.GetOp(),
+                                               std::move(lhs),
+                                               Visit(expr.GetRHS()),
+                                               expr.GetLoc());
+  }
+
+  NodePtr VisitVar(const VarExprAST &expr) {
+    bool is_tail = in_tail;
+    std::vector<std::pair<size_t, NodePtr>> lets;
+    for (const auto &[name, init] : expr.GetVars()) {
+      in_tail = false;
+      lets.emplace_back(num_slots, Visit(*init));
+      scope.emplace_back(name, num_slots++);
+    }
+    in_tail = is_tail;
+    NodePtr body = Visit(expr.GetBody());
+    scope.resize(scope.size() - lets.size());
+    for (auto it = lets.rbegin(); it != lets.rend(); ++it) {
+      body = std::make_unique<LetNode>(it->first, std::move(it->second),
+                                       std::move(body));
+    }
+    return body;
+  }
+
+  /// VisitIf - A literal condition picks its arm now.
+  NodePtr VisitIf(const IfExprAST &expr) {
+    bool is_tail = in_tail;
+    in_tail = false;
+    NodePtr cond = Visit(expr.GetCond());
+    in_tail = is_tail;
+    NodePtr then = Visit(expr.GetThen());
+    in_tail = is_tail;
+    NodePtr otherwise = Visit(expr.GetElse());
+    double k;
+    if (cond->IsConstant(k)) {
+      return IsTrue(k) ? std::move(then) : std::move(otherwise);
+    }
+    if (ShouldSelect(expr)) {
+      return std::make_unique<SelectNode>(std::move(cond), std::move(then),
+                                          std::move(otherwise));
+    }
+    return std::make_unique<IfNode>(std::move(cond), std::move(then),
+                                    std::move(otherwise));
+  }
+
+  NodePtr VisitFor(const ForExprAST &expr) {
+    in_tail = false;
+    const auto &vars = expr.GetVars();
+    std::vector<NodePtr> starts;
+    for (const auto &var : vars) {
+      in_tail = false;
+      starts.push_back(Visit(*var.start));
+    }
+    size_t slot = num_slots;
+    for (const auto &var : vars) {
+      scope.emplace_back(var.name, num_slots++);
+    }
+    std::vector<NodePtr> steps;
+    for (const auto &var : vars) {
+      in_tail = false;
+      steps.push_back(Visit(*var.step));
+    }
+    in_tail = false;
+    NodePtr end = Visit(expr.GetEnd());
+    in_tail = false;
+    NodePtr body = Visit(expr.GetBody());
+    scope.resize(scope.size() - vars.size());
+    return std::make_unique<ForNode>(interp, slot, std::move(starts),
+                                     std::move(steps), std::move(end),
+                                     std::move(body), expr.GetUnroll());
+  }
+
+  NodePtr VisitCall(const CallExprAST &expr) {
+    bool is_tail = in_tail;
+    std::vector<NodePtr> args;
+    args.reserve(expr.GetArgs().size());
+    for (const auto &arg : expr.GetArgs()) {
+      in_tail = false;
+      args.push_back(Visit(*arg));
+    }
+    if (is_tail && !proto.GetName().empty() &&
+        expr.GetCallee() == proto.GetName() &&
+        args.size() == proto.GetArgs().size()) {
+      has_self_tail_call = true;
+      return std::make_unique<SelfTailCallNode>(interp, std::move(args));
+    }
+    return std::make_unique<GenericCallNode>(interp, expr.GetCallee(),
+                                             std::move(args), expr.GetLoc());
+  }
+};
+
+inline double Interpreter::Call(Function &fn, double *args, SourceLoc loc) {
+  if (failed) {
+    return 0.0;
+  }
+  if (fn.native) {
+    return fn.native(args);
+  }
+  if (!fn.ast) {
+    return Fail(loc, "Function is declared but not defined");
+  }
+  if (depth >= MAX_CALL_DEPTH) {
+    return Fail(loc, "Call stack overflow");
+  }
+  if (!fn.body) {
+    std::unique_ptr<ExprAST> inlined = inliner.Inline(*fn.ast, fn.name);
+    const ExprAST &source = inlined ? *inlined : fn.ast->GetBody();
+    std::unique_ptr<ExprAST> optimized = loop_optimizer.Optimize(source);
+    fn.body = Lowering(*this, fn.ast->GetProto())
+                  .LowerBody(optimized ? *optimized : source);
+  }
+  ++depth;
+  double result = Run(fn.body, args);
+  --depth;
+  return result;
+}
+
+inline bool Interpreter::Evaluate(std::unique_ptr<FunctionAST> fn,
+                                  double &result) {
+  failed = false;
+  depth = 0;
+  std::unique_ptr<ExprAST> inlined = inliner.Inline(*fn, "");
+  const ExprAST &source = inlined ? *inlined : fn->GetBody();
+  std::unique_ptr<ExprAST> optimized = loop_optimizer.Optimize(source);
+  NodePtr body = Lowering(*this, fn->GetProto())
+                     .LowerBody(optimized ? *optimized : source);
+  result = Run(body, nullptr);
+  return !failed;
+}
+
+} // namespace interp
+
+using interp::Interpreter;
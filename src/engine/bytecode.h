@@ -0,0 +1,286 @@
+#pragma once
+
+#include "ast.h"
+#include "epoch.h"
+#include "runtime.h"
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Bytecode for the stack VM.
+//
+// Code is an array of 32-bit words. Every instruction starts with one word
+// holding the opcode in its low 8 bits and an operand A in its high 24 bits;
+// a few instructions take a second word B. Code never holds pointers, only
+// indices (into the constant pool, the frame's locals, the function table), so
+// it can be saved to a file and executed straight from a mapping.
+//
+// A frame's locals start with the function's arguments, followed by slots
+// for the names that var and for expressions bind. Calls leave the arguments
+// where the caller pushed them, and they become the callee's first locals.
+// Every name keeps its slot for the whole body, so assignment is a store.
+//
+// A call in tail position, whose value the caller returns as it is, is a
+// tail_call. It moves the arguments down over the caller's locals and runs
+// the callee in the caller's frame, so a chain of tail calls, recursive or
+// not, runs in constant stack. The compiler still emits whatever follows a
+// call there, which only runs if the callee was a builtin.
+//
+// Jumps carry the offset of their target within the body. Only the jump that
+// closes a loop goes backward, to a point the verifier has already reached
+// through straight-line code, so it can still follow every path in one pass.
+//
+// A function's code, constants and frame layout form one BcCode body, which
+// is replaced as a whole and never edited in place.
+
+// X(name, words, description)
+#define KALEIDOSCOPE_OPCODES(X)                                                \
+  X(push_const, 1, "push consts[A]")                                           \
+  X(load_arg, 1, "push locals[A]")                                             \
+  X(store_local, 1, "pop into locals[A]")                                      \
+  X(add, 1, "pop b, a; push a + b")                                            \
+  X(sub, 1, "pop b, a; push a - b")                                            \
+  X(mul, 1, "pop b, a; push a * b")                                            \
+  X(less, 1, "pop b, a; push a < b")                                           \
+  X(call, 2, "call function A with B arguments")                               \
+  X(ret, 1, "return the top of the stack")                                     \
+  X(tail_call, 2, "call function A with B arguments in place of this call")    \
+  X(jump, 1, "continue at A")                                                  \
+  X(jump_if_false, 1, "pop c; continue at A unless c is true")                 \
+  X(select, 1, "pop e, t, c; push t if c is true, else e")                     \
+  X(pop, 1, "pop and discard the top of the stack")                            \
+  X(jump_if_true, 1, "pop c; continue at A if c is true")                      \
+  X(tee_local, 1, "store the top of the stack into locals[A]")                 \
+  X(fma, 1, "pop c, b, a; push a * b + c, rounded once")                       \
+  /* Superinstructions: fused forms of common sequences. */                    \
+  X(arg_add, 1, "load_arg A; add")                                             \
+  X(mul_add, 1, "mul; add")                                                    \
+  X(call1, 1, "call function A with 1 argument")                               \
+  X(jump_if_not_less, 1, "less; jump_if_false A")                              \
+  /* Compile the running function and continue in the compiled code. */       \
+  X(compile, 1, "compile this function, then run it")
+
+enum Opcode : uint8_t {
+#define KALEIDOSCOPE_OPCODE_ENUM(name, words, desc) op_##name,
+  KALEIDOSCOPE_OPCODES(KALEIDOSCOPE_OPCODE_ENUM)
+#undef KALEIDOSCOPE_OPCODE_ENUM
+      num_opcodes
+};
+
+inline const char *OpcodeName(unsigned op) {
+  static const char *const names[] = {
+#define KALEIDOSCOPE_OPCODE_NAME(name, words, desc) #name,
+      KALEIDOSCOPE_OPCODES(KALEIDOSCOPE_OPCODE_NAME)
+#undef KALEIDOSCOPE_OPCODE_NAME
+  };
+  return op < num_opcodes ? names[op] : "<invalid>";
+}
+
+inline unsigned OpcodeWords(unsigned op) {
+  static const unsigned char words[] = {
+#define KALEIDOSCOPE_OPCODE_WORDS(name, w, desc) w,
+      KALEIDOSCOPE_OPCODES(KALEIDOSCOPE_OPCODE_WORDS)
+#undef KALEIDOSCOPE_OPCODE_WORDS
+  };
+  return op < num_opcodes ? words[op] : 1;
+}
+
+inline constexpr uint32_t MAX_OPERAND = (1u << 24) - 1;
+
+constexpr uint32_t EncodeInstr(Opcode op, uint32_t a = 0) {
+  return static_cast<uint32_t>(op) | (a << 8);
+}
+inline unsigned DecodeOp(uint32_t word) { return word & 0xff; }
+inline uint32_t DecodeA(uint32_t word) { return word >> 8; }
+
+/// BcCode - One compiled function body. A body never changes once it is
+/// installed in a BcFunction, so a thread that has loaded a function's body
+/// pointer can read all of it without locking. The code and consts pointers
+/// refer either to the owned vectors below or into a loaded bytecode image.
+struct BcCode {
+  const uint32_t *code = nullptr;
+  const double *consts = nullptr;
+  uint32_t code_size = 0;
+  uint32_t num_consts = 0;
+  uint32_t arity = 0;      // Arguments a call must pass to run this body.
+  uint32_t num_locals = 0; // Arguments plus any other frame slots.
+  uint32_t max_stack = 0;  // Deepest operand stack above the locals.
+
+  std::vector<uint32_t> owned_code;
+  std::vector<double> owned_consts;
+  // (code offset, source location) of each call, for runtime errors.
+  std::vector<std::pair<uint32_t, SourceLoc>> call_locs;
+
+  SourceLoc GetCallLoc(uint32_t offset) const {
+    for (const auto &entry : call_locs) {
+      if (entry.first == offset) {
+        return entry.second;
+      }
+    }
+    return 0;
+  }
+
+  /// Adopt - Point code/consts at this body's own vectors.
+  void Adopt(std::vector<uint32_t> code_words, std::vector<double> pool) {
+    owned_code = std::move(code_words);
+    owned_consts = std::move(pool);
+    code = owned_code.data();
+    consts = owned_consts.data();
+    code_size = static_cast<uint32_t>(owned_code.size());
+    num_consts = static_cast<uint32_t>(owned_consts.size());
+  }
+};
+
+/// LAZY_CODE - The code of every function that is defined but not compiled
+/// yet: a trampoline whose one instruction compiles the function, installs
+/// the real body in its place, and continues into it.
+inline const uint32_t LAZY_CODE[] = {EncodeInstr(op_compile)};
+
+/// MakeLazyBody - A trampoline body for a definition taking arity arguments.
+/// Each definition gets its own, so that the arity calls check is swapped in
+/// together with the code they run.
+inline std::unique_ptr<BcCode> MakeLazyBody(uint32_t arity) {
+  auto body = std::make_unique<BcCode>();
+  body->code = LAZY_CODE;
+  body->code_size = 1;
+  body->arity = arity;
+  body->num_locals = arity;
+  return body;
+}
+
+/// BcFunction - An entry in the VM's function table, or a compiled top-level
+/// expression. Records are built in place and never moved.
+///
+/// Running code reads the body with GetBody, and SetBody replaces it with a
+/// single atomic store. A thread therefore sees either the old body or the
+/// new one, whole, and checks the arity of the body it is about to run. A
+/// builtin is published the same way, as one pointer to its fixed Builtin,
+/// so a function can be redefined while other threads call it. arity is
+/// what the function was last declared with, for the compilers and files;
+/// it is only read under the engine's lock.
+struct BcFunction {
+  std::string_view name;
+  uint32_t arity = 0;
+  std::atomic<bool> declared{false};
+  std::atomic<const Builtin *> native{nullptr};
+  std::unique_ptr<FunctionAST> ast;
+
+private:
+  std::atomic<const BcCode *> body{nullptr}; // Null until defined.
+  std::unique_ptr<BcCode> owned_body;
+
+public:
+  const BcCode *GetBody() const { return body.load(std::memory_order_acquire); }
+
+  /// IsCompiled - Whether the function has a body that is not a trampoline.
+  bool IsCompiled() const {
+    const BcCode *current = GetBody();
+    return current && current->code != LAZY_CODE;
+  }
+
+  /// SetBody - Install new_body, which may be a trampoline from MakeLazyBody.
+  /// Other threads may still be running the previous body, so it is retired
+  /// rather than freed.
+  void SetBody(std::unique_ptr<BcCode> new_body) {
+    body.store(new_body.get(), std::memory_order_release);
+    std::swap(owned_body, new_body);
+    EpochDomain::Get().Retire(std::move(new_body));
+  }
+};
+
+/// FunctionTable - The VM's functions, addressed by the index that call
+/// instructions carry. A name keeps its index for the whole session, so code
+/// can refer to a function before it is defined.
+///
+/// Entries live in fixed-size blocks that are never moved or freed, so
+/// indexing is safe while another thread adds functions. Adding and looking
+/// up names must be serialized by the caller.
+class FunctionTable {
+private:
+  static constexpr uint32_t BLOCK_BITS = 10;
+  static constexpr uint32_t BLOCK_SIZE = 1u << BLOCK_BITS;
+  static constexpr uint32_t MAX_BLOCKS = (MAX_OPERAND + 1) >> BLOCK_BITS;
+
+  std::vector<std::unique_ptr<BcFunction[]>> blocks;
+  uint32_t count = 0;
+  std::unordered_map<std::string_view, uint32_t> indices;
+
+public:
+  FunctionTable() : blocks(MAX_BLOCKS) {}
+
+  uint32_t GetOrCreate(std::string_view name) {
+    auto [it, inserted] = indices.emplace(name, count);
+    if (inserted) {
+      if (count % BLOCK_SIZE == 0) {
+        blocks[count >> BLOCK_BITS].reset(new BcFunction[BLOCK_SIZE]);
+      }
+      (*this)[count].name = name;
+      ++count;
+    }
+    return it->second;
+  }
+
+  BcFunction *Find(std::string_view name) {
+    auto it = indices.find(name);
+    return it == indices.end() ? nullptr : &(*this)[it->second];
+  }
+
+  BcFunction &operator[](uint32_t index) {
+    return blocks[index >> BLOCK_BITS][index & (BLOCK_SIZE - 1)];
+  }
+  const BcFunction &operator[](uint32_t index) const {
+    return blocks[index >> BLOCK_BITS][index & (BLOCK_SIZE - 1)];
+  }
+  uint32_t size() const { return count; }
+};
+
+/// Disassemble - Print body, the code of the function called name, one
+/// instruction per line.
+inline void Disassemble(FILE *out, std::string_view name, const BcCode &body,
+                        const FunctionTable &functions) {
+  fprintf(out, "%.*s: locals %u, max stack %u\n",
+          static_cast<int>(name.size()), name.data(), body.num_locals,
+          body.max_stack);
+  for (uint32_t pc = 0; pc < body.code_size;) {
+    uint32_t word = body.code[pc];
+    unsigned op = DecodeOp(word);
+    uint32_t a = DecodeA(word);
+    fprintf(out, "  %4u  %-10s", pc, OpcodeName(op));
+    switch (op) {
+    case op_push_const:
+      fprintf(out, " %u (%g)", a, body.consts[a]);
+      break;
+    case op_load_arg:
+    case op_store_local:
+    case op_tee_local:
+    case op_arg_add:
+    case op_jump:
+    case op_jump_if_false:
+    case op_jump_if_true:
+    case op_jump_if_not_less:
+      fprintf(out, " %u", a);
+      break;
+    case op_call:
+    case op_call1:
+    case op_tail_call: {
+      std::string_view callee = functions[a].name;
+      fprintf(out, " %u (%.*s)", a, static_cast<int>(callee.size()),
+              callee.data());
+      if (op != op_call1) {
+        fprintf(out, ", %u args", body.code[pc + 1]);
+      }
+      break;
+    }
+    default:
+      break;
+    }
+    fputc('\n', out);
+    pc += OpcodeWords(op);
+  }
+}
@@ -0,0 +1,398 @@
+#pragma once
+
+#include "bytecode.h"
+#include "select.h"
+#include "visitor.h"
+#include <cstring>
+#include <unordered_map>
+
+/// BytecodeOptions - Knobs for BytecodeCompiler.
+struct BytecodeOptions {
+  /// Fuse common instruction sequences into superinstructions.
+  bool superinstructions = true;
+  /// Lower each body to the IR, run the pass pipeline over it, and generate
+  /// code from that.
+  bool ir = false;
+  /// Let the IR passes rearrange floating-point arithmetic as if it were
+  /// exact, which can change how results are rounded.
+  bool fast_math = false;
+  /// Keep floating-point arithmetic as written even in the IR passes: no
+  /// polynomial rewriting, fma contraction or reassociation.
+  bool strict_fp = false;
+  /// Whether the IR passes may contract a * b + c into one fma.
+  bool fma = HasFma();
+};
+
+/// BytecodeEmitter - Appends instructions to one function's code, keeping
+/// its constant pool, the source location of each call and the deepest the
+/// operand stack gets.
+class BytecodeEmitter {
+protected:
+  std::vector<uint32_t> code;
+  std::vector<double> consts;
+  std::unordered_map<uint64_t, uint32_t> const_indices;
+  std::vector<std::pair<uint32_t, SourceLoc>> call_locs;
+  size_t last_instr = SIZE_MAX; // Where the last instruction emitted starts.
+  uint32_t depth = 0;
+  uint32_t max_depth = 0;
+  bool failed = false;
+
+  void Error(SourceLoc loc, const char *message) {
+    ReportError(loc, message);
+    failed = true;
+  }
+
+  void Emit(Opcode op, uint32_t a = 0) {
+    last_instr = code.size();
+    code.push_back(EncodeInstr(op, a));
+  }
+
+  /// Label - Mark the next instruction as a jump target and return its
+  /// offset.
+  uint32_t Label() {
+    last_instr = SIZE_MAX;
+    return static_cast<uint32_t>(code.size());
+  }
+
+  /// PatchJump - Point the jump that starts at offset at target.
+  void PatchJump(size_t offset, uint32_t target) {
+    code[offset] = EncodeInstr(static_cast<Opcode>(DecodeOp(code[offset])),
+                               target);
+  }
+
+  bool LastIs(Opcode op) const {
+    return last_instr != SIZE_MAX && DecodeOp(code[last_instr]) == op;
+  }
+
+  void ReplaceLast(Opcode op) {
+    code[last_instr] = EncodeInstr(op, DecodeA(code[last_instr]));
+  }
+
+  /// Push/Pop - Track the operand stack depth to size frames.
+  void Push() {
+    if (++depth > max_depth) {
+      max_depth = depth;
+    }
+  }
+  void Pop(uint32_t n = 1) { depth -= n; }
+
+  uint32_t AddConst(double val) {
+    uint64_t bits;
+    memcpy(&bits, &val, sizeof(bits));
+    auto [it, inserted] =
+        const_indices.emplace(bits, static_cast<uint32_t>(consts.size()));
+    if (inserted) {
+      consts.push_back(val);
+    }
+    return it->second;
+  }
+
+  /// EmitConst - Push val, or report that the pool is full.
+  void EmitConst(SourceLoc loc, double val) {
+    uint32_t index = AddConst(val);
+    if (index > MAX_OPERAND) {
+      return Error(loc, "too many constants in one function");
+    }
+    Emit(op_push_const, index);
+    Push();
+  }
+
+  /// EmitCall - Call callee with the num_args values on top of the stack.
+  void EmitCall(SourceLoc loc, std::string_view callee, uint32_t num_args,
+                bool is_tail, FunctionTable &functions,
+                const BytecodeOptions &options) {
+    uint32_t index = functions.GetOrCreate(callee);
+    if (index > MAX_OPERAND) {
+      return Error(loc, "too many functions");
+    }
+    call_locs.emplace_back(static_cast<uint32_t>(code.size()), loc);
+    if (is_tail) {
+      Emit(op_tail_call, index);
+      code.push_back(num_args);
+    } else if (options.superinstructions && num_args == 1) {
+      Emit(op_call1, index);
+    } else {
+      Emit(op_call, index);
+      code.push_back(num_args);
+    }
+    Pop(num_args);
+    Push();
+  }
+
+  /// TakeCode - On success, move the code into out, with num_locals slots.
+  bool TakeCode(uint32_t num_locals, BcCode &out) {
+    if (failed) {
+      return false;
+    }
+    out.Adopt(std::move(code), std::move(consts));
+    out.call_locs = std::move(call_locs);
+    out.num_locals = num_locals;
+    out.max_stack = max_depth;
+    return true;
+  }
+};
+
+/// BytecodeCompiler - Compiles one function body to stack bytecode.
+///
+/// Superinstructions are formed as code is emitted, by looking at the
+/// instruction emitted just before: "load_arg n; add" becomes "arg_add n",
+/// "mul; add" becomes "mul_add", and calls with one argument use "call1".
+///
+/// An if is either a select, which needs no jumps, or a conditional jump
+/// over the then arm. Superinstructions never span a jump target: each target
+/// is a label that resets last_instr.
+///
+/// A for loop is straight-line code closed by one backward jump.
+///
+/// A call whose value is the function's result is emitted as a tail_call.
+/// in_tail says whether the expression being visited is in that position:
+/// each handler reads it and clears it for its operands.
+class BytecodeCompiler : public ExprVisitor<BytecodeCompiler>,
+                         private BytecodeEmitter {
+private:
+  FunctionTable &functions;
+  const PrototypeAST &proto;
+  const BytecodeOptions &options;
+
+  // Names bound by enclosing var expressions, innermost last, and the local
+  // slot of each.
+  std::vector<std::pair<std::string_view, uint32_t>> scope;
+  uint32_t num_locals;
+  bool in_tail = false;
+
+public:
+  BytecodeCompiler(FunctionTable &functions, const PrototypeAST &proto,
+                   const BytecodeOptions &options)
+      : functions(functions), proto(proto), options(options),
+        num_locals(static_cast<uint32_t>(proto.GetArgs().size())) {}
+
+  void VisitNumber(const NumberExprAST &expr) {
+    in_tail = false;
+    EmitConst(expr.GetLoc(), expr.GetVal());
+  }
+
+  /// FindSlot - The local slot that name refers to, or false if it is not
+  /// bound.
+  bool FindSlot(std::string_view name, uint32_t &slot) const {
+    for (auto it = scope.rbegin(); it != scope.rend(); ++it) {
+      if (it->first == name) {
+        slot = it->second;
+        return true;
+      }
+    }
+    const auto &names = proto.GetArgs();
+    for (size_t i = 0; i < names.size(); ++i) {
+      if (names[i] == name) {
+        slot = static_cast<uint32_t>(i);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void VisitVariable(const VariableExprAST &expr) {
+    in_tail = false;
+    uint32_t slot;
+    if (FindSlot(expr.GetName(), slot)) {
+      Emit(op_load_arg, slot);
+    } else {
+      // Keep the stack depth consistent so compilation can carry on.
+      Error(expr.GetLoc(), "Unknown variable name");
+    }
+    Push();
+  }
+
+  /// VisitAssign - A name is a fixed slot, so assignment is a store that
+  /// leaves the value on the stack.
+  void VisitAssign(const AssignExprAST &expr) {
+    in_tail = false;
+    Visit(expr.GetValue());
+    uint32_t slot;
+    if (!FindSlot(expr.GetName(), slot)) {
+      return Error(expr.GetLoc(), "Unknown variable name");
+    }
+    Emit(op_tee_local, slot);
+  }
+
+  void VisitBinary(const BinaryExprAST &expr) {
+    in_tail = false;
+    Visit(expr.GetLHS());
+    Visit(expr.GetRHS());
+    Pop();
+    switch (expr.GetOp()) {
+    case '+':
+      if (options.superinstructions && LastIs(op_load_arg)) {
+        return ReplaceLast(op_arg_add);
+      }
+      if (options.superinstructions && LastIs(op_mul)) {
+        return ReplaceLast(op_mul_add);
+      }
+      return Emit(op_add);
+    case '-':
+      return Emit(op_sub);
+    case '*':
+      return Emit(op_mul);
+    case '<':
+      return Emit(op_less);
+    default:
+      return Error(expr.GetLoc(), "invalid binary operator");
+    }
+  }
+
+  /// VisitVar - Each name gets a slot of its own after the arguments; slots
+  /// are not reused between sibling vars.
+  void VisitVar(const VarExprAST &expr) {
+    bool is_tail = in_tail;
+    for (const auto &[name, init] : expr.GetVars()) {
+      in_tail = false;
+      Visit(*init);
+      if (num_locals > MAX_OPERAND) {
+        return Error(expr.GetLoc(), "too many variables in one function");
+      }
+      Emit(op_store_local, num_locals);
+      Pop();
+      scope.emplace_back(name, num_locals++);
+    }
+    in_tail = is_tail;
+    Visit(expr.GetBody());
+    scope.resize(scope.size() - expr.GetVars().size());
+  }
+
+  void VisitIf(const IfExprAST &expr) {
+    bool is_tail = in_tail;
+    in_tail = false;
+    Visit(expr.GetCond());
+    if (ShouldSelect(expr)) {
+      in_tail = false;
+      Visit(expr.GetThen());
+      in_tail = false;
+      Visit(expr.GetElse());
+      Emit(op_select);
+      return Pop(2);
+    }
+
+    //   cond; jump_if_false else; then; jump end; else: otherwise; end:
+    // In tail position the then arm returns instead of jumping to the ret
+    // after end.
+    if (options.superinstructions && LastIs(op_less)) {
+      ReplaceLast(op_jump_if_not_less);
+    } else {
+      Emit(op_jump_if_false);
+    }
+    size_t to_else = last_instr;
+    Pop();
+    uint32_t base = depth;
+    in_tail = is_tail;
+    Visit(expr.GetThen());
+    Emit(is_tail ? op_ret : op_jump);
+    size_t to_end = last_instr;
+    depth = base;
+    PatchJump(to_else, Label());
+    in_tail = is_tail;
+    Visit(expr.GetElse());
+    uint32_t end = Label();
+    if (!is_tail) {
+      PatchJump(to_end, end);
+    }
+    if (end > MAX_OPERAND) {
+      Error(expr.GetLoc(), "function is too long");
+    }
+  }
+
+  /// VisitFor - Each induction variable gets a slot, like a var name. The
+  /// body is emitted unroll times, and only its last copy evaluates end:
+  ///   starts; top: (body; pop; [end;] steps) x unroll; jump_if_true top
+  /// and the loop's value, 0, is pushed after it.
+  void VisitFor(const ForExprAST &expr) {
+    in_tail = false;
+    const auto &vars = expr.GetVars();
+    uint32_t first = num_locals;
+    for (const auto &var : vars) {
+      in_tail = false;
+      Visit(*var.start);
+      if (num_locals > MAX_OPERAND) {
+        return Error(expr.GetLoc(), "too many variables in one function");
+      }
+      Emit(op_store_local, num_locals++);
+      Pop();
+    }
+    for (size_t i = 0; i < vars.size(); ++i) {
+      scope.emplace_back(vars[i].name, first + static_cast<uint32_t>(i));
+    }
+
+    uint32_t top = Label();
+    for (uint32_t copy = 1; copy <= expr.GetUnroll(); ++copy) {
+      in_tail = false;
+      Visit(expr.GetBody());
+      Pop();
+      // A body that only pushes a value need not be run at all, and one
+      // that ends in an assignment need not keep its value.
+      if (LastIs(op_push_const) || LastIs(op_load_arg)) {
+        code.resize(last_instr);
+        last_instr = SIZE_MAX;
+      } else if (LastIs(op_tee_local)) {
+        ReplaceLast(op_store_local);
+      } else {
+        Emit(op_pop);
+      }
+      if (copy == expr.GetUnroll()) {
+        in_tail = false;
+        Visit(expr.GetEnd());
+      }
+      for (size_t i = 0; i < vars.size(); ++i) {
+        uint32_t slot = first + static_cast<uint32_t>(i);
+        in_tail = false;
+        Visit(*vars[i].step);
+        if (options.superinstructions) {
+          Emit(op_arg_add, slot);
+        } else {
+          Emit(op_load_arg, slot);
+          Emit(op_add);
+        }
+        Push();
+        Pop(2);
+        Emit(op_store_local, slot);
+      }
+    }
+    Emit(op_jump_if_true, top);
+    Pop();
+    scope.resize(scope.size() - vars.size());
+    if (code.size() > MAX_OPERAND) {
+      return Error(expr.GetLoc(), "function is too long");
+    }
+    VisitNumber(NumberExprAST(expr.GetLoc(), 0.0));
+  }
+
+  void VisitCall(const CallExprAST &expr) {
+    bool is_tail = in_tail;
+    for (const auto &arg : expr.GetArgs()) {
+      in_tail = false;
+      Visit(*arg);
+    }
+    EmitCall(expr.GetLoc(), expr.GetCallee(),
+             static_cast<uint32_t>(expr.GetArgs().size()), is_tail, functions,
+             options);
+  }
+
+  /// Finish - Compile body and, on success, store the code in out.
+  bool Finish(const ExprAST &body, BcCode &out) {
+    in_tail = true;
+    Visit(body);
+    Emit(op_ret);
+    return TakeCode(num_locals, out);
+  }
+};
+
+/// CompileFunction - Compile body, with the parameters of proto, into out.
+/// On failure out is left unchanged.
+inline bool CompileFunction(FunctionTable &functions, const PrototypeAST &proto,
+                            const ExprAST &body, const BytecodeOptions &options,
+                            BcCode &out) {
+  return BytecodeCompiler(functions, proto, options).Finish(body, out);
+}
+
+inline bool CompileFunction(FunctionTable &functions, const FunctionAST &ast,
+                            const BytecodeOptions &options, BcCode &out) {
+  return CompileFunction(functions, ast.GetProto(), ast.GetBody(), options,
+                         out);
+}
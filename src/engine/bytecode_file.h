@@ -0,0 +1,514 @@
+#pragma once
+
+#include "bytecode.h"
+#include <cstring>
+#include <deque>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define KALEIDOSCOPE_HAVE_MMAP 1
+#else
+#define KALEIDOSCOPE_HAVE_MMAP 0
+#endif
+
+// The .kbc bytecode file format.
+//
+// A .kbc file is a whole compiled program: the VM's function table, each
+// function's code and constant pool, the names that link calls to builtins,
+// and the top-level expressions to run, in order. It is laid out so the VM
+// can execute straight out of a read-only mapping of the file: every section
+// is at a file offset aligned for its contents, and the records only hold
+// offsets and counts, which the loader turns into pointers into the mapping.
+// Nothing is copied or decoded, so loading costs one mmap plus a validation
+// pass, and code pages are faulted in as they are first executed.
+//
+//   KbcHeader
+//   KbcFunction[num_functions + num_entries]   table order, then entries
+//   code and constants, one run per function   8-byte aligned
+//   string table                               function names, not
+//                                              terminated
+//
+// Everything is in the byte order of the machine that wrote the file; the
+// loader rejects files from the other byte order rather than swap them.
+
+/// KBC_VERSION - Bump whenever the layout of the records below changes. The
+/// opcode numbering is covered separately by KbcHeader::opcode_hash.
+inline constexpr uint32_t KBC_VERSION = 1;
+
+inline constexpr char KBC_MAGIC[4] = {'K', 'B', 'C', '\x1a'};
+inline constexpr uint32_t KBC_BYTE_ORDER = 0x01020304;
+
+struct KbcHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t byte_order;  // KBC_BYTE_ORDER, as the writer stored it.
+  uint32_t opcode_hash; // OpcodeSetHash() of the writer.
+  uint32_t num_functions;
+  uint32_t num_entries;
+  uint32_t functions_offset;
+  uint32_t strings_offset;
+  uint32_t strings_size;
+  uint32_t file_size;
+};
+
+enum KbcFunctionFlags : uint32_t {
+  kbc_declared = 1 << 0, // Named in a 'def' or 'extern'.
+  kbc_native = 1 << 1,   // Bound to the builtin of the same name.
+};
+
+struct KbcFunction {
+  uint32_t name_offset; // Into the string table.
+  uint32_t name_length;
+  uint32_t arity;
+  uint32_t num_locals;
+  uint32_t max_stack;
+  uint32_t flags;
+  uint32_t code_offset; // 0 if the function has no code.
+  uint32_t code_size;   // In words.
+  uint32_t consts_offset;
+  uint32_t num_consts;
+};
+
+/// OpcodeSetHash - A hash of the opcode names in numbering order, so a file
+/// written by a VM with a different instruction set is rejected instead of
+/// misread.
+inline uint32_t OpcodeSetHash() {
+  uint32_t hash = 2166136261u;
+  for (unsigned op = 0; op < num_opcodes; ++op) {
+    for (const char *p = OpcodeName(op); *p; ++p) {
+      hash = (hash ^ static_cast<unsigned char>(*p)) * 16777619u;
+    }
+    hash = (hash ^ OpcodeWords(op)) * 16777619u;
+  }
+  return hash;
+}
+
+/// WriteBytecodeFile - Write functions and the top-level entries to path.
+/// Reports errors to stderr and returns false on failure.
+inline bool WriteBytecodeFile(const char *path, const FunctionTable &functions,
+                              const std::deque<BcFunction> &entries) {
+  std::vector<char> out(sizeof(KbcHeader));
+  auto align = [&out](size_t alignment) {
+    out.resize((out.size() + alignment - 1) / alignment * alignment);
+  };
+  auto append = [&out](const void *data, size_t size) {
+    size_t offset = out.size();
+    out.resize(offset + size);
+    if (size) {
+      memcpy(out.data() + offset, data, size);
+    }
+    return static_cast<uint32_t>(offset);
+  };
+
+  uint32_t num_functions = functions.size();
+  size_t num_records = num_functions + entries.size();
+  auto record_for = [&](size_t i) -> const BcFunction & {
+    return i < num_functions ? functions[static_cast<uint32_t>(i)]
+                             : entries[i - num_functions];
+  };
+
+  align(alignof(KbcFunction));
+  uint32_t functions_offset = static_cast<uint32_t>(out.size());
+  out.resize(out.size() + num_records * sizeof(KbcFunction));
+
+  std::vector<KbcFunction> records(num_records);
+  std::string strings;
+  for (size_t i = 0; i < num_records; ++i) {
+    const BcFunction &fn = record_for(i);
+    KbcFunction &record = records[i];
+    record = KbcFunction{};
+    if (i < num_functions) {
+      record.name_offset = static_cast<uint32_t>(strings.size());
+      record.name_length = static_cast<uint32_t>(fn.name.size());
+      strings.append(fn.name);
+    }
+    record.arity = fn.arity;
+    record.flags = (fn.declared ? uint32_t(kbc_declared) : 0) |
+                   (fn.native ? uint32_t(kbc_native) : 0);
+    const BcCode *body = fn.GetBody();
+    if (body && !fn.native) {
+      if (body->code == LAZY_CODE) {
+        fprintf(stderr, "Error: '%.*s' is not compiled\n",
+                static_cast<int>(fn.name.size()), fn.name.data());
+        return false;
+      }
+      record.num_locals = body->num_locals;
+      record.max_stack = body->max_stack;
+      align(sizeof(double));
+      record.consts_offset =
+          append(body->consts, body->num_consts * sizeof(double));
+      record.num_consts = body->num_consts;
+      record.code_offset =
+          append(body->code, body->code_size * sizeof(uint32_t));
+      record.code_size = body->code_size;
+    }
+  }
+  uint32_t strings_offset = append(strings.data(), strings.size());
+  if (out.size() > UINT32_MAX) {
+    fprintf(stderr, "Error: bytecode image too large\n");
+    return false;
+  }
+
+  KbcHeader header{};
+  memcpy(header.magic, KBC_MAGIC, sizeof(header.magic));
+  header.version = KBC_VERSION;
+  header.byte_order = KBC_BYTE_ORDER;
+  header.opcode_hash = OpcodeSetHash();
+  header.num_functions = num_functions;
+  header.num_entries = static_cast<uint32_t>(entries.size());
+  header.functions_offset = functions_offset;
+  header.strings_offset = strings_offset;
+  header.strings_size = static_cast<uint32_t>(strings.size());
+  header.file_size = static_cast<uint32_t>(out.size());
+  memcpy(out.data(), &header, sizeof(header));
+  if (num_records) {
+    memcpy(out.data() + functions_offset, records.data(),
+           num_records * sizeof(KbcFunction));
+  }
+
+  FILE *file = fopen(path, "wb");
+  if (!file) {
+    fprintf(stderr, "Error: cannot open '%s' for writing\n", path);
+    return false;
+  }
+  bool ok = fwrite(out.data(), 1, out.size(), file) == out.size();
+  ok = fclose(file) == 0 && ok;
+  if (!ok) {
+    fprintf(stderr, "Error: cannot write '%s'\n", path);
+  }
+  return ok;
+}
+
+/// MappedFile - A read-only view of a whole file: a private mapping where
+/// mmap is available, else a copy in an 8-byte aligned buffer.
+class MappedFile {
+private:
+  const char *data = nullptr;
+  size_t size = 0;
+#if KALEIDOSCOPE_HAVE_MMAP
+  void *mapping = nullptr;
+#else
+  std::vector<uint64_t> copy;
+#endif
+
+public:
+  MappedFile() = default;
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  ~MappedFile() {
+#if KALEIDOSCOPE_HAVE_MMAP
+    if (mapping) {
+      munmap(mapping, size);
+    }
+#endif
+  }
+
+  /// Open - Map path. Reports errors to stderr.
+  bool Open(const char *path) {
+#if KALEIDOSCOPE_HAVE_MMAP
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+      fprintf(stderr, "Error: cannot open '%s'\n", path);
+      return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      fprintf(stderr, "Error: cannot stat '%s'\n", path);
+      close(fd);
+      return false;
+    }
+    size = static_cast<size_t>(st.st_size);
+    if (size) {
+      mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (mapping == MAP_FAILED) {
+        mapping = nullptr;
+        size = 0;
+        fprintf(stderr, "Error: cannot map '%s'\n", path);
+        close(fd);
+        return false;
+      }
+      data = static_cast<const char *>(mapping);
+    }
+    close(fd);
+    return true;
+#else
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+      fprintf(stderr, "Error: cannot open '%s'\n", path);
+      return false;
+    }
+    std::vector<char> bytes;
+    char chunk[1 << 16];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+      bytes.insert(bytes.end(), chunk, chunk + n);
+    }
+    fclose(file);
+    size = bytes.size();
+    copy.resize((size + 7) / 8);
+    memcpy(copy.data(), bytes.data(), size);
+    data = reinterpret_cast<const char *>(copy.data());
+    return true;
+#endif
+  }
+
+  const char *GetData() const { return data; }
+  size_t GetSize() const { return size; }
+};
+
+/// VerifyCode - Check that body is safe to run: every instruction is whole
+/// and known, every operand is in range, the operand stack never underflows
+/// or grows past max_stack, and the code ends with a return. Jumps must go
+/// to the start of an instruction, and every path must reach it with the same
+/// stack depth; code that only a jump can reach must be the target of one. A
+/// backward jump must go to code the pass has already reached, so the depth
+/// there is known.
+inline bool VerifyCode(const BcCode &fn, uint32_t num_functions) {
+  constexpr uint32_t NO_TARGET = UINT32_MAX;
+  // The stack depth that jumps to each offset arrive with. Once the pass
+  // reaches an instruction, this holds the depth before it as well.
+  std::vector<uint32_t> target_depths(fn.code_size, NO_TARGET);
+  auto add_target = [&](uint32_t pc, uint32_t target, uint32_t depth) {
+    if (target >= fn.code_size) {
+      return false;
+    }
+    if (target > pc && target_depths[target] == NO_TARGET) {
+      target_depths[target] = depth;
+    }
+    return target_depths[target] == depth;
+  };
+
+  uint32_t depth = 0;
+  bool reachable = true; // Whether the previous instruction falls through.
+  unsigned last_op = num_opcodes;
+  for (uint32_t pc = 0; pc < fn.code_size;) {
+    uint32_t word = fn.code[pc];
+    unsigned op = DecodeOp(word);
+    uint32_t a = DecodeA(word);
+    if (op >= num_opcodes || pc + OpcodeWords(op) > fn.code_size) {
+      return false;
+    }
+    if (target_depths[pc] != NO_TARGET) {
+      if (reachable && depth != target_depths[pc]) {
+        return false;
+      }
+      depth = target_depths[pc];
+    } else if (!reachable) {
+      return false;
+    }
+    target_depths[pc] = depth;
+    for (uint32_t i = 1; i < OpcodeWords(op); ++i) {
+      if (target_depths[pc + i] != NO_TARGET) {
+        return false;
+      }
+    }
+    reachable = true;
+    uint32_t pops = 0;
+    uint32_t pushes = 0;
+    switch (static_cast<Opcode>(op)) {
+    case op_push_const:
+      if (a >= fn.num_consts) {
+        return false;
+      }
+      pushes = 1;
+      break;
+    case op_load_arg:
+      if (a >= fn.num_locals) {
+        return false;
+      }
+      pushes = 1;
+      break;
+    case op_store_local:
+      if (a >= fn.num_locals) {
+        return false;
+      }
+      pops = 1;
+      break;
+    case op_tee_local:
+      if (a >= fn.num_locals) {
+        return false;
+      }
+      pops = 1;
+      pushes = 1;
+      break;
+    case op_add:
+    case op_sub:
+    case op_mul:
+    case op_less:
+      pops = 2;
+      pushes = 1;
+      break;
+    case op_arg_add:
+      if (a >= fn.num_locals) {
+        return false;
+      }
+      pops = 1;
+      pushes = 1;
+      break;
+    case op_pop:
+      pops = 1;
+      break;
+    case op_mul_add:
+    case op_fma:
+    case op_select:
+      pops = 3;
+      pushes = 1;
+      break;
+    case op_call:
+    case op_call1:
+    case op_tail_call:
+      if (a >= num_functions) {
+        return false;
+      }
+      pops = op == op_call1 ? 1 : fn.code[pc + 1];
+      pushes = 1;
+      break;
+    case op_ret:
+      pops = 1;
+      reachable = false;
+      break;
+    case op_jump:
+    case op_jump_if_false:
+    case op_jump_if_true:
+    case op_jump_if_not_less:
+      pops = op == op_jump ? 0 : op == op_jump_if_not_less ? 2 : 1;
+      if (depth < pops || !add_target(pc, a, depth - pops)) {
+        return false;
+      }
+      reachable = op != op_jump;
+      break;
+    case op_compile: // Only ever in LAZY_CODE.
+    case num_opcodes:
+      return false;
+    }
+    if (depth < pops) {
+      return false;
+    }
+    depth = depth - pops + pushes;
+    if (depth > fn.max_stack) {
+      return false;
+    }
+    last_op = op;
+    pc += OpcodeWords(op);
+  }
+  return last_op == op_ret;
+}
+
+/// LoadBytecodeFile - Validate file as a .kbc image and fill functions, which
+/// must be empty, and entries with records that point into it. file must
+/// outlive them. Reports errors to stderr.
+inline bool LoadBytecodeFile(const MappedFile &file, const char *path,
+                             FunctionTable &functions,
+                             std::deque<BcFunction> &entries) {
+  auto fail = [path](const char *message) {
+    fprintf(stderr, "Error: %s: %s\n", path, message);
+    return false;
+  };
+  const char *data = file.GetData();
+  size_t size = file.GetSize();
+  KbcHeader header;
+  if (size < sizeof(header)) {
+    return fail("not a bytecode file");
+  }
+  memcpy(&header, data, sizeof(header));
+  if (memcmp(header.magic, KBC_MAGIC, sizeof(KBC_MAGIC)) != 0) {
+    return fail("not a bytecode file");
+  }
+  if (header.byte_order != KBC_BYTE_ORDER) {
+    return fail("bytecode file has the wrong byte order");
+  }
+  if (header.version != KBC_VERSION ||
+      header.opcode_hash != OpcodeSetHash()) {
+    return fail("bytecode file is from an incompatible version");
+  }
+  if (functions.size() != 0) {
+    return fail("bytecode files cannot be loaded after other definitions");
+  }
+
+  // Every range must lie inside the file, and every pointer we hand out must
+  // be aligned for what it points to.
+  auto in_file = [size](uint64_t offset, uint64_t length) {
+    return offset <= size && length <= size - offset;
+  };
+  uint64_t num_records =
+      static_cast<uint64_t>(header.num_functions) + header.num_entries;
+  if (header.file_size != size ||
+      header.functions_offset % alignof(KbcFunction) != 0 ||
+      !in_file(header.functions_offset, num_records * sizeof(KbcFunction)) ||
+      !in_file(header.strings_offset, header.strings_size) ||
+      header.num_functions > MAX_OPERAND + 1) {
+    return fail("bytecode file is corrupt");
+  }
+  const auto *records =
+      reinterpret_cast<const KbcFunction *>(data + header.functions_offset);
+  const char *strings = data + header.strings_offset;
+
+  for (uint64_t i = 0; i < num_records; ++i) {
+    const KbcFunction &record = records[i];
+    bool is_entry = i >= header.num_functions;
+    BcFunction *fn;
+    if (!is_entry) {
+      if (!in_file(header.strings_offset + uint64_t(record.name_offset),
+                   record.name_length) ||
+          uint64_t(record.name_offset) + record.name_length >
+              header.strings_size) {
+        return fail("bytecode file is corrupt");
+      }
+      std::string_view name(strings + record.name_offset, record.name_length);
+      if (functions.GetOrCreate(name) != i) {
+        return fail("bytecode file defines a function twice");
+      }
+      fn = &functions[static_cast<uint32_t>(i)];
+    } else {
+      entries.emplace_back();
+      fn = &entries.back();
+      fn->name = "<top-level>";
+    }
+    fn->arity = record.arity;
+    fn->declared = record.flags & kbc_declared;
+    if (record.flags & kbc_native) {
+      const Builtin *builtin = FindBuiltin(fn->name);
+      if (!builtin || builtin->arity != fn->arity) {
+        return fail("bytecode file refers to an unknown builtin");
+      }
+      fn->native = builtin;
+      continue;
+    }
+    if (!record.code_offset) {
+      if (is_entry) {
+        return fail("bytecode file is corrupt");
+      }
+      continue;
+    }
+    if (record.num_locals < record.arity ||
+        record.num_locals > MAX_OPERAND || record.max_stack > MAX_OPERAND ||
+        record.code_offset % alignof(uint32_t) != 0 ||
+        record.consts_offset % alignof(double) != 0 ||
+        !in_file(record.code_offset,
+                 uint64_t(record.code_size) * sizeof(uint32_t)) ||
+        !in_file(record.consts_offset,
+                 uint64_t(record.num_consts) * sizeof(double))) {
+      return fail("bytecode file is corrupt");
+    }
+    auto body = std::make_unique<BcCode>();
+    body->code = reinterpret_cast<const uint32_t *>(data + record.code_offset);
+    body->consts =
+        reinterpret_cast<const double *>(data + record.consts_offset);
+    body->code_size = record.code_size;
+    body->num_consts = record.num_consts;
+    body->arity = record.arity;
+    body->num_locals = record.num_locals;
+    body->max_stack = record.max_stack;
+    if (!VerifyCode(*body, header.num_functions)) {
+      return fail("bytecode file contains invalid code");
+    }
+    fn->SetBody(std::move(body));
+  }
+  return true;
+}
@@ -0,0 +1,161 @@
+#pragma once
+
+#include "engine.h"
+#include "runtime.h"
+#include "visitor.h"
+#include <unordered_map>
+#include <vector>
+
+/// CheckEngine - Runs nothing; instead reports, for the whole program, the
+/// errors the other engines only find when a definition is compiled or
+/// called: unknown variables, calls to functions that are never defined or
+/// declared, and calls with the wrong number of arguments.
+///
+/// Top-level expressions are checked as they arrive, against what is defined
+/// at that point, just as they would run. Definitions are collected and
+/// checked in Finish, against the final set of functions, so a call to a
+/// function defined further down the file is fine. Checking reads every
+/// body, so with lazy parsing it also parses every body that was skipped.
+class CheckEngine : public Engine {
+private:
+  std::vector<std::unique_ptr<FunctionAST>> functions;
+  // Arity of every name that was defined or declared. As in the engines, a
+  // definition or an extern that binds a builtin replaces it, and any other
+  // extern only declares a function for a later 'def'.
+  std::unordered_map<std::string_view, size_t> arities;
+  unsigned errors = 0;
+
+  /// BodyChecker - Checks one body against the arities known so far.
+  class BodyChecker : public ExprVisitor<BodyChecker> {
+  private:
+    const CheckEngine &engine;
+    const PrototypeAST &proto;
+    std::vector<std::string_view> scope; // Names bound by enclosing vars.
+
+  public:
+    unsigned errors = 0;
+
+    BodyChecker(const CheckEngine &engine, const PrototypeAST &proto)
+        : engine(engine), proto(proto) {}
+
+    void Error(SourceLoc loc, const char *message) {
+      ReportError(loc, message);
+      ++errors;
+    }
+
+    void VisitNumber(const NumberExprAST &) {}
+
+    void CheckName(SourceLoc loc, std::string_view name) {
+      for (std::string_view bound : scope) {
+        if (bound == name) {
+          return;
+        }
+      }
+      for (std::string_view arg : proto.GetArgs()) {
+        if (arg == name) {
+          return;
+        }
+      }
+      Error(loc, "Unknown variable name");
+    }
+
+    void VisitVariable(const VariableExprAST &expr) {
+      CheckName(expr.GetLoc(), expr.GetName());
+    }
+
+    void VisitAssign(const AssignExprAST &expr) {
+      Visit(expr.GetValue());
+      CheckName(expr.GetLoc(), expr.GetName());
+    }
+
+    void VisitBinary(const BinaryExprAST &expr) {
+      Visit(expr.GetLHS());
+      Visit(expr.GetRHS());
+    }
+
+    void VisitVar(const VarExprAST &expr) {
+      for (const auto &[name, init] : expr.GetVars()) {
+        Visit(*init);
+        scope.push_back(name);
+      }
+      Visit(expr.GetBody());
+      scope.resize(scope.size() - expr.GetVars().size());
+    }
+
+    void VisitFor(const ForExprAST &expr) {
+      for (const auto &var : expr.GetVars()) {
+        Visit(*var.start);
+      }
+      for (const auto &var : expr.GetVars()) {
+        scope.push_back(var.name);
+      }
+      Visit(expr.GetEnd());
+      for (const auto &var : expr.GetVars()) {
+        Visit(*var.step);
+      }
+      Visit(expr.GetBody());
+      scope.resize(scope.size() - expr.GetVars().size());
+    }
+
+    void VisitIf(const IfExprAST &expr) {
+      Visit(expr.GetCond());
+      Visit(expr.GetThen());
+      Visit(expr.GetElse());
+    }
+
+    void VisitCall(const CallExprAST &expr) {
+      for (const auto &arg : expr.GetArgs()) {
+        Visit(*arg);
+      }
+      auto it = engine.arities.find(expr.GetCallee());
+      if (it == engine.arities.end()) {
+        Error(expr.GetLoc(), "Unknown function referenced");
+      } else if (it->second != expr.GetArgs().size()) {
+        Error(expr.GetLoc(), "Incorrect # arguments passed");
+      }
+    }
+  };
+
+public:
+  bool AddFunction(std::unique_ptr<FunctionAST> fn) override {
+    arities[fn->GetProto().GetName()] = fn->GetProto().GetArgs().size();
+    functions.push_back(std::move(fn));
+    return true;
+  }
+
+  bool AddExtern(std::unique_ptr<PrototypeAST> proto) override {
+    size_t arity = proto->GetArgs().size();
+    if (const Builtin *builtin = FindBuiltin(proto->GetName())) {
+      if (builtin->arity != arity) {
+        ReportError(proto->GetLoc(), "extern does not match builtin arity");
+        ++errors;
+        return false;
+      }
+      arities[proto->GetName()] = arity;
+    } else {
+      arities.emplace(proto->GetName(), arity);
+    }
+    return true;
+  }
+
+  /// Evaluate - Check the expression now. Nothing is run, so there is never
+  /// a result.
+  bool Evaluate(std::unique_ptr<FunctionAST> fn, double &) override {
+    Check(*fn);
+    return false;
+  }
+
+  void Check(const FunctionAST &fn) {
+    BodyChecker checker(*this, fn.GetProto());
+    checker.Visit(fn.GetBody());
+    errors += checker.errors;
+  }
+
+  /// Finish - Check the definitions and return the total number of errors.
+  unsigned Finish() {
+    for (const auto &fn : functions) {
+      Check(*fn);
+    }
+    return errors;
+  }
+};
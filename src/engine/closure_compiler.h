@@ -0,0 +1,814 @@
+#pragma once
+
+#include "assigned.h"
+#include "engine.h"
+#include "epoch.h"
+#include "inliner.h"
+#include "loop_optimizer.h"
+#include "runtime.h"
+#include "select.h"
+#include "visitor.h"
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// A closure-compiling engine. Each definition is compiled once, when it is
+// added, into a tree of Closures: plain structs holding a function pointer and
+// the operands that pointer needs (child closures, a constant, argument
+// slots, a resolved callee). Evaluating a closure is one indirect call to a
+// function that already knows its node shape, so there is no dispatch on node
+// kind at run time and no std::function overhead.
+//
+// Shapes are picked at compile time: constant subtrees are folded, and
+// operators get dedicated evaluators for "argument op constant",
+// "argument op argument" and "subtree op constant" as well as the general
+// form. Top-level expressions are compiled, run once and thrown away, which
+// is cheap because compiling is a single pass over the AST.
+//
+// An if whose arms are cheap and make no calls evaluates both and picks one
+// with EvalSelect, which has no data-dependent branch; other ifs branch with
+// EvalIf.
+//
+// With lazy compilation a definition is only parsed into its record, whose
+// code is a trampoline closure; the first call compiles the body and swaps
+// the code. Compiled code may then run on several threads: compiles are
+// serialized by the engine's lock, and a thread that makes a first call while
+// another is compiling the same function waits for it and runs its result.
+// Redefinition swaps the code the same way, so callers, which hold the
+// record rather than its code, never need recompiling; the old closures are
+// freed through EpochDomain once no evaluation can still be running them.
+// The code carries the arity it was compiled for, and a call checks the
+// arity of the code it runs, never of some other definition.
+//
+// Bodies go through the Inliner and the LoopOptimizer before they are
+// compiled, and a function whose closures copied the body of one that is then
+// redefined goes back to its trampoline until its next call.
+//
+// A function that calls itself in tail position runs as a loop: the call
+// overwrites the arguments and flags a tail call instead of recursing, and
+// an EvalTailLoop at the root of the body runs it again. Tail calls to other
+// functions are ordinary calls; only the VM eliminates those.
+
+namespace closure {
+
+class ClosureEngine;
+struct Closure;
+struct Function;
+
+using EvalFn = double (*)(const Closure &self, double *args);
+
+/// Closure - One compiled node. Which fields are meaningful depends on eval.
+struct Closure {
+  EvalFn eval;
+  const Closure *lhs = nullptr;
+  const Closure *rhs = nullptr;
+  double k = 0.0;
+  uint32_t slot = 0;
+  uint32_t slot2 = 0;
+  const Closure *cond = nullptr; // Ifs; lhs and rhs are the arms.
+  // Calls.
+  Function *callee = nullptr;
+  NativeFn native = nullptr;
+  const Closure *const *call_args = nullptr;
+  uint32_t num_args = 0;
+  SourceLoc loc = 0;
+};
+
+inline double Eval(const Closure &c, double *args) {
+  return c.eval(c, args);
+}
+
+double EvalLazy(const Closure &c, double *args);
+
+/// Code - Storage for one compiled body, or a trampoline, and the number of
+/// arguments it takes; deques keep addresses stable. Code never changes once
+/// it is installed in a Function.
+struct Code {
+  std::deque<Closure> closures;
+  std::deque<std::vector<const Closure *>> arg_lists;
+  const Closure *entry = nullptr;
+  size_t arity = 0;
+};
+
+/// Function - A named function. Records are never freed or moved, so call
+/// closures hold a pointer to their callee's record; redefining a function
+/// swaps in new code, and calls to names that are not defined yet bind to an
+/// empty record that a later 'def' fills in. The code and the builtin are
+/// each published with one atomic store, so a function can be redefined
+/// while other threads call it. arity is what the function was last
+/// declared with; it is only read under the engine's lock.
+struct Function {
+  ClosureEngine *engine = nullptr;
+  std::string_view name;
+  size_t arity = 0;
+  std::atomic<bool> declared{false};
+  std::atomic<const Builtin *> native{nullptr};
+  std::unique_ptr<FunctionAST> ast;
+
+private:
+  // The compiled body, a trampoline while it is waiting to be compiled, or
+  // null if the function is not defined.
+  std::atomic<const Code *> code{nullptr};
+  std::unique_ptr<Code> owned_code;
+
+public:
+  const Code *GetCode() const { return code.load(std::memory_order_acquire); }
+
+  /// IsCompiled - Whether the function has code that is not a trampoline.
+  bool IsCompiled() const;
+
+  /// SetCode - Install new_code. Other threads may still be running the
+  /// previous code, so it is retired rather than freed.
+  void SetCode(std::unique_ptr<Code> new_code) {
+    code.store(new_code.get(), std::memory_order_release);
+    std::swap(owned_code, new_code);
+    EpochDomain::Get().Retire(std::move(new_code));
+  }
+};
+
+/// MakeTrampoline - Code for fn, taking arity arguments, that compiles its
+/// definition on the first call and then runs that instead.
+inline std::unique_ptr<Code> MakeTrampoline(Function &fn, size_t arity) {
+  auto code = std::make_unique<Code>();
+  Closure &trampoline = code->closures.emplace_back();
+  trampoline.eval = EvalLazy;
+  trampoline.callee = &fn;
+  trampoline.num_args = static_cast<uint32_t>(arity);
+  code->entry = &trampoline;
+  code->arity = arity;
+  return code;
+}
+
+inline bool Function::IsCompiled() const {
+  const Code *current = GetCode();
+  return current && current->entry->eval != EvalLazy;
+}
+
+/// ClosureEngine - Compiles definitions to closures and runs them.
+class ClosureEngine : public Engine {
+private:
+  std::unordered_map<std::string_view, std::unique_ptr<Function>> functions;
+  Inliner inliner;
+  LoopOptimizer loop_optimizer;
+  // Held while compiling or changing the function records.
+  mutable std::mutex lock;
+  bool lazy_compile = false;
+  // Evaluation state of the calling thread.
+  static inline thread_local bool failed = false;
+  static inline thread_local int depth = 0;
+  static inline thread_local bool tail_call = false;
+
+public:
+  Function &GetOrCreate(std::string_view name) {
+    auto &slot = functions[name];
+    if (!slot) {
+      slot = std::make_unique<Function>();
+      slot->engine = this;
+      slot->name = name;
+    }
+    return *slot;
+  }
+
+  void SetLazyCompile(bool enable) { lazy_compile = enable; }
+  InlineOptions &GetInlineOptions() { return inliner.GetOptions(); }
+  LoopOptions &GetLoopOptions() { return loop_optimizer.GetOptions(); }
+
+  /// Invalidate - Send every function that copied the body of name back to
+  /// its trampoline. The caller holds the lock.
+  void Invalidate(std::string_view name) {
+    std::vector<std::string_view> dependents;
+    inliner.GetDependents(name, dependents);
+    for (std::string_view dependent : dependents) {
+      auto found = functions.find(dependent);
+      if (found != functions.end() && found->second->ast &&
+          found->second->IsCompiled()) {
+        Function &record = *found->second;
+        record.SetCode(MakeTrampoline(record, record.arity));
+      }
+    }
+  }
+
+  /// Fail - Report a runtime error. Evaluation unwinds by returning 0 from
+  /// every closure; no further calls are made once an error is recorded.
+  double Fail(SourceLoc loc, const char *message) {
+    if (!failed) {
+      ReportError(loc, message);
+    }
+    return Unwind();
+  }
+
+  /// Unwind - Stop evaluation after an error that was already reported.
+  double Unwind() {
+    failed = true;
+    return 0.0;
+  }
+
+  static bool HasFailed() { return failed; }
+
+  /// SetTailCall/TakeTailCall - Flag a self tail call, whose arguments are
+  /// already in place, for the loop at the root of the body.
+  void SetTailCall() { tail_call = true; }
+  bool TakeTailCall() {
+    bool pending = tail_call;
+    tail_call = false;
+    return pending;
+  }
+
+  /// Call - Run fn's compiled body, with the checks every call needs.
+  double Call(Function &fn, double *args, uint32_t num_args,
+              SourceLoc loc) {
+    if (failed) {
+      return 0.0;
+    }
+    if (const Builtin *native = fn.native.load(std::memory_order_acquire)) {
+      if (native->arity != num_args) {
+        return Fail(loc, "Incorrect # arguments passed");
+      }
+      return native->fn(args);
+    }
+    const Code *code = fn.GetCode();
+    if (!code) {
+      return Fail(loc, fn.declared ? "Function is declared but not defined"
+                                   : "Unknown function referenced");
+    }
+    if (code->arity != num_args) {
+      return Fail(loc, "Incorrect # arguments passed");
+    }
+    if (depth >= MAX_CALL_DEPTH) {
+      return Fail(loc, "Call stack overflow");
+    }
+    ++depth;
+    double result = Eval(*code->entry, args);
+    --depth;
+    return result;
+  }
+
+  bool Compile(Function &fn, const FunctionAST &ast);
+
+  /// CompileLazy - Compile fn, whose entry is trampoline, and return its new
+  /// code, or null if it does not compile. If another thread got here first,
+  /// or fn has been redefined since, wait for it and return what it
+  /// installed.
+  const Code *CompileLazy(Function &fn, const Closure &trampoline) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (fn.GetCode()->entry == &trampoline && !Compile(fn, *fn.ast)) {
+      return nullptr;
+    }
+    return fn.GetCode();
+  }
+
+  /// AddFunction - Compile fn now, or with lazy compilation install its
+  /// trampoline so that it is compiled on its first call. Lazily compiled
+  /// functions report compile errors only when they are first called.
+  bool AddFunction(std::unique_ptr<FunctionAST> fn) override {
+    std::lock_guard<std::mutex> guard(lock);
+    Function &record = GetOrCreate(fn->GetProto().GetName());
+    if (!lazy_compile && !Compile(record, *fn)) {
+      return false;
+    }
+    record.arity = fn->GetProto().GetArgs().size();
+    record.native = nullptr;
+    record.declared = true;
+    record.ast = std::move(fn);
+    if (lazy_compile) {
+      record.SetCode(MakeTrampoline(record, record.arity));
+    }
+    inliner.Define(record.name, record.ast.get());
+    Invalidate(record.name);
+    return true;
+  }
+
+  bool AddExtern(std::unique_ptr<PrototypeAST> proto) override {
+    std::lock_guard<std::mutex> guard(lock);
+    Function &record = GetOrCreate(proto->GetName());
+    if (const Builtin *builtin = FindBuiltin(proto->GetName())) {
+      if (builtin->arity != proto->GetArgs().size()) {
+        ReportError(proto->GetLoc(), "extern does not match builtin arity");
+        return false;
+      }
+      record.native = builtin;
+      // Calls now reach the builtin, not any body copied from a 'def'.
+      inliner.Define(record.name, nullptr);
+      Invalidate(record.name);
+    }
+    // A builtin takes the place of any 'def', arity included.
+    if (record.native || !record.ast) {
+      record.arity = proto->GetArgs().size();
+    }
+    record.declared = true;
+    return true;
+  }
+
+  void
+  GetInlinedCallees(std::string_view name,
+                    std::vector<std::string_view> &callees) const override {
+    std::lock_guard<std::mutex> guard(lock);
+    inliner.GetInlinedCallees(name, callees);
+  }
+
+  bool Evaluate(std::unique_ptr<FunctionAST> fn, double &result) override {
+    Function scratch;
+    scratch.engine = this;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      if (!Compile(scratch, *fn)) {
+        return false;
+      }
+    }
+    EpochGuard guard;
+    failed = false;
+    depth = 0;
+    result = Eval(*scratch.GetCode()->entry, nullptr);
+    return !failed;
+  }
+};
+
+// The evaluators. Each is specific to one node shape.
+
+inline double EvalConst(const Closure &c, double *) { return c.k; }
+
+inline double EvalArg(const Closure &c, double *args) {
+  return args[c.slot];
+}
+
+template <typename Op> double EvalBinary(const Closure &c, double *args) {
+  double l = Eval(*c.lhs, args);
+  return Op::Apply(l, Eval(*c.rhs, args));
+}
+
+template <typename Op>
+double EvalBinaryConst(const Closure &c, double *args) {
+  return Op::Apply(Eval(*c.lhs, args), c.k);
+}
+
+template <typename Op> double EvalArgConst(const Closure &c, double *args) {
+  return Op::Apply(args[c.slot], c.k);
+}
+
+template <typename Op> double EvalArgArg(const Closure &c, double *args) {
+  return Op::Apply(args[c.slot], args[c.slot2]);
+}
+
+inline double EvalCall1(const Closure &c, double *args) {
+  double value = Eval(*c.call_args[0], args);
+  return c.callee->engine->Call(*c.callee, &value, 1, c.loc);
+}
+
+/// IsStillNative - Whether c's callee is still the builtin c bound at
+/// compile time. A later 'def' can take the builtin's name, and then the
+/// call must go through the record.
+inline bool IsStillNative(const Closure &c) {
+  const Builtin *native = c.callee->native.load(std::memory_order_acquire);
+  return native && native->fn == c.native;
+}
+
+/// EvalNative1 - A call to the builtin bound at compile time.
+inline double EvalNative1(const Closure &c, double *args) {
+  double value = Eval(*c.call_args[0], args);
+  if (!IsStillNative(c)) {
+    return c.callee->engine->Call(*c.callee, &value, 1, c.loc);
+  }
+  return c.native(&value);
+}
+
+/// EvalLazy - The trampoline of a function that is not compiled yet: compile
+/// it, then run the real body in its place. The call checked the arity of
+/// the trampoline, num_args, so code that replaced it must take as many.
+inline double EvalLazy(const Closure &c, double *args) {
+  ClosureEngine &engine = *c.callee->engine;
+  const Code *code = engine.CompileLazy(*c.callee, c);
+  if (!code) {
+    return engine.Unwind();
+  }
+  if (code->arity != c.num_args) {
+    return engine.Fail(c.loc, "Incorrect # arguments passed");
+  }
+  return Eval(*code->entry, args);
+}
+
+inline double EvalAssign(const Closure &c, double *args) {
+  return args[c.slot] = Eval(*c.lhs, args);
+}
+
+/// EvalLet - Bind one var name: store the initializer in its frame slot,
+/// then run the rest of the expression.
+inline double EvalLet(const Closure &c, double *args) {
+  args[c.slot] = Eval(*c.lhs, args);
+  return Eval(*c.rhs, args);
+}
+
+inline double EvalIf(const Closure &c, double *args) {
+  return IsTrue(Eval(*c.cond, args)) ? Eval(*c.lhs, args) : Eval(*c.rhs, args);
+}
+
+inline double EvalSelect(const Closure &c, double *args) {
+  double cond = Eval(*c.cond, args);
+  double then = Eval(*c.lhs, args);
+  return Select(cond, then, Eval(*c.rhs, args));
+}
+
+/// StepInductions - Add its step to each variable of the loop c.
+inline void StepInductions(const Closure &c, double *args) {
+  for (uint32_t i = 0; i < c.num_args; ++i) {
+    const Closure &step = *c.call_args[3 + 2 * i];
+    double delta = step.eval == EvalConst ? step.k : Eval(step, args);
+    args[c.slot + i] = args[c.slot + i] + delta;
+  }
+}
+
+/// EvalFor - A for loop. call_args holds end, body, then the start and step
+/// of each of its num_args variables, which live in consecutive slots from
+/// slot. The body runs slot2 times for every evaluation of end.
+inline double EvalFor(const Closure &c, double *args) {
+  const Closure &end = *c.call_args[0];
+  const Closure &body = *c.call_args[1];
+  // The starts cannot read the loop's slots, so each is stored at once.
+  for (uint32_t i = 0; i < c.num_args; ++i) {
+    args[c.slot + i] = Eval(*c.call_args[2 + 2 * i], args);
+  }
+  bool more;
+  do {
+    for (uint32_t copy = 1; copy < c.slot2; ++copy) {
+      Eval(body, args);
+      StepInductions(c, args);
+    }
+    Eval(body, args);
+    more = IsTrue(Eval(end, args));
+    StepInductions(c, args);
+  } while (more && !ClosureEngine::HasFailed());
+  return 0.0;
+}
+
+/// EvalFrame - The root of a body that binds names with var: copy the
+/// arguments into a frame with room for those names as well.
+inline double EvalFrame(const Closure &c, double *args) {
+  double inline_slots[16];
+  std::vector<double> heap_slots;
+  double *slots = inline_slots;
+  if (c.slot > 16) {
+    heap_slots.resize(c.slot);
+    slots = heap_slots.data();
+  }
+  std::copy(args, args + c.slot2, slots);
+  return Eval(*c.lhs, slots);
+}
+
+/// EvalSelfTailCall - A call to the function itself whose value is the
+/// function's result: replace the arguments and let EvalTailLoop run the body
+/// again.
+inline double EvalSelfTailCall(const Closure &c, double *args) {
+  double inline_values[8];
+  std::vector<double> heap_values;
+  double *values = inline_values;
+  if (c.num_args > 8) {
+    heap_values.resize(c.num_args);
+    values = heap_values.data();
+  }
+  for (uint32_t i = 0; i < c.num_args; ++i) {
+    values[i] = Eval(*c.call_args[i], args);
+  }
+  ClosureEngine &engine = *c.callee->engine;
+  if (!engine.HasFailed()) {
+    std::copy(values, values + c.num_args, args);
+    engine.SetTailCall();
+  }
+  return 0.0;
+}
+
+/// EvalTailLoop - The root of a body with self tail calls.
+inline double EvalTailLoop(const Closure &c, double *args) {
+  ClosureEngine &engine = *c.callee->engine;
+  while (true) {
+    double result = Eval(*c.lhs, args);
+    if (!engine.TakeTailCall()) {
+      return result;
+    }
+  }
+}
+
+/// EvalCall - The general call: arguments go into a small on-stack buffer,
+/// or the heap for unusually wide calls.
+inline double EvalCall(const Closure &c, double *args) {
+  double inline_values[8];
+  std::vector<double> heap_values;
+  double *values = inline_values;
+  if (c.num_args > 8) {
+    heap_values.resize(c.num_args);
+    values = heap_values.data();
+  }
+  for (uint32_t i = 0; i < c.num_args; ++i) {
+    values[i] = Eval(*c.call_args[i], args);
+  }
+  if (c.native && IsStillNative(c)) {
+    return c.native(values);
+  }
+  return c.callee->engine->Call(*c.callee, values, c.num_args, c.loc);
+}
+
+/// Compiler - Builds the closure tree for one function body.
+class Compiler : public ExprVisitor<Compiler, const Closure *> {
+private:
+  ClosureEngine &engine;
+  Code &code;
+  const PrototypeAST &proto;
+  // Names bound by enclosing var expressions, innermost last, and the
+  // closure that reads each: its frame slot, or the constant it is bound to.
+  std::vector<std::pair<std::string_view, const Closure *>> scope;
+  // Names the body assigns, which always get a frame slot.
+  AssignedNames assigned;
+  uint32_t num_slots;
+  // Whether the expression being visited is in tail position. Each handler
+  // reads it and clears it for its operands.
+  bool in_tail = false;
+  bool has_self_tail_call = false;
+  bool failed = false;
+
+  Closure &New(EvalFn eval) {
+    code.closures.emplace_back();
+    code.closures.back().eval = eval;
+    return code.closures.back();
+  }
+
+  const Closure *Const(double k) {
+    Closure &c = New(EvalConst);
+    c.k = k;
+    return &c;
+  }
+
+  template <typename Op>
+  const Closure *Binary(const Closure *lhs, const Closure *rhs) {
+    bool lhs_const = lhs->eval == EvalConst;
+    bool rhs_const = rhs->eval == EvalConst;
+    bool lhs_arg = lhs->eval == EvalArg;
+    if (lhs_const && rhs_const) {
+      return Const(Op::Apply(lhs->k, rhs->k));
+    }
+    Closure *c;
+    if (rhs_const && lhs_arg) {
+      c = &New(EvalArgConst<Op>);
+      c->slot = lhs->slot;
+      c->k = rhs->k;
+    } else if (rhs_const) {
+      c = &New(EvalBinaryConst<Op>);
+      c->lhs = lhs;
+      c->k = rhs->k;
+    } else if (lhs_arg && rhs->eval == EvalArg) {
+      c = &New(EvalArgArg<Op>);
+      c->slot = lhs->slot;
+      c->slot2 = rhs->slot;
+    } else {
+      c = &New(EvalBinary<Op>);
+      c->lhs = lhs;
+      c->rhs = rhs;
+    }
+    return c;
+  }
+
+public:
+  Compiler(ClosureEngine &engine, Code &code, const PrototypeAST &proto)
+      : engine(engine), code(code), proto(proto),
+        num_slots(static_cast<uint32_t>(proto.GetArgs().size())) {}
+
+  bool HasFailed() const { return failed; }
+
+  /// CompileBody - The entry closure for body, in a frame of its own if it
+  /// binds any names.
+  const Closure *CompileBody(const ExprAST &body) {
+    assigned.Visit(body);
+    in_tail = true;
+    const Closure *entry = Visit(body);
+    if (has_self_tail_call) {
+      Closure &loop = New(EvalTailLoop);
+      loop.lhs = entry;
+      loop.callee = &engine.GetOrCreate(proto.GetName());
+      entry = &loop;
+    }
+    uint32_t arity = static_cast<uint32_t>(proto.GetArgs().size());
+    if (num_slots == arity) {
+      return entry;
+    }
+    Closure &c = New(EvalFrame);
+    c.lhs = entry;
+    c.slot = num_slots;
+    c.slot2 = arity;
+    return &c;
+  }
+
+  const Closure *VisitNumber(const NumberExprAST &expr) {
+    in_tail = false;
+    return Const(expr.GetVal());
+  }
+
+  const Closure *VisitVariable(const VariableExprAST &expr) {
+    in_tail = false;
+    for (auto it = scope.rbegin(); it != scope.rend(); ++it) {
+      if (it->first == expr.GetName()) {
+        return it->second;
+      }
+    }
+    const auto &names = proto.GetArgs();
+    for (size_t i = 0; i < names.size(); ++i) {
+      if (names[i] == expr.GetName()) {
+        Closure &c = New(EvalArg);
+        c.slot = static_cast<uint32_t>(i);
+        return &c;
+      }
+    }
+    ReportError(expr.GetLoc(), "Unknown variable name");
+    failed = true;
+    return Const(0.0);
+  }
+
+  /// VisitAssign - An EvalAssign into the name's frame slot. A name that is
+  /// assigned is never folded, so it always has one.
+  const Closure *VisitAssign(const AssignExprAST &expr) {
+    in_tail = false;
+    Closure &c = New(EvalAssign);
+    c.lhs = Visit(expr.GetValue());
+    for (auto it = scope.rbegin(); it != scope.rend(); ++it) {
+      if (it->first == expr.GetName()) {
+        c.slot = it->second->slot;
+        return &c;
+      }
+    }
+    const auto &names = proto.GetArgs();
+    for (size_t i = 0; i < names.size(); ++i) {
+      if (names[i] == expr.GetName()) {
+        c.slot = static_cast<uint32_t>(i);
+        return &c;
+      }
+    }
+    ReportError(expr.GetLoc(), "Unknown variable name");
+    failed = true;
+    return &c;
+  }
+
+  const Closure *VisitBinary(const BinaryExprAST &expr) {
+    in_tail = false;
+    const Closure *lhs = Visit(expr.GetLHS());
+    const Closure *rhs = Visit(expr.GetRHS());
+    switch (expr.GetOp()) {
+    case '+':
+      return Binary<AddOp>(lhs, rhs);
+    case '-':
+      return Binary<SubOp>(lhs, rhs);
+    case '*':
+      return Binary<MulOp>(lhs, rhs);
+    case '<':
+      return Binary<LessOp>(lhs, rhs);
+    default:
+      ReportError(expr.GetLoc(), "invalid binary operator");
+      failed = true;
+      return Const(0.0);
+    }
+  }
+
+  /// VisitVar - A chain of EvalLet closures, one per name. A name bound to
+  /// a constant and never assigned is folded into its uses instead.
+  const Closure *VisitVar(const VarExprAST &expr) {
+    bool is_tail = in_tail;
+    std::vector<Closure *> lets;
+    for (const auto &[name, init] : expr.GetVars()) {
+      in_tail = false;
+      const Closure *value = Visit(*init);
+      if (value->eval == EvalConst && !assigned.Contains(name)) {
+        scope.emplace_back(name, value);
+        continue;
+      }
+      Closure &let = New(EvalLet);
+      let.lhs = value;
+      let.slot = num_slots++;
+      lets.push_back(&let);
+      Closure &read = New(EvalArg);
+      read.slot = let.slot;
+      scope.emplace_back(name, &read);
+    }
+    in_tail = is_tail;
+    const Closure *body = Visit(expr.GetBody());
+    scope.resize(scope.size() - expr.GetVars().size());
+    for (auto it = lets.rbegin(); it != lets.rend(); ++it) {
+      (*it)->rhs = body;
+      body = *it;
+    }
+    return body;
+  }
+
+  /// VisitIf - A constant condition picks its arm now; otherwise an EvalIf,
+  /// or an EvalSelect when ShouldSelect allows.
+  const Closure *VisitIf(const IfExprAST &expr) {
+    bool is_tail = in_tail;
+    in_tail = false;
+    const Closure *cond = Visit(expr.GetCond());
+    in_tail = is_tail;
+    const Closure *then = Visit(expr.GetThen());
+    in_tail = is_tail;
+    const Closure *otherwise = Visit(expr.GetElse());
+    if (cond->eval == EvalConst) {
+      return IsTrue(cond->k) ? then : otherwise;
+    }
+    Closure &c = New(ShouldSelect(expr) ? EvalSelect : EvalIf);
+    c.cond = cond;
+    c.lhs = then;
+    c.rhs = otherwise;
+    return &c;
+  }
+
+  /// VisitFor - An EvalFor. Its variables get frame slots, like var names,
+  /// but are never folded, since the loop changes them.
+  const Closure *VisitFor(const ForExprAST &expr) {
+    in_tail = false;
+    const auto &vars = expr.GetVars();
+    code.arg_lists.emplace_back(2 + 2 * vars.size());
+    std::vector<const Closure *> &parts = code.arg_lists.back();
+    for (size_t i = 0; i < vars.size(); ++i) {
+      in_tail = false;
+      parts[2 + 2 * i] = Visit(*vars[i].start);
+    }
+    Closure &c = New(EvalFor);
+    c.slot = num_slots;
+    c.num_args = static_cast<uint32_t>(vars.size());
+    c.slot2 = expr.GetUnroll();
+    for (const auto &var : vars) {
+      Closure &read = New(EvalArg);
+      read.slot = num_slots++;
+      scope.emplace_back(var.name, &read);
+    }
+    for (size_t i = 0; i < vars.size(); ++i) {
+      in_tail = false;
+      parts[3 + 2 * i] = Visit(*vars[i].step);
+    }
+    in_tail = false;
+    parts[0] = Visit(expr.GetEnd());
+    in_tail = false;
+    parts[1] = Visit(expr.GetBody());
+    scope.resize(scope.size() - vars.size());
+    c.call_args = parts.data();
+    return &c;
+  }
+
+  const Closure *VisitCall(const CallExprAST &expr) {
+    bool is_tail = in_tail;
+    code.arg_lists.emplace_back();
+    std::vector<const Closure *> &args = code.arg_lists.back();
+    for (const auto &arg : expr.GetArgs()) {
+      in_tail = false;
+      args.push_back(Visit(*arg));
+    }
+
+    // Builtins are bound now, and the call checks that a 'def' has not taken
+    // the name since. Kaleidoscope callees are bound to their record and
+    // checked when called, since they may be defined later.
+    Function &callee = engine.GetOrCreate(expr.GetCallee());
+    const Builtin *native = callee.native;
+    if (is_tail && !native && !proto.GetName().empty() &&
+        expr.GetCallee() == proto.GetName() &&
+        args.size() == proto.GetArgs().size()) {
+      Closure &c = New(EvalSelfTailCall);
+      c.callee = &callee;
+      c.call_args = args.data();
+      c.num_args = static_cast<uint32_t>(args.size());
+      has_self_tail_call = true;
+      return &c;
+    }
+    bool unary = args.size() == 1;
+    Closure &c = New(native ? (unary ? EvalNative1 : EvalCall)
+                            : (unary ? EvalCall1 : EvalCall));
+    c.callee = &callee;
+    c.native = native ? native->fn : nullptr;
+    if (native && native->arity != args.size()) {
+      ReportError(expr.GetLoc(), "Incorrect # arguments passed");
+      failed = true;
+    }
+    c.call_args = args.data();
+    c.num_args = static_cast<uint32_t>(args.size());
+    c.loc = expr.GetLoc();
+    return &c;
+  }
+};
+
+inline bool ClosureEngine::Compile(Function &fn, const FunctionAST &ast) {
+  // Compile into fresh storage so a failed redefinition leaves the old
+  // body in place, and a running one keeps its closures until it is done.
+  auto code = std::make_unique<Code>();
+  std::unique_ptr<ExprAST> inlined =
+      inliner.Inline(ast, ast.GetProto().GetName());
+  const ExprAST &source = inlined ? *inlined : ast.GetBody();
+  std::unique_ptr<ExprAST> optimized = loop_optimizer.Optimize(source);
+  Compiler compiler(*this, *code, ast.GetProto());
+  const Closure *entry = compiler.CompileBody(optimized ? *optimized : source);
+  if (compiler.HasFailed()) {
+    return false;
+  }
+  code->entry = entry;
+  code->arity = ast.GetProto().GetArgs().size();
+  fn.SetCode(std::move(code));
+  return true;
+}
+
+} // namespace closure
+
+using closure::ClosureEngine;
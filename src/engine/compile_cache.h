@@ -0,0 +1,381 @@
+#pragma once
+
+#include "ast.h"
+#include "bytecode_file.h"
+#include "token_buffer.h"
+#include "vm.h"
+#include <filesystem>
+#include <random>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+
+// A persistent compile cache for the VM.
+//
+// Each definition's compiled bytecode is cached under a 64-bit hash of the
+// definition's tokens and of everything else that affects the code produced:
+// the cache format, the instruction set, the compiler options and the
+// operator precedences the parser used. Hashing tokens rather than raw text
+// means edits to whitespace, comments or other definitions do not
+// invalidate an entry. An entry also stores the tokens it was made from, and
+// a hit must match them exactly, so a hash collision is just a miss.
+//
+// Code refers to other functions by their index in the VM's function table,
+// which differs between sessions. Each entry therefore keeps a relocation
+// for every call instruction: the callee's name, and the index within the
+// definition of the token the call is at. Loading patches the call with the
+// callee's index in the current session, and the token gives the call's
+// source location for runtime errors. Calls are relocated by name because
+// an operator is called without its function's name ever being spelled.
+//
+// Compiling one small definition costs about as much as opening a file, so
+// entries are not kept one per file. Each input gets one pack file in the
+// cache directory, named after the input's path. A pack is read once at
+// start-up and indexed by hash. At exit, if anything missed, it is replaced
+// by a pack of the entries this run used. Stale entries drop out that way.
+// The new pack is written under a private name and renamed into place, so
+// processes sharing the directory never see a partial pack.
+
+/// CacheKey - A definition's tokens, [begin, end) of a pre-lexed buffer, in
+/// the form entries are keyed and checked by.
+struct CacheKey {
+  const TokenBuffer *tokens = nullptr;
+  size_t begin = 0;
+  size_t end = 0;
+  std::string canonical; // Kinds, identifier text and number bits.
+  uint64_t hash = 0;
+};
+
+class CompileCache {
+private:
+  // Bump whenever the layout of the structs below, or what follows them,
+  // changes.
+  static constexpr uint32_t KFP_VERSION = 1;
+  static constexpr char KFP_MAGIC[4] = {'K', 'F', 'P', '\x1a'};
+
+  struct KfpHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t options_hash;
+    uint32_t num_entries;
+  };
+
+  // Each entry: KfpEntry, consts, code, calls, callee names, canonical
+  // tokens.
+  struct KfpEntry {
+    uint64_t hash;
+    uint32_t num_tokens;
+    uint32_t canonical_size;
+    uint32_t arity;
+    uint32_t num_locals;
+    uint32_t max_stack;
+    uint32_t code_size;
+    uint32_t num_consts;
+    uint32_t num_calls;
+    uint32_t names_size;
+  };
+
+  struct KfpCall {
+    uint32_t code_offset;
+    uint32_t token;     // Relative to the 'def' token.
+    uint32_t name_size; // The callee's name follows those of earlier calls.
+  };
+
+  std::filesystem::path pack_path;
+  uint64_t options_hash;
+  MappedFile pack;
+  // Entries in the loaded pack: hash -> (offset, size).
+  std::unordered_map<uint64_t, std::pair<size_t, size_t>> index;
+  // Entries for the next pack, and which hashes it already has.
+  std::string out;
+  uint32_t num_out = 0;
+  std::unordered_map<uint64_t, bool> written;
+  bool dirty = false; // Whether out has entries the pack lacks.
+  unsigned hits = 0;
+  unsigned misses = 0;
+
+  static uint64_t EntrySize(const KfpEntry &entry) {
+    return sizeof(KfpEntry) + uint64_t(entry.num_consts) * sizeof(double) +
+           uint64_t(entry.code_size) * sizeof(uint32_t) +
+           uint64_t(entry.num_calls) * sizeof(KfpCall) + entry.names_size +
+           entry.canonical_size;
+  }
+
+  /// SessionName - name as a view that lives as long as the session's
+  /// source text, for the function table to keep: the text of token if that
+  /// spells it, or else the name of an operator function. Empty if neither.
+  static std::string_view SessionName(const TokenBuffer &tokens, size_t token,
+                                      std::string_view name) {
+    if (tokens.GetKind(token) == Token::token_identifier &&
+        tokens.GetText(token) == name) {
+      return tokens.GetText(token);
+    }
+    for (bool binary : {false, true}) {
+      if (!name.empty() && OperatorFunctionName(binary, name.back()) == name) {
+        return OperatorFunctionName(binary, name.back());
+      }
+    }
+    return {};
+  }
+
+  /// ReadPack - Index the entries of the pack file, if it is usable.
+  void ReadPack() {
+    std::error_code error;
+    if (!std::filesystem::exists(pack_path, error) ||
+        !pack.Open(pack_path.string().c_str())) {
+      return;
+    }
+    const char *data = pack.GetData();
+    size_t size = pack.GetSize();
+    KfpHeader header;
+    if (size < sizeof(header)) {
+      return;
+    }
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, KFP_MAGIC, sizeof(KFP_MAGIC)) != 0 ||
+        header.version != KFP_VERSION ||
+        header.options_hash != options_hash) {
+      return;
+    }
+    size_t pos = sizeof(header);
+    for (uint32_t i = 0; i < header.num_entries; ++i) {
+      KfpEntry entry;
+      if (size - pos < sizeof(entry)) {
+        return;
+      }
+      memcpy(&entry, data + pos, sizeof(entry));
+      uint64_t entry_size = EntrySize(entry);
+      if (entry_size > size - pos) {
+        return;
+      }
+      index.emplace(entry.hash, std::make_pair(pos, size_t(entry_size)));
+      pos += entry_size;
+    }
+  }
+
+  /// Append - Add an entry to the next pack, once.
+  bool Append(uint64_t hash, const void *data, size_t size) {
+    if (!written.emplace(hash, true).second) {
+      return false;
+    }
+    out.append(static_cast<const char *>(data), size);
+    ++num_out;
+    return true;
+  }
+
+public:
+  /// CompileCache - Cache code for the input at path, compiled with
+  /// options and loop_options, in dir, which is created if needed.
+  CompileCache(const std::string &dir, const std::string &path,
+               const BytecodeOptions &options,
+               const LoopOptions &loop_options) {
+    std::error_code error;
+    std::filesystem::create_directories(dir, error);
+    std::string input = std::filesystem::absolute(path, error).string();
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.kfp",
+             static_cast<unsigned long long>(
+                 HashBytes(input.data(), input.size())));
+    pack_path = std::filesystem::path(dir) / name;
+    uint32_t config[] = {OpcodeSetHash(), options.superinstructions ? 1u : 0u,
+                         loop_options.enabled ? 1u : 0u, options.ir ? 1u : 0u,
+                         options.fast_math ? 1u : 0u,
+                         options.strict_fp ? 1u : 0u, options.fma ? 1u : 0u};
+    options_hash = HashBytes(config, sizeof(config));
+    ReadPack();
+  }
+
+  /// MakeKey - Describe the definition in tokens [begin, end). grammar_hash
+  /// must capture any parser state that changes how the tokens parse.
+  void MakeKey(const TokenBuffer &tokens, size_t begin, size_t end,
+               uint64_t grammar_hash, CacheKey &key) const {
+    key.tokens = &tokens;
+    key.begin = begin;
+    key.end = end;
+    key.canonical.clear();
+    tokens.AppendCanonical(begin, end, key.canonical);
+    key.hash = HashBytes(key.canonical.data(), key.canonical.size(),
+                         HashBytes(&grammar_hash, sizeof(grammar_hash)));
+  }
+
+  /// Has - Whether the pack has an entry under key's hash; a miss is
+  /// counted if not. Load still checks that the entry matches.
+  bool Has(const CacheKey &key) {
+    if (index.count(key.hash)) {
+      return true;
+    }
+    ++misses;
+    return false;
+  }
+
+  /// Load - Define name, the function key describes, in vm from the cache.
+  /// Returns false on a miss, including any entry that is stale or damaged.
+  bool Load(VMEngine &vm, const CacheKey &key, std::string_view name) {
+    auto found = index.find(key.hash);
+    if (found == index.end()) {
+      ++misses;
+      return false;
+    }
+    const char *data = pack.GetData() + found->second.first;
+    KfpEntry entry;
+    memcpy(&entry, data, sizeof(entry));
+    const char *p = data + sizeof(entry);
+    const char *canonical =
+        data + found->second.second - entry.canonical_size;
+    if (entry.num_tokens != key.end - key.begin ||
+        std::string_view(canonical, entry.canonical_size) != key.canonical ||
+        entry.num_locals < entry.arity || entry.num_locals > MAX_OPERAND ||
+        entry.max_stack > MAX_OPERAND) {
+      ++misses;
+      return false;
+    }
+
+    // An empty vector's data() may be null, which memcpy must not get.
+    std::vector<double> consts(entry.num_consts);
+    if (!consts.empty()) {
+      memcpy(consts.data(), p, consts.size() * sizeof(double));
+    }
+    p += consts.size() * sizeof(double);
+    std::vector<uint32_t> code(entry.code_size);
+    if (!code.empty()) {
+      memcpy(code.data(), p, code.size() * sizeof(uint32_t));
+    }
+    p += code.size() * sizeof(uint32_t);
+
+    // Relocate calls to this session's function indices.
+    FunctionTable &functions = vm.GetFunctions();
+    const TokenBuffer &tokens = *key.tokens;
+    auto compiled = std::make_unique<BcCode>();
+    const char *names = p + entry.num_calls * sizeof(KfpCall);
+    size_t names_pos = 0;
+    for (uint32_t i = 0; i < entry.num_calls; ++i) {
+      KfpCall call;
+      memcpy(&call, p + i * sizeof(KfpCall), sizeof(call));
+      size_t token = key.begin + call.token;
+      if (call.code_offset >= code.size() || token >= key.end ||
+          call.name_size > entry.names_size - names_pos) {
+        ++misses;
+        return false;
+      }
+      std::string_view callee_name = SessionName(
+          tokens, token, std::string_view(names + names_pos, call.name_size));
+      names_pos += call.name_size;
+      if (callee_name.empty()) {
+        ++misses;
+        return false;
+      }
+      uint32_t &word = code[call.code_offset];
+      uint32_t callee = functions.GetOrCreate(callee_name);
+      if (callee > MAX_OPERAND) {
+        ++misses;
+        return false;
+      }
+      word = EncodeInstr(static_cast<Opcode>(DecodeOp(word)), callee);
+      compiled->call_locs.emplace_back(call.code_offset, tokens.GetLoc(token));
+    }
+
+    compiled->num_locals = entry.num_locals;
+    compiled->max_stack = entry.max_stack;
+    compiled->Adopt(std::move(code), std::move(consts));
+    if (!VerifyCode(*compiled, functions.size())) {
+      ++misses;
+      return false;
+    }
+    vm.AddCompiledFunction(name, entry.arity, std::move(compiled));
+    Append(key.hash, data, found->second.second);
+    ++hits;
+    return true;
+  }
+
+  /// Store - Keep what vm compiled for name, the function key describes.
+  void Store(VMEngine &vm, const CacheKey &key, std::string_view name) {
+    const TokenBuffer &tokens = *key.tokens;
+    const FunctionTable &functions = vm.GetFunctions();
+    const BcFunction *fn = vm.GetFunctions().Find(name);
+    if (!fn || !fn->IsCompiled() || fn->native) {
+      return;
+    }
+    // Code that copied other functions' bodies, or merged calls to a
+    // builtin it took to be pure, depends on more than its own tokens.
+    std::vector<std::string_view> depends;
+    vm.GetInlinedCallees(fn->name, depends);
+    vm.GetAssumedCallees(fn->name, depends);
+    if (!depends.empty()) {
+      return;
+    }
+    const BcCode &body = *fn->GetBody();
+
+    std::vector<KfpCall> calls;
+    std::string names;
+    for (const auto &[offset, loc] : body.call_locs) {
+      size_t token = key.begin;
+      while (token < key.end && tokens.GetLoc(token) != loc) {
+        ++token;
+      }
+      if (token == key.end) {
+        return;
+      }
+      std::string_view callee = functions[DecodeA(body.code[offset])].name;
+      calls.push_back(KfpCall{offset,
+                              static_cast<uint32_t>(token - key.begin),
+                              static_cast<uint32_t>(callee.size())});
+      names += callee;
+    }
+
+    KfpEntry entry{};
+    entry.hash = key.hash;
+    entry.num_tokens = static_cast<uint32_t>(key.end - key.begin);
+    entry.canonical_size = static_cast<uint32_t>(key.canonical.size());
+    entry.arity = fn->arity;
+    entry.num_locals = body.num_locals;
+    entry.max_stack = body.max_stack;
+    entry.code_size = body.code_size;
+    entry.num_consts = body.num_consts;
+    entry.num_calls = static_cast<uint32_t>(calls.size());
+    entry.names_size = static_cast<uint32_t>(names.size());
+
+    std::string data(reinterpret_cast<const char *>(&entry), sizeof(entry));
+    data.append(reinterpret_cast<const char *>(body.consts),
+                body.num_consts * sizeof(double));
+    data.append(reinterpret_cast<const char *>(body.code),
+                body.code_size * sizeof(uint32_t));
+    data.append(reinterpret_cast<const char *>(calls.data()),
+                calls.size() * sizeof(KfpCall));
+    data.append(names);
+    data.append(key.canonical);
+    dirty |= Append(key.hash, data.data(), data.size());
+  }
+
+  /// Flush - Replace the pack with the entries used by this run, if any
+  /// were missing from it.
+  void Flush() {
+    if (!dirty) {
+      return;
+    }
+    KfpHeader header{};
+    memcpy(header.magic, KFP_MAGIC, sizeof(header.magic));
+    header.version = KFP_VERSION;
+    header.options_hash = options_hash;
+    header.num_entries = num_out;
+
+    std::filesystem::path temp = pack_path;
+    temp += "." + std::to_string(std::random_device()()) + ".tmp";
+    FILE *file = fopen(temp.string().c_str(), "wb");
+    if (!file) {
+      return;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(out.data(), 1, out.size(), file) == out.size();
+    ok = fclose(file) == 0 && ok;
+    std::error_code error;
+    if (ok) {
+      std::filesystem::rename(temp, pack_path, error);
+    }
+    if (!ok || error) {
+      std::filesystem::remove(temp, error);
+    }
+  }
+
+  unsigned GetHits() const { return hits; }
+  unsigned GetMisses() const { return misses; }
+};
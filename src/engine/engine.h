@@ -0,0 +1,36 @@
+#pragma once
+
+#include "ast.h"
+#include <memory>
+#include <string_view>
+#include <vector>
+
+/// Engine - Executes parsed code. The driver hands every top-level item to the
+/// active engine: definitions and externs are registered as they are parsed,
+/// and top-level expressions are evaluated immediately.
+///
+/// Errors are reported with ReportError as they are found; the methods below
+/// just say whether they succeeded.
+class Engine {
+public:
+  virtual ~Engine() = default;
+
+  /// AddFunction - Register a definition, replacing any earlier definition
+  /// with the same name.
+  virtual bool AddFunction(std::unique_ptr<FunctionAST> fn) = 0;
+
+  /// AddExtern - Declare a function, binding it to a builtin if there is one
+  /// with that name.
+  virtual bool AddExtern(std::unique_ptr<PrototypeAST> proto) = 0;
+
+  /// Evaluate - Run a top-level expression, which the parser has wrapped in an
+  /// anonymous function, and store its value in result.
+  virtual bool Evaluate(std::unique_ptr<FunctionAST> fn, double &result) = 0;
+
+  /// GetInlinedCallees - Add to callees every function whose body was copied
+  /// into the compiled code of name. Redefining one of them leaves that code
+  /// stale, so it must be recompiled as well. Engines that do not inline copy
+  /// nothing.
+  virtual void GetInlinedCallees(std::string_view,
+                                 std::vector<std::string_view> &) const {}
+};
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// Epoch-based reclamation for compiled code.
+//
+// Redefining a function swaps its body pointer atomically, but a thread may
+// still be running the old body, or hold it in a call frame. So the old body
+// is retired instead of freed: it is tagged with the epoch in which it was
+// swapped out, and freed once every thread running code entered after that
+// epoch. A thread marks itself as running code with an EpochGuard for the
+// whole of one evaluation, so calls inside it cost nothing extra.
+
+/// EpochDomain - The process-wide epoch and the bodies waiting to be freed.
+class EpochDomain {
+private:
+  struct Retired {
+    virtual ~Retired() = default;
+  };
+  template <typename T> struct RetiredObject : Retired {
+    std::unique_ptr<T> object;
+    explicit RetiredObject(std::unique_ptr<T> object)
+        : object(std::move(object)) {}
+  };
+
+  /// ThreadRecord - The epoch the thread entered in, or 0 while it is not
+  /// running code.
+  struct ThreadRecord {
+    std::atomic<uint64_t> epoch{0};
+    unsigned nesting = 0;
+  };
+
+  /// Registration - Adds the thread's record to the domain for the lifetime
+  /// of the thread.
+  struct Registration {
+    ThreadRecord record;
+    Registration() {
+      EpochDomain &domain = Get();
+      std::lock_guard<std::mutex> guard(domain.lock);
+      domain.threads.push_back(&record);
+    }
+    ~Registration() {
+      EpochDomain &domain = Get();
+      std::lock_guard<std::mutex> guard(domain.lock);
+      domain.threads.erase(
+          std::find(domain.threads.begin(), domain.threads.end(), &record));
+    }
+  };
+
+  std::atomic<uint64_t> global{1};
+  std::mutex lock;
+  std::vector<ThreadRecord *> threads;
+  std::vector<std::pair<uint64_t, std::unique_ptr<Retired>>> retired;
+
+  static ThreadRecord &GetThreadRecord() {
+    static thread_local Registration registration;
+    return registration.record;
+  }
+
+  /// Collect - Free what no running thread can still see. The caller holds
+  /// the lock.
+  void Collect() {
+    uint64_t oldest = UINT64_MAX;
+    for (const ThreadRecord *thread : threads) {
+      uint64_t epoch = thread->epoch.load(std::memory_order_seq_cst);
+      if (epoch) {
+        oldest = std::min(oldest, epoch);
+      }
+    }
+    // A body retired in epoch e may be in use by threads that entered in e
+    // or earlier.
+    auto keep =
+        std::partition(retired.begin(), retired.end(),
+                       [&](const auto &r) { return r.first >= oldest; });
+    retired.erase(keep, retired.end());
+  }
+
+public:
+  static EpochDomain &Get() {
+    static EpochDomain domain;
+    return domain;
+  }
+
+  /// Enter - Mark the calling thread as running code. Calls nest.
+  void Enter() {
+    ThreadRecord &thread = GetThreadRecord();
+    if (thread.nesting++ == 0) {
+      thread.epoch.store(global.load(std::memory_order_relaxed),
+                         std::memory_order_seq_cst);
+      // Order the store before any body pointer the thread loads next.
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+  }
+
+  void Exit() {
+    ThreadRecord &thread = GetThreadRecord();
+    if (--thread.nesting == 0) {
+      thread.epoch.store(0, std::memory_order_release);
+    }
+  }
+
+  /// Retire - Free object, which was just unlinked, once no thread that
+  /// entered before the unlink is still running. Without running threads it
+  /// is freed right away.
+  template <typename T> void Retire(std::unique_ptr<T> object) {
+    if (!object) {
+      return;
+    }
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    std::lock_guard<std::mutex> guard(lock);
+    uint64_t epoch = global.fetch_add(1, std::memory_order_seq_cst);
+    retired.emplace_back(
+        epoch, std::make_unique<RetiredObject<T>>(std::move(object)));
+    Collect();
+  }
+
+  /// GetPending - The number of retired objects not freed yet.
+  size_t GetPending() {
+    std::lock_guard<std::mutex> guard(lock);
+    Collect();
+    return retired.size();
+  }
+};
+
+/// EpochGuard - Keeps the calling thread marked as running code while it is
+/// in scope.
+class EpochGuard {
+public:
+  EpochGuard() { EpochDomain::Get().Enter(); }
+  ~EpochGuard() { EpochDomain::Get().Exit(); }
+  EpochGuard(const EpochGuard &) = delete;
+  EpochGuard &operator=(const EpochGuard &) = delete;
+};
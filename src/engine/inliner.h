@@ -0,0 +1,553 @@
+#pragma once
+
+#include "assigned.h"
+#include "visitor.h"
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+/// InlineOptions - Knobs for Inliner.
+struct InlineOptions {
+  bool enabled = true;
+  /// Inline a call when the callee's cost is at most this. The cost is the
+  /// size of the callee's body in AST nodes, less the benefit of inlining:
+  /// CALL_BENEFIT for the call itself, and CONST_ARG_BENEFIT for each
+  /// constant argument, which the engines can fold into the copied body.
+  int threshold = 16;
+  /// The most AST nodes inlining may add to one function.
+  int growth_limit = 256;
+  /// How deeply inlined bodies nest: calls inside a copied body are inlined
+  /// in turn, to this many levels.
+  unsigned depth_limit = 3;
+  /// Print a remark for every call site saying what was decided and why.
+  bool report = false;
+};
+
+/// Inliner - Replaces calls to small functions with copies of their bodies,
+/// before any engine compiles the caller. It works on the AST, so every
+/// backend gets the same inlining from one pass.
+///
+/// An inlined call becomes a VarExprAST that binds each parameter to its
+/// argument, with the callee's body copied beneath it. Arguments that are
+/// constants or variables are substituted into the copy instead of bound,
+/// unless assignment could tell the difference.
+/// Every name the copy binds is renamed to a fresh one that no identifier
+/// can spell, so a copied body never captures the caller's names.
+///
+/// A call is never inlined into a function that is already being copied at
+/// that point, which stops recursion, nor into a callee with a different
+/// arity, which would fail at run time instead. Otherwise calls to
+/// user-defined operators are always inlined, whatever their cost, so an
+/// operator costs no more than the function body it stands for.
+///
+/// Compiled code that copied a body goes stale when that function is
+/// redefined. The inliner therefore remembers, for each function it inlined
+/// into, which bodies were copied and which callees had no definition yet,
+/// and GetDependents names the functions an engine must recompile when a
+/// definition changes. The engine serializes all calls.
+class Inliner {
+public:
+  static constexpr int CALL_BENEFIT = 4;
+  static constexpr int CONST_ARG_BENEFIT = 4;
+
+private:
+  /// Definition - A function whose body can be copied.
+  struct Definition {
+    const FunctionAST *ast = nullptr;
+    // Filled in the first time a call to it is considered, which may parse
+    // the body.
+    bool analyzed = false;
+    bool closed = false; // Every variable the body uses is bound in it.
+    int size = 0;
+  };
+
+  /// Record - What went into the compiled code of one function.
+  struct Record {
+    std::vector<std::string_view> inlined;
+    // Inlined callees and callees that were not defined, whose definition
+    // would change what inlining does.
+    std::vector<std::string_view> watched;
+    // Callees given to Watch, whose properties the code relies on.
+    std::vector<std::string_view> assumed;
+  };
+
+  /// Analyzer - Measures a body and checks that it uses no unknown names.
+  class Analyzer : public ExprVisitor<Analyzer, int> {
+  private:
+    const PrototypeAST &proto;
+    std::vector<std::string_view> scope;
+
+  public:
+    bool closed = true;
+
+    explicit Analyzer(const PrototypeAST &proto) : proto(proto) {}
+
+    int VisitNumber(const NumberExprAST &) { return 1; }
+
+    void CheckName(std::string_view name) {
+      const auto &args = proto.GetArgs();
+      if (std::find(scope.begin(), scope.end(), name) == scope.end() &&
+          std::find(args.begin(), args.end(), name) == args.end()) {
+        closed = false;
+      }
+    }
+
+    int VisitVariable(const VariableExprAST &expr) {
+      CheckName(expr.GetName());
+      return 1;
+    }
+
+    int VisitAssign(const AssignExprAST &expr) {
+      CheckName(expr.GetName());
+      return 1 + Visit(expr.GetValue());
+    }
+
+    int VisitBinary(const BinaryExprAST &expr) {
+      return 1 + Visit(expr.GetLHS()) + Visit(expr.GetRHS());
+    }
+
+    int VisitCall(const CallExprAST &expr) {
+      int size = 1;
+      for (const auto &arg : expr.GetArgs()) {
+        size += Visit(*arg);
+      }
+      return size;
+    }
+
+    int VisitVar(const VarExprAST &expr) {
+      int size = 1;
+      for (const auto &[name, init] : expr.GetVars()) {
+        size += Visit(*init);
+        scope.push_back(name);
+      }
+      size += Visit(expr.GetBody());
+      scope.resize(scope.size() - expr.GetVars().size());
+      return size;
+    }
+
+    int VisitIf(const IfExprAST &expr) {
+      return 1 + Visit(expr.GetCond()) + Visit(expr.GetThen()) +
+             Visit(expr.GetElse());
+    }
+
+    int VisitFor(const ForExprAST &expr) {
+      int size = 1;
+      for (const auto &var : expr.GetVars()) {
+        size += Visit(*var.start);
+      }
+      for (const auto &var : expr.GetVars()) {
+        scope.push_back(var.name);
+      }
+      for (const auto &var : expr.GetVars()) {
+        size += Visit(*var.step);
+      }
+      size += Visit(expr.GetEnd()) + Visit(expr.GetBody());
+      scope.resize(scope.size() - expr.GetVars().size());
+      return size;
+    }
+  };
+
+  /// Copier - Copies one function body, inlining calls on the way.
+  class Copier : public ExprVisitor<Copier, std::unique_ptr<ExprAST>> {
+  private:
+    /// Rename - How a name bound in a copied callee appears in the copy:
+    /// as another name, or as the constant that was passed for it.
+    struct Rename {
+      std::string_view from;
+      std::string_view to;
+      bool is_const;
+      double val;
+    };
+
+    Inliner &inliner;
+    std::string_view root;
+    // The functions being copied, outermost (the root) first.
+    std::vector<std::string_view> active;
+    // Renames in effect; those of the innermost copy start at env_base. The
+    // root's own names are never renamed.
+    std::vector<Rename> env;
+    size_t env_base = 0;
+    int growth = 0;
+    unsigned next_name = 0;
+
+  public:
+    std::vector<std::string_view> inlined;
+    std::vector<std::string_view> watched;
+
+    Copier(Inliner &inliner, std::string_view root)
+        : inliner(inliner), root(root), active{root} {}
+
+    std::unique_ptr<ExprAST> VisitNumber(const NumberExprAST &expr) {
+      return std::make_unique<NumberExprAST>(expr.GetLoc(), expr.GetVal());
+    }
+
+    std::unique_ptr<ExprAST> VisitVariable(const VariableExprAST &expr) {
+      for (size_t i = env.size(); i > env_base; --i) {
+        const Rename &rename = env[i - 1];
+        if (rename.from == expr.GetName()) {
+          if (rename.is_const) {
+            return std::make_unique<NumberExprAST>(expr.GetLoc(), rename.val);
+          }
+          return std::make_unique<VariableExprAST>(expr.GetLoc(), rename.to);
+        }
+      }
+      return std::make_unique<VariableExprAST>(expr.GetLoc(), expr.GetName());
+    }
+
+    /// VisitAssign - The target is renamed like any use of the name. A
+    /// parameter the callee assigns is always bound, never substituted.
+    std::unique_ptr<ExprAST> VisitAssign(const AssignExprAST &expr) {
+      auto value = Visit(expr.GetValue());
+      std::string_view name = expr.GetName();
+      for (size_t i = env.size(); i > env_base; --i) {
+        if (env[i - 1].from == name) {
+          name = env[i - 1].to;
+          break;
+        }
+      }
+      return std::make_unique<AssignExprAST>(expr.GetLoc(), name,
+                                             std::move(value));
+    }
+
+    std::unique_ptr<ExprAST> VisitBinary(const BinaryExprAST &expr) {
+      auto lhs = Visit(expr.GetLHS());
+      return std::make_unique<BinaryExprAST>(expr.GetLoc(), expr.GetOp(),
+                                             std::move(lhs),
+                                             Visit(expr.GetRHS()));
+    }
+
+    std::unique_ptr<ExprAST> VisitVar(const VarExprAST &expr) {
+      bool in_callee = active.size() > 1;
+      std::vector<VarExprAST::Binding> vars;
+      for (const auto &[name, init] : expr.GetVars()) {
+        auto value = Visit(*init);
+        std::string_view to = in_callee ? Fresh(name) : name;
+        if (in_callee) {
+          env.push_back(Rename{name, to, false, 0.0});
+        }
+        vars.emplace_back(to, std::move(value));
+      }
+      auto body = Visit(expr.GetBody());
+      if (in_callee) {
+        env.resize(env.size() - vars.size());
+      }
+      return std::make_unique<VarExprAST>(expr.GetLoc(), std::move(vars),
+                                          std::move(body));
+    }
+
+    std::unique_ptr<ExprAST> VisitIf(const IfExprAST &expr) {
+      auto cond = Visit(expr.GetCond());
+      auto then = Visit(expr.GetThen());
+      return std::make_unique<IfExprAST>(expr.GetLoc(), std::move(cond),
+                                         std::move(then),
+                                         Visit(expr.GetElse()));
+    }
+
+    std::unique_ptr<ExprAST> VisitFor(const ForExprAST &expr) {
+      bool in_callee = active.size() > 1;
+      std::vector<ForExprAST::Induction> vars;
+      for (const auto &var : expr.GetVars()) {
+        vars.push_back({var.name, Visit(*var.start), nullptr});
+      }
+      if (in_callee) {
+        for (auto &var : vars) {
+          std::string_view to = Fresh(var.name);
+          env.push_back(Rename{var.name, to, false, 0.0});
+          var.name = to;
+        }
+      }
+      for (size_t i = 0; i < vars.size(); ++i) {
+        vars[i].step = Visit(*expr.GetVars()[i].step);
+      }
+      auto end = Visit(expr.GetEnd());
+      auto body = Visit(expr.GetBody());
+      if (in_callee) {
+        env.resize(env.size() - vars.size());
+      }
+      return std::make_unique<ForExprAST>(expr.GetLoc(), std::move(vars),
+                                          std::move(end), std::move(body),
+                                          expr.GetUnroll());
+    }
+
+    std::unique_ptr<ExprAST> VisitCall(const CallExprAST &expr) {
+      std::vector<std::unique_ptr<ExprAST>> args;
+      for (const auto &arg : expr.GetArgs()) {
+        args.push_back(Visit(*arg));
+      }
+      const FunctionAST *callee = Decide(expr, args);
+      if (!callee) {
+        return std::make_unique<CallExprAST>(expr.GetLoc(), expr.GetCallee(),
+                                             std::move(args));
+      }
+
+      // Bind the parameters, then copy the body in a scope of its own. A
+      // parameter the body assigns needs a slot of its own. If an argument
+      // assigns, a variable passed beside it must still be read at the
+      // call, so it is bound too.
+      AssignedNames assigned;
+      assigned.Visit(callee->GetBody());
+      bool args_assign = false;
+      for (const auto &arg : args) {
+        args_assign = args_assign || HasAssignment(*arg);
+      }
+      std::vector<Rename> renames;
+      std::vector<VarExprAST::Binding> vars;
+      const auto &params = callee->GetProto().GetArgs();
+      for (size_t i = 0; i < params.size(); ++i) {
+        const ExprAST &arg = *args[i];
+        bool substitute = !assigned.Contains(params[i]);
+        if (substitute && arg.GetKind() == ExprKind::number) {
+          renames.push_back(Rename{
+              params[i], {}, true,
+              static_cast<const NumberExprAST &>(arg).GetVal()});
+        } else if (substitute && !args_assign &&
+                   arg.GetKind() == ExprKind::variable) {
+          renames.push_back(Rename{
+              params[i], static_cast<const VariableExprAST &>(arg).GetName(),
+              false, 0.0});
+        } else {
+          std::string_view to = Fresh(params[i]);
+          renames.push_back(Rename{params[i], to, false, 0.0});
+          vars.emplace_back(to, std::move(args[i]));
+        }
+      }
+      size_t saved_base = env_base;
+      env_base = env.size();
+      env.insert(env.end(), renames.begin(), renames.end());
+      active.push_back(expr.GetCallee());
+      auto body = Visit(callee->GetBody());
+      active.pop_back();
+      env.resize(env_base);
+      env_base = saved_base;
+      if (vars.empty()) {
+        return body;
+      }
+      return std::make_unique<VarExprAST>(expr.GetLoc(), std::move(vars),
+                                          std::move(body));
+    }
+
+  private:
+    /// Fresh - A new name for base, unique within this copy. Identifiers
+    /// cannot contain '.', so no name in the source can clash with it.
+    std::string_view Fresh(std::string_view base) {
+      std::string name(base);
+      name += '.';
+      name += std::to_string(++next_name);
+      return *inliner.names.insert(std::move(name)).first;
+    }
+
+    void Watch(std::string_view name) {
+      if (std::find(watched.begin(), watched.end(), name) == watched.end()) {
+        watched.push_back(name);
+      }
+    }
+
+    /// Decide - The callee to copy in place of expr, or null to keep the
+    /// call. args are the copied arguments.
+    const FunctionAST *
+    Decide(const CallExprAST &expr,
+           const std::vector<std::unique_ptr<ExprAST>> &args) {
+      std::string_view name = expr.GetCallee();
+      char reason[128];
+      const FunctionAST *callee = nullptr;
+      auto found = inliner.definitions.find(name);
+      if (std::find(active.begin(), active.end(), name) != active.end()) {
+        snprintf(reason, sizeof(reason), "recursive");
+      } else if (found == inliner.definitions.end()) {
+        Watch(name);
+        snprintf(reason, sizeof(reason), "no definition");
+      } else if (found->second.ast->GetProto().GetArgs().size() !=
+                 args.size()) {
+        snprintf(reason, sizeof(reason), "takes %zu arguments, not %zu",
+                 found->second.ast->GetProto().GetArgs().size(), args.size());
+      } else if (!found->second.ast->GetProto().IsOperator() &&
+                 active.size() > inliner.options.depth_limit) {
+        snprintf(reason, sizeof(reason), "nested deeper than %u",
+                 inliner.options.depth_limit);
+      } else {
+        Definition &definition = inliner.Analyze(found->second);
+        bool is_operator = definition.ast->GetProto().IsOperator();
+        int cost = definition.size - CALL_BENEFIT;
+        for (const auto &arg : args) {
+          if (arg->GetKind() == ExprKind::number) {
+            cost -= CONST_ARG_BENEFIT;
+          }
+        }
+        if (!definition.closed) {
+          snprintf(reason, sizeof(reason), "uses an unknown variable");
+        } else if (!is_operator && cost > inliner.options.threshold) {
+          snprintf(reason, sizeof(reason), "cost %d, threshold %d", cost,
+                   inliner.options.threshold);
+        } else if (!is_operator &&
+                   growth + definition.size > inliner.options.growth_limit) {
+          snprintf(reason, sizeof(reason),
+                   "would grow the caller past %d nodes",
+                   inliner.options.growth_limit);
+        } else {
+          growth += definition.size;
+          callee = definition.ast;
+          Watch(name);
+          if (std::find(inlined.begin(), inlined.end(), name) ==
+              inlined.end()) {
+            inlined.push_back(name);
+          }
+          if (is_operator) {
+            snprintf(reason, sizeof(reason), "operator");
+          } else {
+            snprintf(reason, sizeof(reason), "cost %d, threshold %d", cost,
+                     inliner.options.threshold);
+          }
+        }
+      }
+      if (inliner.options.report) {
+        std::string_view caller = root.empty() ? "<top-level>" : root;
+        char message[256];
+        snprintf(message, sizeof(message), "'%.*s' %s '%.*s' (%s)",
+                 static_cast<int>(name.size()), name.data(),
+                 callee ? "inlined into" : "not inlined into",
+                 static_cast<int>(caller.size()), caller.data(), reason);
+        ReportRemark(expr.GetLoc(), message);
+      }
+      return callee;
+    }
+  };
+
+  InlineOptions options;
+  std::unordered_map<std::string_view, Definition> definitions;
+  std::unordered_map<std::string_view, Record> records;
+  // The records backwards: for each name, the functions that watch it.
+  std::unordered_map<std::string_view, std::vector<std::string_view>> watchers;
+  // Names made up for bindings in copied bodies.
+  std::unordered_set<std::string> names;
+
+  Definition &Analyze(Definition &definition) {
+    if (!definition.analyzed) {
+      Analyzer analyzer(definition.ast->GetProto());
+      definition.size = analyzer.Visit(definition.ast->GetBody());
+      definition.closed = analyzer.closed;
+      definition.analyzed = true;
+    }
+    return definition;
+  }
+
+  /// SetRecord - Replace the record of name, keeping watchers in step.
+  void SetRecord(std::string_view name, Record record) {
+    auto found = records.find(name);
+    if (found != records.end()) {
+      for (std::string_view callee : found->second.watched) {
+        std::vector<std::string_view> &list = watchers[callee];
+        list.erase(std::find(list.begin(), list.end(), name));
+      }
+      records.erase(found);
+    }
+    if (record.watched.empty()) {
+      return;
+    }
+    for (std::string_view callee : record.watched) {
+      watchers[callee].push_back(name);
+    }
+    records.emplace(name, std::move(record));
+  }
+
+public:
+  InlineOptions &GetOptions() { return options; }
+
+  /// Define - Make ast the body that calls to name copy, or stop inlining
+  /// name if ast is null. ast must live until the next Define of name.
+  void Define(std::string_view name, const FunctionAST *ast) {
+    if (ast) {
+      Definition &definition = definitions[name];
+      definition = Definition();
+      definition.ast = ast;
+    } else {
+      definitions.erase(name);
+    }
+  }
+
+  /// Forget - Stop inlining name, and drop what was inlined into it.
+  void Forget(std::string_view name) {
+    Define(name, nullptr);
+    SetRecord(name, Record());
+  }
+
+  /// Inline - A copy of the body of fn, called name, with calls inlined, or
+  /// null if no call was. The result is remembered as the compiled code of
+  /// name for GetDependents and GetInlinedCallees, unless fn is a top-level
+  /// expression, whose name is empty.
+  std::unique_ptr<ExprAST> Inline(const FunctionAST &fn,
+                                  std::string_view name) {
+    if (!options.enabled) {
+      if (!name.empty()) {
+        SetRecord(name, Record());
+      }
+      return nullptr;
+    }
+    Copier copier(*this, name);
+    auto body = copier.Visit(fn.GetBody());
+    if (!name.empty()) {
+      Record record;
+      record.inlined = copier.inlined;
+      record.watched = std::move(copier.watched);
+      SetRecord(name, std::move(record));
+    }
+    if (copier.inlined.empty()) {
+      return nullptr;
+    }
+    return body;
+  }
+
+  /// Watch - Make name a dependent of callee, for compiled code that relies
+  /// on something about callee other than its body, such as its being a
+  /// pure builtin. Inline replaces what name watches.
+  void Watch(std::string_view name, std::string_view callee) {
+    Record &record = records[name];
+    if (std::find(record.watched.begin(), record.watched.end(), callee) ==
+        record.watched.end()) {
+      record.watched.push_back(callee);
+      watchers[callee].push_back(name);
+    }
+    if (std::find(record.assumed.begin(), record.assumed.end(), callee) ==
+        record.assumed.end()) {
+      record.assumed.push_back(callee);
+    }
+  }
+
+  /// GetDependents - Add to out every function whose compiled code is stale
+  /// now that name was defined, redefined or forgotten.
+  void GetDependents(std::string_view name,
+                     std::vector<std::string_view> &out) const {
+    auto found = watchers.find(name);
+    if (found != watchers.end()) {
+      for (std::string_view caller : found->second) {
+        if (caller != name) {
+          out.push_back(caller);
+        }
+      }
+    }
+  }
+
+  void GetInlinedCallees(std::string_view name,
+                         std::vector<std::string_view> &out) const {
+    auto found = records.find(name);
+    if (found != records.end()) {
+      out.insert(out.end(), found->second.inlined.begin(),
+                 found->second.inlined.end());
+    }
+  }
+
+  /// GetAssumedCallees - Add to out every callee that the compiled code of
+  /// name was made a dependent of with Watch.
+  void GetAssumedCallees(std::string_view name,
+                         std::vector<std::string_view> &out) const {
+    auto found = records.find(name);
+    if (found != records.end()) {
+      out.insert(out.end(), found->second.assumed.begin(),
+                 found->second.assumed.end());
+    }
+  }
+};
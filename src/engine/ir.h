@@ -0,0 +1,536 @@
+#pragma once
+
+#include "source.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <initializer_list>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// An SSA intermediate representation of one function body, for passes that
+// are awkward on the AST: anything that needs to know where a value comes
+// from or who else computes it.
+//
+// A function is a list of basic blocks over one dense array of instructions.
+// An instruction is named by its index in that array, which is also the name
+// of the value it defines, and operands are such indices, kept in one shared
+// array. The IR therefore holds no pointers, and copying a function copies a
+// few vectors. Each block lists its instructions in order and ends with
+// exactly one terminator. Phis come first in their block and have one operand
+// per predecessor, in the order of the block's preds. Block 0 is the entry.
+//
+// Values are typed: f64 for Kaleidoscope's doubles, and i1 for the booleans
+// that comparisons produce and that branches and selects test. to_f64 and
+// to_i1 convert the way the language does: true is 1.0, and a double is true
+// when IsTrue says so.
+//
+// An instruction removed from its block stays in the array, unused, until
+// the function is thrown away.
+
+/// IrType - The type of the value an instruction defines.
+enum class IrType : uint8_t { none, f64, i1 };
+
+// X(name, description)
+#define KALEIDOSCOPE_IR_OPS(X)                                                 \
+  X(constant, "the number k; an i1 constant is 1.0 or 0.0")                   \
+  X(arg, "parameter index")                                                    \
+  X(add, "a + b")                                                              \
+  X(sub, "a - b")                                                              \
+  X(mul, "a * b")                                                              \
+  X(fma, "a * b + c, rounded once")                                            \
+  X(less, "a < b, as an i1")                                                   \
+  X(to_f64, "1.0 if the i1 a is true, else 0.0")                               \
+  X(to_i1, "whether the f64 a is true")                                        \
+  X(select, "b if a is true, else c")                                          \
+  X(call, "call callees[index] with the operands")                             \
+  X(phi, "the operand for the block control came from")                        \
+  X(br, "continue at block index")                                             \
+  X(cond_br, "continue at block index if a is true, else at index2")           \
+  X(ret, "return a")
+
+enum class IrOp : uint8_t {
+#define KALEIDOSCOPE_IR_OP_ENUM(name, desc) name,
+  KALEIDOSCOPE_IR_OPS(KALEIDOSCOPE_IR_OP_ENUM)
+#undef KALEIDOSCOPE_IR_OP_ENUM
+};
+
+inline const char *IrOpName(IrOp op) {
+  static const char *const names[] = {
+#define KALEIDOSCOPE_IR_OP_NAME(name, desc) #name,
+      KALEIDOSCOPE_IR_OPS(KALEIDOSCOPE_IR_OP_NAME)
+#undef KALEIDOSCOPE_IR_OP_NAME
+  };
+  return names[static_cast<unsigned>(op)];
+}
+
+inline bool IsTerminator(IrOp op) {
+  return op == IrOp::br || op == IrOp::cond_br || op == IrOp::ret;
+}
+
+/// HasEffects - Whether an instruction must run where it is, and even if
+/// its value is unused: a call may print, fail or never return.
+inline bool HasEffects(IrOp op) {
+  return op == IrOp::call || IsTerminator(op);
+}
+
+inline constexpr uint32_t NO_VALUE = UINT32_MAX;
+
+/// IrInstr - One instruction, and the value it defines.
+struct IrInstr {
+  IrOp op;
+  IrType type = IrType::none;
+  uint32_t block = 0;
+  // Operands are operands[first, first + count) of the function.
+  uint32_t first = 0;
+  uint32_t count = 0;
+  // arg: the parameter. call: the callee. br, cond_br: the target block.
+  uint32_t index = 0;
+  uint32_t index2 = 0; // cond_br: the target when the condition is false.
+  double k = 0.0;      // constant: the number.
+  SourceLoc loc = 0;   // call: where it was made, for runtime errors.
+};
+
+/// IrBlock - A basic block: its instructions, in order, and the blocks that
+/// branch to it.
+struct IrBlock {
+  std::vector<uint32_t> code;
+  std::vector<uint32_t> preds;
+};
+
+/// IrFunction - One function body in SSA form.
+struct IrFunction {
+  std::string_view name;
+  SourceLoc loc = 0;
+  uint32_t num_params = 0;
+  std::vector<IrInstr> instrs;
+  std::vector<uint32_t> operands;
+  std::vector<IrBlock> blocks;
+  std::vector<std::string_view> callees;
+
+  const IrInstr &operator[](uint32_t value) const { return instrs[value]; }
+  IrInstr &operator[](uint32_t value) { return instrs[value]; }
+
+  uint32_t Operand(uint32_t value, uint32_t i) const {
+    return operands[instrs[value].first + i];
+  }
+  void SetOperand(uint32_t value, uint32_t i, uint32_t operand) {
+    operands[instrs[value].first + i] = operand;
+  }
+
+  uint32_t AddBlock() {
+    blocks.emplace_back();
+    return static_cast<uint32_t>(blocks.size() - 1);
+  }
+
+  /// Make - A new instruction that is in no block yet.
+  uint32_t Make(IrOp op, IrType type, std::initializer_list<uint32_t> args) {
+    return Make(op, type, args.begin(), args.size());
+  }
+  uint32_t Make(IrOp op, IrType type, const uint32_t *args, size_t count) {
+    IrInstr instr;
+    instr.op = op;
+    instr.type = type;
+    instr.first = static_cast<uint32_t>(operands.size());
+    instr.count = static_cast<uint32_t>(count);
+    operands.insert(operands.end(), args, args + count);
+    instrs.push_back(instr);
+    return static_cast<uint32_t>(instrs.size() - 1);
+  }
+
+  /// Append - Put value at the end of block.
+  uint32_t Append(uint32_t block, uint32_t value) {
+    instrs[value].block = block;
+    blocks[block].code.push_back(value);
+    return value;
+  }
+
+  /// InsertBefore - Put value just before the instruction before, in the
+  /// same block.
+  uint32_t InsertBefore(uint32_t before, uint32_t value) {
+    uint32_t block = instrs[before].block;
+    auto &code = blocks[block].code;
+    code.insert(std::find(code.begin(), code.end(), before), value);
+    instrs[value].block = block;
+    return value;
+  }
+
+  uint32_t Callee(std::string_view callee) {
+    auto it = std::find(callees.begin(), callees.end(), callee);
+    if (it != callees.end()) {
+      return static_cast<uint32_t>(it - callees.begin());
+    }
+    callees.push_back(callee);
+    return static_cast<uint32_t>(callees.size() - 1);
+  }
+
+  /// Terminator - The instruction that ends block.
+  const IrInstr &Terminator(uint32_t block) const {
+    return instrs[blocks[block].code.back()];
+  }
+
+  /// Successors - The blocks that block branches to.
+  std::vector<uint32_t> Successors(uint32_t block) const {
+    const IrInstr &term = Terminator(block);
+    switch (term.op) {
+    case IrOp::br:
+      return {term.index};
+    case IrOp::cond_br:
+      return {term.index, term.index2};
+    default:
+      return {};
+    }
+  }
+
+  /// ReplaceAllUses - Make every operand that is from refer to to instead.
+  void ReplaceAllUses(uint32_t from, uint32_t to) {
+    for (uint32_t &operand : operands) {
+      if (operand == from) {
+        operand = to;
+      }
+    }
+  }
+
+  /// CountUses - How many operands of instructions in blocks refer to each
+  /// value.
+  std::vector<uint32_t> CountUses() const {
+    std::vector<uint32_t> uses(instrs.size(), 0);
+    for (const IrBlock &block : blocks) {
+      for (uint32_t value : block.code) {
+        const IrInstr &instr = instrs[value];
+        for (uint32_t i = 0; i < instr.count; ++i) {
+          ++uses[operands[instr.first + i]];
+        }
+      }
+    }
+    return uses;
+  }
+};
+
+/// TrivialPhiValue - The one value a phi can take, when its operands are all
+/// that value or the phi itself; otherwise NO_VALUE.
+inline uint32_t TrivialPhiValue(const IrFunction &fn, uint32_t phi) {
+  uint32_t same = NO_VALUE;
+  for (uint32_t i = 0; i < fn[phi].count; ++i) {
+    uint32_t operand = fn.Operand(phi, i);
+    if (operand == phi || operand == same) {
+      continue;
+    }
+    if (same != NO_VALUE) {
+      return NO_VALUE;
+    }
+    same = operand;
+  }
+  return same;
+}
+
+/// IrCfg - The shape of a function's control flow: its reachable blocks in
+/// reverse postorder, and each one's immediate dominator.
+struct IrCfg {
+  std::vector<uint32_t> rpo;
+  std::vector<uint32_t> rpo_index; // UINT32_MAX for unreachable blocks.
+  std::vector<uint32_t> idom;      // The entry is its own.
+
+  explicit IrCfg(const IrFunction &fn) {
+    size_t n = fn.blocks.size();
+    rpo_index.assign(n, UINT32_MAX);
+    idom.assign(n, UINT32_MAX);
+    // Iterative depth-first search; a block is numbered when it is left.
+    // Successors are visited last to first, so that the order comes out
+    // with the taken side of each branch first, as in the source.
+    std::vector<uint8_t> seen(n, 0);
+    std::vector<std::pair<uint32_t, size_t>> stack{{0, 0}};
+    seen[0] = 1;
+    while (!stack.empty()) {
+      auto &[block, next] = stack.back();
+      std::vector<uint32_t> succs = fn.Successors(block);
+      if (next < succs.size()) {
+        uint32_t succ = succs[succs.size() - 1 - next++];
+        if (!seen[succ]) {
+          seen[succ] = 1;
+          stack.emplace_back(succ, 0);
+        }
+        continue;
+      }
+      rpo.push_back(block);
+      stack.pop_back();
+    }
+    std::reverse(rpo.begin(), rpo.end());
+    for (size_t i = 0; i < rpo.size(); ++i) {
+      rpo_index[rpo[i]] = static_cast<uint32_t>(i);
+    }
+
+    // Cooper, Harvey and Kennedy's "A Simple, Fast Dominance Algorithm".
+    idom[0] = 0;
+    for (bool changed = true; changed;) {
+      changed = false;
+      for (size_t i = 1; i < rpo.size(); ++i) {
+        uint32_t block = rpo[i];
+        uint32_t new_idom = UINT32_MAX;
+        for (uint32_t pred : fn.blocks[block].preds) {
+          if (idom[pred] == UINT32_MAX) {
+            continue;
+          }
+          new_idom = new_idom == UINT32_MAX ? pred : Intersect(pred, new_idom);
+        }
+        if (new_idom != idom[block]) {
+          idom[block] = new_idom;
+          changed = true;
+        }
+      }
+    }
+  }
+
+  bool IsReachable(uint32_t block) const {
+    return rpo_index[block] != UINT32_MAX;
+  }
+
+  /// Dominates - Whether every path from the entry to b passes through a.
+  bool Dominates(uint32_t a, uint32_t b) const {
+    while (rpo_index[b] > rpo_index[a]) {
+      b = idom[b];
+    }
+    return a == b;
+  }
+
+private:
+  uint32_t Intersect(uint32_t a, uint32_t b) const {
+    while (a != b) {
+      while (rpo_index[a] > rpo_index[b]) {
+        a = idom[a];
+      }
+      while (rpo_index[b] > rpo_index[a]) {
+        b = idom[b];
+      }
+    }
+    return a;
+  }
+};
+
+/// PrintIr - Print fn, one instruction per line.
+inline void PrintIr(FILE *out, const IrFunction &fn) {
+  static const char *const type_names[] = {"", "f64", "i1"};
+  fprintf(out, "%.*s: %u params\n", static_cast<int>(fn.name.size()),
+          fn.name.data(), fn.num_params);
+  for (uint32_t b = 0; b < fn.blocks.size(); ++b) {
+    const IrBlock &block = fn.blocks[b];
+    fprintf(out, "b%u:", b);
+    if (!block.preds.empty()) {
+      fprintf(out, "  ; preds");
+      for (uint32_t pred : block.preds) {
+        fprintf(out, " b%u", pred);
+      }
+    }
+    fputc('\n', out);
+    for (uint32_t value : block.code) {
+      const IrInstr &instr = fn[value];
+      fprintf(out, "  ");
+      if (instr.type != IrType::none) {
+        fprintf(out, "%%%u = %s ", value,
+                type_names[static_cast<unsigned>(instr.type)]);
+      }
+      fprintf(out, "%s", IrOpName(instr.op));
+      switch (instr.op) {
+      case IrOp::constant:
+        fprintf(out, " %g", instr.k);
+        break;
+      case IrOp::arg:
+      case IrOp::br:
+        fprintf(out, instr.op == IrOp::br ? " b%u" : " %u", instr.index);
+        break;
+      case IrOp::call: {
+        std::string_view callee = fn.callees[instr.index];
+        fprintf(out, " %.*s", static_cast<int>(callee.size()),
+                callee.data());
+        break;
+      }
+      default:
+        break;
+      }
+      for (uint32_t i = 0; i < instr.count; ++i) {
+        fprintf(out, "%s%%%u", i ? ", " : " ", fn.Operand(value, i));
+        if (instr.op == IrOp::phi && i < block.preds.size()) {
+          fprintf(out, " b%u", block.preds[i]);
+        }
+      }
+      if (instr.op == IrOp::cond_br) {
+        fprintf(out, ", b%u, b%u", instr.index, instr.index2);
+      }
+      fputc('\n', out);
+    }
+  }
+}
+
+/// VerifyIr - Check that fn is well formed, or describe the first problem
+/// in error:
+///
+///   - Every block ends in its one terminator, and its preds are exactly the
+///     blocks whose terminators name it.
+///   - Phis come first and have one operand per predecessor.
+///   - Operands name instructions that are in a block, of the right type.
+///   - Every definition dominates its uses. A phi uses an operand at the end
+///     of the matching predecessor.
+inline bool VerifyIr(const IrFunction &fn, std::string &error) {
+  auto fail = [&](uint32_t value, const char *message) {
+    error = message;
+    if (value != NO_VALUE) {
+      error += " (%" + std::to_string(value) + ")";
+    }
+    return false;
+  };
+  if (fn.blocks.empty()) {
+    return fail(NO_VALUE, "function has no blocks");
+  }
+  size_t n = fn.blocks.size();
+  std::vector<uint32_t> placed(fn.instrs.size(), UINT32_MAX);
+  std::vector<std::vector<uint32_t>> preds(n);
+  for (uint32_t b = 0; b < n; ++b) {
+    const auto &code = fn.blocks[b].code;
+    if (code.empty() || !IsTerminator(fn[code.back()].op)) {
+      return fail(NO_VALUE, "block does not end in a terminator");
+    }
+    bool in_phis = true;
+    for (size_t i = 0; i < code.size(); ++i) {
+      uint32_t value = code[i];
+      if (value >= fn.instrs.size() || placed[value] != UINT32_MAX) {
+        return fail(value, "instruction is in more than one place");
+      }
+      placed[value] = static_cast<uint32_t>(i);
+      const IrInstr &instr = fn[value];
+      if (instr.block != b) {
+        return fail(value, "instruction has the wrong block");
+      }
+      if (IsTerminator(instr.op) != (i + 1 == code.size())) {
+        return fail(value, "terminator in the middle of a block");
+      }
+      if (instr.op == IrOp::phi && !in_phis) {
+        return fail(value, "phi after other instructions");
+      }
+      in_phis = in_phis && instr.op == IrOp::phi;
+    }
+    for (uint32_t succ : fn.Successors(b)) {
+      if (succ >= n) {
+        return fail(code.back(), "branch to a block that does not exist");
+      }
+      preds[succ].push_back(b);
+    }
+  }
+  for (uint32_t b = 0; b < n; ++b) {
+    auto expected = preds[b];
+    auto actual = fn.blocks[b].preds;
+    std::sort(expected.begin(), expected.end());
+    std::sort(actual.begin(), actual.end());
+    if (expected != actual) {
+      return fail(NO_VALUE, "block preds do not match the branches");
+    }
+  }
+  if (!fn.blocks[0].preds.empty()) {
+    return fail(NO_VALUE, "entry block has predecessors");
+  }
+
+  IrCfg cfg(fn);
+  // Whether def is available at position pos of block b.
+  auto available = [&](uint32_t def, uint32_t b, uint32_t pos) {
+    uint32_t def_block = fn[def].block;
+    if (def_block == b) {
+      return placed[def] < pos;
+    }
+    return cfg.Dominates(def_block, b);
+  };
+  for (uint32_t b = 0; b < n; ++b) {
+    if (!cfg.IsReachable(b)) {
+      continue;
+    }
+    const IrBlock &block = fn.blocks[b];
+    for (uint32_t value : block.code) {
+      const IrInstr &instr = fn[value];
+      for (uint32_t i = 0; i < instr.count; ++i) {
+        uint32_t operand = fn.Operand(value, i);
+        if (operand >= fn.instrs.size() || placed[operand] == UINT32_MAX) {
+          return fail(value, "operand is not in any block");
+        }
+        IrType type = fn[operand].type;
+        IrType want = IrType::f64;
+        if (instr.op == IrOp::phi) {
+          want = instr.type;
+        } else if (instr.op == IrOp::select) {
+          want = i == 0 ? IrType::i1 : instr.type;
+        } else if (instr.op == IrOp::to_f64 || instr.op == IrOp::cond_br) {
+          want = IrType::i1;
+        }
+        if (type != want) {
+          return fail(value, "operand has the wrong type");
+        }
+        bool ok = instr.op == IrOp::phi
+                      ? i < block.preds.size() &&
+                            (!cfg.IsReachable(block.preds[i]) ||
+                             available(operand, block.preds[i], UINT32_MAX))
+                      : available(operand, b, placed[value]);
+        if (!ok) {
+          return fail(value, "operand does not dominate its use");
+        }
+      }
+      uint32_t arity = 0;
+      IrType result = IrType::f64;
+      switch (instr.op) {
+      case IrOp::constant:
+        result = instr.type == IrType::i1 ? IrType::i1 : IrType::f64;
+        break;
+      case IrOp::arg:
+        break;
+      case IrOp::br:
+        result = IrType::none;
+        break;
+      case IrOp::to_f64:
+        arity = 1;
+        break;
+      case IrOp::to_i1:
+        arity = 1;
+        result = IrType::i1;
+        break;
+      case IrOp::cond_br:
+      case IrOp::ret:
+        arity = 1;
+        result = IrType::none;
+        break;
+      case IrOp::add:
+      case IrOp::sub:
+      case IrOp::mul:
+        arity = 2;
+        break;
+      case IrOp::less:
+        arity = 2;
+        result = IrType::i1;
+        break;
+      case IrOp::fma:
+        arity = 3;
+        break;
+      case IrOp::select:
+        arity = 3;
+        result = instr.type == IrType::i1 ? IrType::i1 : IrType::f64;
+        break;
+      case IrOp::call:
+        arity = instr.count;
+        if (instr.index >= fn.callees.size()) {
+          return fail(value, "call to an unknown callee");
+        }
+        break;
+      case IrOp::phi:
+        arity = static_cast<uint32_t>(block.preds.size());
+        result = instr.type == IrType::i1 ? IrType::i1 : IrType::f64;
+        break;
+      }
+      if (instr.count != arity) {
+        return fail(value, "wrong number of operands");
+      }
+      if (instr.type != result) {
+        return fail(value, "result has the wrong type");
+      }
+      if (instr.op == IrOp::arg && instr.index >= fn.num_params) {
+        return fail(value, "argument out of range");
+      }
+    }
+  }
+  return true;
+}
@@ -0,0 +1,335 @@
+#pragma once
+
+#include "ir.h"
+#include "select.h"
+#include "visitor.h"
+
+/// IrBuilder - Lowers a function body to SSA form.
+///
+/// Variables never live in memory. The builder keeps the value each name in
+/// scope holds at the point being lowered, and an assignment just replaces
+/// it. Where two paths join, a name that holds different values on them gets
+/// a phi. A loop header gets a phi for every name before the body is
+/// lowered, since what the back edge brings is not known yet, and the phis
+/// the loop turns out not to need are removed again. That is what mem2reg
+/// does for LLVM, done while lowering.
+///
+/// An if in tail position returns from each arm, so a call there is still
+/// followed directly by the return. An if that ShouldSelect allows becomes a
+/// select.
+class IrBuilder : public ExprVisitor<IrBuilder, uint32_t> {
+private:
+  IrFunction &fn;
+  const PrototypeAST &proto;
+  // Names bound by enclosing var and for expressions, innermost last, and
+  // the index in values of each.
+  std::vector<std::pair<std::string_view, uint32_t>> scope;
+  // The value each variable holds: the parameters, then the names in scope.
+  std::vector<uint32_t> values;
+  uint32_t block = 0; // Where instructions are added.
+  // Whether the expression being visited is in tail position. Each handler
+  // reads it and clears it for its operands.
+  bool in_tail = false;
+  bool failed = false;
+
+  uint32_t Error(SourceLoc loc, const char *message) {
+    ReportError(loc, message);
+    failed = true;
+    return Const(0.0);
+  }
+
+  uint32_t Add(IrOp op, IrType type, std::initializer_list<uint32_t> args) {
+    return fn.Append(block, fn.Make(op, type, args));
+  }
+
+  uint32_t Const(double k) {
+    uint32_t value = Add(IrOp::constant, IrType::f64, {});
+    fn[value].k = k;
+    return value;
+  }
+
+  uint32_t AsF64(uint32_t value) {
+    if (fn[value].type != IrType::i1) {
+      return value;
+    }
+    return Add(IrOp::to_f64, IrType::f64, {value});
+  }
+
+  uint32_t AsI1(uint32_t value) {
+    if (fn[value].type == IrType::i1) {
+      return value;
+    }
+    if (fn[value].op == IrOp::to_f64) {
+      return fn.Operand(value, 0);
+    }
+    return Add(IrOp::to_i1, IrType::i1, {value});
+  }
+
+  void Branch(uint32_t from, uint32_t to) {
+    uint32_t br = fn.Append(from, fn.Make(IrOp::br, IrType::none, {}));
+    fn[br].index = to;
+    fn.blocks[to].preds.push_back(from);
+  }
+
+  void CondBranch(uint32_t cond, uint32_t then, uint32_t otherwise) {
+    uint32_t br = Add(IrOp::cond_br, IrType::none, {cond});
+    fn[br].index = then;
+    fn[br].index2 = otherwise;
+    fn.blocks[then].preds.push_back(block);
+    fn.blocks[otherwise].preds.push_back(block);
+  }
+
+  /// Lookup - The index in values of the variable name, or NO_VALUE.
+  uint32_t Lookup(std::string_view name) const {
+    for (auto it = scope.rbegin(); it != scope.rend(); ++it) {
+      if (it->first == name) {
+        return it->second;
+      }
+    }
+    const auto &names = proto.GetArgs();
+    for (size_t i = 0; i < names.size(); ++i) {
+      if (names[i] == name) {
+        return static_cast<uint32_t>(i);
+      }
+    }
+    return NO_VALUE;
+  }
+
+  /// RemoveTrivialPhis - Remove the phis of a loop header whose operands are
+  /// all one value or the phi itself, replacing them with that value. Doing
+  /// so can make others trivial in turn.
+  void RemoveTrivialPhis(uint32_t header, std::vector<uint32_t> &phis) {
+    for (bool changed = true; changed;) {
+      changed = false;
+      for (uint32_t &phi : phis) {
+        if (phi == NO_VALUE) {
+          continue;
+        }
+        uint32_t same = TrivialPhiValue(fn, phi);
+        if (same == NO_VALUE) {
+          continue;
+        }
+        fn.ReplaceAllUses(phi, same);
+        std::replace(values.begin(), values.end(), phi, same);
+        auto &code = fn.blocks[header].code;
+        code.erase(std::find(code.begin(), code.end(), phi));
+        phi = NO_VALUE;
+        changed = true;
+      }
+    }
+  }
+
+public:
+  IrBuilder(IrFunction &fn, const PrototypeAST &proto)
+      : fn(fn), proto(proto) {}
+
+  /// Build - Lower body into fn, which must be empty. Returns false if there
+  /// were errors, which have been reported.
+  bool Build(const ExprAST &body) {
+    fn.name = proto.GetName();
+    fn.loc = proto.GetLoc();
+    fn.num_params = static_cast<uint32_t>(proto.GetArgs().size());
+    block = fn.AddBlock();
+    for (uint32_t i = 0; i < fn.num_params; ++i) {
+      values.push_back(Add(IrOp::arg, IrType::f64, {}));
+      fn[values.back()].index = i;
+    }
+    in_tail = true;
+    uint32_t result = Visit(body);
+    if (result != NO_VALUE) {
+      Add(IrOp::ret, IrType::none, {AsF64(result)});
+    }
+    return !failed;
+  }
+
+  uint32_t VisitNumber(const NumberExprAST &expr) {
+    in_tail = false;
+    return Const(expr.GetVal());
+  }
+
+  uint32_t VisitVariable(const VariableExprAST &expr) {
+    in_tail = false;
+    uint32_t index = Lookup(expr.GetName());
+    if (index == NO_VALUE) {
+      return Error(expr.GetLoc(), "Unknown variable name");
+    }
+    return values[index];
+  }
+
+  uint32_t VisitAssign(const AssignExprAST &expr) {
+    in_tail = false;
+    uint32_t value = AsF64(Visit(expr.GetValue()));
+    uint32_t index = Lookup(expr.GetName());
+    if (index == NO_VALUE) {
+      return Error(expr.GetLoc(), "Unknown variable name");
+    }
+    return values[index] = value;
+  }
+
+  uint32_t VisitBinary(const BinaryExprAST &expr) {
+    in_tail = false;
+    uint32_t lhs = AsF64(Visit(expr.GetLHS()));
+    uint32_t rhs = AsF64(Visit(expr.GetRHS()));
+    switch (expr.GetOp()) {
+    case '+':
+      return Add(IrOp::add, IrType::f64, {lhs, rhs});
+    case '-':
+      return Add(IrOp::sub, IrType::f64, {lhs, rhs});
+    case '*':
+      return Add(IrOp::mul, IrType::f64, {lhs, rhs});
+    case '<':
+      return Add(IrOp::less, IrType::i1, {lhs, rhs});
+    default:
+      return Error(expr.GetLoc(), "invalid binary operator");
+    }
+  }
+
+  uint32_t VisitVar(const VarExprAST &expr) {
+    bool is_tail = in_tail;
+    for (const auto &[name, init] : expr.GetVars()) {
+      in_tail = false;
+      uint32_t value = AsF64(Visit(*init));
+      scope.emplace_back(name, static_cast<uint32_t>(values.size()));
+      values.push_back(value);
+    }
+    in_tail = is_tail;
+    uint32_t result = Visit(expr.GetBody());
+    scope.resize(scope.size() - expr.GetVars().size());
+    values.resize(values.size() - expr.GetVars().size());
+    return result;
+  }
+
+  /// VisitIf - A select, or a diamond of blocks whose join has a phi for
+  /// the value and for every name the arms leave different. In tail position
+  /// each arm returns instead, and there is no join.
+  uint32_t VisitIf(const IfExprAST &expr) {
+    bool is_tail = in_tail;
+    in_tail = false;
+    uint32_t cond = AsI1(Visit(expr.GetCond()));
+    if (ShouldSelect(expr)) {
+      in_tail = false;
+      uint32_t then = AsF64(Visit(expr.GetThen()));
+      in_tail = false;
+      uint32_t otherwise = AsF64(Visit(expr.GetElse()));
+      return Add(IrOp::select, IrType::f64, {cond, then, otherwise});
+    }
+
+    uint32_t then_block = fn.AddBlock();
+    uint32_t else_block = fn.AddBlock();
+    CondBranch(cond, then_block, else_block);
+    std::vector<uint32_t> before = values;
+    block = then_block;
+    in_tail = is_tail;
+    uint32_t then = Visit(expr.GetThen());
+    if (is_tail) {
+      if (then != NO_VALUE) {
+        Add(IrOp::ret, IrType::none, {AsF64(then)});
+      }
+      values = std::move(before);
+      block = else_block;
+      in_tail = true;
+      uint32_t otherwise = Visit(expr.GetElse());
+      if (otherwise != NO_VALUE) {
+        Add(IrOp::ret, IrType::none, {AsF64(otherwise)});
+      }
+      return NO_VALUE;
+    }
+    then = AsF64(then);
+    uint32_t then_end = block;
+    std::vector<uint32_t> then_values = std::move(values);
+
+    values = std::move(before);
+    block = else_block;
+    in_tail = false;
+    uint32_t otherwise = AsF64(Visit(expr.GetElse()));
+    uint32_t else_end = block;
+
+    uint32_t join = fn.AddBlock();
+    Branch(then_end, join);
+    Branch(else_end, join);
+    block = join;
+    for (size_t i = 0; i < values.size(); ++i) {
+      if (then_values[i] != values[i]) {
+        values[i] = Add(IrOp::phi, IrType::f64, {then_values[i], values[i]});
+      }
+    }
+    return then == otherwise
+               ? then
+               : Add(IrOp::phi, IrType::f64, {then, otherwise});
+  }
+
+  /// VisitFor - A header block that holds the loop's phis and the body,
+  /// which may continue in other blocks, ending in a branch back to the
+  /// header or out of the loop:
+  ///   starts; header: phis; (body; [end;] steps) x unroll; cond_br header
+  uint32_t VisitFor(const ForExprAST &expr) {
+    in_tail = false;
+    const auto &vars = expr.GetVars();
+    std::vector<uint32_t> starts;
+    for (const auto &var : vars) {
+      in_tail = false;
+      starts.push_back(AsF64(Visit(*var.start)));
+    }
+    uint32_t first = static_cast<uint32_t>(values.size());
+    for (size_t i = 0; i < vars.size(); ++i) {
+      scope.emplace_back(vars[i].name, first + static_cast<uint32_t>(i));
+      values.push_back(starts[i]);
+    }
+
+    uint32_t header = fn.AddBlock();
+    Branch(block, header);
+    block = header;
+    std::vector<uint32_t> phis;
+    for (uint32_t &value : values) {
+      // The second operand is filled in once the back edge is known.
+      value = Add(IrOp::phi, IrType::f64, {value, value});
+      phis.push_back(value);
+    }
+    uint32_t cond = NO_VALUE;
+    for (uint32_t copy = 1; copy <= expr.GetUnroll(); ++copy) {
+      in_tail = false;
+      Visit(expr.GetBody());
+      if (copy == expr.GetUnroll()) {
+        in_tail = false;
+        cond = AsI1(Visit(expr.GetEnd()));
+      }
+      for (size_t i = 0; i < vars.size(); ++i) {
+        in_tail = false;
+        uint32_t step = AsF64(Visit(*vars[i].step));
+        uint32_t &var = values[first + i];
+        var = Add(IrOp::add, IrType::f64, {var, step});
+      }
+    }
+    uint32_t exit = fn.AddBlock();
+    CondBranch(cond, header, exit);
+    for (size_t i = 0; i < phis.size(); ++i) {
+      fn.SetOperand(phis[i], 1, values[i]);
+    }
+    RemoveTrivialPhis(header, phis);
+    scope.resize(scope.size() - vars.size());
+    values.resize(first);
+    block = exit;
+    return Const(0.0);
+  }
+
+  uint32_t VisitCall(const CallExprAST &expr) {
+    in_tail = false;
+    std::vector<uint32_t> args;
+    for (const auto &arg : expr.GetArgs()) {
+      in_tail = false;
+      args.push_back(AsF64(Visit(*arg)));
+    }
+    uint32_t call = fn.Append(
+        block, fn.Make(IrOp::call, IrType::f64, args.data(), args.size()));
+    fn[call].index = fn.Callee(expr.GetCallee());
+    fn[call].loc = expr.GetLoc();
+    return call;
+  }
+};
+
+/// BuildIr - Lower body, with the parameters of proto, into fn. Returns
+/// false if there were errors, which have been reported.
+inline bool BuildIr(const PrototypeAST &proto, const ExprAST &body,
+                    IrFunction &fn) {
+  return IrBuilder(fn, proto).Build(body);
+}
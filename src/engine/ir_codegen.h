@@ -0,0 +1,586 @@
+#pragma once
+
+#include "bytecode_compiler.h"
+#include "ir.h"
+
+/// IrCodegen - Generates stack bytecode for a function in IR form.
+///
+/// Most values are used once, by an instruction later in the same block.
+/// Such a value is computed just before its user needs it and handed over on
+/// the stack, so straight-line code comes out as the same expression trees
+/// the AST compiler emits. Every other value, and every phi, is computed in
+/// order and kept in a local slot of its own. Constants and arguments are
+/// pushed afresh wherever they are used. Calls must still be made in the
+/// order the IR has them, so a call that would move past another one when
+/// computed at its user gets a slot instead.
+///
+/// Phis are written by their predecessors: at the end of each, a parallel
+/// copy pushes the values for every phi of the successor, then stores them.
+/// A value used only by such a copy is computed right there, and one that
+/// can live in the slot of the phi it feeds does, so its copy is free. When
+/// only one
+/// edge of a conditional branch has copies, they are made before the jump,
+/// with the condition still on the stack, unless the other successor may
+/// still read a phi they overwrite; then the edge gets code of its own.
+///
+/// Blocks are laid out in reverse postorder, which puts a loop's header
+/// before its body, as VerifyCode needs, and a branch to the next block
+/// falls through.
+class IrCodegen : private BytecodeEmitter {
+private:
+  /// Place - Where the value of an instruction is computed and kept.
+  enum class Place : uint8_t {
+    none,    // Unused and free of effects: never computed.
+    operand, // A constant or argument, pushed wherever it is used.
+    stack,   // Computed just before its one user, on the stack.
+    edge,    // Computed in the phi copies on the edge to its one user.
+    slot,    // Computed in order and kept in a local slot.
+    discard, // A call whose value is unused: made in order, then popped.
+    root,    // A terminator.
+  };
+
+  FunctionTable &functions;
+  const IrFunction &fn;
+  const BytecodeOptions &options;
+  std::vector<Place> places;
+  std::vector<uint32_t> slots;
+  // Where in its block each value is computed, counting the instructions
+  // that are computed in order; UINT32_MAX for values on an edge.
+  std::vector<uint32_t> positions;
+  uint32_t num_locals;
+  std::vector<uint32_t> starts; // Where the code of each block starts.
+  std::vector<std::pair<size_t, uint32_t>> fixups; // Jumps, and their blocks.
+
+  /// HasCall - Whether computing value on the stack makes a call.
+  bool HasCall(uint32_t value) const {
+    for (uint32_t i = 0; i < fn[value].count; ++i) {
+      uint32_t operand = fn.Operand(value, i);
+      if (places[operand] == Place::stack &&
+          (fn[operand].op == IrOp::call || HasCall(operand))) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void PlaceValues() {
+    size_t n = fn.instrs.size();
+    std::vector<uint32_t> uses = fn.CountUses();
+    std::vector<uint32_t> users(n, NO_VALUE);
+    std::vector<uint32_t> edges(n, NO_VALUE); // For a phi user, the pred.
+    for (const IrBlock &block : fn.blocks) {
+      for (uint32_t value : block.code) {
+        for (uint32_t i = 0; i < fn[value].count; ++i) {
+          uint32_t operand = fn.Operand(value, i);
+          users[operand] = value;
+          edges[operand] =
+              fn[value].op == IrOp::phi ? block.preds[i] : NO_VALUE;
+        }
+      }
+    }
+    places.assign(n, Place::none);
+    for (const IrBlock &block : fn.blocks) {
+      for (uint32_t value : block.code) {
+        const IrInstr &instr = fn[value];
+        uint32_t user = users[value];
+        Place &place = places[value];
+        if (IsTerminator(instr.op)) {
+          place = Place::root;
+        } else if (instr.op == IrOp::constant || instr.op == IrOp::arg) {
+          place = Place::operand;
+        } else if (instr.op == IrOp::phi) {
+          place = Place::slot;
+        } else if (uses[value] == 0) {
+          place = instr.op == IrOp::call ? Place::discard : Place::none;
+        } else if (uses[value] > 1) {
+          place = Place::slot;
+        } else if (fn[user].op != IrOp::phi) {
+          place = fn[user].block == instr.block ? Place::stack : Place::slot;
+        } else {
+          place = edges[value] == instr.block && instr.op != IrOp::call &&
+                          !HasCall(value)
+                      ? Place::edge
+                      : Place::slot;
+        }
+      }
+    }
+  }
+
+  /// CollectCalls - Append the calls computing value makes, in order.
+  void CollectCalls(uint32_t value, std::vector<uint32_t> &calls) const {
+    for (uint32_t i = 0; i < fn[value].count; ++i) {
+      uint32_t operand = fn.Operand(value, i);
+      if (places[operand] == Place::stack) {
+        CollectCalls(operand, calls);
+      }
+    }
+    if (fn[value].op == IrOp::call) {
+      calls.push_back(value);
+    }
+  }
+
+  /// KeepCallsInOrder - Give a slot to the first call of a block that would
+  /// otherwise be made out of order, until none is.
+  void KeepCallsInOrder() {
+    for (bool changed = true; changed;) {
+      changed = false;
+      for (const IrBlock &block : fn.blocks) {
+        std::vector<uint32_t> expected;
+        std::vector<uint32_t> made;
+        for (uint32_t value : block.code) {
+          if (fn[value].op == IrOp::call) {
+            expected.push_back(value);
+          }
+          Place place = places[value];
+          if (place == Place::slot || place == Place::discard ||
+              place == Place::root) {
+            CollectCalls(value, made);
+          }
+        }
+        auto [first, second] =
+            std::mismatch(expected.begin(), expected.end(), made.begin());
+        if (first != expected.end()) {
+          places[*first] = Place::slot;
+          changed = true;
+        }
+      }
+    }
+  }
+
+  void SetPosition(uint32_t value, uint32_t position) {
+    positions[value] = position;
+    for (uint32_t i = 0; i < fn[value].count; ++i) {
+      uint32_t operand = fn.Operand(value, i);
+      if (places[operand] == Place::stack) {
+        SetPosition(operand, position);
+      }
+    }
+  }
+
+  /// CanShare - Whether value, from block b, can live in the slot of phi,
+  /// which the edge from b sets to value. The old value of phi is lost as
+  /// soon as value is computed, so nothing may read it after that, and every
+  /// other edge into phi's block overwrites value, so no use of value may be
+  /// reached through one without passing b again.
+  bool CanShare(uint32_t value, uint32_t phi) const {
+    uint32_t b = fn[value].block;
+    std::vector<uint32_t> work;
+    for (uint32_t x = 0; x < fn.blocks.size(); ++x) {
+      const IrBlock &block = fn.blocks[x];
+      for (uint32_t user : block.code) {
+        bool is_phi = fn[user].op == IrOp::phi;
+        for (uint32_t i = 0; i < fn[user].count; ++i) {
+          uint32_t operand = fn.Operand(user, i);
+          if (operand == phi &&
+              (is_phi || x != b || positions[user] > positions[value])) {
+            return false;
+          }
+          if (operand == value && user != phi) {
+            work.push_back(is_phi ? block.preds[i] : x);
+          }
+        }
+      }
+    }
+    std::vector<uint8_t> seen(fn.blocks.size(), 0);
+    while (!work.empty()) {
+      uint32_t x = work.back();
+      work.pop_back();
+      if (x == fn[phi].block && x != b) {
+        return false;
+      }
+      if (x == b || seen[x]) {
+        continue;
+      }
+      seen[x] = 1;
+      for (uint32_t pred : fn.blocks[x].preds) {
+        work.push_back(pred);
+      }
+    }
+    return true;
+  }
+
+  /// AssignSlots - Give each value that needs one a slot, sharing the slot
+  /// of a phi it feeds where it can. Only one value shares each phi's slot,
+  /// or one could overwrite another that is still needed. Later blocks go
+  /// first, so that a loop's back edge is what gets the free copy.
+  void AssignSlots() {
+    positions.assign(fn.instrs.size(), UINT32_MAX);
+    for (const IrBlock &block : fn.blocks) {
+      for (uint32_t i = 0; i < block.code.size(); ++i) {
+        Place place = places[block.code[i]];
+        if (place == Place::slot || place == Place::discard ||
+            place == Place::root) {
+          SetPosition(block.code[i], i);
+        }
+      }
+    }
+    slots.assign(fn.instrs.size(), NO_VALUE);
+    for (const IrBlock &block : fn.blocks) {
+      for (uint32_t value : block.code) {
+        if (fn[value].op == IrOp::phi) {
+          slots[value] = num_locals++;
+        }
+      }
+    }
+    std::vector<uint8_t> shared(fn.instrs.size(), 0);
+    for (uint32_t b = static_cast<uint32_t>(fn.blocks.size()); b-- > 0;) {
+      for (uint32_t value : fn.blocks[b].code) {
+        if (places[value] != Place::slot || fn[value].op == IrOp::phi) {
+          continue;
+        }
+        for (uint32_t succ : fn.Successors(b)) {
+          uint32_t index = PredIndex(b, succ);
+          for (uint32_t phi : fn.blocks[succ].code) {
+            if (fn[phi].op != IrOp::phi) {
+              break;
+            }
+            if (slots[value] == NO_VALUE && !shared[phi] &&
+                fn.Operand(phi, index) == value && CanShare(value, phi)) {
+              slots[value] = slots[phi];
+              shared[phi] = 1;
+            }
+          }
+        }
+        if (slots[value] == NO_VALUE) {
+          slots[value] = num_locals++;
+        }
+      }
+    }
+  }
+
+  /// IsLoad - Whether pushing value is a load_arg, and from which slot.
+  bool IsLoad(uint32_t value, uint32_t &slot) const {
+    if (places[value] == Place::slot) {
+      slot = slots[value];
+      return true;
+    }
+    if (fn[value].op == IrOp::arg) {
+      slot = fn[value].index;
+      return true;
+    }
+    return false;
+  }
+
+  /// EmitValue - Push value.
+  void EmitValue(uint32_t value) {
+    const IrInstr &instr = fn[value];
+    switch (places[value]) {
+    case Place::operand:
+      if (instr.op == IrOp::constant) {
+        return EmitConst(fn.loc, instr.k);
+      }
+      Emit(op_load_arg, instr.index);
+      return Push();
+    case Place::stack:
+    case Place::edge:
+      return Compute(value);
+    default:
+      // A value stored just before is still on the stack.
+      if (LastIs(op_store_local) && DecodeA(code[last_instr]) == slots[value]) {
+        ReplaceLast(op_tee_local);
+      } else {
+        Emit(op_load_arg, slots[value]);
+      }
+      return Push();
+    }
+  }
+
+  /// Compute - Push value, computing it from its operands.
+  void Compute(uint32_t value) {
+    const IrInstr &instr = fn[value];
+    uint32_t a = instr.count > 0 ? fn.Operand(value, 0) : NO_VALUE;
+    uint32_t b = instr.count > 1 ? fn.Operand(value, 1) : NO_VALUE;
+    uint32_t slot;
+    switch (instr.op) {
+    case IrOp::add:
+      // Addition commutes, so a load on the left can still use arg_add,
+      // unless the right is a product that mul_add can take.
+      if (options.superinstructions && IsLoad(a, slot) && !IsLoad(b, slot) &&
+          (fn[b].op != IrOp::mul || places[b] == Place::slot)) {
+        EmitValue(b);
+        return Emit(op_arg_add, slot);
+      }
+      EmitValue(a);
+      EmitValue(b);
+      Pop();
+      if (options.superinstructions && LastIs(op_load_arg)) {
+        return ReplaceLast(op_arg_add);
+      }
+      if (options.superinstructions && LastIs(op_mul)) {
+        return ReplaceLast(op_mul_add);
+      }
+      return Emit(op_add);
+    case IrOp::sub:
+    case IrOp::mul:
+    case IrOp::less:
+      EmitValue(a);
+      EmitValue(b);
+      Pop();
+      return Emit(instr.op == IrOp::sub   ? op_sub
+                  : instr.op == IrOp::mul ? op_mul
+                                          : op_less);
+    case IrOp::fma:
+      EmitValue(a);
+      EmitValue(b);
+      EmitValue(fn.Operand(value, 2));
+      Emit(op_fma);
+      return Pop(2);
+    case IrOp::to_f64:
+      EmitValue(a);
+      // less and i1 constants already give 1.0 or 0.0.
+      if (fn[a].op != IrOp::less && fn[a].op != IrOp::constant) {
+        EmitConst(fn.loc, 1.0);
+        EmitConst(fn.loc, 0.0);
+        Emit(op_select);
+        Pop(2);
+      }
+      return;
+    case IrOp::to_i1:
+      // Whatever reads an i1 tests it with IsTrue.
+      return EmitValue(a);
+    case IrOp::select:
+      EmitValue(a);
+      EmitValue(b);
+      EmitValue(fn.Operand(value, 2));
+      Emit(op_select);
+      return Pop(2);
+    case IrOp::call:
+      return EmitCall(value, false);
+    default:
+      return Error(fn.loc, "cannot generate code for IR instruction");
+    }
+  }
+
+  void EmitCall(uint32_t value, bool is_tail) {
+    const IrInstr &instr = fn[value];
+    for (uint32_t i = 0; i < instr.count; ++i) {
+      EmitValue(fn.Operand(value, i));
+    }
+    BytecodeEmitter::EmitCall(instr.loc, fn.callees[instr.index], instr.count,
+                              is_tail, functions, options);
+  }
+
+  /// PredIndex - Which of to's preds from is, which is also which operand
+  /// of its phis comes from there.
+  uint32_t PredIndex(uint32_t from, uint32_t to) const {
+    const auto &preds = fn.blocks[to].preds;
+    return static_cast<uint32_t>(
+        std::find(preds.begin(), preds.end(), from) - preds.begin());
+  }
+
+  /// IsCopy - Whether setting phi to source takes a copy.
+  bool IsCopy(uint32_t phi, uint32_t source) const {
+    return source != phi &&
+           (places[source] != Place::slot || slots[source] != slots[phi]);
+  }
+
+  /// HasCopies - Whether the edge from -> to changes any phi of to.
+  bool HasCopies(uint32_t from, uint32_t to) const {
+    uint32_t index = PredIndex(from, to);
+    for (uint32_t value : fn.blocks[to].code) {
+      if (fn[value].op != IrOp::phi) {
+        break;
+      }
+      if (IsCopy(value, fn.Operand(value, index))) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /// EmitCopies - Set the phis of to for the edge from -> to. All the values
+  /// are pushed before any is stored, so one phi can read another.
+  void EmitCopies(uint32_t from, uint32_t to) {
+    uint32_t index = PredIndex(from, to);
+    std::vector<uint32_t> targets;
+    for (uint32_t value : fn.blocks[to].code) {
+      if (fn[value].op != IrOp::phi) {
+        break;
+      }
+      uint32_t source = fn.Operand(value, index);
+      if (IsCopy(value, source)) {
+        EmitValue(source);
+        targets.push_back(slots[value]);
+      }
+    }
+    for (auto it = targets.rbegin(); it != targets.rend(); ++it) {
+      Emit(op_store_local, *it);
+      Pop();
+    }
+  }
+
+  /// ReadsPhisOf - Whether code that runs after block at, before block phis
+  /// is entered again, may read a phi of phis. Walks back from each use of
+  /// one without passing phis, where they are all defined.
+  bool ReadsPhisOf(uint32_t at, uint32_t phis) const {
+    std::vector<uint32_t> work;
+    for (uint32_t b = 0; b < fn.blocks.size(); ++b) {
+      const IrBlock &block = fn.blocks[b];
+      for (uint32_t value : block.code) {
+        for (uint32_t i = 0; i < fn[value].count; ++i) {
+          uint32_t operand = fn.Operand(value, i);
+          if (fn[operand].op == IrOp::phi && fn[operand].block == phis) {
+            work.push_back(fn[value].op == IrOp::phi ? block.preds[i] : b);
+          }
+        }
+      }
+    }
+    std::vector<uint8_t> seen(fn.blocks.size(), 0);
+    while (!work.empty()) {
+      uint32_t b = work.back();
+      work.pop_back();
+      if (b == at) {
+        return true;
+      }
+      if (b == phis || seen[b]) {
+        continue;
+      }
+      seen[b] = 1;
+      for (uint32_t pred : fn.blocks[b].preds) {
+        work.push_back(pred);
+      }
+    }
+    return false;
+  }
+
+  /// EmitJump - Emit a jump, conditional on the value on the stack unless op
+  /// is op_jump, and return where it is so it can be patched.
+  size_t EmitJump(Opcode op) {
+    if (op == op_jump_if_false && options.superinstructions &&
+        LastIs(op_less)) {
+      ReplaceLast(op_jump_if_not_less);
+    } else {
+      Emit(op);
+    }
+    if (op != op_jump) {
+      Pop();
+    }
+    return last_instr;
+  }
+
+  void EmitJump(Opcode op, uint32_t target) {
+    fixups.emplace_back(EmitJump(op), target);
+  }
+
+  /// JumpTo - Continue at block target, which may be next.
+  void JumpTo(uint32_t target, uint32_t next) {
+    if (target != next) {
+      EmitJump(op_jump, target);
+    }
+  }
+
+  void EmitCondBranch(uint32_t from, uint32_t value, uint32_t next) {
+    const IrInstr &instr = fn[value];
+    uint32_t then = instr.index;
+    uint32_t otherwise = instr.index2;
+    bool then_copies = HasCopies(from, then);
+    bool else_copies = HasCopies(from, otherwise);
+    EmitValue(fn.Operand(value, 0));
+    if (!else_copies && (!then_copies || !ReadsPhisOf(otherwise, then))) {
+      if (then_copies) {
+        EmitCopies(from, then);
+      }
+      if (then == next) {
+        return EmitJump(op_jump_if_false, otherwise);
+      }
+      EmitJump(op_jump_if_true, then);
+      return JumpTo(otherwise, next);
+    }
+    if (!then_copies && !ReadsPhisOf(then, otherwise)) {
+      EmitCopies(from, otherwise);
+      if (otherwise == next) {
+        return EmitJump(op_jump_if_true, then);
+      }
+      EmitJump(op_jump_if_false, otherwise);
+      return JumpTo(then, next);
+    }
+    //   cond; jump_if_false copy_else; then copies; jump then;
+    //   copy_else: else copies; jump otherwise
+    size_t to_else = EmitJump(op_jump_if_false);
+    EmitCopies(from, then);
+    EmitJump(op_jump, then);
+    PatchJump(to_else, Label());
+    EmitCopies(from, otherwise);
+    JumpTo(otherwise, next);
+  }
+
+  void EmitBlock(uint32_t b, uint32_t next) {
+    for (uint32_t value : fn.blocks[b].code) {
+      const IrInstr &instr = fn[value];
+      switch (places[value]) {
+      case Place::slot:
+        if (instr.op != IrOp::phi) {
+          Compute(value);
+          Emit(op_store_local, slots[value]);
+          Pop();
+        }
+        break;
+      case Place::discard:
+        Compute(value);
+        Emit(op_pop);
+        Pop();
+        break;
+      case Place::root:
+        if (instr.op == IrOp::ret) {
+          uint32_t result = fn.Operand(value, 0);
+          if (fn[result].op == IrOp::call &&
+              places[result] == Place::stack) {
+            EmitCall(result, true);
+          } else {
+            EmitValue(result);
+          }
+          Emit(op_ret);
+          Pop();
+        } else if (instr.op == IrOp::br) {
+          EmitCopies(b, instr.index);
+          JumpTo(instr.index, next);
+        } else {
+          EmitCondBranch(b, value, next);
+        }
+        break;
+      default:
+        break;
+      }
+    }
+  }
+
+public:
+  IrCodegen(FunctionTable &functions, const IrFunction &fn,
+            const BytecodeOptions &options)
+      : functions(functions), fn(fn), options(options),
+        num_locals(fn.num_params) {}
+
+  /// Generate - Generate the code and, on success, store it in out.
+  bool Generate(BcCode &out) {
+    PlaceValues();
+    KeepCallsInOrder();
+    AssignSlots();
+    if (num_locals > MAX_OPERAND + 1) {
+      Error(fn.loc, "too many variables in one function");
+      return false;
+    }
+
+    IrCfg cfg(fn);
+    starts.assign(fn.blocks.size(), 0);
+    for (size_t i = 0; i < cfg.rpo.size(); ++i) {
+      uint32_t next = i + 1 < cfg.rpo.size() ? cfg.rpo[i + 1] : NO_VALUE;
+      starts[cfg.rpo[i]] = Label();
+      EmitBlock(cfg.rpo[i], next);
+    }
+    if (code.size() > MAX_OPERAND) {
+      Error(fn.loc, "function is too long");
+      return false;
+    }
+    for (auto [offset, target] : fixups) {
+      PatchJump(offset, starts[target]);
+    }
+    return TakeCode(num_locals, out);
+  }
+};
+
+/// GenerateBytecode - Generate code for fn into out. On failure out is left
+/// unchanged.
+inline bool GenerateBytecode(FunctionTable &functions, const IrFunction &fn,
+                             const BytecodeOptions &options, BcCode &out) {
+  return IrCodegen(functions, fn, options).Generate(out);
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#include "ir.h"
+#include "token_buffer.h"
+#include <cstring>
+#include <functional>
+#include <unordered_map>
+
+/// CallPurity - Whether calls to the function called name have no effects
+/// and give the same result whenever the arguments are the same.
+using CallPurity = std::function<bool(std::string_view name)>;
+
+/// NumberValues - Global value numbering: replace each instruction that
+/// computes the same value as one that dominates it by that one.
+///
+/// An instruction is hash-consed by its opcode, its immediates and the value
+/// numbers of its operands, which are the instructions they were replaced
+/// by, so equal subexpressions are found bottom up in one walk. Operands of
+/// add and mul are put in order first, since those commute. The walk is a
+/// preorder of the dominator tree, and the table is scoped by it: leaving a
+/// block forgets what was defined there, so whatever the table offers
+/// dominates the instruction being looked up. A phi is only equal to another
+/// phi of the same block.
+///
+/// A call is a candidate only when is_pure says so of its callee; any other
+/// may print, fail or never return, and must be made as often as written.
+/// The callee of each call that was replaced is added to merged, once: the
+/// code is only right while those stay pure. Instructions that were replaced
+/// are removed from their blocks.
+inline bool NumberValues(IrFunction &fn, const CallPurity &is_pure,
+                         std::vector<std::string_view> &merged) {
+  struct KeyHash {
+    size_t operator()(const std::vector<uint32_t> &key) const {
+      return HashBytes(key.data(), key.size() * sizeof(uint32_t));
+    }
+  };
+  std::unordered_map<std::vector<uint32_t>, uint32_t, KeyHash> table;
+  std::vector<std::vector<uint32_t>> defined; // Keys added, innermost last.
+
+  std::vector<uint8_t> pure(fn.callees.size());
+  for (size_t i = 0; i < fn.callees.size(); ++i) {
+    pure[i] = is_pure(fn.callees[i]);
+  }
+  std::vector<uint32_t> replacement(fn.instrs.size(), NO_VALUE);
+  auto resolve = [&](uint32_t value) {
+    while (replacement[value] != NO_VALUE) {
+      value = replacement[value];
+    }
+    return value;
+  };
+  bool changed = false;
+  auto number_block = [&](uint32_t block) {
+    for (uint32_t value : fn.blocks[block].code) {
+      const IrInstr &instr = fn[value];
+      for (uint32_t i = 0; i < instr.count; ++i) {
+        fn.SetOperand(value, i, resolve(fn.Operand(value, i)));
+      }
+      if (IsTerminator(instr.op) ||
+          (instr.op == IrOp::call && !pure[instr.index])) {
+        continue;
+      }
+      uint64_t bits;
+      memcpy(&bits, &instr.k, sizeof(bits));
+      std::vector<uint32_t> key = {
+          static_cast<uint32_t>(instr.op), static_cast<uint32_t>(instr.type),
+          instr.index, static_cast<uint32_t>(bits),
+          static_cast<uint32_t>(bits >> 32),
+          instr.op == IrOp::phi ? block : 0};
+      for (uint32_t i = 0; i < instr.count; ++i) {
+        key.push_back(fn.Operand(value, i));
+      }
+      if (instr.op == IrOp::add || instr.op == IrOp::mul) {
+        std::sort(key.end() - 2, key.end());
+      }
+      auto [it, inserted] = table.emplace(key, value);
+      if (inserted) {
+        defined.push_back(std::move(key));
+      } else {
+        replacement[value] = it->second;
+        changed = true;
+        if (instr.op == IrOp::call) {
+          std::string_view callee = fn.callees[instr.index];
+          if (std::find(merged.begin(), merged.end(), callee) ==
+              merged.end()) {
+            merged.push_back(callee);
+          }
+        }
+      }
+    }
+  };
+
+  IrCfg cfg(fn);
+  std::vector<std::vector<uint32_t>> children(fn.blocks.size());
+  for (size_t i = 1; i < cfg.rpo.size(); ++i) {
+    children[cfg.idom[cfg.rpo[i]]].push_back(cfg.rpo[i]);
+  }
+  // Each entry is a block, the next of its children to visit, and how many
+  // keys were defined before it.
+  struct Visit {
+    uint32_t block;
+    size_t next;
+    size_t mark;
+  };
+  std::vector<Visit> stack{{0, 0, 0}};
+  number_block(0);
+  while (!stack.empty()) {
+    Visit &visit = stack.back();
+    if (visit.next < children[visit.block].size()) {
+      uint32_t child = children[visit.block][visit.next++];
+      stack.push_back({child, 0, defined.size()});
+      number_block(child);
+      continue;
+    }
+    for (size_t i = defined.size(); i > visit.mark; --i) {
+      table.erase(defined.back());
+      defined.pop_back();
+    }
+    stack.pop_back();
+  }
+
+  if (!changed) {
+    return false;
+  }
+  // Phis on back edges name values that were only numbered later.
+  for (uint32_t &operand : fn.operands) {
+    operand = resolve(operand);
+  }
+  for (IrBlock &block : fn.blocks) {
+    block.code.erase(std::remove_if(block.code.begin(), block.code.end(),
+                                    [&](uint32_t value) {
+                                      return replacement[value] != NO_VALUE;
+                                    }),
+                     block.code.end());
+  }
+  return true;
+}
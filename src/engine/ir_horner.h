@@ -0,0 +1,157 @@
+#pragma once
+
+#include "ir.h"
+#include <vector>
+
+/// MAX_HORNER_DEGREE - The highest power of a variable RewriteHorner looks
+/// for. A term with more factors is left alone, which also bounds the walk
+/// over products that share factors.
+inline constexpr uint32_t MAX_HORNER_DEGREE = 32;
+
+/// Monomial - A term of a sum that is a constant times a power of one value.
+/// A constant has degree 0 and no variable.
+struct Monomial {
+  uint32_t variable = NO_VALUE;
+  uint32_t degree = 0;
+  uint32_t muls = 0; // How many multiplies the term takes as written.
+  double coefficient = 1.0;
+};
+
+/// MatchMonomial - Whether value is a product of constants and copies of
+/// one value, and if so which.
+inline bool MatchMonomial(const IrFunction &fn, uint32_t value,
+                          Monomial &term) {
+  term = Monomial();
+  std::vector<uint32_t> work{value};
+  while (!work.empty()) {
+    uint32_t factor = work.back();
+    work.pop_back();
+    const IrInstr &instr = fn[factor];
+    if (instr.op == IrOp::mul) {
+      if (++term.muls > MAX_HORNER_DEGREE) {
+        return false;
+      }
+      work.push_back(fn.Operand(factor, 1));
+      work.push_back(fn.Operand(factor, 0));
+    } else if (instr.op == IrOp::constant) {
+      term.coefficient *= instr.k;
+    } else if (term.variable == NO_VALUE || term.variable == factor) {
+      term.variable = factor;
+      ++term.degree;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+/// RewriteHorner - Find sums that are polynomials in one value, written out
+/// term by term, and evaluate them in Horner form instead.
+///
+/// A sum is a chain of adds and subs, as Reassociate finds them, and its
+/// terms are matched with MatchMonomial. The variable is that of the term of
+/// the highest degree, n; the terms in it, and the constants, make up the
+/// polynomial, and any other terms are added after it. The polynomial is
+/// then n multiplies and an add per coefficient that is not zero:
+///
+///   a*x*x*x + b*x*x + c*x + d  =>  ((a*x + b)*x + c)*x + d
+///
+/// which ContractMulAdd turns into n fmas. The sum is only rewritten when
+/// that saves multiplies. Like-powered terms are added at compile time, so
+/// the result can round differently, and --strict-fp turns this off.
+inline bool RewriteHorner(IrFunction &fn) {
+  std::vector<uint32_t> uses = fn.CountUses();
+  std::vector<uint8_t> in_chain(fn.instrs.size(), 0);
+  std::vector<std::pair<uint32_t, bool>> terms, work; // Value, negated.
+  std::vector<Monomial> monomials;
+  std::vector<uint8_t> in_poly;
+  bool changed = false;
+  for (uint32_t b = 0; b < fn.blocks.size(); ++b) {
+    std::vector<uint32_t> roots(fn.blocks[b].code.rbegin(),
+                                fn.blocks[b].code.rend());
+    for (uint32_t root : roots) {
+      IrOp op = fn[root].op;
+      if ((op != IrOp::add && op != IrOp::sub) || in_chain[root]) {
+        continue;
+      }
+      terms.clear();
+      work.assign({{root, false}});
+      while (!work.empty()) {
+        auto [value, negated] = work.back();
+        work.pop_back();
+        const IrInstr &instr = fn[value];
+        bool sum = instr.op == IrOp::add || instr.op == IrOp::sub;
+        if (value != root && (!sum || instr.block != b || uses[value] != 1)) {
+          terms.emplace_back(value, negated);
+          continue;
+        }
+        in_chain[value] = 1;
+        work.emplace_back(fn.Operand(value, 1),
+                          instr.op == IrOp::sub ? !negated : negated);
+        work.emplace_back(fn.Operand(value, 0), negated);
+      }
+
+      // Pick the variable, and add up the coefficient of each power of it.
+      monomials.resize(terms.size());
+      in_poly.assign(terms.size(), 0);
+      uint32_t x = NO_VALUE;
+      uint32_t degree = 0;
+      for (size_t i = 0; i < terms.size(); ++i) {
+        in_poly[i] = MatchMonomial(fn, terms[i].first, monomials[i]);
+        if (in_poly[i] && monomials[i].degree > degree) {
+          x = monomials[i].variable;
+          degree = monomials[i].degree;
+        }
+      }
+      if (degree < 2) {
+        continue;
+      }
+      std::vector<double> coefficients(degree + 1, 0.0);
+      uint32_t muls_before = 0;
+      for (size_t i = 0; i < terms.size(); ++i) {
+        const Monomial &term = monomials[i];
+        in_poly[i] = in_poly[i] &&
+                     (term.variable == x || term.variable == NO_VALUE);
+        if (in_poly[i]) {
+          coefficients[term.degree] +=
+              terms[i].second ? -term.coefficient : term.coefficient;
+          muls_before += term.muls;
+        }
+      }
+      bool monic = coefficients[degree] == 1.0;
+      if (degree - monic >= muls_before) {
+        continue;
+      }
+
+      auto make = [&](IrOp op, std::initializer_list<uint32_t> args) {
+        return fn.InsertBefore(root, fn.Make(op, IrType::f64, args));
+      };
+      auto constant = [&](double k) {
+        uint32_t value = make(IrOp::constant, {});
+        fn[value].k = k;
+        return value;
+      };
+      uint32_t result =
+          monic ? x : make(IrOp::mul, {constant(coefficients[degree]), x});
+      for (uint32_t power = degree; power-- > 0;) {
+        if (coefficients[power] != 0.0) {
+          result = make(IrOp::add, {result, constant(coefficients[power])});
+        }
+        if (power > 0) {
+          result = make(IrOp::mul, {result, x});
+        }
+      }
+      for (size_t i = 0; i < terms.size(); ++i) {
+        if (!in_poly[i]) {
+          result = make(terms[i].second ? IrOp::sub : IrOp::add,
+                        {result, terms[i].first});
+        }
+      }
+      fn.ReplaceAllUses(root, result);
+      uses.resize(fn.instrs.size(), 0);
+      in_chain.resize(fn.instrs.size(), 0);
+      changed = true;
+    }
+  }
+  return changed;
+}
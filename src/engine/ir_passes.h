@@ -0,0 +1,336 @@
+#pragma once
+
+#include "bytecode_compiler.h"
+#include "ir.h"
+#include "ir_gvn.h"
+#include "ir_horner.h"
+#include "ir_reassociate.h"
+#include "pass_manager.h"
+#include "runtime.h"
+#include <cmath>
+
+// The standard cleanup passes over the IR. Each returns whether it changed
+// the function.
+
+/// FoldConstants - Compute what can be computed now: arithmetic on
+/// constants, conversions of constants, selects whose condition is known or
+/// whose arms are the same, phis that only ever take one value, and the
+/// identities x * 1, x - 0 and x + -0.0, which hold for every double. Folded
+/// instructions become constants in place; others are replaced by the value
+/// they always equal, and left for EliminateDeadCode.
+inline bool FoldConstants(IrFunction &fn) {
+  std::vector<uint32_t> replacement(fn.instrs.size(), NO_VALUE);
+  auto resolve = [&](uint32_t value) {
+    while (replacement[value] != NO_VALUE) {
+      value = replacement[value];
+    }
+    return value;
+  };
+  auto is_const = [&](uint32_t value, double k) {
+    return fn[value].op == IrOp::constant && fn[value].k == k &&
+           std::signbit(fn[value].k) == std::signbit(k);
+  };
+  bool changed = false;
+  IrCfg cfg(fn);
+  for (uint32_t block : cfg.rpo) {
+    for (uint32_t value : fn.blocks[block].code) {
+      IrInstr &instr = fn[value];
+      for (uint32_t i = 0; i < instr.count; ++i) {
+        fn.SetOperand(value, i, resolve(fn.Operand(value, i)));
+      }
+      uint32_t a = instr.count > 0 ? fn.Operand(value, 0) : NO_VALUE;
+      uint32_t b = instr.count > 1 ? fn.Operand(value, 1) : NO_VALUE;
+      bool constants = instr.count > 0;
+      for (uint32_t i = 0; i < instr.count; ++i) {
+        constants = constants && fn[fn.Operand(value, i)].op == IrOp::constant;
+      }
+      double k = 0.0;
+      uint32_t same = NO_VALUE;
+      switch (instr.op) {
+      case IrOp::add:
+      case IrOp::sub:
+      case IrOp::mul:
+      case IrOp::fma:
+      case IrOp::less:
+      case IrOp::to_f64:
+      case IrOp::to_i1:
+        if (!constants) {
+          break;
+        }
+        k = fn[a].k;
+        if (instr.op == IrOp::add) {
+          k += fn[b].k;
+        } else if (instr.op == IrOp::sub) {
+          k -= fn[b].k;
+        } else if (instr.op == IrOp::mul) {
+          k *= fn[b].k;
+        } else if (instr.op == IrOp::fma) {
+          k = std::fma(k, fn[b].k, fn[fn.Operand(value, 2)].k);
+        } else if (instr.op == IrOp::less) {
+          k = k < fn[b].k ? 1.0 : 0.0;
+        } else if (instr.op == IrOp::to_i1) {
+          k = IsTrue(k) ? 1.0 : 0.0;
+        }
+        instr.op = IrOp::constant;
+        instr.count = 0;
+        instr.k = k;
+        changed = true;
+        continue;
+      case IrOp::select:
+        if (fn[a].op == IrOp::constant) {
+          same = fn.Operand(value, IsTrue(fn[a].k) ? 1 : 2);
+        } else if (b == fn.Operand(value, 2)) {
+          same = b;
+        }
+        break;
+      case IrOp::phi:
+        same = TrivialPhiValue(fn, value);
+        break;
+      default:
+        break;
+      }
+      if (instr.op == IrOp::mul && is_const(b, 1.0)) {
+        same = a;
+      } else if (instr.op == IrOp::mul && is_const(a, 1.0)) {
+        same = b;
+      } else if (instr.op == IrOp::sub && is_const(b, 0.0)) {
+        same = a;
+      } else if (instr.op == IrOp::add && is_const(b, -0.0)) {
+        same = a;
+      } else if (instr.op == IrOp::to_i1 && fn[a].op == IrOp::to_f64) {
+        same = fn.Operand(a, 0);
+      }
+      if (same != NO_VALUE) {
+        replacement[value] = same;
+        changed = true;
+      }
+    }
+  }
+  // Phis on back edges name values that were only replaced later.
+  for (uint32_t &operand : fn.operands) {
+    operand = resolve(operand);
+  }
+  return changed;
+}
+
+/// RemoveEdge - Forget that from branches to to: drop from from its preds,
+/// and the matching operand from its phis.
+inline void RemoveEdge(IrFunction &fn, uint32_t from, uint32_t to) {
+  auto &preds = fn.blocks[to].preds;
+  auto it = std::find(preds.begin(), preds.end(), from);
+  uint32_t index = static_cast<uint32_t>(it - preds.begin());
+  preds.erase(it);
+  for (uint32_t value : fn.blocks[to].code) {
+    IrInstr &instr = fn[value];
+    if (instr.op != IrOp::phi) {
+      break;
+    }
+    auto first = fn.operands.begin() + instr.first;
+    std::copy(first + index + 1, first + instr.count, first + index);
+    --instr.count;
+  }
+}
+
+/// SimplifyCfg - Turn conditional branches whose condition is known into
+/// plain ones, delete the blocks that can no longer be reached, and merge
+/// each block into its predecessor when it is that block's only successor
+/// and has no other predecessor.
+inline bool SimplifyCfg(IrFunction &fn) {
+  bool changed = false;
+  for (uint32_t b = 0; b < fn.blocks.size(); ++b) {
+    uint32_t value = fn.blocks[b].code.back();
+    IrInstr &term = fn[value];
+    if (term.op != IrOp::cond_br) {
+      continue;
+    }
+    const IrInstr &cond = fn[fn.Operand(value, 0)];
+    if (cond.op != IrOp::constant && term.index != term.index2) {
+      continue;
+    }
+    uint32_t target = term.index;
+    uint32_t other = term.index2;
+    if (cond.op == IrOp::constant && !IsTrue(cond.k)) {
+      std::swap(target, other);
+    }
+    RemoveEdge(fn, b, other);
+    term.op = IrOp::br;
+    term.count = 0;
+    term.index = target;
+    changed = true;
+  }
+
+  // Removed blocks are left empty until the blocks are renumbered.
+  IrCfg cfg(fn);
+  for (uint32_t b = 1; b < fn.blocks.size(); ++b) {
+    if (cfg.IsReachable(b) || fn.blocks[b].code.empty()) {
+      continue;
+    }
+    for (uint32_t succ : fn.Successors(b)) {
+      RemoveEdge(fn, b, succ);
+    }
+    fn.blocks[b].code.clear();
+    changed = true;
+  }
+  for (uint32_t b = 1; b < fn.blocks.size(); ++b) {
+    if (!cfg.IsReachable(b)) {
+      fn.blocks[b].preds.clear();
+    }
+  }
+
+  for (uint32_t b : cfg.rpo) {
+    // A block already merged into its predecessor is empty.
+    while (!fn.blocks[b].code.empty() && fn.Terminator(b).op == IrOp::br) {
+      uint32_t succ = fn.Terminator(b).index;
+      IrBlock &next = fn.blocks[succ];
+      if (succ == b || succ == 0 || next.preds.size() != 1) {
+        break;
+      }
+      auto &code = fn.blocks[b].code;
+      code.pop_back();
+      for (uint32_t value : next.code) {
+        if (fn[value].op == IrOp::phi) {
+          fn.ReplaceAllUses(value, fn.Operand(value, 0));
+        } else {
+          fn[value].block = b;
+          code.push_back(value);
+        }
+      }
+      for (uint32_t after : fn.Successors(succ)) {
+        auto &preds = fn.blocks[after].preds;
+        std::replace(preds.begin(), preds.end(), succ, b);
+      }
+      next.code.clear();
+      next.preds.clear();
+      changed = true;
+    }
+  }
+
+  // Renumber the blocks that are left, keeping their order.
+  std::vector<uint32_t> renumbered(fn.blocks.size(), NO_VALUE);
+  uint32_t kept = 0;
+  for (uint32_t b = 0; b < fn.blocks.size(); ++b) {
+    if (!fn.blocks[b].code.empty()) {
+      renumbered[b] = kept;
+      if (kept != b) {
+        fn.blocks[kept] = std::move(fn.blocks[b]);
+      }
+      ++kept;
+    }
+  }
+  fn.blocks.resize(kept);
+  for (uint32_t b = 0; b < kept; ++b) {
+    IrBlock &block = fn.blocks[b];
+    for (uint32_t &pred : block.preds) {
+      pred = renumbered[pred];
+    }
+    for (uint32_t value : block.code) {
+      fn[value].block = b;
+    }
+    IrInstr &term = fn[block.code.back()];
+    if (term.op == IrOp::br || term.op == IrOp::cond_br) {
+      term.index = renumbered[term.index];
+    }
+    if (term.op == IrOp::cond_br) {
+      term.index2 = renumbered[term.index2];
+    }
+  }
+  return changed;
+}
+
+/// EliminateDeadCode - Remove the instructions nothing needs: those without
+/// effects whose values no instruction that is needed uses.
+inline bool EliminateDeadCode(IrFunction &fn) {
+  std::vector<uint8_t> live(fn.instrs.size(), 0);
+  std::vector<uint32_t> work;
+  for (const IrBlock &block : fn.blocks) {
+    for (uint32_t value : block.code) {
+      if (HasEffects(fn[value].op)) {
+        live[value] = 1;
+        work.push_back(value);
+      }
+    }
+  }
+  while (!work.empty()) {
+    uint32_t value = work.back();
+    work.pop_back();
+    for (uint32_t i = 0; i < fn[value].count; ++i) {
+      uint32_t operand = fn.Operand(value, i);
+      if (!live[operand]) {
+        live[operand] = 1;
+        work.push_back(operand);
+      }
+    }
+  }
+  bool changed = false;
+  for (IrBlock &block : fn.blocks) {
+    auto dead = std::remove_if(block.code.begin(), block.code.end(),
+                               [&](uint32_t value) { return !live[value]; });
+    changed = changed || dead != block.code.end();
+    block.code.erase(dead, block.code.end());
+  }
+  return changed;
+}
+
+/// ContractMulAdd - Turn each a * b + c whose product nothing else uses into
+/// one fma, which rounds once where the two round twice, and remove the
+/// product. Uses are counted as they stand, so this runs after
+/// EliminateDeadCode.
+inline bool ContractMulAdd(IrFunction &fn) {
+  std::vector<uint32_t> uses = fn.CountUses();
+  std::vector<uint8_t> contracted(fn.instrs.size(), 0);
+  bool changed = false;
+  for (const IrBlock &block : fn.blocks) {
+    for (uint32_t value : block.code) {
+      if (fn[value].op != IrOp::add) {
+        continue;
+      }
+      for (uint32_t i = 0; i < 2; ++i) {
+        uint32_t product = fn.Operand(value, i);
+        if (fn[product].op != IrOp::mul || uses[product] != 1) {
+          continue;
+        }
+        uint32_t args[] = {fn.Operand(product, 0), fn.Operand(product, 1),
+                           fn.Operand(value, 1 - i)};
+        fn[value].op = IrOp::fma;
+        fn[value].first = static_cast<uint32_t>(fn.operands.size());
+        fn[value].count = 3;
+        fn.operands.insert(fn.operands.end(), args, args + 3);
+        contracted[product] = 1;
+        changed = true;
+        break;
+      }
+    }
+  }
+  for (IrBlock &block : fn.blocks) {
+    block.code.erase(std::remove_if(block.code.begin(), block.code.end(),
+                                    [&](uint32_t value) {
+                                      return contracted[value] != 0;
+                                    }),
+                     block.code.end());
+  }
+  return changed;
+}
+
+/// AddStandardPasses - The passes every function goes through. options is
+/// read each time they run, is_pure says which callees value numbering may
+/// treat as pure, and merged gets those whose calls it did merge.
+inline void AddStandardPasses(PassManager &passes,
+                              const BytecodeOptions &options,
+                              CallPurity is_pure,
+                              std::vector<std::string_view> &merged) {
+  passes.Add("reassociate", [&options](IrFunction &fn) {
+    return options.fast_math && !options.strict_fp && Reassociate(fn);
+  });
+  passes.Add("horner", [&options](IrFunction &fn) {
+    return !options.strict_fp && RewriteHorner(fn);
+  });
+  passes.Add("fold", FoldConstants);
+  passes.Add("simplify-cfg", SimplifyCfg);
+  passes.Add("gvn", [is_pure = std::move(is_pure), &merged](IrFunction &fn) {
+    return NumberValues(fn, is_pure, merged);
+  });
+  passes.Add("dce", EliminateDeadCode);
+  passes.Add("contract", [&options](IrFunction &fn) {
+    return options.fma && !options.strict_fp && ContractMulAdd(fn);
+  });
+}
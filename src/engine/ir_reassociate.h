@@ -0,0 +1,92 @@
+#pragma once
+
+#include "ir.h"
+#include <algorithm>
+
+/// Reassociate - Rebalance each chain of adds, and each chain of muls, into
+/// a tree of the least height.
+///
+/// The parser leans every chain to the left, so a sum of n terms is n - 1
+/// adds that each wait for the one before. A chain is an add or mul together
+/// with the operands of the same op, in the same block, that it alone uses,
+/// and so on down; what is left are its terms. They are combined two at a
+/// time, oldest first, and each sum joins the back of the line, so the tree
+/// is ceil(log2 n) deep and the terms computed first are added first. The
+/// instructions of the chain are reused for the new tree, which is put just
+/// before the last of them.
+///
+/// Terms are put in order first: constants, then the rest by value, so the
+/// constants of a chain meet and fold, and chains that only differ in the
+/// order of their terms are numbered as one. This changes how the result is
+/// rounded, and is only for --fast-math.
+inline bool Reassociate(IrFunction &fn) {
+  std::vector<uint32_t> uses = fn.CountUses();
+  std::vector<uint32_t> chain(fn.instrs.size(), NO_VALUE); // Its root.
+  std::vector<uint32_t> terms, nodes, work, before;
+  bool changed = false;
+  for (uint32_t b = 0; b < fn.blocks.size(); ++b) {
+    // A chain is found from its last instruction, which comes after the
+    // rest of it.
+    std::vector<uint32_t> roots(fn.blocks[b].code.rbegin(),
+                                fn.blocks[b].code.rend());
+    for (uint32_t root : roots) {
+      IrOp op = fn[root].op;
+      if ((op != IrOp::add && op != IrOp::mul) || chain[root] != NO_VALUE) {
+        continue;
+      }
+      terms.clear();
+      nodes.clear();
+      work.assign({fn.Operand(root, 1), fn.Operand(root, 0)});
+      while (!work.empty()) {
+        uint32_t value = work.back();
+        work.pop_back();
+        if (fn[value].op != op || fn[value].block != b || uses[value] != 1) {
+          terms.push_back(value);
+          continue;
+        }
+        chain[value] = root;
+        nodes.push_back(value);
+        work.push_back(fn.Operand(value, 1));
+        work.push_back(fn.Operand(value, 0));
+      }
+      if (terms.size() < 3) {
+        continue;
+      }
+      nodes.push_back(root);
+      before.clear();
+      for (uint32_t node : nodes) {
+        before.push_back(fn.Operand(node, 0));
+        before.push_back(fn.Operand(node, 1));
+      }
+
+      std::sort(terms.begin(), terms.end(), [&](uint32_t x, uint32_t y) {
+        bool x_const = fn[x].op == IrOp::constant;
+        bool y_const = fn[y].op == IrOp::constant;
+        return x_const != y_const ? x_const : x < y;
+      });
+      // terms is the line; sums join its back. The root is made last.
+      std::vector<uint32_t> order;
+      for (size_t head = 0, next = 0; terms.size() - head > 1; head += 2) {
+        uint32_t node = terms.size() - head == 2 ? root : nodes[next++];
+        fn.SetOperand(node, 0, terms[head]);
+        fn.SetOperand(node, 1, terms[head + 1]);
+        terms.push_back(node);
+        order.push_back(node);
+      }
+      for (size_t i = 0; i < nodes.size(); ++i) {
+        changed = changed || fn.Operand(nodes[i], 0) != before[2 * i] ||
+                  fn.Operand(nodes[i], 1) != before[2 * i + 1];
+      }
+
+      auto &code = fn.blocks[b].code;
+      code.erase(std::remove_if(code.begin(), code.end(),
+                                [&](uint32_t value) {
+                                  return value != root && chain[value] == root;
+                                }),
+                 code.end());
+      code.insert(std::find(code.begin(), code.end(), root), order.begin(),
+                  order.end() - 1);
+    }
+  }
+  return changed;
+}
@@ -0,0 +1,346 @@
+#pragma once
+
+#include "engine.h"
+#include "parser.h"
+#include "visitor.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+/// Library - A file of definitions and externs that is loaded into an engine
+/// and can be reloaded whenever the file changes.
+///
+/// A reload does not start over. Every definition is found by skipping over
+/// its tokens, not parsing them, and is identified by a hash of those tokens
+/// in the same canonical form the compile cache uses, so moving a definition
+/// or editing a comment changes nothing. Only definitions whose tokens
+/// changed are parsed and handed to the engine again. The library also keeps
+/// the call graph of the definitions it loaded, built from the callee of
+/// every CallExprAST, and recompiles any caller whose compiled code copied in
+/// a changed callee (see Engine::GetInlinedCallees). Other callers keep their
+/// code: calls go through the engine's function table, so they reach the new
+/// definition without being touched.
+///
+/// Externs are cheap and are declared again on every load. A definition
+/// that is removed from the file stays defined. A file that does not parse is
+/// not loaded at all, which leaves the engine as it was.
+class Library {
+private:
+  /// Definition - What was loaded for one name.
+  struct Definition {
+    std::string canonical;
+    uint64_t hash = 0;
+    std::vector<std::string_view> callees;
+  };
+
+  /// Item - A definition or extern in the file, tokens [begin, end).
+  struct Item {
+    bool is_extern;
+    std::string_view name;
+    size_t begin;
+    size_t end;
+    // Definitions only: whether the tokens differ from what was loaded
+    // before, and if so their canonical form.
+    bool changed = false;
+    std::string canonical;
+    uint64_t hash = 0;
+  };
+
+  /// CalleeCollector - Gathers the names a body calls.
+  class CalleeCollector : public ExprVisitor<CalleeCollector> {
+  public:
+    std::vector<std::string_view> callees;
+
+    void VisitNumber(const NumberExprAST &) {}
+    void VisitVariable(const VariableExprAST &) {}
+    void VisitAssign(const AssignExprAST &expr) { Visit(expr.GetValue()); }
+
+    void VisitBinary(const BinaryExprAST &expr) {
+      Visit(expr.GetLHS());
+      Visit(expr.GetRHS());
+    }
+
+    void VisitCall(const CallExprAST &expr) {
+      callees.push_back(expr.GetCallee());
+      for (const auto &arg : expr.GetArgs()) {
+        Visit(*arg);
+      }
+    }
+
+    void VisitVar(const VarExprAST &expr) {
+      for (const auto &binding : expr.GetVars()) {
+        Visit(*binding.second);
+      }
+      Visit(expr.GetBody());
+    }
+
+    void VisitIf(const IfExprAST &expr) {
+      Visit(expr.GetCond());
+      Visit(expr.GetThen());
+      Visit(expr.GetElse());
+    }
+
+    void VisitFor(const ForExprAST &expr) {
+      for (const auto &var : expr.GetVars()) {
+        Visit(*var.start);
+        Visit(*var.step);
+      }
+      Visit(expr.GetEnd());
+      Visit(expr.GetBody());
+    }
+  };
+
+  std::string path;
+  std::filesystem::file_time_type loaded_time;
+  const SourceBuffer *loaded_text = nullptr;
+  // Tokens of the text loaded last. Earlier texts stay in SOURCES, so names
+  // and error locations in code that was not recompiled remain valid.
+  TokenBuffer tokens;
+  std::unordered_map<std::string_view, Definition> definitions;
+  // The call graph backwards: for each name, the definitions that call it.
+  std::unordered_map<std::string_view, std::vector<std::string_view>> callers;
+
+  /// SetCallees - Replace the callees of definition name, keeping callers in
+  /// step.
+  void SetCallees(std::string_view name, Definition &definition,
+                  std::vector<std::string_view> callees) {
+    for (std::string_view callee : definition.callees) {
+      std::vector<std::string_view> &list = callers[callee];
+      list.erase(std::find(list.begin(), list.end(), name));
+    }
+    for (std::string_view callee : callees) {
+      callers[callee].push_back(name);
+    }
+    definition.callees = std::move(callees);
+  }
+
+  /// Forget - Drop definition name, and its calls from the call graph.
+  void Forget(std::string_view name) {
+    auto it = definitions.find(name);
+    if (it != definitions.end()) {
+      SetCallees(name, it->second, {});
+      definitions.erase(it);
+    }
+  }
+
+  /// Scan - Find every item in tokens and compare each definition with the
+  /// one loaded before. On a syntax error, parse from there to report it and
+  /// return false.
+  bool Scan(std::vector<Item> &items) {
+    uint64_t grammar_hash = GrammarHash();
+    uint64_t seed = HashBytes(&grammar_hash, sizeof(grammar_hash));
+    std::string canonical;
+    for (size_t pos = 0;;) {
+      int kind = tokens.GetKind(pos);
+      if (kind == Token::token_eof) {
+        return true;
+      }
+      if (kind == ';') {
+        ++pos;
+        continue;
+      }
+      if (kind != Token::token_def && kind != Token::token_extern) {
+        ReportError(tokens.GetLoc(pos),
+                    "Expected 'def' or 'extern' in a library");
+        return false;
+      }
+      bool is_extern = kind == Token::token_extern;
+      TokenSkipper skipper(tokens, is_extern ? pos + 1 : pos, BinopPrecedence);
+      if (!(is_extern ? skipper.SkipPrototype() : skipper.SkipDefinition())) {
+        SkipToToken(pos);
+        if (is_extern) {
+          ParseExtern();
+        } else {
+          ParseDefinition();
+        }
+        return false;
+      }
+      Item item{is_extern, tokens.GetText(pos + 1), pos, skipper.GetPos(),
+                false, {}, 0};
+      int name_kind = tokens.GetKind(pos + 1);
+      if (name_kind == Token::token_unary ||
+          name_kind == Token::token_binary) {
+        // Skipping checked the prototype, so this parse succeeds. A binary
+        // operator changes how the items after it parse and hash.
+        SkipToToken(pos + 1);
+        auto proto = ParsePrototype();
+        item.name = proto->GetName();
+        if (!is_extern) {
+          InstallOperator(*proto);
+          grammar_hash = GrammarHash();
+          seed = HashBytes(&grammar_hash, sizeof(grammar_hash));
+        }
+      }
+      if (!is_extern) {
+        canonical.clear();
+        tokens.AppendCanonical(item.begin, item.end, canonical);
+        item.hash = HashBytes(canonical.data(), canonical.size(), seed);
+        auto it = definitions.find(item.name);
+        item.changed = it == definitions.end() ||
+                       it->second.hash != item.hash ||
+                       it->second.canonical != canonical;
+        if (item.changed) {
+          item.canonical = canonical;
+        }
+      }
+      pos = item.end;
+      items.push_back(std::move(item));
+    }
+  }
+
+  /// Apply - Hand the engine the externs and the definitions that need
+  /// compiling, and print what changed. Returns false if any failed.
+  bool Apply(Engine &engine, std::vector<Item> &items) {
+    // The last definition of a name is the one that counts.
+    std::unordered_map<std::string_view, size_t> last;
+    for (size_t i = 0; i < items.size(); ++i) {
+      if (!items[i].is_extern) {
+        last[items[i].name] = i;
+      }
+    }
+    std::unordered_set<std::string_view> recompile;
+    for (const auto &[name, index] : last) {
+      if (items[index].changed) {
+        recompile.insert(name);
+      }
+    }
+    size_t changed = recompile.size();
+
+    // Follow the call graph backwards from each changed function to the
+    // callers that copied its body.
+    std::vector<std::string_view> work(recompile.begin(), recompile.end());
+    std::vector<std::string_view> inlined;
+    while (!work.empty()) {
+      std::string_view callee = work.back();
+      work.pop_back();
+      auto found = callers.find(callee);
+      if (found == callers.end()) {
+        continue;
+      }
+      for (std::string_view caller : found->second) {
+        if (recompile.count(caller) || !last.count(caller)) {
+          continue;
+        }
+        inlined.clear();
+        engine.GetInlinedCallees(caller, inlined);
+        if (std::find(inlined.begin(), inlined.end(), callee) !=
+            inlined.end()) {
+          recompile.insert(caller);
+          work.push_back(caller);
+        }
+      }
+    }
+
+    bool ok = true;
+    for (size_t i = 0; i < items.size(); ++i) {
+      Item &item = items[i];
+      if (!item.is_extern &&
+          (last[item.name] != i || !recompile.count(item.name))) {
+        continue;
+      }
+      SkipToToken(item.begin);
+      if (item.is_extern) {
+        auto proto = ParseExtern();
+        ok &= proto && engine.AddExtern(std::move(proto));
+        continue;
+      }
+      // Scan checked that it parses.
+      auto fn = ParseDefinition();
+      CalleeCollector collector;
+      collector.Visit(fn->GetBody());
+      std::vector<std::string_view> &callees = collector.callees;
+      std::sort(callees.begin(), callees.end());
+      callees.erase(std::unique(callees.begin(), callees.end()),
+                    callees.end());
+      if (engine.AddFunction(std::move(fn))) {
+        Definition &definition = definitions[item.name];
+        if (item.changed) {
+          definition.canonical = std::move(item.canonical);
+          definition.hash = item.hash;
+        }
+        SetCallees(item.name, definition, std::move(callees));
+      } else {
+        // Try again on the next load, whether or not the text changes.
+        Forget(item.name);
+        ok = false;
+      }
+    }
+
+    std::vector<std::string_view> removed;
+    for (const auto &entry : definitions) {
+      if (!last.count(entry.first)) {
+        removed.push_back(entry.first);
+      }
+    }
+    for (std::string_view name : removed) {
+      Forget(name);
+    }
+    fprintf(stderr,
+            "Loaded %s: %zu changed, %zu dependent, %zu unchanged, %zu "
+            "removed",
+            path.c_str(), changed, recompile.size() - changed,
+            last.size() - recompile.size(), removed.size());
+    return ok;
+  }
+
+public:
+  explicit Library(std::string path) : path(std::move(path)) {}
+
+  const std::string &GetPath() const { return path; }
+
+  /// Load - Read the file and bring engine up to date with it.
+  bool Load(Engine &engine) {
+    auto start = std::chrono::steady_clock::now();
+    std::error_code error;
+    loaded_time = std::filesystem::last_write_time(path, error);
+    FILE *file = fopen(path.c_str(), "rb");
+    if (!file) {
+      fprintf(stderr, "Error: cannot open '%s'\n", path.c_str());
+      return false;
+    }
+    std::string text;
+    ReadAll(file, text);
+    fclose(file);
+    if (loaded_text && loaded_text->text == text) {
+      return true;
+    }
+    loaded_text = &SOURCES.AddBuffer(path, std::move(text));
+    LexBuffer(*loaded_text, tokens);
+
+    // Parse the library's tokens, with whole bodies, and then go back to
+    // whatever the driver was parsing.
+    ParserState saved = SaveParserState();
+    bool lazy_bodies = LAZY_BODIES;
+    LAZY_BODIES = false;
+    UsePrelexedTokens(&tokens);
+    std::vector<Item> items;
+    bool ok = Scan(items);
+    if (ok) {
+      ok = Apply(engine, items);
+      std::chrono::duration<double> elapsed =
+          std::chrono::steady_clock::now() - start;
+      fprintf(stderr, " in %.3f ms\n", elapsed.count() * 1e3);
+    }
+    LAZY_BODIES = lazy_bodies;
+    RestoreParserState(saved);
+    return ok;
+  }
+
+  /// ReloadIfChanged - Load the file again if it was modified since the last
+  /// load. A file that cannot be read right now, such as one an editor is
+  /// replacing, is left for the next call.
+  bool ReloadIfChanged(Engine &engine) {
+    std::error_code error;
+    auto time = std::filesystem::last_write_time(path, error);
+    if (error || time == loaded_time) {
+      return true;
+    }
+    return Load(engine);
+  }
+};
@@ -0,0 +1,574 @@
+#pragma once
+
+#include "assigned.h"
+#include "visitor.h"
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+/// LoopOptions - Knobs for the LoopOptimizer.
+struct LoopOptions {
+  bool enabled = true;
+};
+
+/// LoopOptimizer - Rewrites the for loops of a body before an engine compiles
+/// it:
+///
+///   - Loop-invariant code motion. A subexpression that makes no calls, runs
+///     no loop, assigns nothing and reads no name the loop binds or assigns
+///     has the same value on every iteration, so it is computed once, by a
+///     var around the outermost loop that holds for. A loop runs its body,
+///     end and step at least once, so nothing is computed that the loop
+///     would not have computed anyway; code in the arms of an if stays in the
+///     loops around the if.
+///   - Strength reduction. In a loop with a known trip count, i*c for a
+///     positive integer c becomes an induction variable of its own, which
+///     steps by step*c. Every value involved is an integer below 2^53, so
+///     this is exact. Stepping the new variable costs about as much as the
+///     multiply it saves, so products used fewer than SR_MIN_USES times are
+///     left alone.
+///   - Unrolling. A loop with a known trip count and a small body runs the
+///     body several times for every evaluation of end.
+///
+/// The trip count is known when start and step are numbers, end is i < K or
+/// K < i for a number K, and nothing assigns i. The optimizer then steps i
+/// the way the engines will, for up to TRIP_LIMIT iterations.
+///
+/// The variables it creates are named ".N", which neither the source nor the
+/// Inliner can produce.
+class LoopOptimizer {
+public:
+  static constexpr uint64_t TRIP_LIMIT = 1 << 16;
+  static constexpr int SR_MIN_USES = 2;
+  static constexpr uint32_t UNROLL_MAX = 8;
+  static constexpr int UNROLL_BUDGET = 64; // Nodes in the unrolled body.
+
+private:
+  LoopOptions options;
+  std::unordered_set<std::string> names; // Backs the names of new variables.
+
+  /// Shape - Counts the nodes and the loops in an expression.
+  class Shape : public ExprVisitor<Shape> {
+  public:
+    int nodes = 0;
+    int loops = 0;
+
+    void VisitNumber(const NumberExprAST &) { ++nodes; }
+    void VisitVariable(const VariableExprAST &) { ++nodes; }
+
+    void VisitAssign(const AssignExprAST &expr) {
+      ++nodes;
+      Visit(expr.GetValue());
+    }
+
+    void VisitBinary(const BinaryExprAST &expr) {
+      ++nodes;
+      Visit(expr.GetLHS());
+      Visit(expr.GetRHS());
+    }
+
+    void VisitCall(const CallExprAST &expr) {
+      ++nodes;
+      for (const auto &arg : expr.GetArgs()) {
+        Visit(*arg);
+      }
+    }
+
+    void VisitVar(const VarExprAST &expr) {
+      ++nodes;
+      for (const auto &binding : expr.GetVars()) {
+        Visit(*binding.second);
+      }
+      Visit(expr.GetBody());
+    }
+
+    void VisitIf(const IfExprAST &expr) {
+      ++nodes;
+      Visit(expr.GetCond());
+      Visit(expr.GetThen());
+      Visit(expr.GetElse());
+    }
+
+    void VisitFor(const ForExprAST &expr) {
+      ++nodes;
+      ++loops;
+      for (const auto &var : expr.GetVars()) {
+        Visit(*var.start);
+        Visit(*var.step);
+      }
+      Visit(expr.GetEnd());
+      Visit(expr.GetBody());
+    }
+  };
+
+  /// Uses - The names an expression reads from outside itself, and whether
+  /// it is pure: whether it makes no calls, runs no loops and assigns
+  /// nothing.
+  class Uses : public ExprVisitor<Uses> {
+  private:
+    std::vector<std::string_view> bound;
+
+  public:
+    std::vector<std::string_view> names;
+    bool pure = true;
+
+    void VisitNumber(const NumberExprAST &) {}
+
+    void VisitVariable(const VariableExprAST &expr) {
+      std::string_view name = expr.GetName();
+      if (std::find(bound.begin(), bound.end(), name) == bound.end() &&
+          std::find(names.begin(), names.end(), name) == names.end()) {
+        names.push_back(name);
+      }
+    }
+
+    void VisitBinary(const BinaryExprAST &expr) {
+      Visit(expr.GetLHS());
+      Visit(expr.GetRHS());
+    }
+
+    void VisitAssign(const AssignExprAST &expr) {
+      pure = false;
+      Visit(expr.GetValue());
+    }
+
+    void VisitCall(const CallExprAST &expr) {
+      pure = false;
+      for (const auto &arg : expr.GetArgs()) {
+        Visit(*arg);
+      }
+    }
+
+    void VisitVar(const VarExprAST &expr) {
+      for (const auto &[name, init] : expr.GetVars()) {
+        Visit(*init);
+        bound.push_back(name);
+      }
+      Visit(expr.GetBody());
+      bound.resize(bound.size() - expr.GetVars().size());
+    }
+
+    void VisitIf(const IfExprAST &expr) {
+      Visit(expr.GetCond());
+      Visit(expr.GetThen());
+      Visit(expr.GetElse());
+    }
+
+    void VisitFor(const ForExprAST &expr) {
+      pure = false;
+      for (const auto &var : expr.GetVars()) {
+        Visit(*var.start);
+      }
+      for (const auto &var : expr.GetVars()) {
+        bound.push_back(var.name);
+      }
+      for (const auto &var : expr.GetVars()) {
+        Visit(*var.step);
+      }
+      Visit(expr.GetEnd());
+      Visit(expr.GetBody());
+      bound.resize(bound.size() - expr.GetVars().size());
+    }
+  };
+
+  /// Products - Counts the uses of i*c and c*i, for numbers c, where i is
+  /// the variable of the loop being looked at rather than a name that
+  /// shadows it.
+  class Products : public ExprVisitor<Products> {
+  private:
+    std::string_view iv;
+    int shadowed = 0;
+
+  public:
+    std::vector<std::pair<double, int>> counts;
+
+    explicit Products(std::string_view iv) : iv(iv) {}
+
+    void VisitNumber(const NumberExprAST &) {}
+    void VisitVariable(const VariableExprAST &) {}
+    void VisitAssign(const AssignExprAST &expr) { Visit(expr.GetValue()); }
+
+    void VisitBinary(const BinaryExprAST &expr) {
+      double c;
+      if (!shadowed && IsProduct(expr, iv, c)) {
+        auto it = std::find_if(
+            counts.begin(), counts.end(),
+            [c](const auto &entry) { return entry.first == c; });
+        if (it == counts.end()) {
+          counts.emplace_back(c, 1);
+        } else {
+          ++it->second;
+        }
+        return;
+      }
+      Visit(expr.GetLHS());
+      Visit(expr.GetRHS());
+    }
+
+    void VisitCall(const CallExprAST &expr) {
+      for (const auto &arg : expr.GetArgs()) {
+        Visit(*arg);
+      }
+    }
+
+    void VisitVar(const VarExprAST &expr) {
+      int saved = shadowed;
+      for (const auto &[name, init] : expr.GetVars()) {
+        Visit(*init);
+        shadowed += name == iv;
+      }
+      Visit(expr.GetBody());
+      shadowed = saved;
+    }
+
+    void VisitIf(const IfExprAST &expr) {
+      Visit(expr.GetCond());
+      Visit(expr.GetThen());
+      Visit(expr.GetElse());
+    }
+
+    void VisitFor(const ForExprAST &expr) {
+      int saved = shadowed;
+      for (const auto &var : expr.GetVars()) {
+        Visit(*var.start);
+      }
+      for (const auto &var : expr.GetVars()) {
+        shadowed += var.name == iv;
+      }
+      for (const auto &var : expr.GetVars()) {
+        Visit(*var.step);
+      }
+      Visit(expr.GetEnd());
+      Visit(expr.GetBody());
+      shadowed = saved;
+    }
+  };
+
+  /// Rewriter - Copies a body, optimizing each loop on the way.
+  class Rewriter : public ExprVisitor<Rewriter, std::unique_ptr<ExprAST>> {
+  private:
+    /// Loop - A loop being copied.
+    struct Loop {
+      size_t scope_base; // Where the names the loop binds start in scope.
+      // Names assigned anywhere in the loop, its starts included, since
+      // hoisted code runs before them.
+      AssignedNames assigned;
+      // Invariants computed before the loop.
+      std::vector<VarExprAST::Binding> hoisted;
+      // Strength-reduced products of the loop's own variable: c, and the
+      // induction variable that holds i*c.
+      std::vector<std::pair<double, std::string_view>> products;
+    };
+
+    LoopOptimizer &optimizer;
+    // Names bound around the node being copied, innermost last, and for
+    // each the loop whose own variable it is, or -1.
+    std::vector<std::string_view> scope;
+    std::vector<int> owners;
+    // Enclosing loops, outermost first. Only the first active may take
+    // hoisted code: while an invariant is copied out of a loop, that loop
+    // and the ones inside it are not around it any more.
+    std::vector<Loop> loops;
+    size_t active = 0;
+    // The first loop that code may be hoisted to. The arms of an if may not
+    // run at all, so nothing in them is hoisted out of loops around the if.
+    size_t hoist_floor = 0;
+    unsigned next_name = 0;
+
+    std::string_view Fresh() {
+      return *optimizer.names.insert("." + std::to_string(++next_name)).first;
+    }
+
+    /// Hoist - If expr is invariant in an active loop, copy it into a var
+    /// around the outermost such loop and return a reference to that var.
+    std::unique_ptr<ExprAST> Hoist(const ExprAST &expr) {
+      if (active == 0) {
+        return nullptr;
+      }
+      Uses uses;
+      uses.Visit(expr);
+      // Without names it is a constant, which engines fold.
+      if (!uses.pure || uses.names.empty()) {
+        return nullptr;
+      }
+      for (size_t k = hoist_floor; k < active; ++k) {
+        auto bound_in_loop = [&](std::string_view name) {
+          return std::find(scope.begin() + loops[k].scope_base, scope.end(),
+                           name) != scope.end() ||
+                 loops[k].assigned.Contains(name);
+        };
+        if (std::none_of(uses.names.begin(), uses.names.end(),
+                         bound_in_loop)) {
+          size_t saved = active;
+          active = k;
+          std::unique_ptr<ExprAST> value = Visit(expr);
+          active = saved;
+          std::string_view name = Fresh();
+          loops[k].hoisted.emplace_back(name, std::move(value));
+          return std::make_unique<VariableExprAST>(expr.GetLoc(), name);
+        }
+      }
+      return nullptr;
+    }
+
+    /// Reduced - The induction variable that holds expr, if it is a
+    /// strength-reduced product, or an empty name.
+    std::string_view Reduced(const BinaryExprAST &expr) {
+      for (size_t k = 0; k < loops.size(); ++k) {
+        size_t base = loops[k].scope_base;
+        double c;
+        if (loops[k].products.empty() ||
+            !IsProduct(expr, scope[base], c)) {
+          continue;
+        }
+        // The name must refer to loop k's variable, not one shadowing it.
+        auto inner = std::find(scope.rbegin(), scope.rend(), scope[base]);
+        if (owners[scope.rend() - inner - 1] != static_cast<int>(k)) {
+          continue;
+        }
+        for (const auto &[factor, name] : loops[k].products) {
+          if (factor == c) {
+            return name;
+          }
+        }
+      }
+      return {};
+    }
+
+    /// Reduce - Pick the products of loop's variable to strength-reduce,
+    /// given that the loop runs trip times and leaves its variable at last,
+    /// and add an induction variable to vars for each.
+    void Reduce(const ForExprAST &loop, double last,
+                std::vector<ForExprAST::Induction> &vars, Loop &info) {
+      const auto &own = loop.GetVars()[0];
+      double start = static_cast<const NumberExprAST &>(*own.start).GetVal();
+      double step = static_cast<const NumberExprAST &>(*own.step).GetVal();
+      double reach = std::max(std::fabs(start), std::fabs(last));
+      auto integral = [](double x) { return std::floor(x) == x; };
+      if (!integral(start) || !integral(step) || std::signbit(start) ||
+          reach >= 0x1p53) {
+        return;
+      }
+      Products products(own.name);
+      products.Visit(loop.GetEnd());
+      products.Visit(loop.GetBody());
+      for (const auto &[c, uses] : products.counts) {
+        // With c > 0, i*c and the stepped variable agree on the sign of
+        // zero as well.
+        if (uses < SR_MIN_USES || !integral(c) || c <= 0 ||
+            reach * c >= 0x1p53) {
+          continue;
+        }
+        std::string_view name = Fresh();
+        info.products.emplace_back(c, name);
+        vars.push_back(
+            {name, std::make_unique<NumberExprAST>(loop.GetLoc(), start * c),
+             std::make_unique<NumberExprAST>(loop.GetLoc(), step * c)});
+      }
+    }
+
+  public:
+    explicit Rewriter(LoopOptimizer &optimizer) : optimizer(optimizer) {}
+
+    std::unique_ptr<ExprAST> VisitNumber(const NumberExprAST &expr) {
+      return std::make_unique<NumberExprAST>(expr.GetLoc(), expr.GetVal());
+    }
+
+    std::unique_ptr<ExprAST> VisitVariable(const VariableExprAST &expr) {
+      return std::make_unique<VariableExprAST>(expr.GetLoc(), expr.GetName());
+    }
+
+    std::unique_ptr<ExprAST> VisitBinary(const BinaryExprAST &expr) {
+      if (auto hoisted = Hoist(expr)) {
+        return hoisted;
+      }
+      std::string_view reduced = Reduced(expr);
+      if (!reduced.empty()) {
+        return std::make_unique<VariableExprAST>(expr.GetLoc(), reduced);
+      }
+      auto lhs = Visit(expr.GetLHS());
+      return std::make_unique<BinaryExprAST>(expr.GetLoc(), expr.GetOp(),
+                                             std::move(lhs),
+                                             Visit(expr.GetRHS()));
+    }
+
+    std::unique_ptr<ExprAST> VisitAssign(const AssignExprAST &expr) {
+      return std::make_unique<AssignExprAST>(expr.GetLoc(), expr.GetName(),
+                                             Visit(expr.GetValue()));
+    }
+
+    std::unique_ptr<ExprAST> VisitCall(const CallExprAST &expr) {
+      std::vector<std::unique_ptr<ExprAST>> args;
+      for (const auto &arg : expr.GetArgs()) {
+        args.push_back(Visit(*arg));
+      }
+      return std::make_unique<CallExprAST>(expr.GetLoc(), expr.GetCallee(),
+                                           std::move(args));
+    }
+
+    std::unique_ptr<ExprAST> VisitVar(const VarExprAST &expr) {
+      if (auto hoisted = Hoist(expr)) {
+        return hoisted;
+      }
+      std::vector<VarExprAST::Binding> vars;
+      for (const auto &[name, init] : expr.GetVars()) {
+        vars.emplace_back(name, Visit(*init));
+        scope.push_back(name);
+        owners.push_back(-1);
+      }
+      auto body = Visit(expr.GetBody());
+      scope.resize(scope.size() - vars.size());
+      owners.resize(scope.size());
+      return std::make_unique<VarExprAST>(expr.GetLoc(), std::move(vars),
+                                          std::move(body));
+    }
+
+    std::unique_ptr<ExprAST> VisitIf(const IfExprAST &expr) {
+      if (auto hoisted = Hoist(expr)) {
+        return hoisted;
+      }
+      auto cond = Visit(expr.GetCond());
+      size_t saved = hoist_floor;
+      hoist_floor = loops.size();
+      auto then = Visit(expr.GetThen());
+      auto otherwise = Visit(expr.GetElse());
+      hoist_floor = saved;
+      return std::make_unique<IfExprAST>(expr.GetLoc(), std::move(cond),
+                                         std::move(then), std::move(otherwise));
+    }
+
+    std::unique_ptr<ExprAST> VisitFor(const ForExprAST &expr) {
+      // The starts are evaluated outside the loop.
+      std::vector<ForExprAST::Induction> vars;
+      for (const auto &var : expr.GetVars()) {
+        vars.push_back({var.name, Visit(*var.start), nullptr});
+      }
+
+      size_t k = loops.size();
+      loops.push_back(Loop{scope.size(), {}, {}, {}});
+      loops[k].assigned.Visit(expr);
+      uint32_t unroll = expr.GetUnroll();
+      double last;
+      bool counted = expr.GetVars().size() == 1 &&
+                     !loops[k].assigned.Contains(expr.GetVars()[0].name);
+      if (uint64_t trip = counted ? TripCount(expr, last) : 0) {
+        Reduce(expr, last, vars, loops[k]);
+        if (unroll == 1) {
+          Shape shape;
+          shape.Visit(expr.GetBody());
+          unroll = UnrollFactor(trip, shape.nodes);
+        }
+      }
+
+      for (size_t i = 0; i < vars.size(); ++i) {
+        scope.push_back(vars[i].name);
+        owners.push_back(i == 0 ? static_cast<int>(k) : -1);
+      }
+      size_t saved = active;
+      active = loops.size();
+      for (size_t i = 0; i < expr.GetVars().size(); ++i) {
+        vars[i].step = Visit(*expr.GetVars()[i].step);
+      }
+      auto end = Visit(expr.GetEnd());
+      auto body = Visit(expr.GetBody());
+      active = saved;
+      scope.resize(loops[k].scope_base);
+      owners.resize(scope.size());
+
+      std::vector<VarExprAST::Binding> hoisted = std::move(loops[k].hoisted);
+      loops.pop_back();
+      auto loop = std::make_unique<ForExprAST>(expr.GetLoc(), std::move(vars),
+                                               std::move(end), std::move(body),
+                                               unroll);
+      if (hoisted.empty()) {
+        return loop;
+      }
+      return std::make_unique<VarExprAST>(expr.GetLoc(), std::move(hoisted),
+                                          std::move(loop));
+    }
+  };
+
+  /// IsProduct - Whether expr is iv*c or c*iv for a number c, which is
+  /// stored in c.
+  static bool IsProduct(const BinaryExprAST &expr, std::string_view iv,
+                        double &c) {
+    if (expr.GetOp() != '*') {
+      return false;
+    }
+    const ExprAST *var = &expr.GetLHS();
+    const ExprAST *num = &expr.GetRHS();
+    if (var->GetKind() == ExprKind::number) {
+      std::swap(var, num);
+    }
+    if (var->GetKind() != ExprKind::variable ||
+        num->GetKind() != ExprKind::number ||
+        static_cast<const VariableExprAST *>(var)->GetName() != iv) {
+      return false;
+    }
+    c = static_cast<const NumberExprAST *>(num)->GetVal();
+    return true;
+  }
+
+  /// TripCount - How many times loop runs its body, if that is known and at
+  /// most TRIP_LIMIT, else 0. last is set to the loop variable's final value.
+  static uint64_t TripCount(const ForExprAST &loop, double &last) {
+    const auto &own = loop.GetVars()[0];
+    if (own.start->GetKind() != ExprKind::number ||
+        own.step->GetKind() != ExprKind::number ||
+        loop.GetEnd().GetKind() != ExprKind::binary) {
+      return 0;
+    }
+    const auto &end = static_cast<const BinaryExprAST &>(loop.GetEnd());
+    const ExprAST *var = &end.GetLHS();
+    const ExprAST *bound = &end.GetRHS();
+    bool var_first = var->GetKind() == ExprKind::variable;
+    if (!var_first) {
+      std::swap(var, bound);
+    }
+    if (end.GetOp() != '<' || var->GetKind() != ExprKind::variable ||
+        bound->GetKind() != ExprKind::number ||
+        static_cast<const VariableExprAST *>(var)->GetName() != own.name) {
+      return 0;
+    }
+    double k = static_cast<const NumberExprAST *>(bound)->GetVal();
+    double i = static_cast<const NumberExprAST &>(*own.start).GetVal();
+    double step = static_cast<const NumberExprAST &>(*own.step).GetVal();
+    for (uint64_t trip = 1; trip <= TRIP_LIMIT; ++trip) {
+      bool more = var_first ? i < k : k < i;
+      i = i + step;
+      if (!more) {
+        last = i;
+        return trip;
+      }
+    }
+    return 0;
+  }
+
+  /// UnrollFactor - How many copies of a body of size nodes to run per
+  /// evaluation of end, in a loop that runs it trip times.
+  static uint32_t UnrollFactor(uint64_t trip, int size) {
+    for (uint32_t factor = UNROLL_MAX; factor > 1; --factor) {
+      if (trip % factor == 0 &&
+          size * static_cast<int>(factor) <= UNROLL_BUDGET) {
+        return factor;
+      }
+    }
+    return 1;
+  }
+
+public:
+  LoopOptions &GetOptions() { return options; }
+
+  /// Optimize - A copy of body with its loops optimized, or null if there
+  /// is nothing to do.
+  std::unique_ptr<ExprAST> Optimize(const ExprAST &body) {
+    Shape shape;
+    shape.Visit(body);
+    if (!options.enabled || shape.loops == 0) {
+      return nullptr;
+    }
+    return Rewriter(*this).Visit(body);
+  }
+};
@@ -0,0 +1,128 @@
+#pragma once
+
+#include "ir.h"
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+
+/// PassOptions - Knobs for PassManager.
+struct PassOptions {
+  /// Check the IR after lowering and after every pass.
+  bool verify = false;
+  /// Measure how long each step takes, for PrintTimings.
+  bool time = false;
+  /// Print each function's IR once the passes have run.
+  bool print = false;
+};
+
+/// PassManager - Runs a pipeline of passes over each function's IR.
+///
+/// Every step can be timed, lowering and code generation included, and the
+/// IR can be verified after each one, so a pass that breaks it is named
+/// rather than showing up as wrong code later. The pipeline is built once
+/// and reused for every function; statistics add up across functions.
+class PassManager {
+public:
+  /// A pass returns whether it changed the function.
+  using Pass = std::function<bool(IrFunction &)>;
+
+private:
+  struct Step {
+    std::string name;
+    Pass run;
+  };
+
+  struct Stats {
+    std::string name;
+    double seconds = 0.0;
+    unsigned runs = 0;
+    unsigned changes = 0;
+  };
+
+  std::vector<Step> passes;
+  std::vector<Stats> stats; // In the order steps first ran.
+  PassOptions options;
+
+  Stats &GetStats(std::string_view name) {
+    for (Stats &entry : stats) {
+      if (entry.name == name) {
+        return entry;
+      }
+    }
+    stats.push_back({std::string(name)});
+    return stats.back();
+  }
+
+  /// Verify - With verification on, check fn after the step called name.
+  bool Verify(const IrFunction &fn, std::string_view name) {
+    std::string error;
+    if (!options.verify || VerifyIr(fn, error)) {
+      return true;
+    }
+    std::string message = "invalid IR after " + std::string(name) + " in " +
+                          std::string(fn.name) + ": " + error;
+    ReportError(fn.loc, message.c_str());
+    return false;
+  }
+
+public:
+  PassOptions &GetOptions() { return options; }
+
+  /// Add - Append a pass to the pipeline.
+  void Add(std::string name, Pass pass) {
+    passes.push_back({std::move(name), std::move(pass)});
+  }
+
+  /// Time - Run work, a step called name, and with timing on add how long
+  /// it took to that step's total. Returns what work returns.
+  template <typename Work> auto Time(std::string_view name, Work &&work) {
+    if (!options.time) {
+      return work();
+    }
+    auto start = std::chrono::steady_clock::now();
+    auto result = work();
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    Stats &entry = GetStats(name);
+    entry.seconds += elapsed.count();
+    ++entry.runs;
+    return result;
+  }
+
+  /// Run - Run the pipeline over fn, fresh from lowering. Returns false if
+  /// verification failed, which has been reported.
+  bool Run(IrFunction &fn) {
+    if (!Verify(fn, "lowering")) {
+      return false;
+    }
+    for (const Step &pass : passes) {
+      bool changed = Time(pass.name, [&] { return pass.run(fn); });
+      if (changed && options.time) {
+        ++GetStats(pass.name).changes;
+      }
+      if (!Verify(fn, pass.name)) {
+        return false;
+      }
+    }
+    if (options.print) {
+      PrintIr(stderr, fn);
+    }
+    return true;
+  }
+
+  /// PrintTimings - Report the time spent in each step.
+  void PrintTimings(FILE *out) const {
+    double total = 0.0;
+    for (const Stats &entry : stats) {
+      total += entry.seconds;
+    }
+    fprintf(out, "Pass timings (%.3f ms in all):\n", total * 1e3);
+    for (const Stats &entry : stats) {
+      fprintf(out, "  %10.3f ms  %5.1f%%  %6u runs  %6u changed  %s\n",
+              entry.seconds * 1e3,
+              total > 0.0 ? 100.0 * entry.seconds / total : 0.0, entry.runs,
+              entry.changes, entry.name.c_str());
+    }
+  }
+};
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <string_view>
+
+/// NativeFn - How engines call builtins: arguments are passed as an array, so
+/// one signature covers every arity.
+using NativeFn = double (*)(const double *args);
+
+/// Builtin - A native function that Kaleidoscope code can bind to with
+/// 'extern'. A pure one has no effects, so calls to it with the same
+/// arguments can share one result.
+struct Builtin {
+  std::string_view name;
+  size_t arity;
+  NativeFn fn;
+  bool pure = true;
+};
+
+/// putchard - Put the character with code x to stderr and return 0.
+inline double PutCharD(const double *args) {
+  fputc(static_cast<char>(args[0]), stderr);
+  return 0;
+}
+
+/// printd - Print x as "%f\n" to stderr and return 0.
+inline double PrintD(const double *args) {
+  fprintf(stderr, "%f\n", args[0]);
+  return 0;
+}
+
+inline const Builtin BUILTINS[] = {
+    {"sin", 1, [](const double *a) { return std::sin(a[0]); }},
+    {"cos", 1, [](const double *a) { return std::cos(a[0]); }},
+    {"tan", 1, [](const double *a) { return std::tan(a[0]); }},
+    {"atan", 1, [](const double *a) { return std::atan(a[0]); }},
+    {"atan2", 2, [](const double *a) { return std::atan2(a[0], a[1]); }},
+    {"exp", 1, [](const double *a) { return std::exp(a[0]); }},
+    {"log", 1, [](const double *a) { return std::log(a[0]); }},
+    {"sqrt", 1, [](const double *a) { return std::sqrt(a[0]); }},
+    {"fabs", 1, [](const double *a) { return std::fabs(a[0]); }},
+    {"floor", 1, [](const double *a) { return std::floor(a[0]); }},
+    {"pow", 2, [](const double *a) { return std::pow(a[0], a[1]); }},
+    {"fmod", 2, [](const double *a) { return std::fmod(a[0], a[1]); }},
+    {"putchard", 1, PutCharD, false},
+    {"printd", 1, PrintD, false},
+};
+
+/// FindBuiltin - The builtin called name, or null.
+inline const Builtin *FindBuiltin(std::string_view name) {
+  for (const Builtin &builtin : BUILTINS) {
+    if (builtin.name == name) {
+      return &builtin;
+    }
+  }
+  return nullptr;
+}
+
+// The built-in binary operators, as types so engines can stamp out one
+// specialized evaluator per operator with a template.
+struct AddOp {
+  static double Apply(double a, double b) { return a + b; }
+};
+struct SubOp {
+  static double Apply(double a, double b) { return a - b; }
+};
+struct MulOp {
+  static double Apply(double a, double b) { return a * b; }
+};
+struct LessOp {
+  static double Apply(double a, double b) { return a < b ? 1.0 : 0.0; }
+};
+
+/// MAX_CALL_DEPTH - Engines report an error rather than overflow the native
+/// stack when calls nest deeper than this.
+inline constexpr int MAX_CALL_DEPTH = 10000;
+
+/// IsTrue - How conditions read a value: anything but 0.0 is true, except
+/// NaN.
+inline bool IsTrue(double cond) { return cond < 0.0 || cond > 0.0; }
+
+/// HasFma - Whether this CPU has a fused multiply-add instruction. Without
+/// one, std::fma is done in software, far slower than a multiply and an add.
+inline bool HasFma() {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  return __builtin_cpu_supports("fma");
+#elif defined(__aarch64__)
+  return true;
+#else
+  return false;
+#endif
+}
+
+/// Select - then if cond is true, else otherwise. Both are already computed,
+/// so this compiles to a compare and a conditional move, with no branch.
+inline double Select(double cond, double then, double otherwise) {
+  return IsTrue(cond) ? then : otherwise;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "visitor.h"
+
+/// SELECT_ARM_LIMIT - The most nodes an arm of an if may have for the if to
+/// be lowered to a select.
+inline constexpr int SELECT_ARM_LIMIT = 8;
+
+/// ArmCost - Measures an arm of an if: its node count, or -1 if it must not
+/// be evaluated unless it is picked: calls have effects (printing, errors,
+/// recursion that may never end), loops may never end, and assignments
+/// change the frame. Everything else is a pure function of the frame.
+class ArmCost : public ExprVisitor<ArmCost, int> {
+private:
+  static int Add(int a, int b) { return a < 0 || b < 0 ? -1 : a + b; }
+
+public:
+  int VisitNumber(const NumberExprAST &) { return 1; }
+  int VisitVariable(const VariableExprAST &) { return 1; }
+  int VisitCall(const CallExprAST &) { return -1; }
+  int VisitFor(const ForExprAST &) { return -1; } // It may not end.
+  int VisitAssign(const AssignExprAST &) { return -1; }
+
+  int VisitBinary(const BinaryExprAST &expr) {
+    return Add(1, Add(Visit(expr.GetLHS()), Visit(expr.GetRHS())));
+  }
+
+  int VisitVar(const VarExprAST &expr) {
+    int size = 1;
+    for (const auto &binding : expr.GetVars()) {
+      size = Add(size, Visit(*binding.second));
+    }
+    return Add(size, Visit(expr.GetBody()));
+  }
+
+  int VisitIf(const IfExprAST &expr) {
+    return Add(1, Add(Visit(expr.GetCond()),
+                      Add(Visit(expr.GetThen()), Visit(expr.GetElse()))));
+  }
+};
+
+/// ShouldSelect - Whether to lower expr without a branch: evaluate the
+/// condition and both arms, then pick one of the values. That is only
+/// allowed when neither arm has effects, and only pays when both are cheap,
+/// since the arm that is not picked is computed for nothing. In exchange,
+/// code whose condition is unpredictable never mispredicts, and evaluation
+/// takes the same path whichever way the condition goes.
+inline bool ShouldSelect(const IfExprAST &expr) {
+  int then_cost = ArmCost().Visit(expr.GetThen());
+  int else_cost = ArmCost().Visit(expr.GetElse());
+  return then_cost >= 0 && then_cost <= SELECT_ARM_LIMIT && else_cost >= 0 &&
+         else_cost <= SELECT_ARM_LIMIT;
+}
@@ -0,0 +1,702 @@
+#pragma once
+
+#include "bytecode_compiler.h"
+#include "bytecode_file.h"
+#include "engine.h"
+#include "inliner.h"
+#include "ir_builder.h"
+#include "ir_codegen.h"
+#include "ir_passes.h"
+#include "loop_optimizer.h"
+#include <algorithm>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+// The dispatch loop uses GCC/Clang labels-as-values ("computed goto") where
+// available: each handler ends with its own indirect jump through a table
+// indexed by the next opcode, which gives the branch predictor one history
+// per handler instead of one shared switch. Elsewhere it falls back to a
+// portable switch in a loop. Define KALEIDOSCOPE_COMPUTED_GOTO to 0 to force
+// the switch.
+#ifndef KALEIDOSCOPE_COMPUTED_GOTO
+#if defined(__GNUC__)
+#define KALEIDOSCOPE_COMPUTED_GOTO 1
+#else
+#define KALEIDOSCOPE_COMPUTED_GOTO 0
+#endif
+#endif
+
+/// VMEngine - Compiles definitions to bytecode and runs it on a stack VM.
+///
+/// The VM does not recurse on the native stack: each call pushes a Frame,
+/// and all frames share one value stack, so recursion depth is bounded by
+/// VM_STACK_SLOTS rather than by the C++ stack. A tail call pushes nothing:
+/// the callee takes over the caller's frame, so recursion through tail calls,
+/// including mutual recursion, runs in constant stack.
+///
+/// With lazy compilation a definition starts out with a LAZY_CODE
+/// trampoline and is compiled on its first call. Code may run on several
+/// threads at once: each thread has its own value stack, and compiles are
+/// serialized by a lock, so when several threads make the first call to a
+/// function one of them compiles it and the others wait and then run the
+/// result. A redefinition swaps the function's body in one atomic store, so
+/// callers are never recompiled and see either the old body or the new one;
+/// the old body is freed through EpochDomain once no run can still be using
+/// it. Definitions are added by one driver thread, and profiling assumes
+/// code runs on one thread.
+///
+/// Bodies go through the Inliner, then the LoopOptimizer, before they are
+/// compiled, either straight from the AST or, with BytecodeOptions::ir, by
+/// way of the IR and the passes over it. A function whose code copied the
+/// body of one that is then redefined is sent back to its trampoline, so it
+/// is compiled again on its next call.
+class VMEngine : public Engine {
+public:
+  /// VM_STACK_SLOTS - Size of the value stack shared by all frames.
+  static constexpr size_t VM_STACK_SLOTS = 1 << 20;
+
+private:
+  struct Frame {
+    const uint32_t *pc;
+    const BcFunction *fn;
+    const BcCode *body;
+    double *locals;
+  };
+
+  /// ThreadState - The value stack and frames of one thread running code.
+  struct ThreadState {
+    // Left uninitialized: slots are always written before they are read.
+    std::unique_ptr<double[]> stack{new double[VM_STACK_SLOTS]};
+    std::vector<Frame> frames;
+
+    ThreadState() { frames.reserve(1024); }
+  };
+
+  static ThreadState &GetThreadState() {
+    static thread_local ThreadState state;
+    return state;
+  }
+
+  FunctionTable functions;
+  // Compiled top-level expressions kept for a bytecode file, or loaded from
+  // one.
+  std::deque<BcFunction> entries;
+  // The loaded bytecode file, which functions and entries point into.
+  std::unique_ptr<MappedFile> image;
+  BytecodeOptions options;
+  Inliner inliner;
+  LoopOptimizer loop_optimizer;
+  PassManager passes;
+  // The callees whose calls value numbering merged in the function being
+  // compiled.
+  std::vector<std::string_view> merged_callees;
+  // Held while compiling or changing the function table.
+  mutable std::mutex lock;
+  bool lazy_compile = false;
+  bool dump_bytecode = false;
+
+  // Dynamic opcode-pair counts, [previous][current], when profiling.
+  bool profile = false;
+  std::vector<uint64_t> pair_counts;
+
+  bool Fail(const BcCode &body, const uint32_t *instr, const char *message) {
+    ReportError(body.GetCallLoc(static_cast<uint32_t>(instr - body.code)),
+                message);
+    return false;
+  }
+
+  /// IsPureCallee - Whether calls to name reach a builtin without effects.
+  /// The caller holds the lock.
+  bool IsPureCallee(std::string_view name) {
+    const BcFunction *record = functions.Find(name);
+    const Builtin *builtin = FindBuiltin(name);
+    return record && builtin && builtin->pure &&
+           record->native.load(std::memory_order_relaxed) == builtin;
+  }
+
+  /// CompileIr - Compile body by way of the IR. The caller holds the lock.
+  bool CompileIr(const PrototypeAST &proto, const ExprAST &body,
+                 BcCode &out) {
+    IrFunction ir;
+    merged_callees.clear();
+    if (!passes.Time("lower", [&] { return BuildIr(proto, body, ir); }) ||
+        !passes.Run(ir)) {
+      return false;
+    }
+    // Merged calls to a pure builtin are wrong once it is redefined.
+    if (!ir.name.empty()) {
+      for (std::string_view callee : merged_callees) {
+        inliner.Watch(ir.name, callee);
+      }
+    }
+    return passes.Time("codegen", [&] {
+      return GenerateBytecode(functions, ir, options, out);
+    });
+  }
+
+  /// Compile - Compile fn into a new body, or return null on errors, which
+  /// have been reported. The caller holds the lock.
+  std::unique_ptr<BcCode> Compile(const FunctionAST &fn,
+                                  std::string_view name) {
+    auto body = std::make_unique<BcCode>();
+    std::unique_ptr<ExprAST> inlined =
+        inliner.Inline(fn, fn.GetProto().GetName());
+    const ExprAST &source = inlined ? *inlined : fn.GetBody();
+    std::unique_ptr<ExprAST> optimized = loop_optimizer.Optimize(source);
+    const ExprAST &final_body = optimized ? *optimized : source;
+    bool compiled =
+        options.ir ? CompileIr(fn.GetProto(), final_body, *body)
+                   : CompileFunction(functions, fn.GetProto(), final_body,
+                                     options, *body);
+    if (!compiled) {
+      return nullptr;
+    }
+    body->arity = static_cast<uint32_t>(fn.GetProto().GetArgs().size());
+    if (dump_bytecode) {
+      Disassemble(stderr, name, *body, functions);
+    }
+    return body;
+  }
+
+  /// CompileLazy - Replace trampoline, the body of fn, with its compiled body
+  /// and return the body, or null if it does not compile. If another thread
+  /// got here first, or fn has been redefined since, wait for it and return
+  /// what it installed.
+  const BcCode *CompileLazy(BcFunction &fn, const BcCode &trampoline) {
+    std::lock_guard<std::mutex> guard(lock);
+    const BcCode *body = fn.GetBody();
+    if (body != &trampoline) {
+      return body;
+    }
+    std::unique_ptr<BcCode> compiled = Compile(*fn.ast, fn.name);
+    if (!compiled) {
+      return nullptr;
+    }
+    body = compiled.get();
+    fn.SetBody(std::move(compiled));
+    return body;
+  }
+
+  /// Invalidate - Send every function that copied the body of name back to
+  /// its trampoline. The caller holds the lock.
+  void Invalidate(std::string_view name) {
+    std::vector<std::string_view> dependents;
+    inliner.GetDependents(name, dependents);
+    for (std::string_view dependent : dependents) {
+      BcFunction *record = functions.Find(dependent);
+      if (record && record->ast && record->IsCompiled()) {
+        record->SetBody(MakeLazyBody(record->arity));
+      }
+    }
+  }
+
+  template <bool Profile> bool Execute(const BcFunction &entry, double &result);
+
+public:
+  BytecodeOptions &GetOptions() { return options; }
+  InlineOptions &GetInlineOptions() { return inliner.GetOptions(); }
+  LoopOptions &GetLoopOptions() { return loop_optimizer.GetOptions(); }
+  PassManager &GetPasses() { return passes; }
+  FunctionTable &GetFunctions() { return functions; }
+  VMEngine() {
+    AddStandardPasses(
+        passes, options,
+        [this](std::string_view callee) { return IsPureCallee(callee); },
+        merged_callees);
+  }
+
+  void SetDumpBytecode(bool enable) { dump_bytecode = enable; }
+  void SetLazyCompile(bool enable) { lazy_compile = enable; }
+  void SetProfile(bool enable) {
+    profile = enable;
+    pair_counts.assign(num_opcodes * num_opcodes, 0);
+  }
+
+  /// Run - Execute entry, which takes no arguments. Safe to call from several
+  /// threads at once, and while another thread redefines functions: a
+  /// replaced body stays alive until every run that could see it is over.
+  bool Run(const BcFunction &entry, double &result) {
+    EpochGuard guard;
+    return profile ? Execute<true>(entry, result)
+                   : Execute<false>(entry, result);
+  }
+
+  /// AddFunction - Compile fn now, or with lazy compilation give it the
+  /// trampoline so that it is compiled on its first call. Lazily compiled
+  /// functions report compile errors only when they are first called.
+  bool AddFunction(std::unique_ptr<FunctionAST> fn) override {
+    std::lock_guard<std::mutex> guard(lock);
+    BcFunction &record =
+        functions[functions.GetOrCreate(fn->GetProto().GetName())];
+    auto arity = static_cast<uint32_t>(fn->GetProto().GetArgs().size());
+    std::unique_ptr<BcCode> compiled =
+        lazy_compile ? MakeLazyBody(arity) : Compile(*fn, record.name);
+    if (!compiled) {
+      return false;
+    }
+    record.arity = arity;
+    record.native = nullptr;
+    record.declared = true;
+    record.ast = std::move(fn);
+    record.SetBody(std::move(compiled));
+    inliner.Define(record.name, record.ast.get());
+    Invalidate(record.name);
+    return true;
+  }
+
+  /// AddCompiledFunction - Define name with a body compiled elsewhere, such
+  /// as a compile cache. body must only call functions in GetFunctions().
+  void AddCompiledFunction(std::string_view name, uint32_t arity,
+                           std::unique_ptr<BcCode> body) {
+    std::lock_guard<std::mutex> guard(lock);
+    BcFunction &record = functions[functions.GetOrCreate(name)];
+    if (dump_bytecode) {
+      Disassemble(stderr, name, *body, functions);
+    }
+    body->arity = arity;
+    record.arity = arity;
+    record.native = nullptr;
+    record.declared = true;
+    record.ast = nullptr;
+    record.SetBody(std::move(body));
+    inliner.Forget(record.name);
+    Invalidate(record.name);
+  }
+
+  /// AttachDefinition - Give a function added with AddCompiledFunction the
+  /// definition its code came from, so that callers compiled later can
+  /// inline it. The code is kept.
+  void AttachDefinition(std::unique_ptr<FunctionAST> fn) {
+    std::lock_guard<std::mutex> guard(lock);
+    BcFunction *record = functions.Find(fn->GetProto().GetName());
+    if (!record || record->ast || !record->IsCompiled()) {
+      return;
+    }
+    record->ast = std::move(fn);
+    inliner.Define(record->name, record->ast.get());
+  }
+
+  /// CompileAll - Compile every function still waiting on its trampoline.
+  bool CompileAll() {
+    bool ok = true;
+    for (uint32_t i = 0; i < functions.size(); ++i) {
+      const BcCode *body = functions[i].GetBody();
+      if (body && body->code == LAZY_CODE &&
+          !CompileLazy(functions[i], *body)) {
+        ok = false;
+      }
+    }
+    return ok;
+  }
+
+  bool AddExtern(std::unique_ptr<PrototypeAST> proto) override {
+    std::lock_guard<std::mutex> guard(lock);
+    BcFunction &record = functions[functions.GetOrCreate(proto->GetName())];
+    if (const Builtin *builtin = FindBuiltin(proto->GetName())) {
+      if (builtin->arity != proto->GetArgs().size()) {
+        ReportError(proto->GetLoc(), "extern does not match builtin arity");
+        return false;
+      }
+      record.native = builtin;
+      // Calls now reach the builtin, not any body copied from a 'def'.
+      inliner.Define(record.name, nullptr);
+      Invalidate(record.name);
+    }
+    // A builtin takes the place of any 'def', arity included.
+    if (record.native || !record.GetBody()) {
+      record.arity = static_cast<uint32_t>(proto->GetArgs().size());
+    }
+    record.declared = true;
+    return true;
+  }
+
+  void
+  GetInlinedCallees(std::string_view name,
+                    std::vector<std::string_view> &callees) const override {
+    std::lock_guard<std::mutex> guard(lock);
+    inliner.GetInlinedCallees(name, callees);
+  }
+
+  /// GetAssumedCallees - Add to callees every function that the compiled
+  /// code of name relies on being a pure builtin.
+  void GetAssumedCallees(std::string_view name,
+                         std::vector<std::string_view> &callees) const {
+    std::lock_guard<std::mutex> guard(lock);
+    inliner.GetAssumedCallees(name, callees);
+  }
+
+  bool Evaluate(std::unique_ptr<FunctionAST> fn, double &result) override {
+    BcFunction entry;
+    entry.name = "<top-level>";
+    std::unique_ptr<BcCode> body;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      body = Compile(*fn, entry.name);
+    }
+    if (!body) {
+      return false;
+    }
+    entry.SetBody(std::move(body));
+    return Run(entry, result);
+  }
+
+  /// AddEntry - Compile a top-level expression and keep it for
+  /// WriteBytecodeFile instead of running it.
+  bool AddEntry(std::unique_ptr<FunctionAST> fn) {
+    entries.emplace_back();
+    BcFunction &entry = entries.back();
+    entry.name = "<top-level>";
+    std::unique_ptr<BcCode> body;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      body = Compile(*fn, entry.name);
+    }
+    if (!body) {
+      entries.pop_back();
+      return false;
+    }
+    entry.SetBody(std::move(body));
+    entry.ast = std::move(fn);
+    return true;
+  }
+
+  /// WriteImage - Save every function and entry to a .kbc file at path,
+  /// first compiling any function that has not been called yet.
+  bool WriteImage(const char *path) {
+    return CompileAll() && WriteBytecodeFile(path, functions, entries);
+  }
+
+  /// LoadImage - Map the .kbc file at path and run from it. Must be called
+  /// before anything else is added.
+  bool LoadImage(const char *path) {
+    auto file = std::make_unique<MappedFile>();
+    if (!file->Open(path) ||
+        !LoadBytecodeFile(*file, path, functions, entries)) {
+      return false;
+    }
+    image = std::move(file);
+    if (dump_bytecode) {
+      for (uint32_t i = 0; i < functions.size(); ++i) {
+        if (functions[i].IsCompiled()) {
+          Disassemble(stderr, functions[i].name, *functions[i].GetBody(),
+                      functions);
+        }
+      }
+    }
+    return true;
+  }
+
+  const std::deque<BcFunction> &GetEntries() const { return entries; }
+
+  /// PrintOpcodeProfile - Report the most frequent dynamic opcode pairs seen
+  /// while profiling: candidates for new superinstructions.
+  void PrintOpcodeProfile(FILE *out, size_t top = 20) const {
+    std::vector<std::pair<uint64_t, unsigned>> pairs;
+    uint64_t total = 0;
+    for (unsigned i = 0; i < pair_counts.size(); ++i) {
+      if (pair_counts[i]) {
+        pairs.emplace_back(pair_counts[i], i);
+        total += pair_counts[i];
+      }
+    }
+    std::sort(pairs.begin(), pairs.end(),
+              [](const auto &a, const auto &b) { return a.first > b.first; });
+    fprintf(out, "Opcode pairs (%llu dispatches):\n",
+            static_cast<unsigned long long>(total));
+    for (size_t i = 0; i < pairs.size() && i < top; ++i) {
+      fprintf(out, "  %12llu  %5.1f%%  %s -> %s\n",
+              static_cast<unsigned long long>(pairs[i].first),
+              100.0 * pairs[i].first / total,
+              OpcodeName(pairs[i].second / num_opcodes),
+              OpcodeName(pairs[i].second % num_opcodes));
+    }
+  }
+};
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+
+template <bool Profile>
+bool VMEngine::Execute(const BcFunction &entry, double &result) {
+  ThreadState &thread = GetThreadState();
+  std::vector<Frame> &frames = thread.frames;
+  double *stack_limit = thread.stack.get() + VM_STACK_SLOTS;
+  const BcFunction *fn = &entry;
+  const BcCode *body = entry.GetBody();
+  const uint32_t *pc = body->code;
+  const double *consts = body->consts;
+  double *locals = thread.stack.get();
+  double *sp = locals + body->num_locals; // One past the top of the stack.
+  if (sp + body->max_stack > stack_limit) {
+    return Fail(*body, pc, "Call stack overflow");
+  }
+  frames.clear();
+
+  uint32_t word;
+  unsigned prev_op = num_opcodes;
+  BcFunction *callee;
+  const BcCode *callee_body;
+  const Builtin *callee_native;
+  uint32_t num_args;
+  const uint32_t *call_pc;
+
+#define VM_PROFILE()                                                           \
+  do {                                                                         \
+    if (Profile) {                                                             \
+      if (prev_op != num_opcodes) {                                            \
+        ++pair_counts[prev_op * num_opcodes + DecodeOp(word)];                 \
+      }                                                                        \
+      prev_op = DecodeOp(word);                                                \
+    }                                                                          \
+  } while (0)
+
+  // Enter callee with num_args arguments already on the stack. Natives are
+  // called in place; the call instruction starts at call_pc. The callee's
+  // body is loaded once, and its arity checked against that same body, so a
+  // concurrent compile or redefinition cannot change either mid-call.
+#define VM_CALL()                                                              \
+  {                                                                            \
+    callee_native = callee->native.load(std::memory_order_acquire);            \
+    callee_body = callee_native ? nullptr : callee->GetBody();                 \
+    if ((callee_native && callee_native->arity != num_args) ||                 \
+        (callee_body && callee_body->arity != num_args)) {                     \
+      return Fail(*body, call_pc, "Incorrect # arguments passed");             \
+    }                                                                          \
+    if (callee_native) {                                                       \
+      sp -= num_args;                                                          \
+      *sp = callee_native->fn(sp);                                             \
+      ++sp;                                                                    \
+      VM_DISPATCH();                                                           \
+    }                                                                          \
+    if (!callee_body) {                                                        \
+      return Fail(*body, call_pc,                                              \
+                  callee->declared ? "Function is declared but not defined"    \
+                                   : "Unknown function referenced");           \
+    }                                                                          \
+    double *callee_locals = sp - num_args;                                     \
+    if (callee_locals + callee_body->num_locals + callee_body->max_stack >     \
+        stack_limit) {                                                         \
+      return Fail(*body, call_pc, "Call stack overflow");                      \
+    }                                                                          \
+    frames.push_back(Frame{pc, fn, body, locals});                             \
+    fn = callee;                                                               \
+    body = callee_body;                                                        \
+    locals = callee_locals;                                                    \
+    sp = locals + body->num_locals;                                            \
+    pc = body->code;                                                           \
+    consts = body->consts;                                                     \
+    VM_DISPATCH();                                                             \
+  }
+
+#if KALEIDOSCOPE_COMPUTED_GOTO
+  static const void *const dispatch_table[] = {
+#define KALEIDOSCOPE_OPCODE_LABEL(name, words, desc) &&do_##name,
+      KALEIDOSCOPE_OPCODES(KALEIDOSCOPE_OPCODE_LABEL)
+#undef KALEIDOSCOPE_OPCODE_LABEL
+  };
+#define VM_CASE(name) do_##name:
+#define VM_DISPATCH()                                                          \
+  do {                                                                         \
+    word = *pc++;                                                              \
+    VM_PROFILE();                                                              \
+    goto *dispatch_table[DecodeOp(word)];                                      \
+  } while (0)
+
+  VM_DISPATCH();
+#else
+#define VM_CASE(name) case op_##name:
+#define VM_DISPATCH() continue
+
+  while (true) {
+    word = *pc++;
+    VM_PROFILE();
+    switch (DecodeOp(word)) {
+#endif
+
+  VM_CASE(push_const) {
+    *sp++ = consts[DecodeA(word)];
+    VM_DISPATCH();
+  }
+  VM_CASE(load_arg) {
+    *sp++ = locals[DecodeA(word)];
+    VM_DISPATCH();
+  }
+  VM_CASE(store_local) {
+    locals[DecodeA(word)] = *--sp;
+    VM_DISPATCH();
+  }
+  VM_CASE(tee_local) {
+    locals[DecodeA(word)] = sp[-1];
+    VM_DISPATCH();
+  }
+  VM_CASE(add) {
+    --sp;
+    sp[-1] = sp[-1] + sp[0];
+    VM_DISPATCH();
+  }
+  VM_CASE(sub) {
+    --sp;
+    sp[-1] = sp[-1] - sp[0];
+    VM_DISPATCH();
+  }
+  VM_CASE(mul) {
+    --sp;
+    sp[-1] = sp[-1] * sp[0];
+    VM_DISPATCH();
+  }
+  VM_CASE(less) {
+    --sp;
+    sp[-1] = sp[-1] < sp[0] ? 1.0 : 0.0;
+    VM_DISPATCH();
+  }
+  VM_CASE(arg_add) {
+    sp[-1] = sp[-1] + locals[DecodeA(word)];
+    VM_DISPATCH();
+  }
+  VM_CASE(mul_add) {
+    // a b c -> a + b * c
+    sp -= 2;
+    sp[-1] = sp[-1] + sp[0] * sp[1];
+    VM_DISPATCH();
+  }
+  VM_CASE(fma) {
+    // a b c -> a * b + c
+    sp -= 2;
+    sp[-1] = std::fma(sp[-1], sp[0], sp[1]);
+    VM_DISPATCH();
+  }
+  VM_CASE(call1) {
+    call_pc = pc - 1;
+    callee = &functions[DecodeA(word)];
+    num_args = 1;
+    VM_CALL()
+  }
+  VM_CASE(call) {
+    call_pc = pc - 1;
+    callee = &functions[DecodeA(word)];
+    num_args = *pc++;
+    VM_CALL()
+  }
+  VM_CASE(tail_call) {
+    call_pc = pc - 1;
+    callee = &functions[DecodeA(word)];
+    num_args = *pc++;
+    callee_native = callee->native.load(std::memory_order_acquire);
+    callee_body = callee_native ? nullptr : callee->GetBody();
+    if ((callee_native && callee_native->arity != num_args) ||
+        (callee_body && callee_body->arity != num_args)) {
+      return Fail(*body, call_pc, "Incorrect # arguments passed");
+    }
+    if (callee_native) {
+      // Call it in place; the ret that follows returns its value.
+      sp -= num_args;
+      *sp = callee_native->fn(sp);
+      ++sp;
+      VM_DISPATCH();
+    }
+    if (!callee_body) {
+      return Fail(*body, call_pc,
+                  callee->declared ? "Function is declared but not defined"
+                                   : "Unknown function referenced");
+    }
+    if (locals + callee_body->num_locals + callee_body->max_stack >
+        stack_limit) {
+      return Fail(*body, call_pc, "Call stack overflow");
+    }
+    // The arguments are above the locals, so copying forward is safe.
+    std::copy(sp - num_args, sp, locals);
+    fn = callee;
+    body = callee_body;
+    sp = locals + body->num_locals;
+    pc = body->code;
+    consts = body->consts;
+    VM_DISPATCH();
+  }
+  VM_CASE(jump) {
+    pc = body->code + DecodeA(word);
+    VM_DISPATCH();
+  }
+  VM_CASE(jump_if_false) {
+    if (!IsTrue(*--sp)) {
+      pc = body->code + DecodeA(word);
+    }
+    VM_DISPATCH();
+  }
+  VM_CASE(jump_if_true) {
+    if (IsTrue(*--sp)) {
+      pc = body->code + DecodeA(word);
+    }
+    VM_DISPATCH();
+  }
+  VM_CASE(jump_if_not_less) {
+    sp -= 2;
+    if (!(sp[0] < sp[1])) {
+      pc = body->code + DecodeA(word);
+    }
+    VM_DISPATCH();
+  }
+  VM_CASE(select) {
+    // c t e -> t or e
+    sp -= 2;
+    sp[-1] = Select(sp[-1], sp[0], sp[1]);
+    VM_DISPATCH();
+  }
+  VM_CASE(pop) {
+    --sp;
+    VM_DISPATCH();
+  }
+  VM_CASE(ret) {
+    double value = sp[-1];
+    if (frames.empty()) {
+      result = value;
+      return true;
+    }
+    sp = locals;
+    *sp++ = value;
+    const Frame &frame = frames.back();
+    pc = frame.pc;
+    fn = frame.fn;
+    body = frame.body;
+    locals = frame.locals;
+    consts = body->consts;
+    frames.pop_back();
+    VM_DISPATCH();
+  }
+  VM_CASE(compile) {
+    // fn is running its trampoline, with the arguments already in place as
+    // locals. Only functions in the table, which the engine owns, have one.
+    // If fn was redefined since the call checked the trampoline's arity,
+    // the body that replaced it must take as many arguments.
+    callee_body = CompileLazy(const_cast<BcFunction &>(*fn), *body);
+    if (!callee_body) {
+      return false;
+    }
+    if (callee_body->arity != body->arity) {
+      return Fail(*body, pc - 1, "Incorrect # arguments passed");
+    }
+    if (locals + callee_body->num_locals + callee_body->max_stack >
+        stack_limit) {
+      return Fail(*callee_body, callee_body->code, "Call stack overflow");
+    }
+    body = callee_body;
+    sp = locals + body->num_locals;
+    pc = body->code;
+    consts = body->consts;
+    VM_DISPATCH();
+  }
+
+#if !KALEIDOSCOPE_COMPUTED_GOTO
+    default:
+      return Fail(*body, pc - 1, "invalid opcode");
+    }
+  }
+#endif
+
+#undef VM_CASE
+#undef VM_DISPATCH
+#undef VM_PROFILE
+#undef VM_CALL
+}
+
+#pragma GCC diagnostic pop
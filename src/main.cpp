@@ -1,16 +1,484 @@
+#include "ast_interpreter.h"
+#include "ast_printer.h"
+#include "checker.h"
+#include "closure_compiler.h"
+#include "compile_cache.h"
+#include "library.h"
 #include "parser.h"
+#include "vm.h"
+#include <chrono>
+#include <cstring>
+
+//===----------------------------------------------------------------------===//
+// Top-Level parsing and evaluation
+//===----------------------------------------------------------------------===//
+
+/// DUMP_AST - Print each parsed item as an S-expression.
+static bool DUMP_AST = false;
+
+/// ENGINE - Runs what the parser produces; null when only parsing.
+static Engine *ENGINE = nullptr;
+
+/// VM - ENGINE, when it is the bytecode VM.
+static VMEngine *VM = nullptr;
+
+/// TIME_EVAL - Report how long each top-level expression took to evaluate.
+static bool TIME_EVAL = false;
+
+/// EMIT_BC - Compile top-level expressions into VM entries for a bytecode
+/// file instead of evaluating them.
+static bool EMIT_BC = false;
+
+/// CACHE - The VM's on-disk compile cache, if one was given.
+static CompileCache *CACHE = nullptr;
+
+/// LIBRARIES - Files given with --lib, reloaded when they change.
+static std::vector<std::unique_ptr<Library>> LIBRARIES;
+
+/// ReportEvaluation - Print the result of an evaluation that began at start.
+static void ReportEvaluation(bool ok, double result,
+                             std::chrono::steady_clock::time_point start) {
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  if (ok) {
+    fprintf(stderr, "Evaluated to %f\n", result);
+  }
+  if (TIME_EVAL) {
+    fprintf(stderr, "Evaluation took %.3f ms\n", elapsed.count() * 1e3);
+  }
+}
+
+/// LookupCachedDefinition - Find where the definition at the current token
+/// ends and describe it in key. If the cache has it, define it and skip
+/// past it. Returns false if the definition must be parsed.
+static bool LookupCachedDefinition(CacheKey &key) {
+  size_t begin = CurTokenIndex();
+  TokenSkipper skipper(*PRELEXED_TOKENS, begin, BinopPrecedence);
+  if (!skipper.SkipDefinition()) {
+    return false;
+  }
+  CACHE->MakeKey(*PRELEXED_TOKENS, begin, skipper.GetPos(), GrammarHash(),
+                 key);
+  if (!CACHE->Has(key)) {
+    return false;
+  }
+  // The prototype names the function, and the definition is kept so that
+  // later callers can still inline it. Its body is only parsed if one does.
+  bool lazy_bodies = LAZY_BODIES;
+  LAZY_BODIES = true;
+  auto fn = ParseDefinition();
+  LAZY_BODIES = lazy_bodies;
+  if (!fn || !CACHE->Load(*VM, key, fn->GetProto().GetName())) {
+    SkipToToken(begin);
+    return false;
+  }
+  fprintf(stderr, "Loaded a cached function definition.\n");
+  VM->AttachDefinition(std::move(fn));
+  return true;
+}
+
+static void HandleDefinition() {
+  CacheKey key;
+  bool cacheable = CACHE && PRELEXED_TOKENS;
+  if (cacheable && LookupCachedDefinition(key)) {
+    return;
+  }
+  if (auto fn = ParseDefinition()) {
+    fprintf(stderr, "Parsed a function definition.\n");
+    if (DUMP_AST) {
+      fprintf(stderr, "%s\n", DumpFunction(*fn).c_str());
+    }
+    std::string_view name = fn->GetProto().GetName();
+    if (ENGINE && ENGINE->AddFunction(std::move(fn)) && cacheable &&
+        key.tokens && CurTokenIndex() == key.end) {
+      CACHE->Store(*VM, key, name);
+    }
+  } else {
+    // Skip token for error recovery.
+    GetNextToken();
+  }
+}
+
+static void HandleExtern() {
+  if (auto proto = ParseExtern()) {
+    fprintf(stderr, "Parsed an extern\n");
+    if (DUMP_AST) {
+      fprintf(stderr, "%s\n", DumpProto(*proto).c_str());
+    }
+    if (ENGINE) {
+      ENGINE->AddExtern(std::move(proto));
+    }
+  } else {
+    // Skip token for error recovery.
+    GetNextToken();
+  }
+}
+
+static void HandleTopLevelExpr() {
+  // Evaluate a top-level expression into an anonymous function.
+  if (auto fn = ParseTopLevelExpr()) {
+    fprintf(stderr, "Parsed a top-level expression\n");
+    if (DUMP_AST) {
+      fprintf(stderr, "%s\n", DumpExpr(fn->GetBody()).c_str());
+    }
+    if (!ENGINE) {
+      return;
+    }
+    if (EMIT_BC) {
+      VM->AddEntry(std::move(fn));
+      return;
+    }
+    // Pick up edits to the libraries before running anything.
+    for (auto &library : LIBRARIES) {
+      library->ReloadIfChanged(*ENGINE);
+    }
+    double result;
+    auto start = std::chrono::steady_clock::now();
+    bool ok = ENGINE->Evaluate(std::move(fn), result);
+    ReportEvaluation(ok, result, start);
+  } else {
+    // Skip token for error recovery.
+    GetNextToken();
+  }
+}
+
+/// top ::= definition | external | expression | ';'
+static void MainLoop() {
+  while (true) {
+    fprintf(stderr, "ready> ");
+    switch (cur_token) {
+    case Token::token_eof:
+      return;
+    case ';':
+      GetNextToken();
+      break;
+    case Token::token_def:
+      HandleDefinition();
+      break;
+    case Token::token_extern:
+      HandleExtern();
+      break;
+    default:
+      HandleTopLevelExpr();
+      break;
+    }
+  }
+}
+
+//===----------------------------------------------------------------------===//
+// Main driver code.
+//===----------------------------------------------------------------------===//
+
+/// LexOnly - Lex source into tokens and report throughput, without parsing.
+static void LexOnly(const SourceBuffer &source, TokenBuffer &tokens) {
+  auto start = std::chrono::steady_clock::now();
+  LexBuffer(source, tokens);
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  double secs = elapsed.count();
+  fprintf(stderr,
+          "Lexed %zu bytes into %zu tokens in %.3f ms (%.1f MB/s, %s)\n",
+          source.text.size(), tokens.size(), secs * 1e3,
+          secs > 0 ? source.text.size() / secs / 1e6 : 0.0,
+          ScanLevelName(GetScanLevel()));
+}
+
+/// RunImage - Run the top-level expressions of a loaded bytecode file.
+static void RunImage() {
+  for (const BcFunction &entry : VM->GetEntries()) {
+    double result;
+    auto start = std::chrono::steady_clock::now();
+    bool ok = VM->Run(entry, result);
+    ReportEvaluation(ok, result, start);
+  }
+}
+
+/// EndsWith - Whether text ends with suffix.
+static bool EndsWith(const char *text, const char *suffix) {
+  size_t n = strlen(text);
+  size_t m = strlen(suffix);
+  return n >= m && strcmp(text + n - m, suffix) == 0;
+}
+
+static void PrintUsage() {
+  fprintf(stderr,
+          "usage: kaleidoscope [options] [file.kl | file.kbc]\n"
+          "  --prelex    lex the whole input up front\n"
+          "  --lazy-parse\n"
+          "              with pre-lexed input, parse function bodies on\n"
+          "              first use\n"
+          "  --lib=FILE  load the definitions and externs in FILE first,\n"
+          "              and again whenever it changes (repeatable)\n"
+          "  --check     report errors in every definition instead of\n"
+          "              running the program\n"
+          "  --engine=ast|closure|vm|none\n"
+          "              how to run the program (default: ast; none only\n"
+          "              parses)\n"
+          "  --lazy-compile\n"
+          "              compile each function on its first call (closure,\n"
+          "              vm)\n"
+          "  --no-inline do not inline calls to small functions\n"
+          "  --inline-report\n"
+          "              say for every call site whether it was inlined\n"
+          "              and why (ast, closure, vm)\n"
+          "  --no-loop-opt\n"
+          "              do not hoist, strength-reduce or unroll loops\n"
+          "  --dump-bc   print the bytecode of each function (vm)\n"
+          "  --profile-ops\n"
+          "              count dynamic opcode pairs and print the most\n"
+          "              frequent at exit (vm)\n"
+          "  --no-super  do not form superinstructions (vm)\n"
+          "  --ir        compile by way of the SSA IR and its passes (vm)\n"
+          "  --dump-ir   print the IR of each function after the passes\n"
+          "              (vm; implies --ir)\n"
+          "  --verify-ir check the IR after every pass (vm; implies --ir)\n"
+          "  --time-passes\n"
+          "              report the time spent in each pass at exit (vm;\n"
+          "              implies --ir)\n"
+          "  --fast-math reassociate sums and products, which can change\n"
+          "              how they round (vm; implies --ir)\n"
+          "  --strict-fp keep arithmetic as written in the IR passes: no\n"
+          "              Horner form, fma contraction or --fast-math (vm)\n"
+          "  --cache-dir=DIR\n"
+          "              keep compiled definitions in DIR and reuse them\n"
+          "              across runs (vm)\n"
+          "  --emit-bc[=FILE]\n"
+          "              compile to a bytecode file instead of running (vm;\n"
+          "              default: the input with a .kbc extension)\n"
+          "  --time      report how long each top-level expression took\n"
+          "  --dump-ast  print each parsed item as an S-expression\n"
+          "  --lex-only  lex the whole input, report timing and exit\n"
+          "  --scan=scalar|sse2|avx2\n"
+          "              lexer scanning implementation (default: best)\n");
+}
+
+int main(int argc, char **argv) {
+  bool prelex = false;
+  bool lex_only = false;
+  const char *path = nullptr;
+  const char *engine_name = nullptr;
+  const char *emit_path = nullptr;
+  const char *cache_dir = nullptr;
+  bool dump_bc = false;
+  bool profile_ops = false;
+  bool superinstructions = true;
+  bool ir = false;
+  bool fast_math = false;
+  bool strict_fp = false;
+  PassOptions pass_options;
+  bool lazy_compile = false;
+  InlineOptions inline_options;
+  LoopOptions loop_options;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--prelex") == 0) {
+      prelex = true;
+    } else if (strcmp(argv[i], "--lazy-parse") == 0) {
+      LAZY_BODIES = true;
+    } else if (strcmp(argv[i], "--lazy-compile") == 0) {
+      lazy_compile = true;
+    } else if (strcmp(argv[i], "--no-inline") == 0) {
+      inline_options.enabled = false;
+    } else if (strcmp(argv[i], "--inline-report") == 0) {
+      inline_options.report = true;
+    } else if (strcmp(argv[i], "--no-loop-opt") == 0) {
+      loop_options.enabled = false;
+    } else if (strncmp(argv[i], "--lib=", 6) == 0) {
+      LIBRARIES.push_back(std::make_unique<Library>(argv[i] + 6));
+    } else if (strcmp(argv[i], "--check") == 0) {
+      engine_name = "check";
+    } else if (strncmp(argv[i], "--engine=", 9) == 0) {
+      engine_name = argv[i] + 9;
+    } else if (strcmp(argv[i], "--emit-bc") == 0) {
+      EMIT_BC = true;
+    } else if (strncmp(argv[i], "--emit-bc=", 10) == 0) {
+      EMIT_BC = true;
+      emit_path = argv[i] + 10;
+    } else if (strncmp(argv[i], "--cache-dir=", 12) == 0) {
+      cache_dir = argv[i] + 12;
+    } else if (strcmp(argv[i], "--dump-bc") == 0) {
+      dump_bc = true;
+    } else if (strcmp(argv[i], "--profile-ops") == 0) {
+      profile_ops = true;
+    } else if (strcmp(argv[i], "--no-super") == 0) {
+      superinstructions = false;
+    } else if (strcmp(argv[i], "--ir") == 0) {
+      ir = true;
+    } else if (strcmp(argv[i], "--dump-ir") == 0) {
+      ir = pass_options.print = true;
+    } else if (strcmp(argv[i], "--verify-ir") == 0) {
+      ir = pass_options.verify = true;
+    } else if (strcmp(argv[i], "--time-passes") == 0) {
+      ir = pass_options.time = true;
+    } else if (strcmp(argv[i], "--fast-math") == 0) {
+      ir = fast_math = true;
+    } else if (strcmp(argv[i], "--strict-fp") == 0) {
+      strict_fp = true;
+    } else if (strcmp(argv[i], "--time") == 0) {
+      TIME_EVAL = true;
+    } else if (strcmp(argv[i], "--dump-ast") == 0) {
+      DUMP_AST = true;
+    } else if (strcmp(argv[i], "--lex-only") == 0) {
+      lex_only = true;
+    } else if (strncmp(argv[i], "--scan=", 7) == 0) {
+      const char *level = argv[i] + 7;
+      if (strcmp(level, "scalar") == 0) {
+        SetScanLevel(ScanLevel::scalar);
+      } else if (strcmp(level, "sse2") == 0) {
+        SetScanLevel(ScanLevel::sse2);
+      } else if (strcmp(level, "avx2") == 0) {
+        SetScanLevel(ScanLevel::avx2);
+      } else {
+        PrintUsage();
+        return 1;
+      }
+    } else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+      PrintUsage();
+      return 1;
+    } else {
+      path = argv[i];
+    }
+  }
+
+  // Bytecode files and the compile cache are written and read by the VM.
+  bool run_image = path && EndsWith(path, ".kbc");
+  bool needs_vm = EMIT_BC || run_image || cache_dir;
+  if (!engine_name) {
+    engine_name = needs_vm ? "vm" : "ast";
+  }
+  if (needs_vm && strcmp(engine_name, "vm") != 0) {
+    fprintf(stderr, "Error: bytecode files and --cache-dir need "
+                    "--engine=vm\n");
+    return 1;
+  }
+  std::string default_emit_path;
+  if (EMIT_BC && !emit_path) {
+    default_emit_path = path ? path : "a";
+    if (EndsWith(default_emit_path.c_str(), ".kl")) {
+      default_emit_path.resize(default_emit_path.size() - 3);
+    }
+    default_emit_path += ".kbc";
+    emit_path = default_emit_path.c_str();
+  }
+
+  std::unique_ptr<Engine> engine;
+  CheckEngine *checker = nullptr;
+  if (strcmp(engine_name, "ast") == 0) {
+    auto interp = std::make_unique<Interpreter>();
+    interp->GetInlineOptions() = inline_options;
+    interp->GetLoopOptions() = loop_options;
+    engine = std::move(interp);
+  } else if (strcmp(engine_name, "closure") == 0) {
+    auto closure = std::make_unique<ClosureEngine>();
+    closure->SetLazyCompile(lazy_compile);
+    closure->GetInlineOptions() = inline_options;
+    closure->GetLoopOptions() = loop_options;
+    engine = std::move(closure);
+  } else if (strcmp(engine_name, "vm") == 0) {
+    auto vm = std::make_unique<VMEngine>();
+    vm->SetDumpBytecode(dump_bc);
+    vm->SetLazyCompile(lazy_compile);
+    vm->SetProfile(profile_ops);
+    vm->GetOptions().superinstructions = superinstructions;
+    vm->GetOptions().ir = ir;
+    vm->GetOptions().fast_math = fast_math;
+    vm->GetOptions().strict_fp = strict_fp;
+    vm->GetPasses().GetOptions() = pass_options;
+    vm->GetInlineOptions() = inline_options;
+    vm->GetLoopOptions() = loop_options;
+    VM = vm.get();
+    engine = std::move(vm);
+  } else if (strcmp(engine_name, "check") == 0) {
+    auto check = std::make_unique<CheckEngine>();
+    checker = check.get();
+    engine = std::move(check);
+  } else if (strcmp(engine_name, "none") != 0) {
+    PrintUsage();
+    return 1;
+  }
+  ENGINE = engine.get();
+
+  // The cache works on pre-lexed definitions, so it implies --prelex.
+  std::unique_ptr<CompileCache> cache;
+  if (cache_dir) {
+    cache = std::make_unique<CompileCache>(
+        cache_dir, path ? path : "<stdin>", VM->GetOptions(), loop_options);
+    CACHE = cache.get();
+    prelex = true;
+  }
 
-int main() {
   // Install standard binary operators.
   // 1 is lowest precedence.
+  BinopPrecedence['='] = 2;
   BinopPrecedence['<'] = 10;
   BinopPrecedence['+'] = 20;
   BinopPrecedence['-'] = 30;
   BinopPrecedence['*'] = 40;
 
+  if (!LIBRARIES.empty() && (run_image || !ENGINE)) {
+    fprintf(stderr, "Error: --lib needs an engine and a source file\n");
+    return 1;
+  }
+  for (auto &library : LIBRARIES) {
+    library->Load(*ENGINE);
+  }
+
+  if (run_image) {
+    if (!VM->LoadImage(path)) {
+      return 1;
+    }
+    RunImage();
+    if (profile_ops) {
+      VM->PrintOpcodeProfile(stderr);
+    }
+    return 0;
+  }
+
+  // A named file is always lexed up front; stdin only when asked to.
+  TokenBuffer tokens;
+  if (path || prelex || lex_only) {
+    FILE *file = path ? fopen(path, "rb") : stdin;
+    if (!file) {
+      fprintf(stderr, "Error: cannot open '%s'\n", path);
+      return 1;
+    }
+    std::string text;
+    ReadAll(file, text);
+    if (file != stdin) {
+      fclose(file);
+    }
+    const SourceBuffer &source =
+        SOURCES.AddBuffer(path ? path : "<stdin>", std::move(text));
+    if (lex_only) {
+      LexOnly(source, tokens);
+      return 0;
+    }
+    LexBuffer(source, tokens);
+    UsePrelexedTokens(&tokens);
+  }
+
   fprintf(stderr, "ready> ");
   GetNextToken();
 
   MainLoop();
+
+  if (checker) {
+    unsigned errors = checker->Finish();
+    fprintf(stderr, "%u error%s\n", errors, errors == 1 ? "" : "s");
+    return errors ? 1 : 0;
+  }
+  if (CACHE) {
+    CACHE->Flush();
+    fprintf(stderr, "Compile cache: %u hits, %u misses\n", CACHE->GetHits(),
+            CACHE->GetMisses());
+  }
+  if (EMIT_BC && !VM->WriteImage(emit_path)) {
+    return 1;
+  }
+  if (VM && profile_ops) {
+    VM->PrintOpcodeProfile(stderr);
+  }
+  if (VM && pass_options.time) {
+    VM->GetPasses().PrintTimings(stderr);
+  }
   return 0;
-}
\ No newline at end of file
+}
@@ -1,13 +1,42 @@
 #pragma once
 
+#include "source.h"
+#include <cstdint>
+#include <map>
 #include <memory>
 #include <string>
+#include <string_view>
+#include <utility>
 #include <vector>
 
-/// ExprAST - Base class for all expression nodes.
+/// ExprKind - The closed set of expression node kinds. Every ExprAST carries
+/// its kind, so passes dispatch with a switch (see ExprVisitor) rather than
+/// with virtual calls or dynamic_cast chains.
+enum class ExprKind : uint8_t {
+  number,
+  variable,
+  binary,
+  call,
+  var,
+  if_,
+  for_,
+  assign
+};
+
+/// ExprAST - Base class for all expression nodes. Each node records its kind
+/// and where it came from as a 32-bit SourceLoc; both fit beside the vtable
+/// pointer.
 class ExprAST {
+private:
+  SourceLoc loc;
+  ExprKind kind;
+
 public:
+  ExprAST(ExprKind kind, SourceLoc loc) : loc(loc), kind(kind) {}
   virtual ~ExprAST() = default;
+
+  ExprKind GetKind() const { return kind; }
+  SourceLoc GetLoc() const { return loc; }
 };
 
 /// NumberExprAST - Expression class for numeric literals like "1.0".
@@ -16,16 +45,22 @@ private:
   double val;
 
 public:
-  NumberExprAST(double val) : val(val) {}
+  NumberExprAST(SourceLoc loc, double val)
+      : ExprAST(ExprKind::number, loc), val(val) {}
+
+  double GetVal() const { return val; }
 };
 
 /// VariableExprAST - Expression class for referencing a variable, like "a".
 class VariableExprAST : public ExprAST {
 private:
-  std::string name;
+  std::string_view name;
 
 public:
-  VariableExprAST(const std::string &name) : name(name) {}
+  VariableExprAST(SourceLoc loc, std::string_view name)
+      : ExprAST(ExprKind::variable, loc), name(name) {}
+
+  std::string_view GetName() const { return name; }
 };
 
 /// BinaryExprAST - Expression class for a binary operator.
@@ -36,46 +71,215 @@ private:
   std::unique_ptr<ExprAST> RHS;
 
 public:
-  BinaryExprAST(char op, std::unique_ptr<ExprAST> LHS,
+  BinaryExprAST(SourceLoc loc, char op, std::unique_ptr<ExprAST> LHS,
                 std::unique_ptr<ExprAST> RHS)
-      : op(op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
+      : ExprAST(ExprKind::binary, loc), op(op), LHS(std::move(LHS)),
+        RHS(std::move(RHS)) {}
+
+  char GetOp() const { return op; }
+  const ExprAST &GetLHS() const { return *LHS; }
+  const ExprAST &GetRHS() const { return *RHS; }
 };
 
 /// CallExprAST - Expression class for function calls.
 class CallExprAST : public ExprAST {
 private:
-  std::string callee;
+  std::string_view callee;
   std::vector<std::unique_ptr<ExprAST>> args;
 
 public:
-  CallExprAST(const std::string &callee,
+  CallExprAST(SourceLoc loc, std::string_view callee,
               std::vector<std::unique_ptr<ExprAST>> args)
-      : callee(callee), args(std::move(args)) {}
+      : ExprAST(ExprKind::call, loc), callee(callee), args(std::move(args)) {}
+
+  std::string_view GetCallee() const { return callee; }
+  const std::vector<std::unique_ptr<ExprAST>> &GetArgs() const { return args; }
+};
+
+/// VarExprAST - Expression class for var/in, which binds names to values for
+/// the extent of body. The initializers are evaluated in order, each with the
+/// names before it already bound, and a name shadows any outer one it
+/// repeats. The inliner also creates these, to bind the parameters of an
+/// inlined call.
+class VarExprAST : public ExprAST {
+public:
+  using Binding = std::pair<std::string_view, std::unique_ptr<ExprAST>>;
+
+private:
+  std::vector<Binding> vars;
+  std::unique_ptr<ExprAST> body;
+
+public:
+  VarExprAST(SourceLoc loc, std::vector<Binding> vars,
+             std::unique_ptr<ExprAST> body)
+      : ExprAST(ExprKind::var, loc), vars(std::move(vars)),
+        body(std::move(body)) {}
+
+  const std::vector<Binding> &GetVars() const { return vars; }
+  const ExprAST &GetBody() const { return *body; }
+};
+
+/// AssignExprAST - Expression class for "name = value", which stores value
+/// in a variable, argument or loop variable and evaluates to it.
+class AssignExprAST : public ExprAST {
+  std::string_view name;
+  std::unique_ptr<ExprAST> value;
+
+public:
+  AssignExprAST(SourceLoc loc, std::string_view name,
+                std::unique_ptr<ExprAST> value)
+      : ExprAST(ExprKind::assign, loc), name(name), value(std::move(value)) {}
+
+  std::string_view GetName() const { return name; }
+  const ExprAST &GetValue() const { return *value; }
+};
+
+/// IfExprAST - Expression class for if/then/else. The condition is true when
+/// it is not 0.0 (so NaN counts as false), and only the arm it picks has to
+/// be evaluated.
+class IfExprAST : public ExprAST {
+  std::unique_ptr<ExprAST> cond, then, otherwise;
+
+public:
+  IfExprAST(SourceLoc loc, std::unique_ptr<ExprAST> cond,
+            std::unique_ptr<ExprAST> then, std::unique_ptr<ExprAST> otherwise)
+      : ExprAST(ExprKind::if_, loc), cond(std::move(cond)),
+        then(std::move(then)), otherwise(std::move(otherwise)) {}
+
+  const ExprAST &GetCond() const { return *cond; }
+  const ExprAST &GetThen() const { return *then; }
+  const ExprAST &GetElse() const { return *otherwise; }
+};
+
+/// ForExprAST - Expression class for for/in:
+///
+///   for i = start, end, step in body
+///
+/// i is set to start; then the loop runs body, evaluates end, adds step to i
+/// and goes round again if end was true. body therefore always runs at least
+/// once, and end sees i before the step. step defaults to 1.0, and the value
+/// of the loop is always 0.0. i is in scope in end, step and body.
+///
+/// The loop optimizer adds induction variables of its own, which step along
+/// with i, and may unroll the loop: body then runs unroll times for every
+/// evaluation of end, which must be free of effects.
+class ForExprAST : public ExprAST {
+public:
+  /// Induction - A variable the loop steps. Every start is evaluated before
+  /// any of the loop's variables are bound; the steps are added in order.
+  struct Induction {
+    std::string_view name;
+    std::unique_ptr<ExprAST> start;
+    std::unique_ptr<ExprAST> step;
+  };
+
+private:
+  std::vector<Induction> vars; // The one the source named comes first.
+  std::unique_ptr<ExprAST> end, body;
+  uint32_t unroll;
+
+public:
+  ForExprAST(SourceLoc loc, std::vector<Induction> vars,
+             std::unique_ptr<ExprAST> end, std::unique_ptr<ExprAST> body,
+             uint32_t unroll = 1)
+      : ExprAST(ExprKind::for_, loc), vars(std::move(vars)),
+        end(std::move(end)), body(std::move(body)), unroll(unroll) {}
+
+  const std::vector<Induction> &GetVars() const { return vars; }
+  const ExprAST &GetEnd() const { return *end; }
+  const ExprAST &GetBody() const { return *body; }
+  uint32_t GetUnroll() const { return unroll; }
 };
 
 /// PrototypeAST - This class represents the "prototype" for a function, which
 /// captures its name, and its argument names (thus implicitly the number of
 /// arguments the function takes).
-
+///
+/// Names in the AST are views into the parse session's source text (see
+/// SourceManager), so building a node never copies an identifier.
+///
+/// A user-defined operator is an ordinary function, named by
+/// OperatorFunctionName, whose prototype also records that it is an
+/// operator and, for a binary one, its precedence.
 class PrototypeAST {
 private:
-  std::string name;
-  std::vector<std::string> args;
+  SourceLoc loc;
+  std::string_view name;
+  std::vector<std::string_view> args;
+  bool is_operator;
+  int precedence; // Precedence if a binary operator.
 
 public:
-  PrototypeAST(const std::string &name, std::vector<std::string> args)
-      : name(name), args(std::move(args)) {}
+  PrototypeAST(SourceLoc loc, std::string_view name,
+               std::vector<std::string_view> args, bool is_operator = false,
+               int precedence = 0)
+      : loc(loc), name(name), args(std::move(args)), is_operator(is_operator),
+        precedence(precedence) {}
+
+  SourceLoc GetLoc() const { return loc; }
+  std::string_view GetName() const { return name; }
+  const std::vector<std::string_view> &GetArgs() const { return args; }
 
-  const std::string &GetName() const { return name; }
+  bool IsOperator() const { return is_operator; }
+  bool IsUnaryOp() const { return is_operator && args.size() == 1; }
+  bool IsBinaryOp() const { return is_operator && args.size() == 2; }
+
+  char GetOperatorName() const { return name.back(); }
+  int GetBinaryPrecedence() const { return precedence; }
 };
 
+/// OperatorFunctionName - The name of the function that implements the unary
+/// or binary operator op: "unary" or "binary" followed by op. No identifier
+/// can spell it. Each name is made once and lives as long as source text.
+inline std::string_view OperatorFunctionName(bool binary, char op) {
+  static std::string names[2][128];
+  std::string &name = names[binary][op & 127];
+  if (name.empty()) {
+    name = binary ? "binary" : "unary";
+    name += op;
+  }
+  return name;
+}
+
+class TokenBuffer;
+
+/// SkippedBody - A function body the parser skipped over: tokens
+/// [begin, end) of a pre-lexed buffer, and the binary operator precedences
+/// in effect when it was skipped, which decide how those tokens parse.
+struct SkippedBody {
+  const TokenBuffer *tokens = nullptr;
+  size_t begin = 0;
+  size_t end = 0;
+  std::shared_ptr<const std::map<char, int>> precedence;
+};
+
+/// BodyParser - Parses a function body that the parser skipped over.
+using BodyParser = std::unique_ptr<ExprAST> (*)(const SkippedBody &body);
+
+/// FunctionAST - A function definition. Its body is either parsed along with
+/// the prototype or, with lazy parsing, only the first time it is asked for.
 class FunctionAST {
 private:
   std::unique_ptr<PrototypeAST> proto;
-  std::unique_ptr<ExprAST> body;
+  mutable std::unique_ptr<ExprAST> body;
+  BodyParser body_parser = nullptr;
+  SkippedBody skipped;
 
 public:
   FunctionAST(std::unique_ptr<PrototypeAST> proto,
               std::unique_ptr<ExprAST> body)
       : proto(std::move(proto)), body(std::move(body)) {}
+  FunctionAST(std::unique_ptr<PrototypeAST> proto, BodyParser body_parser,
+              SkippedBody skipped)
+      : proto(std::move(proto)), body_parser(body_parser),
+        skipped(std::move(skipped)) {}
+
+  const PrototypeAST &GetProto() const { return *proto; }
+  bool IsBodyParsed() const { return body != nullptr; }
+  const ExprAST &GetBody() const {
+    if (!body) {
+      body = body_parser(skipped);
+    }
+    return *body;
+  }
 };
\ No newline at end of file
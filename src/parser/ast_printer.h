@@ -0,0 +1,133 @@
+#pragma once
+
+#include "visitor.h"
+#include <cstdio>
+#include <string>
+
+/// ASTPrinter - Renders expressions as S-expressions, e.g. "(+ x (foo y 4))"
+/// "(var ((a 1) (b a)) (* a b))", "(if (< x 1) 1 x)" or
+/// "(for ((i 0 1)) (< i n) (f i))" or "(= x (+ x 1))". An unrolled loop is
+/// "(for*4 ...)".
+class ASTPrinter : public ExprVisitor<ASTPrinter> {
+private:
+  std::string &out;
+
+public:
+  explicit ASTPrinter(std::string &out) : out(out) {}
+
+  void VisitNumber(const NumberExprAST &expr) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%g", expr.GetVal());
+    out += buf;
+  }
+
+  void VisitVariable(const VariableExprAST &expr) { out += expr.GetName(); }
+
+  void VisitBinary(const BinaryExprAST &expr) {
+    out += '(';
+    out += expr.GetOp();
+    out += ' ';
+    Visit(expr.GetLHS());
+    out += ' ';
+    Visit(expr.GetRHS());
+    out += ')';
+  }
+
+  void VisitCall(const CallExprAST &expr) {
+    out += '(';
+    out += expr.GetCallee();
+    for (const auto &arg : expr.GetArgs()) {
+      out += ' ';
+      Visit(*arg);
+    }
+    out += ')';
+  }
+
+  void VisitVar(const VarExprAST &expr) {
+    out += "(var (";
+    for (size_t i = 0; i < expr.GetVars().size(); ++i) {
+      out += i ? " (" : "(";
+      out += expr.GetVars()[i].first;
+      out += ' ';
+      Visit(*expr.GetVars()[i].second);
+      out += ')';
+    }
+    out += ") ";
+    Visit(expr.GetBody());
+    out += ')';
+  }
+
+  void VisitFor(const ForExprAST &expr) {
+    out += "(for";
+    if (expr.GetUnroll() > 1) {
+      out += '*';
+      out += std::to_string(expr.GetUnroll());
+    }
+    out += " (";
+    for (size_t i = 0; i < expr.GetVars().size(); ++i) {
+      const auto &var = expr.GetVars()[i];
+      out += i ? " (" : "(";
+      out += var.name;
+      out += ' ';
+      Visit(*var.start);
+      out += ' ';
+      Visit(*var.step);
+      out += ')';
+    }
+    out += ") ";
+    Visit(expr.GetEnd());
+    out += ' ';
+    Visit(expr.GetBody());
+    out += ')';
+  }
+
+  void VisitAssign(const AssignExprAST &expr) {
+    out += "(= ";
+    out += expr.GetName();
+    out += ' ';
+    Visit(expr.GetValue());
+    out += ')';
+  }
+
+  void VisitIf(const IfExprAST &expr) {
+    out += "(if ";
+    Visit(expr.GetCond());
+    out += ' ';
+    Visit(expr.GetThen());
+    out += ' ';
+    Visit(expr.GetElse());
+    out += ')';
+  }
+
+  void PrintProto(const PrototypeAST &proto) {
+    out += proto.GetName();
+    out += " (";
+    for (size_t i = 0; i < proto.GetArgs().size(); ++i) {
+      out += i ? " " : "";
+      out += proto.GetArgs()[i];
+    }
+    out += ')';
+  }
+};
+
+/// DumpExpr/DumpProto/DumpFunction - One-line renderings for debugging.
+inline std::string DumpExpr(const ExprAST &expr) {
+  std::string out;
+  ASTPrinter(out).Visit(expr);
+  return out;
+}
+
+inline std::string DumpProto(const PrototypeAST &proto) {
+  std::string out = "(extern ";
+  ASTPrinter(out).PrintProto(proto);
+  return out + ")";
+}
+
+inline std::string DumpFunction(const FunctionAST &fn) {
+  std::string out = "(def ";
+  ASTPrinter printer(out);
+  printer.PrintProto(fn.GetProto());
+  out += ' ';
+  printer.Visit(fn.GetBody());
+  return out + ")";
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+/// CharClass - Bits describing what a byte can be part of. A byte may belong
+/// to several classes (digits are also number characters, for example).
+enum CharClass : uint8_t {
+  char_space = 1 << 0,     // ' ', '\t', '\n', '\v', '\f', '\r'
+  char_alpha = 1 << 1,     // [A-Za-z]: starts an identifier
+  char_alnum = 1 << 2,     // [0-9A-Za-z]: continues an identifier
+  char_digit = 1 << 3,     // [0-9]
+  char_number = 1 << 4,    // [0-9.]: starts or continues a number
+  char_line_end = 1 << 5,  // '\n', '\r': ends a comment
+};
+
+/// MakeCharClassTable - Build the 256-entry class table at compile time. Only
+/// ASCII is classified, so the result never depends on the C locale.
+constexpr std::array<uint8_t, 256> MakeCharClassTable() {
+  std::array<uint8_t, 256> table{};
+  for (int ch = 0; ch < 256; ++ch) {
+    uint8_t bits = 0;
+    bool alpha = (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z');
+    bool digit = ch >= '0' && ch <= '9';
+    if (ch == ' ' || (ch >= '\t' && ch <= '\r')) {
+      bits |= char_space;
+    }
+    if (alpha) {
+      bits |= char_alpha | char_alnum;
+    }
+    if (digit) {
+      bits |= char_digit | char_alnum | char_number;
+    }
+    if (ch == '.') {
+      bits |= char_number;
+    }
+    if (ch == '\n' || ch == '\r') {
+      bits |= char_line_end;
+    }
+    table[ch] = bits;
+  }
+  return table;
+}
+
+inline constexpr std::array<uint8_t, 256> CHAR_CLASS = MakeCharClassTable();
+
+inline bool HasCharClass(unsigned char ch, uint8_t cls) {
+  return (CHAR_CLASS[ch] & cls) != 0;
+}
+inline bool IsSpaceChar(unsigned char ch) { return HasCharClass(ch, char_space); }
+inline bool IsAlphaChar(unsigned char ch) { return HasCharClass(ch, char_alpha); }
+inline bool IsAlnumChar(unsigned char ch) { return HasCharClass(ch, char_alnum); }
+inline bool IsDigitChar(unsigned char ch) { return HasCharClass(ch, char_digit); }
+inline bool IsNumberChar(unsigned char ch) {
+  return HasCharClass(ch, char_number);
+}
+inline bool IsLineEndChar(unsigned char ch) {
+  return HasCharClass(ch, char_line_end);
+}
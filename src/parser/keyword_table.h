@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+/// Keyword - A reserved word and the token the lexer returns for it.
+struct Keyword {
+  std::string_view text;
+  int token = 0;
+};
+
+/// KeywordTable - A perfect hash table over a fixed keyword list, built at
+/// compile time. The hash only looks at the length and the first and last
+/// characters, so a lookup is a few arithmetic ops, one table load and a
+/// single string compare against the only keyword that could match.
+///
+/// The constructor searches for a seed that sends every keyword to its own
+/// slot; IsPerfect() reports whether it found one so callers can
+/// static_assert on it when the keyword list changes.
+template <size_t N> class KeywordTable {
+private:
+  static constexpr size_t TableSize() {
+    size_t size = 1;
+    while (size < 2 * N) {
+      size *= 2;
+    }
+    return size;
+  }
+
+  static constexpr size_t Slot(std::string_view text, uint32_t seed) {
+    uint32_t h = static_cast<unsigned char>(text.front()) * seed;
+    h ^= static_cast<unsigned char>(text.back()) +
+         static_cast<uint32_t>(text.size()) * 0x9e37u;
+    h ^= h >> 11;
+    h *= 0x85ebca6bu;
+    h ^= h >> 15;
+    return h & (TableSize() - 1);
+  }
+
+  Keyword slots[TableSize()] = {};
+  uint32_t seed = 0;
+  size_t min_length = ~size_t(0);
+  size_t max_length = 0;
+
+  constexpr bool TryBuild(const Keyword (&keywords)[N], uint32_t try_seed) {
+    for (Keyword &slot : slots) {
+      slot = Keyword{};
+    }
+    for (const Keyword &keyword : keywords) {
+      Keyword &slot = slots[Slot(keyword.text, try_seed)];
+      if (!slot.text.empty()) {
+        return false;
+      }
+      slot = keyword;
+    }
+    return true;
+  }
+
+public:
+  constexpr explicit KeywordTable(const Keyword (&keywords)[N]) {
+    for (const Keyword &keyword : keywords) {
+      min_length = keyword.text.size() < min_length ? keyword.text.size()
+                                                    : min_length;
+      max_length = keyword.text.size() > max_length ? keyword.text.size()
+                                                    : max_length;
+    }
+    for (uint32_t try_seed = 1; try_seed < (1u << 16); ++try_seed) {
+      if (TryBuild(keywords, try_seed)) {
+        seed = try_seed;
+        return;
+      }
+    }
+  }
+
+  constexpr bool IsPerfect() const { return seed != 0; }
+
+  /// Lookup - The keyword token for text, or fallback if it is not one.
+  constexpr int Lookup(std::string_view text, int fallback) const {
+    if (text.size() < min_length || text.size() > max_length) {
+      return fallback;
+    }
+    const Keyword &slot = slots[Slot(text, seed)];
+    return slot.text == text ? slot.token : fallback;
+  }
+};
@@ -1,8 +1,14 @@
 #pragma once
 
+#include "keyword_table.h"
+#include "scan.h"
+#include "source.h"
 #include <cctype>
+#include <charconv>
 #include <cstdio>
+#include <iterator>
 #include <string>
+#include <string_view>
 #include <vector>
 
 // The lexer returns tokens [0-255] if it is an unknown character, otherwise one
@@ -14,63 +20,157 @@ enum Token {
   token_extern = -3,
   // primary
   token_identifier = -4,
-  token_number = -5
+  token_number = -5,
+  // control
+  token_if = -6,
+  token_then = -7,
+  token_else = -8,
+  token_for = -9,
+  token_in = -10,
+  // operators
+  token_binary = -11,
+  token_unary = -12,
+  // var definition
+  token_var = -13
 };
 
+/// KEYWORDS - The reserved words, looked up through a perfect hash built at
+/// compile time. Adding a keyword is one line here.
+inline constexpr Keyword KEYWORD_LIST[] = {
+    {"def", Token::token_def},
+    {"extern", Token::token_extern},
+    {"if", Token::token_if},
+    {"then", Token::token_then},
+    {"else", Token::token_else},
+    {"for", Token::token_for},
+    {"in", Token::token_in},
+    {"binary", Token::token_binary},
+    {"unary", Token::token_unary},
+    {"var", Token::token_var},
+};
+inline constexpr KeywordTable<std::size(KEYWORD_LIST)> KEYWORDS(KEYWORD_LIST);
+static_assert(KEYWORDS.IsPerfect(), "no perfect hash seed for KEYWORD_LIST");
+
+/// IsOperatorChar - Whether token is a character that can name a user-defined
+/// operator: any ASCII punctuation except the ones that delimit expressions.
+inline bool IsOperatorChar(int token) {
+  return isascii(token) && ispunct(token) && token != '(' && token != ')' &&
+         token != ',' && token != ';';
+}
+
+/// IsBuiltinBinop - Whether op is one of the binary operators the engines
+/// implement themselves, or assignment. Any other is a call to a
+/// user-defined function.
+inline bool IsBuiltinBinop(int op) {
+  return op == '<' || op == '+' || op == '-' || op == '*' || op == '=';
+}
+
 // Simply use a global variable here, it is not a good practice though.
-static std::string IDENTIFIER_STR; // Filled in if token is an identifier
-static double NUM_VAL;             // Filled in if token is a number
+static std::string_view IDENTIFIER_STR; // Filled in if token is an identifier
+static double NUM_VAL;                  // Filled in if token is a number
+static SourceLoc TOKEN_LOC;             // Where the last token started
 
 inline bool IsSpace(int ch) { return ch == ' ' || ch == '\t'; }
 
-static int GetToken() {
-  static int last_char = ' ';
-  while (isspace(last_char)) {
-    last_char = getchar();
-  }
+/// LexedToken - One token as found by LexToken: its kind, where its text lives
+/// in the buffer being lexed, and its value if it is a number.
+struct LexedToken {
+  int kind;
+  const char *start;
+  size_t length;
+  double num_val;
+};
 
-  if (isalpha(last_char)) {
-    IDENTIFIER_STR = last_char;
-    while (isalnum(last_char = getchar())) {
-      IDENTIFIER_STR += last_char;
-    }
-    if (IDENTIFIER_STR == "def") {
-      return Token::token_def;
-    }
-    if (IDENTIFIER_STR == "extern") {
-      return Token::token_extern;
+/// ParseNumber - Convert the text of a number token to its value. As with
+/// std::stod, anything after the longest valid prefix (e.g. "1.2.3") is ignored.
+inline double ParseNumber(const char *start, const char *end) {
+  double val = 0.0;
+  std::from_chars(start, end, val);
+  return val;
+}
+
+/// LexToken - Lex the next token out of [cur, end) and advance cur past it.
+/// Whitespace and comments are skipped first; token_eof is returned once the
+/// range is exhausted. Tokens never span lines, so the range may be a whole
+/// file or a single line.
+inline LexedToken LexToken(const char *&cur, const char *end) {
+  while (true) {
+    cur = SkipWhitespace(cur, end);
+    if (cur == end || *cur != '#') {
+      break;
     }
-    return Token::token_identifier;
+    cur = SkipToLineEnd(cur, end);
   }
 
-  if (isdigit(last_char) || last_char == '.') {
-    std::string num_str{""};
-    num_str += last_char;
-    last_char = getchar();
-    while (isdigit(last_char) || last_char == '.') {
-      num_str += last_char;
-      last_char = getchar();
-    }
-    NUM_VAL = std::stod(num_str);
-    return Token::token_number;
+  LexedToken tok{Token::token_eof, cur, 0, 0.0};
+  if (cur == end) {
+    return tok;
   }
 
-  if (last_char == '#') {
-    last_char = getchar();
-    while (last_char != EOF && last_char != '\n' && last_char != '\r') {
-      last_char = getchar();
-    }
-    if (last_char != EOF) {
-      return GetToken();
-    }
+  const char *start = cur;
+  unsigned char ch = *cur;
+  if (IsAlphaChar(ch)) {
+    cur = SkipIdentifierTail(cur + 1, end);
+    tok.kind = KEYWORDS.Lookup(std::string_view(start, cur - start),
+                               Token::token_identifier);
+  } else if (IsNumberChar(ch)) {
+    cur = SkipNumberTail(cur + 1, end);
+    tok.kind = Token::token_number;
+    tok.num_val = ParseNumber(start, cur);
+  } else {
+    ++cur;
+    tok.kind = ch;
   }
+  tok.length = cur - start;
+  return tok;
+}
+
+// The stdin line GetToken is currently lexing, and how far into it we are.
+// Lines are kept in SOURCES, so identifiers can point straight into them.
+static const SourceBuffer *LINE_BUF;
+static size_t LINE_POS;
+static unsigned LINE_NUMBER;
 
-  if (last_char == EOF) {
-    return Token::token_eof;
+/// ReadLine - Read one line (including its '\n') from file into line. Returns
+/// false at end of input.
+inline bool ReadLine(FILE *file, std::string &line) {
+  line.clear();
+  int ch;
+  while ((ch = getc(file)) != EOF) {
+    line += static_cast<char>(ch);
+    if (ch == '\n') {
+      break;
+    }
   }
+  return !line.empty();
+}
+
+/// GetToken - Return the next token from standard input, lexing lazily one
+/// line at a time.
+static int GetToken() {
+  while (true) {
+    if (LINE_BUF) {
+      const char *begin = LINE_BUF->text.data();
+      const char *cur = begin + LINE_POS;
+      LexedToken tok = LexToken(cur, begin + LINE_BUF->text.size());
+      LINE_POS = cur - begin;
+      TOKEN_LOC = LINE_BUF->GetLoc(tok.start - begin);
 
-  int this_char = last_char;
+      if (tok.kind == Token::token_identifier) {
+        IDENTIFIER_STR = std::string_view(tok.start, tok.length);
+      } else if (tok.kind == Token::token_number) {
+        NUM_VAL = tok.num_val;
+      }
+      if (tok.kind != Token::token_eof) {
+        return tok.kind;
+      }
+    }
 
-  last_char = getchar();
-  return this_char;
+    std::string line;
+    if (!ReadLine(stdin, line)) {
+      return Token::token_eof;
+    }
+    LINE_BUF = &SOURCES.AddBuffer("<stdin>", std::move(line), ++LINE_NUMBER);
+    LINE_POS = 0;
+  }
 }
@@ -2,21 +2,112 @@
 
 #include "ast.h"
 #include "lexer.h"
+#include "token_buffer.h"
+#include "token_skipper.h"
+#include <algorithm>
+#include <cstdint>
 #include <cstdio>
 #include <map>
 #include <memory>
 #include <string>
+#include <string_view>
 #include <vector>
 
+/// PRELEXED_TOKENS - When set, the parser walks this pre-lexed buffer by index
+/// instead of pulling tokens lazily from GetToken.
+static const TokenBuffer *PRELEXED_TOKENS = nullptr;
+static size_t cur_token_index;
+static size_t next_token_index;
+static size_t end_token_index = SIZE_MAX; // Read as token_eof from here on.
+
 /// cur_token/getNextToken - Provide a simple token buffer.  cur_token is the
 /// current token the parser is looking at.  getNextToken reads another token
 /// from the lexer and updates cur_token with its results.
+/// cur_loc is where cur_token starts.
 static int cur_token;
-static int GetNextToken() { return cur_token = GetToken(); }
+static SourceLoc cur_loc;
+static int GetNextToken() {
+  if (!PRELEXED_TOKENS) {
+    cur_token = GetToken();
+    cur_loc = TOKEN_LOC;
+    return cur_token;
+  }
+  // Stay on the trailing token_eof once the buffer is exhausted, or on the
+  // end of the range being parsed.
+  size_t last = std::min(PRELEXED_TOKENS->size() - 1, end_token_index);
+  cur_token_index = next_token_index < last ? next_token_index : last;
+  next_token_index = cur_token_index + 1;
+  cur_loc = PRELEXED_TOKENS->GetLoc(cur_token_index);
+  if (cur_token_index == end_token_index) {
+    return cur_token = Token::token_eof;
+  }
+  return cur_token = PRELEXED_TOKENS->GetKind(cur_token_index);
+}
+
+/// UsePrelexedTokens - Make the parser walk tokens from the start.
+inline void UsePrelexedTokens(const TokenBuffer *tokens) {
+  PRELEXED_TOKENS = tokens;
+  cur_token_index = 0;
+  next_token_index = 0;
+  end_token_index = SIZE_MAX;
+}
+
+/// ParserState - Where the parser is, so that it can parse from somewhere
+/// else and then come back.
+struct ParserState {
+  const TokenBuffer *tokens;
+  int token;
+  SourceLoc loc;
+  size_t index;
+  size_t next_index;
+  size_t end_index;
+};
+
+inline ParserState SaveParserState() {
+  return ParserState{PRELEXED_TOKENS, cur_token, cur_loc, cur_token_index,
+                     next_token_index, end_token_index};
+}
+
+inline void RestoreParserState(const ParserState &state) {
+  PRELEXED_TOKENS = state.tokens;
+  cur_token = state.token;
+  cur_loc = state.loc;
+  cur_token_index = state.index;
+  next_token_index = state.next_index;
+  end_token_index = state.end_index;
+}
+
+/// CurTokenIndex - Where the parser is in the pre-lexed buffer.
+inline size_t CurTokenIndex() { return cur_token_index; }
 
-/// LogError* - These are little helper functions for error handling.
+/// SkipToToken - Move the parser to token index of the pre-lexed buffer,
+/// leaving out everything before it.
+inline void SkipToToken(size_t index) {
+  next_token_index = index;
+  GetNextToken();
+}
+
+/// CurIdentifier/CurNumVal - The payload of the current token, read from
+/// whichever token source the parser is walking.
+/// Identifiers are views into the session's retained source text.
+static std::string_view CurIdentifier() {
+  if (!PRELEXED_TOKENS) {
+    return IDENTIFIER_STR;
+  }
+  return PRELEXED_TOKENS->GetText(cur_token_index);
+}
+
+static double CurNumVal() {
+  if (!PRELEXED_TOKENS) {
+    return NUM_VAL;
+  }
+  return PRELEXED_TOKENS->GetNumVal(cur_token_index);
+}
+
+/// LogError* - These are little helper functions for error handling. Errors
+/// are reported at the current token.
 inline std::unique_ptr<ExprAST> LogError(const char *str) {
-  fprintf(stderr, "Error: %s\n", str);
+  ReportError(cur_loc, str);
   return nullptr;
 }
 
@@ -27,7 +118,7 @@ inline std::unique_ptr<PrototypeAST> LogErrorP(const char *str) {
 
 /// numberexpr ::= number
 static std::unique_ptr<ExprAST> ParseNumberExpr() {
-  auto result = std::make_unique<NumberExprAST>(NUM_VAL);
+  auto result = std::make_unique<NumberExprAST>(cur_loc, CurNumVal());
   GetNextToken();
   return std::move(result);
 }
@@ -52,12 +143,13 @@ static std::unique_ptr<ExprAST> ParseParenExpr() {
 ///   ::= identifier
 ///   ::= identifier '(' expression* ')'
 static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
-  std::string id_name = IDENTIFIER_STR;
+  std::string_view id_name = CurIdentifier();
+  SourceLoc id_loc = cur_loc;
 
   GetNextToken(); // eat identifier.
 
   if (cur_token != '(') { // Simple variable ref.
-    return std::make_unique<VariableExprAST>(id_name);
+    return std::make_unique<VariableExprAST>(id_loc, id_name);
   }
 
   // Call.
@@ -84,15 +176,171 @@ static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
 
   // eat the ')'
   GetNextToken();
-  return std::make_unique<CallExprAST>(id_name, std::move(args));
+  return std::make_unique<CallExprAST>(id_loc, id_name, std::move(args));
+}
+
+/// ifexpr ::= 'if' expression 'then' expression 'else' expression
+static std::unique_ptr<ExprAST> ParseIfExpr() {
+  SourceLoc if_loc = cur_loc;
+  GetNextToken(); // eat the if.
+
+  auto cond = ParseExpression();
+  if (!cond) {
+    return nullptr;
+  }
+  if (cur_token != Token::token_then) {
+    return LogError("expected then");
+  }
+  GetNextToken(); // eat the then.
+
+  auto then = ParseExpression();
+  if (!then) {
+    return nullptr;
+  }
+  if (cur_token != Token::token_else) {
+    return LogError("expected else");
+  }
+  GetNextToken(); // eat the else.
+
+  auto otherwise = ParseExpression();
+  if (!otherwise) {
+    return nullptr;
+  }
+  return std::make_unique<IfExprAST>(if_loc, std::move(cond), std::move(then),
+                                     std::move(otherwise));
+}
+
+/// forexpr ::= 'for' identifier '=' expression ',' expression
+///             (',' expression)? 'in' expression
+static std::unique_ptr<ExprAST> ParseForExpr() {
+  SourceLoc for_loc = cur_loc;
+  GetNextToken(); // eat the for.
+
+  if (cur_token != Token::token_identifier) {
+    return LogError("expected identifier after for");
+  }
+  std::string_view id_name = CurIdentifier();
+  GetNextToken(); // eat identifier.
+
+  if (cur_token != '=') {
+    return LogError("expected '=' after for");
+  }
+  GetNextToken(); // eat '='.
+
+  auto start = ParseExpression();
+  if (!start) {
+    return nullptr;
+  }
+  if (cur_token != ',') {
+    return LogError("expected ',' after for start value");
+  }
+  GetNextToken();
+
+  auto end = ParseExpression();
+  if (!end) {
+    return nullptr;
+  }
+
+  // The step value is optional.
+  std::unique_ptr<ExprAST> step;
+  if (cur_token == ',') {
+    GetNextToken();
+    step = ParseExpression();
+    if (!step) {
+      return nullptr;
+    }
+  } else {
+    step = std::make_unique<NumberExprAST>(for_loc, 1.0);
+  }
+
+  if (cur_token != Token::token_in) {
+    return LogError("expected 'in' after for");
+  }
+  GetNextToken(); // eat 'in'.
+
+  auto body = ParseExpression();
+  if (!body) {
+    return nullptr;
+  }
+  std::vector<ForExprAST::Induction> vars;
+  vars.push_back({id_name, std::move(start), std::move(step)});
+  return std::make_unique<ForExprAST>(for_loc, std::move(vars), std::move(end),
+                                      std::move(body));
+}
+
+/// varexpr ::= 'var' identifier ('=' expression)?
+///                    (',' identifier ('=' expression)?)* 'in' expression
+static std::unique_ptr<ExprAST> ParseVarExpr() {
+  SourceLoc var_loc = cur_loc;
+  GetNextToken(); // eat the var.
+
+  std::vector<VarExprAST::Binding> var_names;
+
+  // At least one variable name is required.
+  if (cur_token != Token::token_identifier) {
+    return LogError("expected identifier after var");
+  }
+
+  while (true) {
+    std::string_view name = CurIdentifier();
+    SourceLoc name_loc = cur_loc;
+    GetNextToken(); // eat identifier.
+
+    // Read the optional initializer.
+    std::unique_ptr<ExprAST> init;
+    if (cur_token == '=') {
+      GetNextToken(); // eat the '='.
+
+      init = ParseExpression();
+      if (!init) {
+        return nullptr;
+      }
+    } else {
+      init = std::make_unique<NumberExprAST>(name_loc, 0.0);
+    }
+
+    var_names.emplace_back(name, std::move(init));
+
+    // End of var list, exit loop.
+    if (cur_token != ',') {
+      break;
+    }
+    GetNextToken(); // eat the ','.
+
+    if (cur_token != Token::token_identifier) {
+      return LogError("expected identifier list after var");
+    }
+  }
+
+  // At this point, we have to have 'in'.
+  if (cur_token != Token::token_in) {
+    return LogError("expected 'in' keyword after 'var'");
+  }
+  GetNextToken(); // eat 'in'.
+
+  auto body = ParseExpression();
+  if (!body) {
+    return nullptr;
+  }
+  return std::make_unique<VarExprAST>(var_loc, std::move(var_names),
+                                      std::move(body));
 }
 
 /// primary
 ///   ::= identifierexpr
 ///   ::= numberexpr
 ///   ::= parenexpr
+///   ::= ifexpr
+///   ::= forexpr
+///   ::= varexpr
 static std::unique_ptr<ExprAST> ParsePrimary() {
   switch (cur_token) {
+  case Token::token_var:
+    return ParseVarExpr();
+  case Token::token_for:
+    return ParseForExpr();
+  case Token::token_if:
+    return ParseIfExpr();
   case Token::token_identifier:
     return ParseIdentifierExpr();
   case Token::token_number:
@@ -108,27 +356,79 @@ static std::unique_ptr<ExprAST> ParsePrimary() {
 /// defined.
 static std::map<char, int> BinopPrecedence;
 
-/// GetTokPrecedence - Get the precedence of the pending binary operator token.
-static int GetTokenPrecedence() {
-  if (!isascii(cur_token)) {
+/// PARSE_PRECEDENCE - The precedences the parser is using: BinopPrecedence,
+/// or those a skipped body was skipped with while it is parsed.
+static const std::map<char, int> *PARSE_PRECEDENCE = &BinopPrecedence;
+
+/// GetBinopPrecedence - Get the precedence of token as a binary operator, or
+/// -1 if it is not one.
+static int GetBinopPrecedence(int token) {
+  if (!isascii(token)) {
     return -1;
   }
   // Make sure it's a declared binop.
-  int token_prec = BinopPrecedence[cur_token];
-  if (token_prec <= 0) {
+  auto it = PARSE_PRECEDENCE->find(static_cast<char>(token));
+  if (it == PARSE_PRECEDENCE->end() || it->second <= 0) {
     return -1;
   }
-  return token_prec;
+  return it->second;
+}
+
+/// GrammarHash - A hash of the parser state that decides how tokens parse.
+inline uint64_t GrammarHash() {
+  uint64_t hash = HashBytes(nullptr, 0);
+  for (const auto &[op, prec] : BinopPrecedence) {
+    int entry[] = {op, prec};
+    hash = HashBytes(entry, sizeof(entry), hash);
+  }
+  return hash;
+}
+
+/// GetTokPrecedence - Get the precedence of the pending binary operator token.
+static int GetTokenPrecedence() { return GetBinopPrecedence(cur_token); }
+
+/// InstallOperator - Let later input use the operator proto defines.
+inline void InstallOperator(const PrototypeAST &proto) {
+  if (proto.IsBinaryOp()) {
+    BinopPrecedence[proto.GetOperatorName()] = proto.GetBinaryPrecedence();
+  }
+}
+
+/// unary
+///   ::= primary
+///   ::= '!' unary
+///
+/// Any operator character may start a unary expression; it is a call to the
+/// function that defines it, which fails at run time if there is none.
+static std::unique_ptr<ExprAST> ParseUnary() {
+  // If the current token is not an operator, it must be a primary expr.
+  if (!IsOperatorChar(cur_token)) {
+    return ParsePrimary();
+  }
+
+  // If this is a unary operator, read it.
+  int opc = cur_token;
+  SourceLoc op_loc = cur_loc;
+  GetNextToken();
+  auto operand = ParseUnary();
+  if (!operand) {
+    return nullptr;
+  }
+  std::vector<std::unique_ptr<ExprAST>> args;
+  args.push_back(std::move(operand));
+  return std::make_unique<CallExprAST>(
+      op_loc, OperatorFunctionName(false, static_cast<char>(opc)),
+      std::move(args));
 }
 
 static std::unique_ptr<ExprAST> ParseBinOpRHS(int expr_prec,
                                               std::unique_ptr<ExprAST> LHS);
 
 /// expression
-///   ::= primary binoprhs
+///   ::= unary binoprhs
 ///
 static std::unique_ptr<ExprAST> ParseExpression() {
-  auto LHS = ParsePrimary();
+  auto LHS = ParseUnary();
   if (!LHS) {
     return nullptr;
   }
@@ -136,7 +436,7 @@ static std::unique_ptr<ExprAST> ParseExpression() {
 }
 
 /// binoprhs
-///   ::= ('+' primary)*
+///   ::= ('+' unary)*
 static std::unique_ptr<ExprAST> ParseBinOpRHS(int expr_prec,
                                               std::unique_ptr<ExprAST> LHS) {
   // If this is a binop, find its precedence.
@@ -151,10 +451,11 @@ static std::unique_ptr<ExprAST> ParseBinOpRHS(int expr_prec,
 
     // Okay, we know this is a binop.
     int binop = cur_token;
+    SourceLoc binop_loc = cur_loc;
     GetNextToken(); // eat binop
 
-    // Parse the primary expression after the binary operator.
-    auto RHS = ParsePrimary();
+    // Parse the unary expression after the binary operator.
+    auto RHS = ParseUnary();
     if (!RHS) {
       return nullptr;
     }
@@ -169,47 +470,169 @@ static std::unique_ptr<ExprAST> ParseBinOpRHS(int expr_prec,
       }
     }
     // Merge LHS/RHS.
-    LHS =
-        std::make_unique<BinaryExprAST>(binop, std::move(LHS), std::move(RHS));
+    if (binop == '=') {
+      // The destination of '=' must be a variable, not a value.
+      if (LHS->GetKind() != ExprKind::variable) {
+        ReportError(binop_loc, "destination of '=' must be a variable");
+        return nullptr;
+      }
+      std::string_view name =
+          static_cast<const VariableExprAST &>(*LHS).GetName();
+      LHS = std::make_unique<AssignExprAST>(binop_loc, name, std::move(RHS));
+      continue;
+    }
+    if (IsBuiltinBinop(binop)) {
+      LHS = std::make_unique<BinaryExprAST>(binop_loc, binop, std::move(LHS),
+                                            std::move(RHS));
+      continue;
+    }
+    std::vector<std::unique_ptr<ExprAST>> args;
+    args.push_back(std::move(LHS));
+    args.push_back(std::move(RHS));
+    LHS = std::make_unique<CallExprAST>(
+        binop_loc, OperatorFunctionName(true, static_cast<char>(binop)),
+        std::move(args));
   }
 }
 
 /// prototype
 ///   ::= id '(' id* ')'
+///   ::= binary LETTER number? (id, id)
+///   ::= unary LETTER (id)
 static std::unique_ptr<PrototypeAST> ParsePrototype() {
-  if (cur_token != Token::token_identifier) {
+  std::string_view fn_name;
+  SourceLoc fn_loc = cur_loc;
+
+  unsigned kind = 0; // 0 = identifier, 1 = unary, 2 = binary.
+  int binary_precedence = 30;
+
+  switch (cur_token) {
+  default:
     return LogErrorP("Expected function name in prototype");
-  }
+  case Token::token_identifier:
+    fn_name = CurIdentifier();
+    kind = 0;
+    GetNextToken();
+    break;
+  case Token::token_unary:
+    GetNextToken();
+    if (!IsOperatorChar(cur_token)) {
+      return LogErrorP("Expected unary operator");
+    }
+    fn_name = OperatorFunctionName(false, static_cast<char>(cur_token));
+    kind = 1;
+    GetNextToken();
+    break;
+  case Token::token_binary:
+    GetNextToken();
+    if (!IsOperatorChar(cur_token)) {
+      return LogErrorP("Expected binary operator");
+    }
+    if (IsBuiltinBinop(cur_token)) {
+      return LogErrorP("Cannot redefine a built-in binary operator");
+    }
+    fn_name = OperatorFunctionName(true, static_cast<char>(cur_token));
+    kind = 2;
+    GetNextToken();
 
-  std::string fn_name = IDENTIFIER_STR;
-  GetNextToken();
+    // Read the precedence if present.
+    if (cur_token == Token::token_number) {
+      double prec = CurNumVal();
+      if (prec < 1 || prec > 100) {
+        return LogErrorP("Invalid precedence: must be 1..100");
+      }
+      binary_precedence = static_cast<int>(prec);
+      GetNextToken();
+    }
+    break;
+  }
 
   if (cur_token != '(') {
     return LogErrorP("Expected '(' in prototype");
   }
 
   // Read the list of argument names.
-  std::vector<std::string> arg_names;
+  std::vector<std::string_view> arg_names;
   while (GetNextToken() == Token::token_identifier) {
-    arg_names.push_back(IDENTIFIER_STR);
+    arg_names.push_back(CurIdentifier());
   }
   if (cur_token != ')') {
     return LogErrorP("Expected ')' in prototype");
   }
 
+  // Verify right number of names for operator.
+  if (kind && arg_names.size() != kind) {
+    return LogErrorP("Invalid number of operands for operator");
+  }
+
   // success.
   GetNextToken(); // eat ')'.
-  return std::make_unique<PrototypeAST>(fn_name, std::move(arg_names));
+  return std::make_unique<PrototypeAST>(fn_loc, fn_name, std::move(arg_names),
+                                        kind != 0, binary_precedence);
+}
+
+/// LAZY_BODIES - When walking pre-lexed tokens, have ParseDefinition skip
+/// over function bodies and leave them to be parsed on first use.
+static bool LAZY_BODIES = false;
+
+/// CurrentPrecedence - BinopPrecedence as it is now, for a skipped body to
+/// be parsed with later. Copies are shared until it changes.
+inline std::shared_ptr<const std::map<char, int>> CurrentPrecedence() {
+  static std::shared_ptr<const std::map<char, int>> current;
+  if (!current || *current != BinopPrecedence) {
+    current = std::make_shared<const std::map<char, int>>(BinopPrecedence);
+  }
+  return current;
+}
+
+/// ParseSkippedBody - Parse body as it would have parsed when it was
+/// skipped, leaving the parser where it was, which may be in another buffer.
+/// Operators defined since then do not change its meaning, and the parse
+/// cannot run past the end the skipper found.
+static std::unique_ptr<ExprAST> ParseSkippedBody(const SkippedBody &body) {
+  ParserState saved = SaveParserState();
+  const std::map<char, int> *precedence = PARSE_PRECEDENCE;
+  PRELEXED_TOKENS = body.tokens;
+  PARSE_PRECEDENCE = body.precedence.get();
+  end_token_index = body.end;
+  SkipToToken(body.begin);
+  auto E = ParseExpression();
+  bool at_end = cur_token_index == body.end;
+  PARSE_PRECEDENCE = precedence;
+  RestoreParserState(saved);
+  // The body was checked by TokenSkipper when it was skipped, so this cannot
+  // fail unless the two disagree about the grammar.
+  if (!E || !at_end) {
+    E = std::make_unique<NumberExprAST>(body.tokens->GetLoc(body.begin), 0);
+  }
+  return E;
 }
 
 /// definition ::= 'def' prototype expression
+///
+/// A binary operator can be used from the end of its definition on, so its
+/// own body cannot use it as an operator.
 static std::unique_ptr<FunctionAST> ParseDefinition() {
   GetNextToken(); // eat def.
   auto Proto = ParsePrototype();
   if (!Proto) {
     return nullptr;
   }
+  if (LAZY_BODIES && PRELEXED_TOKENS) {
+    // Only skip bodies that parse; parse the rest now to report the error.
+    size_t begin = cur_token_index;
+    TokenSkipper skipper(*PRELEXED_TOKENS, begin, BinopPrecedence);
+    if (skipper.SkipExpression()) {
+      SkippedBody body{PRELEXED_TOKENS, begin, skipper.GetPos(),
+                       CurrentPrecedence()};
+      SkipToToken(body.end);
+      InstallOperator(*Proto);
+      return std::make_unique<FunctionAST>(std::move(Proto), ParseSkippedBody,
+                                           std::move(body));
+    }
+  }
   if (auto E = ParseExpression()) {
+    InstallOperator(*Proto);
     return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
   }
   return nullptr;
@@ -225,60 +648,9 @@ static std::unique_ptr<PrototypeAST> ParseExtern() {
 static std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
   if (auto E = ParseExpression()) {
     // Make an anonymous proto.
-    auto proto = std::make_unique<PrototypeAST>("", std::vector<std::string>());
+    auto proto = std::make_unique<PrototypeAST>(E->GetLoc(), "",
+                                                std::vector<std::string_view>());
     return std::make_unique<FunctionAST>(std::move(proto), std::move(E));
   }
   return nullptr;
 }
-
-// Top-Level parsing
-static void HandleDefinition() {
-  if (ParseDefinition()) {
-    fprintf(stderr, "Parsed a function definition.\n");
-  } else {
-    // Skip token for error recovery.
-    GetNextToken();
-  }
-}
-
-static void HandleExtern() {
-  if (ParseExtern()) {
-    fprintf(stderr, "Parsed an extern\n");
-  } else {
-    // Skip token for error recovery.
-    GetNextToken();
-  }
-}
-
-static void HandleTopLevelExpr() {
-  // Evaluate a top-level expression into an anonymous function.
-  if (ParseTopLevelExpr()) {
-    fprintf(stderr, "Parsed a top-level expression\n");
-  } else {
-    // Skip token for error recovery.
-    GetNextToken();
-  }
-}
-
-/// top ::= definition | external | expression | ';'
-static void MainLoop() {
-  while (true) {
-    fprintf(stderr, "ready> ");
-    switch (cur_token) {
-    case Token::token_eof:
-      return;
-    case ';':
-      GetNextToken();
-      break;
-    case Token::token_def:
-      HandleDefinition();
-      break;
-    case Token::token_extern:
-      HandleExtern();
-      break;
-    default:
-      HandleTopLevelExpr();
-      break;
-    }
-  }
-}
@@ -0,0 +1,235 @@
+#pragma once
+
+#include "char_class.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KALEIDOSCOPE_SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+// Character-run scanners used by the lexer. Each Skip* function returns the
+// first position in [cur, end) that does not belong to its run (or end), and
+// never reads outside [cur, end). Wide versions handle 16 or 32 bytes per step
+// and finish the tail with the scalar loop.
+
+/// ScanLevel - Which implementation the scanners dispatch to.
+enum class ScanLevel { scalar, sse2, avx2 };
+
+namespace scan {
+
+inline const char *SkipSpaceScalar(const char *cur, const char *end) {
+  while (cur != end && IsSpaceChar(*cur)) {
+    ++cur;
+  }
+  return cur;
+}
+
+inline const char *SkipAlnumScalar(const char *cur, const char *end) {
+  while (cur != end && IsAlnumChar(*cur)) {
+    ++cur;
+  }
+  return cur;
+}
+
+inline const char *SkipNumberScalar(const char *cur, const char *end) {
+  while (cur != end && IsNumberChar(*cur)) {
+    ++cur;
+  }
+  return cur;
+}
+
+inline const char *SkipLineScalar(const char *cur, const char *end) {
+  while (cur != end && !IsLineEndChar(*cur)) {
+    ++cur;
+  }
+  return cur;
+}
+
+#ifdef KALEIDOSCOPE_SCAN_X86
+
+// The SSE2 and AVX2 versions share one body; only the vector width and the
+// intrinsics differ. Bytes >= 0x80 compare as negative, so none of the ASCII
+// ranges below ever match them.
+
+#define KALEIDOSCOPE_DEFINE_SCANNERS(SUFFIX, ATTR, VEC, WIDTH, LOAD, SET1, EQ,   \
+                                     GT, OR, AND, MOVEMASK)                     \
+  ATTR inline VEC InRange##SUFFIX(VEC v, char lo, char hi) {                   \
+    return AND(GT(v, SET1(static_cast<char>(lo - 1))),                         \
+               GT(SET1(static_cast<char>(hi + 1)), v));                        \
+  }                                                                            \
+  ATTR inline VEC SpaceMask##SUFFIX(VEC v) {                                   \
+    return OR(EQ(v, SET1(' ')), InRange##SUFFIX(v, '\t', '\r'));               \
+  }                                                                            \
+  ATTR inline VEC AlnumMask##SUFFIX(VEC v) {                                   \
+    return OR(InRange##SUFFIX(v, '0', '9'),                                    \
+              InRange##SUFFIX(OR(v, SET1(0x20)), 'a', 'z'));                   \
+  }                                                                            \
+  ATTR inline VEC NumberMask##SUFFIX(VEC v) {                                  \
+    return OR(InRange##SUFFIX(v, '0', '9'), EQ(v, SET1('.')));                 \
+  }                                                                            \
+  ATTR inline VEC LineEndMask##SUFFIX(VEC v) {                                 \
+    return OR(EQ(v, SET1('\n')), EQ(v, SET1('\r')));                           \
+  }                                                                            \
+  /* Advance while MASK holds (or, if STOP, until it holds). */                \
+  template <VEC (*MASK)(VEC), bool STOP>                                       \
+  ATTR const char *Run##SUFFIX(const char *cur, const char *end) {             \
+    while (end - cur >= WIDTH) {                                               \
+      VEC v = LOAD(reinterpret_cast<const VEC *>(cur));                        \
+      unsigned bits = static_cast<unsigned>(MOVEMASK(MASK(v)));                \
+      if (!STOP) {                                                             \
+        bits = ~bits;                                                          \
+      }                                                                        \
+      if (WIDTH == 16) {                                                       \
+        bits &= 0xffffu;                                                       \
+      }                                                                        \
+      if (bits) {                                                              \
+        return cur + __builtin_ctz(bits);                                      \
+      }                                                                        \
+      cur += WIDTH;                                                            \
+    }                                                                          \
+    return cur;                                                                \
+  }                                                                            \
+  ATTR inline const char *SkipSpace##SUFFIX(const char *cur,                   \
+                                            const char *end) {                 \
+    return SkipSpaceScalar(Run##SUFFIX<SpaceMask##SUFFIX, false>(cur, end),    \
+                           end);                                               \
+  }                                                                            \
+  ATTR inline const char *SkipAlnum##SUFFIX(const char *cur,                   \
+                                            const char *end) {                 \
+    return SkipAlnumScalar(Run##SUFFIX<AlnumMask##SUFFIX, false>(cur, end),    \
+                           end);                                               \
+  }                                                                            \
+  ATTR inline const char *SkipNumber##SUFFIX(const char *cur,                  \
+                                             const char *end) {                \
+    return SkipNumberScalar(Run##SUFFIX<NumberMask##SUFFIX, false>(cur, end),  \
+                            end);                                              \
+  }                                                                            \
+  ATTR inline const char *SkipLine##SUFFIX(const char *cur,                    \
+                                           const char *end) {                  \
+    return SkipLineScalar(Run##SUFFIX<LineEndMask##SUFFIX, true>(cur, end),    \
+                          end);                                                \
+  }
+
+#define KALEIDOSCOPE_SSE2_ATTR __attribute__((target("sse2")))
+#define KALEIDOSCOPE_AVX2_ATTR __attribute__((target("avx2")))
+
+KALEIDOSCOPE_DEFINE_SCANNERS(Sse2, KALEIDOSCOPE_SSE2_ATTR, __m128i, 16,
+                             _mm_loadu_si128, _mm_set1_epi8, _mm_cmpeq_epi8,
+                             _mm_cmpgt_epi8, _mm_or_si128, _mm_and_si128,
+                             _mm_movemask_epi8)
+KALEIDOSCOPE_DEFINE_SCANNERS(Avx2, KALEIDOSCOPE_AVX2_ATTR, __m256i, 32,
+                             _mm256_loadu_si256, _mm256_set1_epi8,
+                             _mm256_cmpeq_epi8, _mm256_cmpgt_epi8,
+                             _mm256_or_si256, _mm256_and_si256,
+                             _mm256_movemask_epi8)
+
+#undef KALEIDOSCOPE_DEFINE_SCANNERS
+
+#endif // KALEIDOSCOPE_SCAN_X86
+
+} // namespace scan
+
+/// BestScanLevel - The widest implementation this CPU supports.
+inline ScanLevel BestScanLevel() {
+#ifdef KALEIDOSCOPE_SCAN_X86
+  if (__builtin_cpu_supports("avx2")) {
+    return ScanLevel::avx2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return ScanLevel::sse2;
+  }
+#endif
+  return ScanLevel::scalar;
+}
+
+namespace scan {
+
+using ScanFn = const char *(*)(const char *, const char *);
+
+/// Scanners - The table the lexer calls through.
+struct Scanners {
+  ScanLevel level;
+  ScanFn skip_space;
+  ScanFn skip_alnum;
+  ScanFn skip_number;
+  ScanFn skip_line;
+};
+
+inline Scanners MakeScanners(ScanLevel level) {
+  switch (level) {
+#ifdef KALEIDOSCOPE_SCAN_X86
+  case ScanLevel::avx2:
+    return {level, SkipSpaceAvx2, SkipAlnumAvx2, SkipNumberAvx2, SkipLineAvx2};
+  case ScanLevel::sse2:
+    return {level, SkipSpaceSse2, SkipAlnumSse2, SkipNumberSse2, SkipLineSse2};
+#endif
+  default:
+    return {ScanLevel::scalar, SkipSpaceScalar, SkipAlnumScalar,
+            SkipNumberScalar, SkipLineScalar};
+  }
+}
+
+/// ActiveScanners - Dispatches to the best level the CPU supports unless
+/// SetScanLevel says otherwise.
+inline Scanners &ActiveScanners() {
+  static Scanners scanners = MakeScanners(BestScanLevel());
+  return scanners;
+}
+
+} // namespace scan
+
+/// SetScanLevel - Route the scanners to the given implementation, clamped to
+/// what the CPU supports. Returns the level actually selected.
+inline ScanLevel SetScanLevel(ScanLevel level) {
+  if (level > BestScanLevel()) {
+    level = BestScanLevel();
+  }
+  scan::ActiveScanners() = scan::MakeScanners(level);
+  return scan::ActiveScanners().level;
+}
+
+inline ScanLevel GetScanLevel() { return scan::ActiveScanners().level; }
+
+inline const char *ScanLevelName(ScanLevel level) {
+  switch (level) {
+  case ScanLevel::avx2:
+    return "avx2";
+  case ScanLevel::sse2:
+    return "sse2";
+  default:
+    return "scalar";
+  }
+}
+
+// Entry points for the lexer. Most runs are a single character (one space
+// between tokens, one-letter names), so the first byte is checked inline and
+// the dispatched scanner is only called for longer runs.
+
+inline const char *SkipWhitespace(const char *cur, const char *end) {
+  if (cur == end || !IsSpaceChar(*cur)) {
+    return cur;
+  }
+  ++cur;
+  if (cur == end || !IsSpaceChar(*cur)) {
+    return cur;
+  }
+  return scan::ActiveScanners().skip_space(cur, end);
+}
+
+inline const char *SkipIdentifierTail(const char *cur, const char *end) {
+  if (cur == end || !IsAlnumChar(*cur)) {
+    return cur;
+  }
+  return scan::ActiveScanners().skip_alnum(cur, end);
+}
+
+inline const char *SkipNumberTail(const char *cur, const char *end) {
+  if (cur == end || !IsNumberChar(*cur)) {
+    return cur;
+  }
+  return scan::ActiveScanners().skip_number(cur, end);
+}
+
+inline const char *SkipToLineEnd(const char *cur, const char *end) {
+  return scan::ActiveScanners().skip_line(cur, end);
+}
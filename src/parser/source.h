@@ -0,0 +1,151 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/// SourceLoc - A position in the session's source text, encoded in 32 bits.
+/// Every buffer gets its own range of the location space, so a SourceLoc
+/// alone identifies both the buffer and the byte offset within it. 0 means
+/// "unknown".
+using SourceLoc = uint32_t;
+
+/// SourceBuffer - One piece of retained source text and where it lives in
+/// the location space.
+struct SourceBuffer {
+  std::string name;
+  std::string text;
+  SourceLoc base;      // Location of text[0], or 0 if the space ran out.
+  unsigned first_line; // Line number of the first line in text.
+  // Offsets of each line start, built the first time a location in this
+  // buffer is decoded.
+  mutable std::vector<uint32_t> line_starts;
+
+  SourceLoc GetLoc(size_t offset) const {
+    return base ? base + static_cast<SourceLoc>(offset) : 0;
+  }
+};
+
+/// PresumedLoc - A decoded SourceLoc, ready for a diagnostic.
+struct PresumedLoc {
+  std::string_view name;
+  unsigned line;
+  unsigned column;
+};
+
+/// SourceManager - Owns every piece of source text read during a parse
+/// session: whole files, or stdin one line at a time. Buffers are never moved
+/// or freed while the session lives, so tokens and AST nodes refer to their
+/// text with plain string_views instead of copying it, and to their position
+/// with a SourceLoc.
+class SourceManager {
+private:
+  std::deque<SourceBuffer> buffers;
+  // Buffers that were given a location range, in location order.
+  std::vector<const SourceBuffer *> located;
+  uint64_t next_base = 1;
+
+  const SourceBuffer *FindBuffer(SourceLoc loc) const {
+    auto it = std::upper_bound(
+        located.begin(), located.end(), loc,
+        [](SourceLoc l, const SourceBuffer *b) { return l < b->base; });
+    if (it == located.begin()) {
+      return nullptr;
+    }
+    const SourceBuffer *buffer = *(it - 1);
+    if (loc - buffer->base > buffer->text.size()) {
+      return nullptr;
+    }
+    return buffer;
+  }
+
+public:
+  /// AddBuffer - Take ownership of text and give it a range of locations.
+  /// The returned buffer stays valid, at the same address, for the rest of
+  /// the session.
+  const SourceBuffer &AddBuffer(std::string name, std::string text,
+                                unsigned first_line = 1) {
+    // Leave room for the one-past-the-end location (where token_eof sits).
+    uint64_t size = text.size() + 1;
+    SourceLoc base = 0;
+    if (next_base + size <= UINT32_MAX) {
+      base = static_cast<SourceLoc>(next_base);
+      next_base += size;
+    }
+    buffers.push_back(
+        SourceBuffer{std::move(name), std::move(text), base, first_line, {}});
+    if (base) {
+      located.push_back(&buffers.back());
+    }
+    return buffers.back();
+  }
+
+  /// Decode - Turn loc into a buffer name, line and column. Returns false if
+  /// loc is unknown.
+  bool Decode(SourceLoc loc, PresumedLoc &result) const {
+    const SourceBuffer *buffer = loc ? FindBuffer(loc) : nullptr;
+    if (!buffer) {
+      return false;
+    }
+    std::vector<uint32_t> &starts = buffer->line_starts;
+    if (starts.empty()) {
+      const char *text = buffer->text.data();
+      const char *end = text + buffer->text.size();
+      starts.push_back(0);
+      for (const char *p = text;
+           (p = static_cast<const char *>(memchr(p, '\n', end - p)));) {
+        starts.push_back(static_cast<uint32_t>(++p - text));
+      }
+    }
+    uint32_t offset = loc - buffer->base;
+    auto line = std::upper_bound(starts.begin(), starts.end(), offset) - 1;
+    result.name = buffer->name;
+    result.line = buffer->first_line + static_cast<unsigned>(line - starts.begin());
+    result.column = offset - *line + 1;
+    return true;
+  }
+};
+
+/// ReadAll - Read everything left in file into text.
+inline void ReadAll(FILE *file, std::string &text) {
+  char chunk[1 << 16];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+    text.append(chunk, n);
+  }
+}
+
+// The session's source text. Like the other parser globals, there is one per
+// process.
+static SourceManager SOURCES;
+
+/// ReportError - Print "file:line:col: Error: message", or just
+/// "Error: message" if loc is unknown.
+inline void ReportError(SourceLoc loc, const char *message) {
+  PresumedLoc presumed;
+  if (SOURCES.Decode(loc, presumed)) {
+    fprintf(stderr, "%.*s:%u:%u: Error: %s\n",
+            static_cast<int>(presumed.name.size()), presumed.name.data(),
+            presumed.line, presumed.column, message);
+  } else {
+    fprintf(stderr, "Error: %s\n", message);
+  }
+}
+
+/// ReportRemark - Print "file:line:col: remark: message", for diagnostics
+/// that explain what a pass did rather than report a problem.
+inline void ReportRemark(SourceLoc loc, const char *message) {
+  PresumedLoc presumed;
+  if (SOURCES.Decode(loc, presumed)) {
+    fprintf(stderr, "%.*s:%u:%u: remark: %s\n",
+            static_cast<int>(presumed.name.size()), presumed.name.data(),
+            presumed.line, presumed.column, message);
+  } else {
+    fprintf(stderr, "remark: %s\n", message);
+  }
+}
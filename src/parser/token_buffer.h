@@ -0,0 +1,211 @@
+#pragma once
+
+#include "lexer.h"
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/// HashBytes - 64-bit FNV-1a of size bytes at data, continuing from seed.
+inline uint64_t HashBytes(const void *data, size_t size,
+                          uint64_t seed = 14695981039346656037ull) {
+  const unsigned char *bytes = static_cast<const unsigned char *>(data);
+  uint64_t hash = seed;
+  for (size_t i = 0; i < size; ++i) {
+    hash = (hash ^ bytes[i]) * 1099511628211ull;
+  }
+  return hash;
+}
+
+/// HashName - A quick hash of an identifier's text, taking it eight bytes
+/// at a time. Names are short, so this is usually one or two multiplies.
+inline uint64_t HashName(std::string_view name) {
+  const char *bytes = name.data();
+  size_t size = name.size();
+  uint64_t hash = size * 0x9e3779b97f4a7c15ull;
+  for (; size >= 8; bytes += 8, size -= 8) {
+    uint64_t word;
+    memcpy(&word, bytes, 8);
+    hash = (hash ^ word) * 0xbf58476d1ce4e5b9ull;
+    hash ^= hash >> 31;
+  }
+  if (size) {
+    uint64_t word = 0;
+    memcpy(&word, bytes, size);
+    hash = (hash ^ word) * 0x94d049bb133111ebull;
+  }
+  return hash ^ (hash >> 29);
+}
+
+/// SymbolTable - Interns identifier text so that every distinct name gets a
+/// small dense ID. The table holds views only; the text itself lives in the
+/// source buffer being lexed, which must outlive the table.
+///
+/// Lookups probe a flat open-addressing table, kept at most half full, of
+/// IDs tagged with the high half of their name's hash, so that a probe only
+/// compares text when the tags match. This runs once per identifier token,
+/// so it is most of what lexing costs beyond the scanners.
+class SymbolTable {
+private:
+  static constexpr uint32_t EMPTY = UINT32_MAX;
+
+  struct Slot {
+    uint32_t tag = 0;
+    uint32_t id = EMPTY;
+  };
+
+  std::vector<std::string_view> names;
+  std::vector<Slot> slots = std::vector<Slot>(64);
+
+  /// Grow - Double the table and put every name back in it.
+  void Grow() {
+    std::vector<Slot> old(slots.size() * 2);
+    slots.swap(old);
+    size_t mask = slots.size() - 1;
+    for (const Slot &slot : old) {
+      if (slot.id == EMPTY) {
+        continue;
+      }
+      size_t i = HashName(names[slot.id]) & mask;
+      while (slots[i].id != EMPTY) {
+        i = (i + 1) & mask;
+      }
+      slots[i] = slot;
+    }
+  }
+
+public:
+  uint32_t Intern(std::string_view name) {
+    uint64_t hash = HashName(name);
+    uint32_t tag = static_cast<uint32_t>(hash >> 32);
+    size_t mask = slots.size() - 1;
+    size_t i = hash & mask;
+    for (; slots[i].id != EMPTY; i = (i + 1) & mask) {
+      if (slots[i].tag == tag && names[slots[i].id] == name) {
+        return slots[i].id;
+      }
+    }
+    uint32_t id = static_cast<uint32_t>(names.size());
+    names.push_back(name);
+    slots[i] = {tag, id};
+    if (names.size() * 2 > slots.size()) {
+      Grow();
+    }
+    return id;
+  }
+
+  std::string_view GetName(uint32_t id) const { return names[id]; }
+  size_t size() const { return names.size(); }
+};
+
+/// TokenBuffer - A whole input lexed up front. Tokens are stored
+/// struct-of-arrays style: token i is described by kinds[i], offsets[i],
+/// lengths[i] and values[i], with offsets relative to the source buffer the
+/// tokens were lexed from. The buffer always ends with a token_eof token.
+class TokenBuffer {
+public:
+  /// TokenValue - Number tokens carry their value, identifiers their symbol ID.
+  union TokenValue {
+    double num_val;
+    uint32_t symbol;
+  };
+
+private:
+  std::vector<int16_t> kinds;
+  std::vector<uint32_t> offsets;
+  std::vector<uint32_t> lengths;
+  std::vector<TokenValue> values;
+  SymbolTable symbols;
+  const SourceBuffer *buffer = nullptr;
+
+public:
+  void Append(int kind, uint32_t offset, uint32_t length, TokenValue value) {
+    kinds.push_back(static_cast<int16_t>(kind));
+    offsets.push_back(offset);
+    lengths.push_back(length);
+    values.push_back(value);
+  }
+
+  void Clear(const SourceBuffer &new_buffer) {
+    buffer = &new_buffer;
+    kinds.clear();
+    offsets.clear();
+    lengths.clear();
+    values.clear();
+    symbols = SymbolTable();
+  }
+
+  void Reserve(size_t count) {
+    kinds.reserve(count);
+    offsets.reserve(count);
+    lengths.reserve(count);
+    values.reserve(count);
+  }
+
+  size_t size() const { return kinds.size(); }
+  int GetKind(size_t i) const { return kinds[i]; }
+  uint32_t GetOffset(size_t i) const { return offsets[i]; }
+  uint32_t GetLength(size_t i) const { return lengths[i]; }
+  double GetNumVal(size_t i) const { return values[i].num_val; }
+  uint32_t GetSymbol(size_t i) const { return values[i].symbol; }
+
+  /// GetText - The source text of token i; a view, not a copy.
+  std::string_view GetText(size_t i) const {
+    return std::string_view(buffer->text).substr(offsets[i], lengths[i]);
+  }
+
+  /// GetLoc - Where token i starts in the session's location space.
+  SourceLoc GetLoc(size_t i) const { return buffer->GetLoc(offsets[i]); }
+
+  SymbolTable &GetSymbols() { return symbols; }
+  const SymbolTable &GetSymbols() const { return symbols; }
+
+  /// AppendCanonical - Append tokens [begin, end) to out as their kinds,
+  /// identifier text and number bits: everything that decides how they
+  /// parse, and nothing about where they are.
+  void AppendCanonical(size_t begin, size_t end, std::string &out) const {
+    for (size_t i = begin; i < end; ++i) {
+      int16_t kind = kinds[i];
+      out.append(reinterpret_cast<const char *>(&kind), sizeof(kind));
+      if (kind == Token::token_identifier) {
+        std::string_view text = GetText(i);
+        uint32_t length = static_cast<uint32_t>(text.size());
+        out.append(reinterpret_cast<const char *>(&length), sizeof(length));
+        out.append(text);
+      } else if (kind == Token::token_number) {
+        double value = values[i].num_val;
+        out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+      }
+    }
+  }
+};
+
+/// LexBuffer - Lex all of buffer into tokens, replacing whatever tokens it
+/// held before. Tokens refer into buffer, so it must outlive them (buffers
+/// owned by SOURCES always do).
+inline void LexBuffer(const SourceBuffer &buffer, TokenBuffer &tokens) {
+  std::string_view source = buffer.text;
+  tokens.Clear(buffer);
+  // A rough guess that avoids most regrowth on typical input.
+  tokens.Reserve(source.size() / 2 + 1);
+
+  const char *begin = source.data();
+  const char *cur = begin;
+  const char *end = begin + source.size();
+  while (true) {
+    LexedToken tok = LexToken(cur, end);
+    TokenBuffer::TokenValue value{};
+    if (tok.kind == Token::token_identifier) {
+      value.symbol =
+          tokens.GetSymbols().Intern(std::string_view(tok.start, tok.length));
+    } else if (tok.kind == Token::token_number) {
+      value.num_val = tok.num_val;
+    }
+    tokens.Append(tok.kind, static_cast<uint32_t>(tok.start - begin),
+                  static_cast<uint32_t>(tok.length), value);
+    if (tok.kind == Token::token_eof) {
+      return;
+    }
+  }
+}
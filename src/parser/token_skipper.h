@@ -0,0 +1,208 @@
+#pragma once
+
+#include "token_buffer.h"
+#include <map>
+
+/// TokenSkipper - Finds where a construct ends in a pre-lexed buffer without
+/// parsing it. It follows the parser's grammar and lookahead exactly (the
+/// same tokens continue an expression, and '(' after an identifier starts a
+/// call), but only moves an index, so it allocates nothing and costs a few
+/// compares per token.
+///
+/// Skip* return false on input the parser would reject; callers should then
+/// parse normally, which reports the error.
+class TokenSkipper {
+private:
+  const TokenBuffer &tokens;
+  const std::map<char, int> &precedence;
+  size_t pos;
+
+  int Kind() const { return tokens.GetKind(pos); }
+
+  /// Precedence - The precedence of kind as a binary operator, or -1 if it
+  /// is not one.
+  int Precedence(int kind) const {
+    if (!isascii(kind)) {
+      return -1;
+    }
+    auto it = precedence.find(static_cast<char>(kind));
+    return it == precedence.end() || it->second <= 0 ? -1 : it->second;
+  }
+
+  bool Expect(int kind) {
+    if (Kind() != kind) {
+      return false;
+    }
+    ++pos;
+    return true;
+  }
+
+  /// primary ::= identifier ['(' [expression (',' expression)*] ')']
+  ///           | number | '(' expression ')'
+  ///           | 'if' expression 'then' expression 'else' expression
+  ///           | 'for' identifier '=' expression ',' expression
+  ///             [',' expression] 'in' expression
+  ///           | 'var' identifier ['=' expression]
+  ///             (',' identifier ['=' expression])* 'in' expression
+  ///
+  /// bare says whether the primary is a variable reference, which may be
+  /// assigned to.
+  bool SkipPrimary(bool &bare) {
+    bare = false;
+    switch (Kind()) {
+    case Token::token_var:
+      ++pos;
+      do {
+        if (!Expect(Token::token_identifier) ||
+            (Expect('=') && !SkipExpression())) {
+          return false;
+        }
+      } while (Expect(','));
+      return Expect(Token::token_in) && SkipExpression();
+    case Token::token_for:
+      ++pos;
+      if (!Expect(Token::token_identifier) || !Expect('=') ||
+          !SkipExpression() || !Expect(',') || !SkipExpression()) {
+        return false;
+      }
+      if (Expect(',') && !SkipExpression()) {
+        return false;
+      }
+      return Expect(Token::token_in) && SkipExpression();
+    case Token::token_if:
+      ++pos;
+      return SkipExpression() && Expect(Token::token_then) &&
+             SkipExpression() && Expect(Token::token_else) && SkipExpression();
+    case Token::token_identifier:
+      ++pos;
+      if (Kind() != '(') {
+        bare = true;
+        return true;
+      }
+      ++pos;
+      if (Expect(')')) {
+        return true;
+      }
+      while (true) {
+        if (!SkipExpression()) {
+          return false;
+        }
+        if (Expect(')')) {
+          return true;
+        }
+        if (!Expect(',')) {
+          return false;
+        }
+      }
+    case Token::token_number:
+      ++pos;
+      return true;
+    case '(':
+      ++pos;
+      return SkipExpression(bare) && Expect(')');
+    default:
+      return false;
+    }
+  }
+
+public:
+  /// TokenSkipper - Skip tokens from pos, with precedence giving the binary
+  /// operators, as in BinopPrecedence.
+  TokenSkipper(const TokenBuffer &tokens, size_t pos,
+               const std::map<char, int> &precedence)
+      : tokens(tokens), precedence(precedence), pos(pos) {}
+
+  size_t GetPos() const { return pos; }
+
+  /// unary ::= opchar unary | primary
+  bool SkipUnary(bool &bare) {
+    bool prefixed = false;
+    while (IsOperatorChar(Kind())) {
+      ++pos;
+      prefixed = true;
+    }
+    if (!SkipPrimary(bare)) {
+      return false;
+    }
+    bare = bare && !prefixed;
+    return true;
+  }
+
+  /// expression ::= unary (binop unary)*
+  ///
+  /// The destination of '=' is what the parser would give it as its left
+  /// operand: the operands back to the last operator that binds more loosely
+  /// than '='. That must be a single bare variable. bare says whether the
+  /// whole expression is one.
+  bool SkipExpression(bool &bare) {
+    int assign_precedence = Precedence('=');
+    bool operand_bare;
+    if (!SkipUnary(operand_bare)) {
+      return false;
+    }
+    bare = operand_bare;
+    size_t run = 1; // Operands since the last operator looser than '='.
+    for (int prec; (prec = Precedence(Kind())) > 0;) {
+      if (Kind() == '=' && (run != 1 || !operand_bare)) {
+        return false;
+      }
+      if (prec < assign_precedence) {
+        run = 0;
+      }
+      ++pos;
+      if (!SkipUnary(operand_bare)) {
+        return false;
+      }
+      ++run;
+      bare = false;
+    }
+    return true;
+  }
+
+  bool SkipExpression() {
+    bool bare;
+    return SkipExpression(bare);
+  }
+
+  /// prototype ::= identifier '(' identifier* ')'
+  ///             | 'unary' opchar '(' identifier ')'
+  ///             | 'binary' opchar [number] '(' identifier identifier ')'
+  bool SkipPrototype() {
+    size_t operands = 0;
+    if (Expect(Token::token_unary)) {
+      if (!IsOperatorChar(Kind())) {
+        return false;
+      }
+      ++pos;
+      operands = 1;
+    } else if (Expect(Token::token_binary)) {
+      int op = Kind();
+      if (!IsOperatorChar(op) || IsBuiltinBinop(op)) {
+        return false;
+      }
+      ++pos;
+      if (Kind() == Token::token_number) {
+        double prec = tokens.GetNumVal(pos++);
+        if (prec < 1 || prec > 100) {
+          return false;
+        }
+      }
+      operands = 2;
+    } else if (!Expect(Token::token_identifier)) {
+      return false;
+    }
+    if (!Expect('(')) {
+      return false;
+    }
+    size_t names = 0;
+    while (Expect(Token::token_identifier)) {
+      ++names;
+    }
+    return (operands == 0 || names == operands) && Expect(')');
+  }
+
+  /// definition ::= 'def' prototype expression
+  bool SkipDefinition() {
+    return Expect(Token::token_def) && SkipPrototype() && SkipExpression();
+  }
+};
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "ast.h"
+
+/// ExprVisitor - CRTP base for passes over expression trees. Visit switches
+/// on the node's ExprKind and calls the derived class's handler directly:
+///
+///   class CountNodes : public ExprVisitor<CountNodes, int> {
+///   public:
+///     int VisitNumber(const NumberExprAST &) { return 1; }
+///     int VisitBinary(const BinaryExprAST &e) {
+///       return 1 + Visit(e.GetLHS()) + Visit(e.GetRHS());
+///     }
+///     ...
+///   };
+///
+/// There are no virtual calls, so handlers can be inlined and the switch
+/// compiles to a jump table. Extra arguments (ArgTys) are passed through to
+/// every handler. A derived class must handle every ExprKind.
+template <typename Derived, typename RetTy = void, typename... ArgTys>
+class ExprVisitor {
+public:
+  RetTy Visit(const ExprAST &expr, ArgTys... args) {
+    Derived &self = static_cast<Derived &>(*this);
+    switch (expr.GetKind()) {
+    case ExprKind::number:
+      return self.VisitNumber(static_cast<const NumberExprAST &>(expr),
+                              args...);
+    case ExprKind::variable:
+      return self.VisitVariable(static_cast<const VariableExprAST &>(expr),
+                                args...);
+    case ExprKind::binary:
+      return self.VisitBinary(static_cast<const BinaryExprAST &>(expr),
+                              args...);
+    case ExprKind::call:
+      return self.VisitCall(static_cast<const CallExprAST &>(expr), args...);
+    case ExprKind::var:
+      return self.VisitVar(static_cast<const VarExprAST &>(expr), args...);
+    case ExprKind::if_:
+      return self.VisitIf(static_cast<const IfExprAST &>(expr), args...);
+    case ExprKind::for_:
+      return self.VisitFor(static_cast<const ForExprAST &>(expr), args...);
+    case ExprKind::assign:
+      return self.VisitAssign(static_cast<const AssignExprAST &>(expr),
+                              args...);
+    }
+    __builtin_unreachable();
+  }
+};
@@ -0,0 +1,264 @@
+// Runs compiled code on several threads at once, which the scripts cannot:
+//
+// - Threads call functions while the main thread redefines their callees,
+//   a builtin's name included. Every call must see one definition or the
+//   other, whole, and every replaced body must be freed once the threads
+//   are done.
+// - Threads make the first call to a lazily compiled function together. It
+//   must be compiled once, by one of them, and the others must run that.
+//
+// Both run under the closure engine and the VM, compiling eagerly and
+// lazily. Only the main thread parses.
+
+#include "closure_compiler.h"
+#include "epoch.h"
+#include "parser.h"
+#include "vm.h"
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+static constexpr unsigned NUM_THREADS = 4;
+static constexpr unsigned NUM_CALLS = 2000;
+static constexpr unsigned NUM_REDEFINITIONS = 500;
+static constexpr unsigned NUM_LAZY = 200;
+
+static unsigned FAILURES = 0;
+
+static void Expect(bool ok, const char *engine, const char *what) {
+  if (!ok) {
+    fprintf(stderr, "FAIL (%s): %s\n", engine, what);
+    ++FAILURES;
+  }
+}
+
+/// Program - The items of one parsed source text, in order. Top-level
+/// expressions are kept rather than run, so that other threads can run them.
+struct Program {
+  std::vector<std::unique_ptr<FunctionAST>> definitions;
+  std::vector<std::unique_ptr<PrototypeAST>> externs;
+  std::vector<std::unique_ptr<FunctionAST>> exprs;
+};
+
+/// Parse - Lex and parse text, which must be free of errors. The parsed
+/// names point into the session's source text, which outlives them.
+static Program Parse(std::string text) {
+  static std::deque<TokenBuffer> token_buffers;
+  const SourceBuffer &source =
+      SOURCES.AddBuffer("<test>", std::move(text));
+  TokenBuffer &tokens = token_buffers.emplace_back();
+  LexBuffer(source, tokens);
+  UsePrelexedTokens(&tokens);
+  GetNextToken();
+
+  Program program;
+  bool ok = true;
+  while (ok && cur_token != Token::token_eof) {
+    if (cur_token == ';') {
+      GetNextToken();
+    } else if (cur_token == Token::token_def) {
+      program.definitions.push_back(ParseDefinition());
+      ok = program.definitions.back() != nullptr;
+    } else if (cur_token == Token::token_extern) {
+      program.externs.push_back(ParseExtern());
+      ok = program.externs.back() != nullptr;
+    } else {
+      program.exprs.push_back(ParseTopLevelExpr());
+      ok = program.exprs.back() != nullptr;
+    }
+  }
+  if (!ok) {
+    fprintf(stderr, "FAIL: the test's own source does not parse\n");
+    exit(1);
+  }
+  return program;
+}
+
+/// Define - Hand every definition and extern in text to engine.
+static bool Define(Engine &engine, const std::string &text) {
+  Program program = Parse(text);
+  bool ok = true;
+  for (auto &proto : program.externs) {
+    ok = proto && engine.AddExtern(std::move(proto)) && ok;
+  }
+  for (auto &fn : program.definitions) {
+    ok = fn && engine.AddFunction(std::move(fn)) && ok;
+  }
+  return ok;
+}
+
+/// CallsOf - Parse NUM_CALLS calls callee(i) for each thread.
+static std::vector<Program> CallsOf(const char *callee) {
+  std::vector<Program> calls;
+  for (unsigned t = 0; t < NUM_THREADS; ++t) {
+    std::string text;
+    for (unsigned i = 0; i < NUM_CALLS; ++i) {
+      text += std::string(callee) + "(" + std::to_string(i) + ");\n";
+    }
+    calls.push_back(Parse(text));
+  }
+  return calls;
+}
+
+/// RunThreads - Evaluate each thread's calls on a thread of its own, once
+/// all of them have started, and check each result with expected(i, value).
+/// main runs on this thread meanwhile.
+template <typename Expected, typename Main>
+static unsigned RunThreads(Engine &engine, std::vector<Program> &calls,
+                           Expected expected, Main main) {
+  std::atomic<unsigned> ready{0};
+  std::atomic<unsigned> wrong{0};
+  std::vector<std::thread> threads;
+  for (unsigned t = 0; t < NUM_THREADS; ++t) {
+    threads.emplace_back([&, t] {
+      ++ready;
+      while (ready < NUM_THREADS) {
+        std::this_thread::yield();
+      }
+      for (unsigned i = 0; i < calls[t].exprs.size(); ++i) {
+        double value;
+        if (!engine.Evaluate(std::move(calls[t].exprs[i]), value) ||
+            !expected(i, value)) {
+          ++wrong;
+        }
+      }
+    });
+  }
+  main();
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  return wrong;
+}
+
+/// TestRedefinition - Call g and s on other threads while their callees are
+/// redefined back and forth.
+static void TestRedefinition(const char *name, Engine &engine) {
+  Expect(Define(engine, "def f(x) x + 1;\n"
+                        "def g(x) f(x) * 2;\n"
+                        "extern sin(x);\n"
+                        "def s(x) sin(0) + x;\n"),
+         name, "defining the functions");
+  std::vector<Program> redefinitions;
+  for (unsigned i = 0; i < NUM_REDEFINITIONS; ++i) {
+    redefinitions.push_back(Parse(i % 2 ? "def f(x) x + 1;\n"
+                                          "extern sin(x);\n"
+                                        : "def f(x) x + 2;\n"
+                                          "def sin(x) x * 0;\n"));
+  }
+
+  std::vector<Program> calls = CallsOf("g");
+  unsigned wrong = RunThreads(
+      engine, calls,
+      [](unsigned i, double value) {
+        return value == 2.0 * (i + 1) || value == 2.0 * (i + 2);
+      },
+      [&] {
+        for (Program &program : redefinitions) {
+          for (auto &proto : program.externs) {
+            engine.AddExtern(std::move(proto));
+          }
+          for (auto &fn : program.definitions) {
+            engine.AddFunction(std::move(fn));
+          }
+        }
+      });
+  Expect(wrong == 0, name, "a call to g saw neither definition of f");
+
+  calls = CallsOf("s");
+  redefinitions.clear();
+  for (unsigned i = 0; i < NUM_REDEFINITIONS; ++i) {
+    redefinitions.push_back(
+        Parse(i % 2 ? "extern sin(x);\n" : "def sin(x) x * 0;\n"));
+  }
+  wrong = RunThreads(
+      engine, calls, [](unsigned i, double value) { return value == i; },
+      [&] {
+        for (Program &program : redefinitions) {
+          for (auto &proto : program.externs) {
+            engine.AddExtern(std::move(proto));
+          }
+          for (auto &fn : program.definitions) {
+            engine.AddFunction(std::move(fn));
+          }
+        }
+      });
+  Expect(wrong == 0, name, "a call to s saw neither sin");
+  Expect(EpochDomain::Get().GetPending() == 0, name,
+         "replaced bodies were not freed");
+}
+
+/// TestFirstCalls - Make the first calls to lazily compiled functions h0,
+/// h1, ... on every thread at once. Half the threads call them in order and
+/// half in reverse, so threads meet at functions none of them has compiled.
+/// This thread stays in an evaluation meanwhile, so nothing retired can be
+/// freed: one retired body per function, its trampoline, shows that each was
+/// compiled once.
+static void TestFirstCalls(const char *name, Engine &engine) {
+  std::string definitions;
+  double expected = 0;
+  for (unsigned k = 0; k < NUM_LAZY; ++k) {
+    definitions += "def h" + std::to_string(k) + "(x) x * 3 + " +
+                   std::to_string(k) + ";\n";
+    expected += 3 + k;
+  }
+  Expect(Define(engine, definitions), name, "defining the functions");
+  std::vector<Program> calls;
+  for (unsigned t = 0; t < NUM_THREADS; ++t) {
+    std::string text;
+    for (unsigned i = 0; i < NUM_LAZY; ++i) {
+      unsigned k = t % 2 ? NUM_LAZY - 1 - i : i;
+      text += (i ? " + h" : "h") + std::to_string(k) + "(1)";
+    }
+    calls.push_back(Parse(text + ";\n"));
+  }
+
+  size_t pending = 0;
+  unsigned wrong;
+  {
+    EpochGuard guard;
+    wrong = RunThreads(
+        engine, calls,
+        [expected](unsigned, double value) { return value == expected; },
+        [] {});
+    pending = EpochDomain::Get().GetPending();
+  }
+  Expect(wrong == 0, name, "the first calls gave the wrong result");
+  Expect(pending == NUM_LAZY, name, "a function was not compiled once");
+  Expect(EpochDomain::Get().GetPending() == 0, name,
+         "the trampolines were not freed");
+}
+
+int main() {
+  // The standard binary operators, as the driver installs them.
+  BinopPrecedence['<'] = 10;
+  BinopPrecedence['+'] = 20;
+  BinopPrecedence['-'] = 30;
+  BinopPrecedence['*'] = 40;
+
+  for (bool lazy : {false, true}) {
+    closure::ClosureEngine closure_engine;
+    closure_engine.SetLazyCompile(lazy);
+    TestRedefinition(lazy ? "closure, lazy" : "closure", closure_engine);
+    VMEngine vm;
+    vm.SetLazyCompile(lazy);
+    TestRedefinition(lazy ? "vm, lazy" : "vm", vm);
+  }
+  closure::ClosureEngine closure_engine;
+  closure_engine.SetLazyCompile(true);
+  TestFirstCalls("closure, lazy", closure_engine);
+  VMEngine vm;
+  vm.SetLazyCompile(true);
+  TestFirstCalls("vm, lazy", vm);
+
+  if (FAILURES) {
+    fprintf(stderr, "%u failures\n", FAILURES);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,22 @@
+# Feeds a script to the program's stdin in two parts, for tests of --lib
+# reloading: the lines before the first "# @edit" line, then, once LIB has
+# been overwritten with EDIT, the rest. Called by run_test.cmake with -D for
+# SCRIPT, LIB and EDIT; it runs as the first command of a pipeline.
+
+file(READ "${SCRIPT}" text)
+string(FIND "${text}" "\n# @edit\n" at)
+if(at EQUAL -1)
+  message(FATAL_ERROR "${SCRIPT} has no '# @edit' line")
+endif()
+string(SUBSTRING "${text}" 0 ${at} before)
+math(EXPR rest "${at} + 1")
+string(SUBSTRING "${text}" ${rest} -1 after)
+string(REGEX REPLACE "\n$" "" after "${after}")
+
+execute_process(COMMAND "${CMAKE_COMMAND}" -E echo "${before}")
+# Let the program read and run the first part, and make sure the edit gets a
+# later modification time even where the file system's clock is coarse.
+execute_process(COMMAND "${CMAKE_COMMAND}" -E sleep 1.1)
+file(READ "${EDIT}" library)
+file(WRITE "${LIB}" "${library}")
+execute_process(COMMAND "${CMAKE_COMMAND}" -E echo "${after}")
@@ -0,0 +1,98 @@
+# Runs one regression test: the script is copied into a scratch directory of
+# its own and run with the given arguments, and what the program prints is
+# compared with the expected output. Called by kl_test with -D for:
+#
+#   KALEIDOSCOPE  the program
+#   WORK_DIR      the scratch directory, emptied first
+#   SCRIPT        the .kl script
+#   EXPECTED      the file holding the expected output
+#   ARGS          arguments for the run, separated by '|'
+#   RUN           what to run instead of the script, such as a .kbc file
+#   STDIN         feed the script on stdin rather than naming it
+#   SETUP_ARGS    if set, first run the program once with these arguments
+#   SETUP_SCRIPT  the script for that first run, copied to SCRIPT's name
+#   RESULT        the exit status the run should have, 0 if not given
+#   LIB           a --lib file, copied next to the script
+#   EDIT          what LIB is overwritten with halfway through a STDIN run,
+#                 by edit_lib.cmake
+#
+# Prompts, "Parsed a ..." notes and load times are dropped before comparing,
+# so that one expected output serves every engine and flag.
+
+function(copy_script from to)
+  file(READ "${from}" text)
+  file(WRITE "${to}" "${text}")
+endfunction()
+
+function(split_args out joined)
+  if(joined STREQUAL "")
+    set(${out} "" PARENT_SCOPE)
+  else()
+    string(REPLACE "|" ";" list "${joined}")
+    set(${out} "${list}" PARENT_SCOPE)
+  endif()
+endfunction()
+
+get_filename_component(script_name "${SCRIPT}" NAME)
+file(REMOVE_RECURSE "${WORK_DIR}")
+file(MAKE_DIRECTORY "${WORK_DIR}")
+
+if(DEFINED SETUP_ARGS)
+  if(NOT SETUP_SCRIPT)
+    set(SETUP_SCRIPT "${SCRIPT}")
+  endif()
+  copy_script("${SETUP_SCRIPT}" "${WORK_DIR}/${script_name}")
+  split_args(setup_args "${SETUP_ARGS}")
+  execute_process(
+    COMMAND "${KALEIDOSCOPE}" ${setup_args} "${script_name}"
+    WORKING_DIRECTORY "${WORK_DIR}"
+    RESULT_VARIABLE result
+    OUTPUT_VARIABLE output
+    ERROR_VARIABLE output)
+  if(NOT result EQUAL 0)
+    message(FATAL_ERROR "Setup run failed (${result}):\n${output}")
+  endif()
+endif()
+
+copy_script("${SCRIPT}" "${WORK_DIR}/${script_name}")
+if(LIB)
+  get_filename_component(lib_name "${LIB}" NAME)
+  copy_script("${LIB}" "${WORK_DIR}/${lib_name}")
+endif()
+split_args(args "${ARGS}")
+if(EDIT)
+  set(feed COMMAND "${CMAKE_COMMAND}" -DSCRIPT=${WORK_DIR}/${script_name}
+                   -DLIB=${WORK_DIR}/${lib_name} -DEDIT=${EDIT}
+                   -P ${CMAKE_CURRENT_LIST_DIR}/edit_lib.cmake)
+elseif(STDIN)
+  set(input INPUT_FILE "${WORK_DIR}/${script_name}")
+elseif(RUN)
+  list(APPEND args "${RUN}")
+else()
+  list(APPEND args "${script_name}")
+endif()
+execute_process(
+  ${feed}
+  COMMAND "${KALEIDOSCOPE}" ${args}
+  ${input}
+  WORKING_DIRECTORY "${WORK_DIR}"
+  RESULT_VARIABLE result
+  OUTPUT_VARIABLE output
+  ERROR_VARIABLE output)
+
+string(REPLACE "ready> " "" output "${output}")
+string(REGEX REPLACE "(^|\n)Parsed [^\n]*" "" output "${output}")
+string(REGEX REPLACE " in [0-9.]+ ms\n" "\n" output "${output}")
+string(REGEX REPLACE "^\n+" "" output "${output}")
+file(READ "${EXPECTED}" expected)
+if(NOT DEFINED RESULT)
+  set(RESULT 0)
+endif()
+if(NOT result EQUAL RESULT)
+  message(FATAL_ERROR "Run failed (${result}):\n${output}")
+endif()
+if(NOT output STREQUAL expected)
+  file(WRITE "${WORK_DIR}/actual.out" "${output}")
+  message(FATAL_ERROR "Output differs from ${EXPECTED}:\n"
+                      "--- expected\n${expected}--- actual\n${output}")
+endif()